@@ -0,0 +1,87 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "AccountName.h"
+
+static bool _EqualsIgnoreCase(std::wstring_view s1, std::wstring_view s2)
+{
+    // Ordinal, so the result does not depend on the locale of the user that is signed in
+    return s1.size() == s2.size() &&
+        (s1.empty() || CompareStringOrdinal(s1.data(), static_cast<int>(s1.size()), s2.data(), static_cast<int>(s2.size()), TRUE) == CSTR_EQUAL);
+}
+
+HRESULT ParseAccountName(
+    _In_ PCWSTR pszName,
+    _In_ std::wstring_view defaultDomain,
+    _Out_ ACCOUNT_NAME* pName
+)
+{
+    std::wstring_view name(pszName);
+    size_t ichWhack = name.find(L'\\');
+    size_t ichAt = name.find(L'@');
+
+    *pName = ACCOUNT_NAME();
+    if (ichWhack != std::wstring_view::npos)
+    {
+        pName->domain = name.substr(0, ichWhack);
+        pName->username = name.substr(ichWhack + 1);
+        pName->format = pName->domain == L"." ? ANF_LOCAL : ANF_DOWN_LEVEL;
+    }
+    else if (ichAt != std::wstring_view::npos)
+    {
+        pName->domain = name.substr(ichAt + 1);
+        pName->username = name.substr(0, ichAt);
+        pName->upn = name;
+        pName->format = ANF_UPN;
+    }
+    else
+    {
+        pName->domain = defaultDomain;
+        pName->username = name;
+        pName->format = ANF_PLAIN;
+    }
+
+    // Only the separator we split on may appear, and only once
+    if (pName->domain.empty() || pName->username.empty() ||
+        pName->username.find_first_of(L"\\@") != std::wstring_view::npos ||
+        pName->domain.find(L'@') != std::wstring_view::npos)
+    {
+        *pName = ACCOUNT_NAME();
+        return HRESULT_FROM_WIN32(ERROR_INVALID_ACCOUNT_NAME);
+    }
+    return S_OK;
+}
+
+bool IsSameAccount(
+    _In_ const ACCOUNT_NAME& name1,
+    _In_ const ACCOUNT_NAME& name2
+)
+{
+    if (!_EqualsIgnoreCase(name1.username, name2.username))
+    {
+        return false;
+    }
+
+    bool fNetBiosDomain1 = name1.format == ANF_PLAIN || name1.format == ANF_DOWN_LEVEL;
+    bool fNetBiosDomain2 = name2.format == ANF_PLAIN || name2.format == ANF_DOWN_LEVEL;
+    return !(fNetBiosDomain1 && fNetBiosDomain2) || _EqualsIgnoreCase(name1.domain, name2.domain);
+}
+
+void GetLogonNames(
+    _In_ const ACCOUNT_NAME& name,
+    _Out_ ATL::CStringW* pstrDomain,
+    _Out_ ATL::CStringW* pstrUsername
+)
+{
+    if (name.format == ANF_UPN)
+    {
+        pstrDomain->Empty();
+        pstrUsername->SetString(name.upn.data(), static_cast<int>(name.upn.size()));
+    }
+    else
+    {
+        pstrDomain->SetString(name.domain.data(), static_cast<int>(name.domain.size()));
+        pstrUsername->SetString(name.username.data(), static_cast<int>(name.username.size()));
+    }
+}
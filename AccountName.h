@@ -0,0 +1,50 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+#include <string_view>
+
+// How a user name was written.
+enum ACCOUNT_NAME_FORMAT
+{
+    ANF_PLAIN,      // user; the domain is the default domain that was passed to ParseAccountName.
+    ANF_DOWN_LEVEL, // DOMAIN\user
+    ANF_LOCAL,      // .\user, an account on this computer.
+    ANF_UPN,        // user@dns.domain
+};
+
+// A user name split into its domain and user name. The parts are views into the string (or default
+// domain) it was parsed from, so they are not null-terminated and only valid as long as that string.
+struct ACCOUNT_NAME
+{
+    std::wstring_view   domain;     // The DNS domain for ANF_UPN, "." for ANF_LOCAL.
+    std::wstring_view   username;   // Without the domain, also for ANF_UPN.
+    std::wstring_view   upn;        // The whole name for ANF_UPN, empty otherwise.
+    ACCOUNT_NAME_FORMAT format;
+};
+
+// Splits pszName without copying it. A name without a domain gets defaultDomain. Fails with
+// HRESULT_FROM_WIN32(ERROR_INVALID_ACCOUNT_NAME) if a part is empty or there is more than one separator
+// (e.g. DOMAIN\user@dns.domain or user@a@b).
+HRESULT ParseAccountName(
+    _In_ PCWSTR pszName,
+    _In_ std::wstring_view defaultDomain,
+    _Out_ ACCOUNT_NAME* pName
+);
+
+// Whether two names are the same account, ignoring case. The domains are only compared if both are
+// NetBIOS names: a UPN suffix or "." cannot be compared to a NetBIOS domain name without asking a domain controller.
+bool IsSameAccount(
+    _In_ const ACCOUNT_NAME& name1,
+    _In_ const ACCOUNT_NAME& name2
+);
+
+// The domain and user name as LogonUser and LSA want them. For a UPN, the whole name is the user name
+// and the domain is empty.
+void GetLogonNames(
+    _In_ const ACCOUNT_NAME& name,
+    _Out_ ATL::CStringW* pstrDomain,
+    _Out_ ATL::CStringW* pstrUsername
+);
@@ -0,0 +1,332 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "AppCloser.h"
+#include "ConfigStore.h"
+#include "ProcessIndex.h"
+#include "Dll.h"
+#include <wtsapi32.h>
+#include <userenv.h>
+#include <shellapi.h>
+
+#pragma comment(lib, "wtsapi32.lib")
+#pragma comment(lib, "userenv.lib")
+
+// How long the helper waits for a window to answer WM_QUERYENDSESSION and WM_ENDSESSION
+static const UINT s_uSendTimeoutMs = 5000;
+
+// The helper has to run on the desktop of the user, not on the secure desktop of LogonUI
+static WCHAR s_szUserDesktop[] = L"winsta0\\default";
+
+AppCloser::AppCloser()
+{
+}
+
+AppCloser::~AppCloser()
+{
+    for (size_t i = 0; i < _rgApps.GetCount(); i++)
+    {
+        CloseHandle(_rgApps[i].hProcess);
+    }
+}
+
+HRESULT AppCloser::AddSession(DWORD dwSessionId)
+{
+    if (dwSessionId == WTS_CURRENT_SESSION)
+    {
+        ProcessIdToSessionId(GetCurrentProcessId(), &dwSessionId);
+    }
+
+    DWORD dwLevel = 0;
+    PWTS_PROCESS_INFOW rgInfo;
+    DWORD cInfo;
+    if (!WTSEnumerateProcessesExW(WTS_CURRENT_SERVER_HANDLE, &dwLevel, dwSessionId, reinterpret_cast<LPWSTR*>(&rgInfo), &cInfo))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    std::shared_ptr<const Config> pConfig = ConfigStore::Instance().Current();
+    ULONGLONG ullNow = GetTickCount64();
+    size_t iFirstApp = _rgApps.GetCount();
+    ATL::CStringW strProcessIds;
+    ATL::CStringW strFolded;
+    HRESULT hr = S_OK;
+    for (DWORD i = 0; SUCCEEDED(hr) && i < cInfo; i++)
+    {
+        const WTS_PROCESS_INFOW& info = rgInfo[i];
+        if (info.pProcessName == nullptr)
+        {
+            continue;
+        }
+        ProcessIndex::FoldExeName(info.pProcessName, &strFolded);
+        const CProtectedAppMap::CPair* pApp = pConfig->protectedApps.Lookup(strFolded);
+        if (pApp == nullptr)
+        {
+            continue;
+        }
+
+        // If it exited meanwhile (or we may not touch it), there is nothing to wait for
+        HANDLE hProcess = OpenProcess(SYNCHRONIZE | PROCESS_TERMINATE, FALSE, info.ProcessId);
+        if (hProcess == nullptr)
+        {
+            continue;
+        }
+
+        const CAppCloseTimeoutMap::CPair* pTimeout = pConfig->appCloseTimeouts.Lookup(strFolded);
+        CLOSING_APP app;
+        app.dwProcessId = info.ProcessId;
+        app.dwSessionId = dwSessionId;
+        app.strName = pApp->m_value;
+        app.hProcess = hProcess;
+        app.ullDeadline = ullNow + static_cast<ULONGLONG>(pTimeout != nullptr ? pTimeout->m_value : pConfig->dwAppCloseTimeout) * 1000;
+        app.outcome = ACO_PENDING;
+        if (_rgApps.Add(app) == static_cast<size_t>(-1))
+        {
+            CloseHandle(hProcess);
+            hr = E_OUTOFMEMORY;
+        }
+        else
+        {
+            strProcessIds.AppendFormat(L" %lu", info.ProcessId);
+        }
+    }
+    WTSFreeMemoryExW(WTSTypeProcessInfoLevel0, rgInfo, cInfo);
+
+    if (SUCCEEDED(hr) && !strProcessIds.IsEmpty())
+    {
+        hr = _StartHelper(dwSessionId, strProcessIds);
+        if (FAILED(hr))
+        {
+            // Nobody can ask them to close, so leave them to signing out rather than terminating them
+            for (size_t i = iFirstApp; i < _rgApps.GetCount(); i++)
+            {
+                _rgApps[i].outcome = ACO_FAILED;
+            }
+        }
+    }
+    return hr;
+}
+
+HRESULT AppCloser::Wait(_In_opt_ HANDLE hCancelEvent)
+{
+    for (;;)
+    {
+        // The cancel event, if any, goes first
+        HANDLE rghProcesses[MAXIMUM_WAIT_OBJECTS];
+        size_t rgiApps[MAXIMUM_WAIT_OBJECTS];
+        DWORD cProcesses = 0;
+        if (hCancelEvent != nullptr)
+        {
+            rghProcesses[cProcesses++] = hCancelEvent;
+        }
+        DWORD iFirstProcess = cProcesses;
+        bool fMore = false;
+        ULONGLONG ullNow = GetTickCount64();
+        ULONGLONG ullNextDeadline = ULLONG_MAX;
+        for (size_t i = 0; i < _rgApps.GetCount(); i++)
+        {
+            CLOSING_APP& app = _rgApps[i];
+            if (app.outcome != ACO_PENDING)
+            {
+                continue;
+            }
+
+            if (WaitForSingleObject(app.hProcess, 0) == WAIT_OBJECT_0)
+            {
+                app.outcome = ACO_CLOSED;
+            }
+            else if (app.ullDeadline <= ullNow)
+            {
+                // Only the ones that are late; the others keep their time
+                _Terminate(&app);
+            }
+            else if (cProcesses < ARRAYSIZE(rghProcesses))
+            {
+                rghProcesses[cProcesses] = app.hProcess;
+                rgiApps[cProcesses++] = i;
+                if (app.ullDeadline < ullNextDeadline)
+                {
+                    ullNextDeadline = app.ullDeadline;
+                }
+            }
+            else
+            {
+                fMore = true;
+            }
+        }
+        if (cProcesses == iFirstProcess)
+        {
+            return S_OK;
+        }
+
+        // With more processes than fit in one wait, look at the others again soon
+        ULONGLONG ullTimeout = ullNextDeadline - ullNow;
+        ULONGLONG ullMaxTimeout = fMore ? 100 : INFINITE - 1;
+        DWORD dwTimeout = static_cast<DWORD>(ullTimeout < ullMaxTimeout ? ullTimeout : ullMaxTimeout);
+        DWORD dwWait = WaitForMultipleObjects(cProcesses, rghProcesses, FALSE, dwTimeout);
+        if (dwWait < WAIT_OBJECT_0 + iFirstProcess)
+        {
+            return HRESULT_FROM_WIN32(ERROR_CANCELLED);
+        }
+        else if (dwWait < WAIT_OBJECT_0 + cProcesses)
+        {
+            _rgApps[rgiApps[dwWait - WAIT_OBJECT_0]].outcome = ACO_CLOSED;
+        }
+        else if (dwWait == WAIT_FAILED)
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+}
+
+void AppCloser::GetApps(APP_CLOSE_OUTCOME outcome, _Out_ ATL::CStringW* pstrApps) const
+{
+    pstrApps->Empty();
+    for (size_t i = 0; i < _rgApps.GetCount(); i++)
+    {
+        if (_rgApps[i].outcome == outcome)
+        {
+            if (!pstrApps->IsEmpty())
+            {
+                *pstrApps += L", ";
+            }
+            pstrApps->AppendFormat(L"%s (%lu)", _rgApps[i].strName.GetString(), _rgApps[i].dwProcessId);
+        }
+    }
+}
+
+// Starts rundll32 with CloseApplicationsW as the user of the session, on its desktop.
+HRESULT AppCloser::_StartHelper(DWORD dwSessionId, _In_ const ATL::CStringW& strProcessIds)
+{
+    WCHAR szDll[MAX_PATH];
+    DWORD cchDll = GetModuleFileNameW(HINST_THISDLL, szDll, ARRAYSIZE(szDll));
+    if (cchDll == 0 || cchDll == ARRAYSIZE(szDll))
+    {
+        return E_UNEXPECTED;
+    }
+    WCHAR szSystem[MAX_PATH];
+    UINT cchSystem = GetSystemDirectoryW(szSystem, ARRAYSIZE(szSystem));
+    if (cchSystem == 0 || cchSystem >= ARRAYSIZE(szSystem))
+    {
+        return E_UNEXPECTED;
+    }
+
+    HANDLE hToken;
+    if (!WTSQueryUserToken(dwSessionId, &hToken))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    ATL::CStringW strApplication;
+    strApplication.Format(L"%s\\rundll32.exe", szSystem);
+    ATL::CStringW strCommandLine;
+    strCommandLine.Format(L"\"%s\" \"%s\",CloseApplications%s", strApplication.GetString(), szDll, strProcessIds.GetString());
+
+    LPVOID pEnvironment = nullptr;
+    CreateEnvironmentBlock(&pEnvironment, hToken, FALSE);
+
+    STARTUPINFOW si = { sizeof(si) };
+    si.lpDesktop = s_szUserDesktop;
+    PROCESS_INFORMATION pi;
+    HRESULT hr = S_OK;
+    if (CreateProcessAsUserW(hToken, strApplication, strCommandLine.GetBuffer(), nullptr, nullptr, FALSE,
+        CREATE_UNICODE_ENVIRONMENT | CREATE_NO_WINDOW, pEnvironment, szSystem, &si, &pi))
+    {
+        // We wait for the applications, not for the helper
+        CloseHandle(pi.hThread);
+        CloseHandle(pi.hProcess);
+    }
+    else
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    strCommandLine.ReleaseBuffer();
+
+    if (pEnvironment != nullptr)
+    {
+        DestroyEnvironmentBlock(pEnvironment);
+    }
+    CloseHandle(hToken);
+    return hr;
+}
+
+void AppCloser::_Terminate(_Inout_ CLOSING_APP* pApp)
+{
+    pApp->outcome = TerminateProcess(pApp->hProcess, ERROR_PROCESS_ABORTED) ? ACO_TERMINATED : ACO_FAILED;
+}
+
+struct CLOSE_WINDOWS
+{
+    DWORD                   dwProcessId;
+    ATL::CAtlArray<HWND>    rgWindows;
+};
+
+// Collects the top-level windows of a process that the user could close.
+static BOOL CALLBACK _CollectWindowsProc(_In_ HWND hwnd, _In_ LPARAM lParam)
+{
+    CLOSE_WINDOWS* pCloseWindows = reinterpret_cast<CLOSE_WINDOWS*>(lParam);
+    DWORD dwProcessId;
+    if (GetWindowThreadProcessId(hwnd, &dwProcessId) != 0 && dwProcessId == pCloseWindows->dwProcessId &&
+        IsWindowVisible(hwnd) && GetWindow(hwnd, GW_OWNER) == nullptr)
+    {
+        pCloseWindows->rgWindows.Add(hwnd);
+    }
+    return TRUE;
+}
+
+static DWORD WINAPI _CloseProcessWindows(_In_ LPVOID lpParameter)
+{
+    CLOSE_WINDOWS closeWindows;
+    closeWindows.dwProcessId = static_cast<DWORD>(reinterpret_cast<ULONG_PTR>(lpParameter));
+    EnumWindows(_CollectWindowsProc, reinterpret_cast<LPARAM>(&closeWindows));
+
+    for (size_t i = 0; i < closeWindows.rgWindows.GetCount(); i++)
+    {
+        // Let it save its data as it would when Windows signs out, then ask it to close
+        HWND hwnd = closeWindows.rgWindows[i];
+        DWORD_PTR dwResult;
+        if (SendMessageTimeoutW(hwnd, WM_QUERYENDSESSION, 0, ENDSESSION_CLOSEAPP, SMTO_ABORTIFHUNG, s_uSendTimeoutMs, &dwResult))
+        {
+            SendMessageTimeoutW(hwnd, WM_ENDSESSION, dwResult != 0, ENDSESSION_CLOSEAPP, SMTO_ABORTIFHUNG, s_uSendTimeoutMs, &dwResult);
+        }
+        PostMessageW(hwnd, WM_CLOSE, 0, 0);
+    }
+    return 0;
+}
+
+EXTERN_C void CALLBACK CloseApplicationsW(_In_opt_ HWND /*hwnd*/, _In_opt_ HINSTANCE /*hinst*/, _In_ LPWSTR pszCmdLine, int /*nCmdShow*/)
+{
+    int cArgs;
+    PWSTR* rgpszArgs = CommandLineToArgvW(pszCmdLine, &cArgs);
+    if (rgpszArgs == nullptr)
+    {
+        return;
+    }
+
+    // One thread per process, so one that does not answer does not hold up the others
+    HANDLE rghThreads[MAXIMUM_WAIT_OBJECTS];
+    DWORD cThreads = 0;
+    for (int i = 0; i < cArgs && cThreads < ARRAYSIZE(rghThreads); i++)
+    {
+        DWORD dwProcessId = wcstoul(rgpszArgs[i], nullptr, 10);
+        if (dwProcessId != 0)
+        {
+            rghThreads[cThreads] = CreateThread(nullptr, 0, _CloseProcessWindows, reinterpret_cast<LPVOID>(static_cast<ULONG_PTR>(dwProcessId)), 0, nullptr);
+            if (rghThreads[cThreads] != nullptr)
+            {
+                cThreads++;
+            }
+        }
+    }
+    LocalFree(rgpszArgs);
+
+    if (cThreads > 0)
+    {
+        WaitForMultipleObjects(cThreads, rghThreads, TRUE, INFINITE);
+    }
+    for (DWORD i = 0; i < cThreads; i++)
+    {
+        CloseHandle(rghThreads[i]);
+    }
+}
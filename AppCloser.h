@@ -0,0 +1,75 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+
+// What happened to a protected application that was asked to close.
+enum APP_CLOSE_OUTCOME
+{
+    ACO_PENDING,        // Still running, its deadline has not passed yet.
+    ACO_CLOSED,         // It closed by itself.
+    ACO_TERMINATED,     // It did not close before its deadline and was terminated.
+    ACO_FAILED,         // It could not be asked to close, or could not be terminated; signing out will end it.
+};
+
+struct CLOSING_APP
+{
+    DWORD               dwProcessId;
+    DWORD               dwSessionId;
+    ATL::CStringW       strName;            // As configured in ProtectedApplications.
+    HANDLE              hProcess;           // SYNCHRONIZE and PROCESS_TERMINATE.
+    ULONGLONG           ullDeadline;        // GetTickCount64.
+    APP_CLOSE_OUTCOME   outcome;
+};
+
+// Closes the protected applications (e.g. Multivers) in the sessions that are about to be signed out, so they
+// can save their data, instead of having them end with the session.
+//
+// AddSession asks every protected application in a session to close, through a helper (rundll32 with the
+// CloseApplications export of this DLL) that runs as the user of that session, since only there its windows
+// can be reached. Wait then waits for all applications of all sessions at once, each until its own deadline,
+// and terminates the ones that are still running at their deadline. So closing takes as long as the slowest
+// application, not the sum of them, and never more than five minutes (see GetAppCloseTimeout).
+class AppCloser
+{
+public:
+    AppCloser();
+    ~AppCloser();
+
+    // Finds the protected applications in the session and asks them to close. Does not wait for them.
+    HRESULT AddSession(DWORD dwSessionId);
+
+    // Returns once every application added has closed or was terminated, or with HRESULT_FROM_WIN32(ERROR_CANCELLED)
+    // once hCancelEvent is signalled; the applications that are still running are then left as they are.
+    HRESULT Wait(_In_opt_ HANDLE hCancelEvent);
+
+    size_t GetCount() const
+    {
+        return _rgApps.GetCount();
+    }
+
+    const CLOSING_APP& GetApp(size_t i) const
+    {
+        return _rgApps[i];
+    }
+
+    // The applications with this outcome as e.g. "Multi.exe (1234)", separated by ", ".
+    void GetApps(APP_CLOSE_OUTCOME outcome, _Out_ ATL::CStringW* pstrApps) const;
+
+private:
+    AppCloser(const AppCloser&) = delete;
+    AppCloser& operator=(const AppCloser&) = delete;
+
+    HRESULT _StartHelper(DWORD dwSessionId, _In_ const ATL::CStringW& strProcessIds);
+    void _Terminate(_Inout_ CLOSING_APP* pApp);
+
+    ATL::CAtlArray<CLOSING_APP>     _rgApps;
+};
+
+// The helper that AppCloser starts in a session, for rundll32:
+//   rundll32 GEWISUnlockV2CredentialProvider.dll,CloseApplications <process ID>...
+// Asks the top-level windows of each process to end the session (WM_QUERYENDSESSION and WM_ENDSESSION with
+// ENDSESSION_CLOSEAPP) and then to close (WM_CLOSE), all processes at the same time.
+EXTERN_C void CALLBACK CloseApplicationsW(_In_opt_ HWND hwnd, _In_opt_ HINSTANCE hinst, _In_ LPWSTR pszCmdLine, int nCmdShow);
@@ -0,0 +1,738 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "AuditLog.h"
+#include "Dll.h"
+#include <new>
+#include <sddl.h>
+#include <shellapi.h>
+
+static const BYTE s_rgbMagic[8] = { 'G', 'W', 'A', 'U', 'D', 'I', 'T', 0 };
+static const DWORD s_dwVersion = 1;
+
+// Shared by the LogonUI processes of all sessions, hence in the global namespace
+static const WCHAR s_szFileMutex[] = L"Global\\GEWISUnlockAuditLog";
+
+// Each LogonUI process appends its records when it drains its queue, so the log is only roughly in time order:
+// a record can follow later ones from other processes. A query starts this much earlier in the index (an hour,
+// in FILETIME units), which covers any drain that did not wait out several lock timeouts.
+static const ULONGLONG s_ullIndexMargin = 60ULL * 60 * 10000000;
+
+AuditLog& AuditLog::Instance()
+{
+    static AuditLog s_log;
+    return s_log;
+}
+
+AuditLog::AuditLog() :
+    _fScheduled(FALSE),
+    _cUsers(0),
+    _pWork(nullptr),
+    _hFileMutex(nullptr),
+    _hFile(INVALID_HANDLE_VALUE),
+    _hMapping(nullptr),
+    _pbView(nullptr)
+{
+    InitializeSListHead(&_queue);
+    InitializeSRWLock(&_usersLock);
+    InitializeSRWLock(&_fileLock);
+}
+
+AuditLog::~AuditLog()
+{
+    // The work item is closed and the file written by the last Release
+}
+
+void AuditLog::AddRef()
+{
+    AcquireSRWLockExclusive(&_usersLock);
+    if (_cUsers++ == 0)
+    {
+        // Without the work item, records are written by the last Release
+        TP_CALLBACK_ENVIRON callbackEnviron;
+        InitializeThreadpoolEnvironment(&callbackEnviron);
+        SetThreadpoolCallbackLibrary(&callbackEnviron, HINST_THISDLL);
+        _pWork = CreateThreadpoolWork(_WorkCallback, this, &callbackEnviron);
+        DestroyThreadpoolEnvironment(&callbackEnviron);
+    }
+    ReleaseSRWLockExclusive(&_usersLock);
+}
+
+void AuditLog::Release()
+{
+    AcquireSRWLockExclusive(&_usersLock);
+    if (_cUsers > 0 && --_cUsers == 0)
+    {
+        if (_pWork != nullptr)
+        {
+            WaitForThreadpoolWorkCallbacks(_pWork, FALSE);
+            CloseThreadpoolWork(_pWork);
+            _pWork = nullptr;
+        }
+        _Drain();
+
+        AcquireSRWLockExclusive(&_fileLock);
+        if (_hFileMutex != nullptr)
+        {
+            CloseHandle(_hFileMutex);
+            _hFileMutex = nullptr;
+        }
+        ReleaseSRWLockExclusive(&_fileLock);
+    }
+    ReleaseSRWLockExclusive(&_usersLock);
+}
+
+ULONGLONG AuditLog::Now()
+{
+    FILETIME ftNow;
+    GetSystemTimeAsFileTime(&ftNow);
+    return (static_cast<ULONGLONG>(ftNow.dwHighDateTime) << 32) | ftNow.dwLowDateTime;
+}
+
+void AuditLog::Write(_In_ const AUDIT_RECORD& record)
+{
+    NODE* pNode = new(std::nothrow) NODE();
+    if (pNode == nullptr)
+    {
+        return;
+    }
+    pNode->record = record;
+    InterlockedPushEntrySList(&_queue, &pNode->entry);
+
+    // One work item drains everything that was queued before it runs
+    if (InterlockedExchange(&_fScheduled, TRUE) == FALSE)
+    {
+        AcquireSRWLockShared(&_usersLock);
+        if (_pWork != nullptr)
+        {
+            SubmitThreadpoolWork(_pWork);
+        }
+        else
+        {
+            _fScheduled = FALSE;
+        }
+        ReleaseSRWLockShared(&_usersLock);
+    }
+}
+
+void AuditLog::Flush()
+{
+    _Drain();
+}
+
+VOID CALLBACK AuditLog::_WorkCallback(_Inout_ PTP_CALLBACK_INSTANCE /*pInstance*/, _Inout_opt_ PVOID pContext, _Inout_ PTP_WORK /*pWork*/)
+{
+    AuditLog* pLog = static_cast<AuditLog*>(pContext);
+
+    // Cleared before draining, so a record that is queued meanwhile schedules another run
+    InterlockedExchange(&pLog->_fScheduled, FALSE);
+    pLog->_Drain();
+}
+
+// Writes every queued record to the file.
+void AuditLog::_Drain()
+{
+    AcquireSRWLockExclusive(&_fileLock);
+
+    // The list is last-in first-out; reverse it so records are written in the order they were queued
+    SLIST_ENTRY* pEntry = InterlockedFlushSList(&_queue);
+    SLIST_ENTRY* pReversed = nullptr;
+    while (pEntry != nullptr)
+    {
+        SLIST_ENTRY* pNext = pEntry->Next;
+        pEntry->Next = pReversed;
+        pReversed = pEntry;
+        pEntry = pNext;
+    }
+
+    if (pReversed != nullptr && !_LockFile())
+    {
+        // Another process holds the file for far too long; put the records back for the next drain, oldest
+        // pushed last so the order is kept
+        while (pReversed != nullptr)
+        {
+            SLIST_ENTRY* pNext = pReversed->Next;
+            pReversed->Next = pEntry;
+            pEntry = pReversed;
+            pReversed = pNext;
+        }
+        while (pEntry != nullptr)
+        {
+            SLIST_ENTRY* pNext = pEntry->Next;
+            InterlockedPushEntrySList(&_queue, pEntry);
+            pEntry = pNext;
+        }
+        ReleaseSRWLockExclusive(&_fileLock);
+        return;
+    }
+
+    bool fLocked = (pReversed != nullptr);
+    while (pReversed != nullptr)
+    {
+        NODE* pNode = CONTAINING_RECORD(pReversed, NODE, entry);
+        pReversed = pReversed->Next;
+
+        // A record that cannot be written is lost; the kick itself must not fail because of the log
+        _Append(pNode->record);
+        delete pNode;
+    }
+
+    if (fLocked)
+    {
+        // Closing flushes the view; the next drain, here or in another process, reads the header again
+        _Close();
+        _UnlockFile();
+    }
+    ReleaseSRWLockExclusive(&_fileLock);
+}
+
+// Takes the mutex that all processes writing the log share, creating it if needed. The caller must hold _fileLock.
+bool AuditLog::_LockFile()
+{
+    if (_hFileMutex == nullptr)
+    {
+        // Only SYSTEM (LogonUI) and administrators may use it, so nobody else can hold the log up
+        PSECURITY_DESCRIPTOR pSD;
+        if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(L"D:P(A;;GA;;;SY)(A;;GA;;;BA)", SDDL_REVISION_1, &pSD, nullptr))
+        {
+            return false;
+        }
+        SECURITY_ATTRIBUTES sa = { sizeof(sa), pSD, FALSE };
+        _hFileMutex = CreateMutexW(&sa, FALSE, s_szFileMutex);
+        LocalFree(pSD);
+        if (_hFileMutex == nullptr)
+        {
+            return false;
+        }
+    }
+
+    // An abandoned mutex is fine: a record only becomes part of the log when ibEnd is moved past it
+    DWORD dwWait = WaitForSingleObject(_hFileMutex, s_msFileLockTimeout);
+    return dwWait == WAIT_OBJECT_0 || dwWait == WAIT_ABANDONED;
+}
+
+// The caller must hold _fileLock and the mutex.
+void AuditLog::_UnlockFile()
+{
+    ReleaseMutex(_hFileMutex);
+}
+
+// Appends one record to the file, rotating it if the record does not fit. The caller must hold _fileLock and the mutex.
+HRESULT AuditLog::_Append(_In_ const AUDIT_RECORD& record)
+{
+    _Serialize(record, &_rgbPayload);
+    DWORD cbPayload = static_cast<DWORD>(_rgbPayload.GetCount());
+    DWORD cbRecord = sizeof(RECORD_PREFIX) + cbPayload;
+    if (cbRecord > s_cbFile - s_cbHeader)
+    {
+        return E_INVALIDARG;
+    }
+
+    HRESULT hr = _Open();
+    if (SUCCEEDED(hr) && reinterpret_cast<FILE_HEADER*>(_pbView)->ibEnd + cbRecord > s_cbFile)
+    {
+        hr = _Rotate();
+    }
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    FILE_HEADER* pHeader = reinterpret_cast<FILE_HEADER*>(_pbView);
+    ULONGLONG ibRecord = pHeader->ibEnd;
+
+    RECORD_PREFIX prefix = { cbPayload, _Crc32(_rgbPayload.GetData(), cbPayload) };
+    memcpy(_pbView + ibRecord, &prefix, sizeof(prefix));
+    memcpy(_pbView + ibRecord + sizeof(prefix), _rgbPayload.GetData(), cbPayload);
+
+    // Index the first record of every stride of the file
+    if (pHeader->cIndexEntries < s_cIndexEntries && ibRecord >= s_cbHeader + static_cast<ULONGLONG>(pHeader->cIndexEntries) * s_cbIndexStride)
+    {
+        pHeader->rgIndex[pHeader->cIndexEntries].ullTime = record.ullTime;
+        pHeader->rgIndex[pHeader->cIndexEntries].ibRecord = ibRecord;
+        pHeader->cIndexEntries++;
+    }
+
+    // Only now is the record part of the log; if we crash before this, it is overwritten next time
+    pHeader->ibEnd = ibRecord + cbRecord;
+    return S_OK;
+}
+
+// Opens and maps audit.log, creating it if needed. The caller must hold _fileLock and the mutex.
+HRESULT AuditLog::_Open()
+{
+    if (_pbView != nullptr)
+    {
+        return S_OK;
+    }
+
+    ATL::CStringW strFile;
+    HRESULT hr = _GetFileName(0, &strFile);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    // Other processes only open it under the mutex; readers may have it open, and must let it be renamed. GetDataDirectory
+    // makes sure only SYSTEM and administrators can put anything in the directory, but a link that is there anyway is
+    // not followed, so we never write to another file.
+    _hFile = CreateFileW(strFile, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OPEN_REPARSE_POINT, nullptr);
+    if (_hFile == INVALID_HANDLE_VALUE)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    FILE_ATTRIBUTE_TAG_INFO info;
+    if (!GetFileInformationByHandleEx(_hFile, FileAttributeTagInfo, &info, sizeof(info)))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    else if ((info.FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_REPARSE_POINT_ENCOUNTERED);
+    }
+    if (FAILED(hr))
+    {
+        _Close();
+        return hr;
+    }
+
+    // Mapping the file at its full size allocates it on disk right away
+    _hMapping = CreateFileMappingW(_hFile, nullptr, PAGE_READWRITE, 0, s_cbFile, nullptr);
+    if (_hMapping != nullptr)
+    {
+        _pbView = static_cast<BYTE*>(MapViewOfFile(_hMapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, s_cbFile));
+    }
+    if (_pbView == nullptr)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        _Close();
+        return hr;
+    }
+
+    // A new file is all zeroes. A file that is damaged or from another version is started over.
+    FILE_HEADER* pHeader = reinterpret_cast<FILE_HEADER*>(_pbView);
+    if (memcmp(pHeader->rgbMagic, s_rgbMagic, sizeof(s_rgbMagic)) != 0 ||
+        pHeader->dwVersion != s_dwVersion ||
+        pHeader->ibEnd < s_cbHeader || pHeader->ibEnd > s_cbFile ||
+        pHeader->cIndexEntries > s_cIndexEntries)
+    {
+        ZeroMemory(pHeader, s_cbHeader);
+        memcpy(pHeader->rgbMagic, s_rgbMagic, sizeof(s_rgbMagic));
+        pHeader->dwVersion = s_dwVersion;
+        pHeader->ibEnd = s_cbHeader;
+    }
+    return S_OK;
+}
+
+// The caller must hold _fileLock.
+void AuditLog::_Close()
+{
+    if (_pbView != nullptr)
+    {
+        FlushViewOfFile(_pbView, 0);
+        UnmapViewOfFile(_pbView);
+        _pbView = nullptr;
+    }
+    if (_hMapping != nullptr)
+    {
+        CloseHandle(_hMapping);
+        _hMapping = nullptr;
+    }
+    if (_hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(_hFile);
+        _hFile = INVALID_HANDLE_VALUE;
+    }
+}
+
+// Renames audit.log to audit.1.log (and so on, dropping the oldest) and opens a new audit.log. The caller must hold _fileLock and the mutex.
+// Renaming does not follow links, and the new audit.log is opened by _Open, so a link in the directory is never written through.
+HRESULT AuditLog::_Rotate()
+{
+    _Close();
+
+    HRESULT hr = S_OK;
+    for (DWORD iRotation = s_cRotatedFiles; SUCCEEDED(hr) && iRotation > 0; iRotation--)
+    {
+        ATL::CStringW strFrom;
+        ATL::CStringW strTo;
+        hr = _GetFileName(iRotation - 1, &strFrom);
+        if (SUCCEEDED(hr))
+        {
+            hr = _GetFileName(iRotation, &strTo);
+        }
+        if (SUCCEEDED(hr) && !MoveFileExW(strFrom, strTo, MOVEFILE_REPLACE_EXISTING) && GetLastError() != ERROR_FILE_NOT_FOUND)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+    return SUCCEEDED(hr) ? _Open() : hr;
+}
+
+HRESULT AuditLog::Query(_In_ PCWSTR pszFile, _In_opt_ PCWSTR pszUser, ULONGLONG ullFrom, ULONGLONG ullTo,
+    _Inout_ ATL::CAtlArray<AUDIT_RECORD>* prgRecords)
+{
+    // A writer may have the file open and may rotate it, so allow that
+    HANDLE hFile = CreateFileW(pszFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    HRESULT hr = S_OK;
+    LARGE_INTEGER liSize;
+    HANDLE hMapping = nullptr;
+    const BYTE* pbView = nullptr;
+    if (!GetFileSizeEx(hFile, &liSize))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    else if (liSize.QuadPart < s_cbHeader || liSize.QuadPart > s_cbFile)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT);
+    }
+    else
+    {
+        hMapping = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (hMapping != nullptr)
+        {
+            pbView = static_cast<const BYTE*>(MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0));
+        }
+        if (pbView == nullptr)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        const FILE_HEADER* pHeader = reinterpret_cast<const FILE_HEADER*>(pbView);
+        ULONGLONG ibEnd = pHeader->ibEnd;
+        DWORD cIndexEntries = pHeader->cIndexEntries;
+        if (memcmp(pHeader->rgbMagic, s_rgbMagic, sizeof(s_rgbMagic)) != 0 || pHeader->dwVersion != s_dwVersion ||
+            ibEnd < s_cbHeader || ibEnd > static_cast<ULONGLONG>(liSize.QuadPart) || cIndexEntries > s_cIndexEntries)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT);
+        }
+        else
+        {
+            // Start at the last indexed record from well before ullFrom; everything before it is older
+            ULONGLONG ullSeek = ullFrom > s_ullIndexMargin ? ullFrom - s_ullIndexMargin : 0;
+            ULONGLONG ibRecord = s_cbHeader;
+            DWORD iLow = 0;
+            DWORD iHigh = cIndexEntries;
+            while (iLow < iHigh)
+            {
+                DWORD iMid = iLow + (iHigh - iLow) / 2;
+                if (pHeader->rgIndex[iMid].ullTime <= ullSeek)
+                {
+                    iLow = iMid + 1;
+                }
+                else
+                {
+                    iHigh = iMid;
+                }
+            }
+            if (iLow > 0 && pHeader->rgIndex[iLow - 1].ibRecord >= s_cbHeader && pHeader->rgIndex[iLow - 1].ibRecord < ibEnd)
+            {
+                ibRecord = pHeader->rgIndex[iLow - 1].ibRecord;
+            }
+
+            while (SUCCEEDED(hr) && ibEnd - ibRecord >= sizeof(RECORD_PREFIX))
+            {
+                RECORD_PREFIX prefix;
+                memcpy(&prefix, pbView + ibRecord, sizeof(prefix));
+                if (prefix.cbPayload > ibEnd - ibRecord - sizeof(prefix))
+                {
+                    // Damaged; the lengths after this cannot be trusted either
+                    break;
+                }
+
+                const BYTE* pbPayload = pbView + ibRecord + sizeof(prefix);
+                AUDIT_RECORD record;
+                if (_Crc32(pbPayload, prefix.cbPayload) == prefix.dwCrc && _Deserialize(pbPayload, prefix.cbPayload, &record))
+                {
+                    // Not stopping at the first record after ullTo, as an earlier one may still follow it
+                    if (record.ullTime >= ullFrom && record.ullTime <= ullTo &&
+                        (pszUser == nullptr || record.strResponsible.CompareNoCase(pszUser) == 0 || record.strVictim.CompareNoCase(pszUser) == 0))
+                    {
+                        if (prgRecords->Add(record) == static_cast<size_t>(-1))
+                        {
+                            hr = E_OUTOFMEMORY;
+                        }
+                    }
+                }
+                ibRecord += sizeof(prefix) + prefix.cbPayload;
+            }
+        }
+    }
+
+    if (pbView != nullptr)
+    {
+        UnmapViewOfFile(pbView);
+    }
+    if (hMapping != nullptr)
+    {
+        CloseHandle(hMapping);
+    }
+    CloseHandle(hFile);
+    return hr;
+}
+
+HRESULT AuditLog::GetFiles(_Inout_ ATL::CAtlArray<ATL::CStringW>* prgstrFiles)
+{
+    HRESULT hr = S_OK;
+    for (DWORD iRotation = s_cRotatedFiles + 1; SUCCEEDED(hr) && iRotation > 0; iRotation--)
+    {
+        ATL::CStringW strFile;
+        hr = _GetFileName(iRotation - 1, &strFile);
+        if (SUCCEEDED(hr) && GetFileAttributesW(strFile) != INVALID_FILE_ATTRIBUTES)
+        {
+            prgstrFiles->Add(strFile);
+        }
+    }
+    return hr;
+}
+
+PCWSTR AuditLog::GetOutcomeName(AUDIT_OUTCOME outcome)
+{
+    switch (outcome)
+    {
+    case AO_SIGNED_OUT:         return L"signed out";
+    case AO_SIGN_OUT_FAILED:    return L"sign out failed";
+    case AO_DENIED:             return L"denied";
+    case AO_LOGON_FAILED:       return L"logon failed";
+    case AO_BLOCKED_PROTECTED:  return L"blocked by protected application";
+    case AO_RECLAIMED:          return L"reclaimed";
+    case AO_SIGNED_OUT_FORCED:  return L"signed out (forced)";
+    case AO_SIGN_OUT_REQUESTED: return L"sign out requested";
+    default:                    return L"unknown";
+    }
+}
+
+static void _AppendBytes(_Inout_ ATL::CAtlArray<BYTE>* prgb, _In_reads_bytes_(cb) const void* pv, size_t cb)
+{
+    size_t ib = prgb->GetCount();
+    if (prgb->SetCount(ib + cb))
+    {
+        memcpy(prgb->GetData() + ib, pv, cb);
+    }
+}
+
+void AuditLog::_Serialize(_In_ const AUDIT_RECORD& record, _Inout_ ATL::CAtlArray<BYTE>* prgbPayload)
+{
+    prgbPayload->RemoveAll();
+    DWORD dwOutcome = record.outcome;
+    _AppendBytes(prgbPayload, &record.ullTime, sizeof(record.ullTime));
+    _AppendBytes(prgbPayload, &dwOutcome, sizeof(dwOutcome));
+    _AppendBytes(prgbPayload, &record.dwLatencyMs, sizeof(record.dwLatencyMs));
+
+    const ATL::CStringW* rgpstr[] = { &record.strResponsible, &record.strVictim, &record.strProtectedApps };
+    for (size_t i = 0; i < ARRAYSIZE(rgpstr); i++)
+    {
+        DWORD cch = static_cast<DWORD>(rgpstr[i]->GetLength());
+        _AppendBytes(prgbPayload, &cch, sizeof(cch));
+        _AppendBytes(prgbPayload, rgpstr[i]->GetString(), cch * sizeof(WCHAR));
+    }
+}
+
+bool AuditLog::_Deserialize(_In_reads_bytes_(cbPayload) const BYTE* pbPayload, DWORD cbPayload, _Out_ AUDIT_RECORD* pRecord)
+{
+    const DWORD cbFixed = sizeof(ULONGLONG) + 2 * sizeof(DWORD);
+    if (cbPayload < cbFixed)
+    {
+        return false;
+    }
+
+    DWORD dwOutcome;
+    memcpy(&pRecord->ullTime, pbPayload, sizeof(ULONGLONG));
+    memcpy(&dwOutcome, pbPayload + sizeof(ULONGLONG), sizeof(DWORD));
+    memcpy(&pRecord->dwLatencyMs, pbPayload + sizeof(ULONGLONG) + sizeof(DWORD), sizeof(DWORD));
+    pRecord->outcome = static_cast<AUDIT_OUTCOME>(dwOutcome);
+
+    DWORD ib = cbFixed;
+    ATL::CStringW* rgpstr[] = { &pRecord->strResponsible, &pRecord->strVictim, &pRecord->strProtectedApps };
+    for (size_t i = 0; i < ARRAYSIZE(rgpstr); i++)
+    {
+        DWORD cch;
+        if (cbPayload - ib < sizeof(cch))
+        {
+            return false;
+        }
+        memcpy(&cch, pbPayload + ib, sizeof(cch));
+        ib += sizeof(cch);
+        if (cch > (cbPayload - ib) / sizeof(WCHAR))
+        {
+            return false;
+        }
+
+        // The characters may not be aligned, so they are copied rather than pointed to
+        PWSTR pwsz = rgpstr[i]->GetBufferSetLength(static_cast<int>(cch));
+        memcpy(pwsz, pbPayload + ib, cch * sizeof(WCHAR));
+        rgpstr[i]->ReleaseBufferSetLength(static_cast<int>(cch));
+        ib += cch * sizeof(WCHAR);
+    }
+    return ib == cbPayload;
+}
+
+// CRC-32 as used by zip and Ethernet (reflected polynomial 0xEDB88320).
+DWORD AuditLog::_Crc32(_In_reads_bytes_(cb) const BYTE* pb, size_t cb)
+{
+    static const struct CRC_TABLE
+    {
+        DWORD rgdw[256];
+        CRC_TABLE()
+        {
+            for (DWORD i = 0; i < 256; i++)
+            {
+                DWORD dw = i;
+                for (int iBit = 0; iBit < 8; iBit++)
+                {
+                    dw = (dw & 1) ? (dw >> 1) ^ 0xEDB88320 : dw >> 1;
+                }
+                rgdw[i] = dw;
+            }
+        }
+    } s_table;
+
+    DWORD dwCrc = 0xFFFFFFFF;
+    for (size_t i = 0; i < cb; i++)
+    {
+        dwCrc = s_table.rgdw[(dwCrc ^ pb[i]) & 0xFF] ^ (dwCrc >> 8);
+    }
+    return ~dwCrc;
+}
+
+// audit.log for iRotation 0, audit.<iRotation>.log for the older ones.
+HRESULT AuditLog::_GetFileName(DWORD iRotation, _Out_ ATL::CStringW* pstrFile)
+{
+    ATL::CStringW strDirectory;
+    HRESULT hr = GetDataDirectory(L"audit", &strDirectory);
+    if (SUCCEEDED(hr))
+    {
+        if (iRotation == 0)
+        {
+            pstrFile->Format(L"%s\\audit.log", strDirectory.GetString());
+        }
+        else
+        {
+            pstrFile->Format(L"%s\\audit.%lu.log", strDirectory.GetString(), iRotation);
+        }
+    }
+    return hr;
+}
+
+// Reads a date as yyyy-mm-dd into the FILETIME at the start of that day (UTC).
+static bool _ParseDate(_In_ PCWSTR pszDate, _Out_ ULONGLONG* pullTime)
+{
+    SYSTEMTIME st = {};
+    FILETIME ft;
+    if (swscanf_s(pszDate, L"%hu-%hu-%hu", &st.wYear, &st.wMonth, &st.wDay) != 3 || !SystemTimeToFileTime(&st, &ft))
+    {
+        return false;
+    }
+    *pullTime = (static_cast<ULONGLONG>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+    return true;
+}
+
+// Quotes a field for CSV, doubling the quotes in it. The names are typed in at the lock screen, so a field that a
+// spreadsheet would take for a formula (e.g. =HYPERLINK(...)) gets a ' in front to keep it text.
+static ATL::CStringW _CsvField(_In_ const ATL::CStringW& str)
+{
+    ATL::CStringW strField(str);
+    if (!strField.IsEmpty() && wcschr(L"=+-@\t\r", strField[0]) != nullptr)
+    {
+        strField.Insert(0, L'\'');
+    }
+    strField.Replace(L"\"", L"\"\"");
+    return L"\"" + strField + L"\"";
+}
+
+// Exports the audit log as CSV, for use with rundll32 by an administrator:
+//   rundll32 GEWISUnlockV2CredentialProvider.dll,QueryAuditLog <output.csv> [user|*] [from yyyy-mm-dd] [to yyyy-mm-dd]
+// The user is matched against both the room responsible and the user that was signed out; the dates are inclusive (UTC).
+EXTERN_C void CALLBACK QueryAuditLogW(_In_opt_ HWND hwnd, _In_opt_ HINSTANCE /*hinst*/, _In_ LPWSTR pszCmdLine, int /*nCmdShow*/)
+{
+    int cArgs;
+    PWSTR* rgpszArgs = CommandLineToArgvW(pszCmdLine, &cArgs);
+    if (rgpszArgs == nullptr)
+    {
+        return;
+    }
+
+    PCWSTR pszUser = (cArgs > 1 && wcscmp(rgpszArgs[1], L"*") != 0) ? rgpszArgs[1] : nullptr;
+    ULONGLONG ullFrom = 0;
+    ULONGLONG ullTo = ~0ULL;
+    bool fValid = cArgs >= 1 && cArgs <= 4 && pszCmdLine[0] != L'\0';
+    if (fValid && cArgs > 2)
+    {
+        fValid = _ParseDate(rgpszArgs[2], &ullFrom);
+    }
+    if (fValid && cArgs > 3)
+    {
+        // Up to the end of that day
+        fValid = _ParseDate(rgpszArgs[3], &ullTo);
+        ullTo += 24ULL * 60 * 60 * 10000000 - 1;
+    }
+    if (!fValid)
+    {
+        MessageBoxW(hwnd, L"Usage: rundll32 GEWISUnlockV2CredentialProvider.dll,QueryAuditLog <output.csv> [user|*] [from yyyy-mm-dd] [to yyyy-mm-dd]",
+            L"GEWIS Unlock audit log", MB_OK | MB_ICONINFORMATION);
+        LocalFree(rgpszArgs);
+        return;
+    }
+
+    ATL::CAtlArray<ATL::CStringW> rgstrFiles;
+    ATL::CAtlArray<AUDIT_RECORD> rgRecords;
+    HRESULT hr = AuditLog::GetFiles(&rgstrFiles);
+    for (size_t i = 0; SUCCEEDED(hr) && i < rgstrFiles.GetCount(); i++)
+    {
+        // A file that cannot be read is skipped, so the others can still be exported
+        AuditLog::Query(rgstrFiles[i], pszUser, ullFrom, ullTo, &rgRecords);
+    }
+
+    ATL::CStringW strCsv(L"time (UTC),outcome,latency (ms),room responsible,user,protected applications\r\n");
+    for (size_t i = 0; SUCCEEDED(hr) && i < rgRecords.GetCount(); i++)
+    {
+        const AUDIT_RECORD& record = rgRecords[i];
+        FILETIME ft;
+        ft.dwHighDateTime = static_cast<DWORD>(record.ullTime >> 32);
+        ft.dwLowDateTime = static_cast<DWORD>(record.ullTime);
+        SYSTEMTIME st = {};
+        FileTimeToSystemTime(&ft, &st);
+
+        strCsv.AppendFormat(L"%04u-%02u-%02uT%02u:%02u:%02u.%03uZ,%s,%lu,%s,%s,%s\r\n",
+            st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, st.wMilliseconds,
+            AuditLog::GetOutcomeName(record.outcome), record.dwLatencyMs,
+            _CsvField(record.strResponsible).GetString(), _CsvField(record.strVictim).GetString(), _CsvField(record.strProtectedApps).GetString());
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        ATL::CStringA strUtf8(ATL::CW2A(strCsv, CP_UTF8));
+        HANDLE hFile = CreateFileW(rgpszArgs[0], GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        DWORD cbWritten;
+        if (hFile == INVALID_HANDLE_VALUE)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+        else
+        {
+            if (!WriteFile(hFile, strUtf8.GetString(), static_cast<DWORD>(strUtf8.GetLength()), &cbWritten, nullptr))
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+            }
+            CloseHandle(hFile);
+        }
+    }
+
+    if (FAILED(hr))
+    {
+        ATL::CStringW strMessage;
+        strMessage.Format(L"The audit log could not be exported (error 0x%08lX).", hr);
+        MessageBoxW(hwnd, strMessage, L"GEWIS Unlock audit log", MB_OK | MB_ICONERROR);
+    }
+    LocalFree(rgpszArgs);
+}
@@ -0,0 +1,142 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+
+// What happened to an attempt to sign out a user.
+enum AUDIT_OUTCOME
+{
+    AO_SIGNED_OUT,          // The session was signed out.
+    AO_SIGN_OUT_FAILED,     // Signing out failed, or the session did not sign out in time.
+    AO_DENIED,              // The room responsible does not have the rights for this kick.
+    AO_LOGON_FAILED,        // The username or password of the room responsible was wrong.
+    AO_BLOCKED_PROTECTED,   // A protected application was running and the box was not checked; nobody was verified yet.
+    AO_RECLAIMED,           // Signed out automatically because the session was locked for too long.
+    AO_SIGNED_OUT_FORCED,   // Signed out after the remaining processes of a session that did not sign out in time were terminated.
+    AO_SIGN_OUT_REQUESTED,  // Asked to sign out, but we could not wait to see it happen (e.g. the session of this LogonUI).
+};
+
+struct AUDIT_RECORD
+{
+    ULONGLONG       ullTime;            // FILETIME (UTC) of the attempt.
+    AUDIT_OUTCOME   outcome;
+    DWORD           dwLatencyMs;        // From submitting the kick until the outcome was known.
+    ATL::CStringW   strResponsible;     // The room responsible, as entered (DOMAIN\user or user@domain).
+    ATL::CStringW   strVictim;          // The user whose session was (to be) signed out.
+    ATL::CStringW   strProtectedApps;   // The protected applications that were running, separated by ", ".
+};
+
+// An append-only log of every attempt to sign out a user, in %ProgramData%\GEWISUnlock\audit.
+//
+// Write only copies the record onto a lock-free list (an SLIST) and, if needed, queues a threadpool
+// work item, so logging does not slow down the kick. The work item appends the records to audit.log,
+// a preallocated file that is mapped into memory. Each record is stored with its length and a CRC-32,
+// so a torn or damaged record is detected and skipped when reading. When the file is full it is
+// renamed to audit.1.log (keeping s_cRotatedFiles old files) and a new one is started.
+//
+// Every locked session has its own LogonUI process, each with its own AuditLog, and all of them write to
+// the same file. So the file is only open while draining, under a named mutex that all of them share, and
+// the end of the log is read from the header each time rather than remembered.
+//
+// The header of the file holds a sparse index: the time and position of a record every few kilobytes,
+// so a query for a time range only reads the part of the file that can contain it.
+class AuditLog
+{
+public:
+    static AuditLog& Instance();
+
+    // The provider keeps the writer available with AddRef/Release. The last Release writes what is queued.
+    void AddRef();
+    void Release();
+
+    // The current time for AUDIT_RECORD::ullTime.
+    static ULONGLONG Now();
+
+    void Write(_In_ const AUDIT_RECORD& record);
+
+    // Writes what is queued right away, e.g. before signing out the session this process runs in.
+    void Flush();
+
+    // Appends the records in pszFile that are between ullFrom and ullTo and, if pszUser is not null,
+    // that have pszUser as the room responsible or the victim (ignoring case).
+    static HRESULT Query(_In_ PCWSTR pszFile, _In_opt_ PCWSTR pszUser, ULONGLONG ullFrom, ULONGLONG ullTo,
+        _Inout_ ATL::CAtlArray<AUDIT_RECORD>* prgRecords);
+
+    // The current log and its rotated predecessors, oldest first.
+    static HRESULT GetFiles(_Inout_ ATL::CAtlArray<ATL::CStringW>* prgstrFiles);
+
+    static PCWSTR GetOutcomeName(AUDIT_OUTCOME outcome);
+
+private:
+    AuditLog();
+    ~AuditLog();
+
+    static const DWORD s_cbFile = 4 * 1024 * 1024;
+    static const DWORD s_cbHeader = 4096;
+    static const DWORD s_cIndexEntries = 254;
+    static const DWORD s_cbIndexStride = (s_cbFile - s_cbHeader) / s_cIndexEntries;
+    static const DWORD s_cRotatedFiles = 3;
+    static const DWORD s_msFileLockTimeout = 10000;
+
+    struct INDEX_ENTRY
+    {
+        ULONGLONG   ullTime;
+        ULONGLONG   ibRecord;
+    };
+
+    // At the start of the file; the records follow at s_cbHeader.
+    struct FILE_HEADER
+    {
+        BYTE        rgbMagic[8];
+        DWORD       dwVersion;
+        DWORD       cIndexEntries;      // Used entries of rgIndex.
+        ULONGLONG   ibEnd;              // Where the next record goes.
+        INDEX_ENTRY rgIndex[s_cIndexEntries];
+    };
+    static_assert(sizeof(FILE_HEADER) <= s_cbHeader, "The header does not fit");
+
+    // Each record is a RECORD_PREFIX followed by cbPayload bytes: ullTime, outcome, dwLatencyMs and the three
+    // strings, each as a character count and the characters.
+    struct RECORD_PREFIX
+    {
+        DWORD       cbPayload;
+        DWORD       dwCrc;              // CRC-32 of the payload.
+    };
+
+    struct DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) NODE
+    {
+        SLIST_ENTRY     entry;          // Must be first.
+        AUDIT_RECORD    record;
+    };
+
+    static VOID CALLBACK _WorkCallback(_Inout_ PTP_CALLBACK_INSTANCE pInstance, _Inout_opt_ PVOID pContext, _Inout_ PTP_WORK pWork);
+    void _Drain();
+    bool _LockFile();
+    void _UnlockFile();
+    HRESULT _Append(_In_ const AUDIT_RECORD& record);
+    HRESULT _Open();
+    void _Close();
+    HRESULT _Rotate();
+
+    static void _Serialize(_In_ const AUDIT_RECORD& record, _Inout_ ATL::CAtlArray<BYTE>* prgbPayload);
+    static bool _Deserialize(_In_reads_bytes_(cbPayload) const BYTE* pbPayload, DWORD cbPayload, _Out_ AUDIT_RECORD* pRecord);
+    static DWORD _Crc32(_In_reads_bytes_(cb) const BYTE* pb, size_t cb);
+    static HRESULT _GetFileName(DWORD iRotation, _Out_ ATL::CStringW* pstrFile);
+
+    SLIST_HEADER            _queue;
+    volatile LONG           _fScheduled;    // Whether _pWork has been submitted and not started draining yet.
+    SRWLOCK                 _usersLock;     // Guards _cUsers and _pWork.
+    long                    _cUsers;
+    PTP_WORK                _pWork;
+
+    // Only used while draining, which happens on one thread at a time in this process, and under _hFileMutex
+    // across processes.
+    SRWLOCK                 _fileLock;
+    HANDLE                  _hFileMutex;
+    HANDLE                  _hFile;
+    HANDLE                  _hMapping;
+    BYTE*                   _pbView;
+    ATL::CAtlArray<BYTE>    _rgbPayload;
+};
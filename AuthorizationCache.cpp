@@ -0,0 +1,255 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "AuthorizationCache.h"
+#include "Dll.h"
+#include <bcrypt.h>
+#pragma comment(lib, "bcrypt.lib")
+
+// PBKDF2-HMAC-SHA256 iterations for the password verifier. This makes a stolen verifier expensive to
+// brute force while a cache hit still takes only a few milliseconds, instead of a round trip to a domain controller.
+static const ULONGLONG s_cVerifierIterations = 10000;
+
+AuthorizationCache& AuthorizationCache::Instance()
+{
+    static AuthorizationCache s_cache;
+    return s_cache;
+}
+
+AuthorizationCache::AuthorizationCache() :
+    _pTimer(nullptr),
+    _fArmed(false)
+{
+    InitializeSRWLock(&_lock);
+}
+
+AuthorizationCache::~AuthorizationCache()
+{
+    _WipeEntries();
+}
+
+HRESULT AuthorizationCache::Lookup(_In_ PCWSTR pszDomain, _In_ PCWSTR pszUsername, _In_ PCWSTR pszPassword, _Out_ DWORD* pdwRights)
+{
+    HRESULT hr = S_FALSE;
+    *pdwRights = AR_NONE;
+
+    ATL::CStringW strKey;
+    _MakeKey(pszDomain, pszUsername, &strKey);
+
+    ENTRY entry;
+    bool fFound = false;
+    AcquireSRWLockExclusive(&_lock);
+    _PurgeExpired();
+    const CEntryMap::CPair* pPair = _entries.Lookup(strKey);
+    if (pPair != nullptr)
+    {
+        entry = pPair->m_value;
+        fFound = true;
+    }
+    ReleaseSRWLockExclusive(&_lock);
+
+    if (fFound)
+    {
+        if (CheckVerifier(entry.verifier, pszPassword) == S_OK)
+        {
+            *pdwRights = entry.dwRights;
+            hr = S_OK;
+        }
+        SecureZeroMemory(&entry, sizeof(entry));
+    }
+
+    return hr;
+}
+
+HRESULT AuthorizationCache::Store(_In_ PCWSTR pszDomain, _In_ PCWSTR pszUsername, _In_ PCWSTR pszPassword, DWORD dwRights, DWORD dwTtlSeconds)
+{
+    if (dwTtlSeconds == 0)
+    {
+        return S_OK;
+    }
+
+    ENTRY entry;
+    entry.dwRights = dwRights;
+    entry.ullExpires = GetTickCount64() + static_cast<ULONGLONG>(dwTtlSeconds) * 1000;
+
+    HRESULT hr = CreateVerifier(pszPassword, &entry.verifier);
+    if (SUCCEEDED(hr))
+    {
+        ATL::CStringW strKey;
+        _MakeKey(pszDomain, pszUsername, &strKey);
+
+        AcquireSRWLockExclusive(&_lock);
+        _entries.SetAt(strKey, entry);
+        _Arm();
+        ReleaseSRWLockExclusive(&_lock);
+    }
+
+    SecureZeroMemory(&entry, sizeof(entry));
+    return hr;
+}
+
+HRESULT AuthorizationCache::CreateVerifier(_In_ PCWSTR pszPassword, _Out_ PASSWORD_VERIFIER* pVerifier)
+{
+    HRESULT hr = HRESULT_FROM_NT(BCryptGenRandom(nullptr, pVerifier->rgbSalt, sizeof(pVerifier->rgbSalt), BCRYPT_USE_SYSTEM_PREFERRED_RNG));
+    if (SUCCEEDED(hr))
+    {
+        hr = _DeriveVerifier(pszPassword, pVerifier->rgbSalt, pVerifier->rgbVerifier);
+    }
+    if (FAILED(hr))
+    {
+        SecureZeroMemory(pVerifier, sizeof(*pVerifier));
+    }
+    return hr;
+}
+
+HRESULT AuthorizationCache::CheckVerifier(_In_ const PASSWORD_VERIFIER& verifier, _In_ PCWSTR pszPassword)
+{
+    BYTE rgbVerifier[s_cbVerifier];
+    HRESULT hr = _DeriveVerifier(pszPassword, verifier.rgbSalt, rgbVerifier);
+    if (SUCCEEDED(hr))
+    {
+        // Compare all bytes, so the time taken does not depend on where the first difference is
+        BYTE bDifference = 0;
+        for (DWORD i = 0; i < s_cbVerifier; i++)
+        {
+            bDifference |= rgbVerifier[i] ^ verifier.rgbVerifier[i];
+        }
+        hr = bDifference == 0 ? S_OK : S_FALSE;
+    }
+    SecureZeroMemory(rgbVerifier, sizeof(rgbVerifier));
+    return hr;
+}
+
+void AuthorizationCache::Clear()
+{
+    AcquireSRWLockExclusive(&_lock);
+    _WipeEntries();
+    _Arm();
+    ReleaseSRWLockExclusive(&_lock);
+}
+
+void AuthorizationCache::WipeOnDetach()
+{
+    // Other threads may have been terminated while holding the lock, so we cannot take it here.
+    _WipeEntries();
+}
+
+void AuthorizationCache::_MakeKey(_In_ PCWSTR pszDomain, _In_ PCWSTR pszUsername, _Out_ ATL::CStringW* pstrKey)
+{
+    pstrKey->Format(L"%s\\%s", pszDomain, pszUsername);
+    int cchKey = pstrKey->GetLength();
+    CharUpperBuffW(pstrKey->GetBuffer(), static_cast<DWORD>(cchKey));
+    pstrKey->ReleaseBuffer(cchKey);
+}
+
+HRESULT AuthorizationCache::_DeriveVerifier(_In_ PCWSTR pszPassword, _In_reads_bytes_(s_cbSalt) const BYTE* pbSalt, _Out_writes_bytes_all_(s_cbVerifier) BYTE* pbVerifier)
+{
+    BCRYPT_ALG_HANDLE hAlgorithm;
+    HRESULT hr = HRESULT_FROM_NT(BCryptOpenAlgorithmProvider(&hAlgorithm, BCRYPT_SHA256_ALGORITHM, nullptr, BCRYPT_ALG_HANDLE_HMAC_FLAG));
+    if (SUCCEEDED(hr))
+    {
+        hr = HRESULT_FROM_NT(BCryptDeriveKeyPBKDF2(hAlgorithm,
+            (PUCHAR)pszPassword, static_cast<ULONG>(wcslen(pszPassword) * sizeof(wchar_t)),
+            (PUCHAR)pbSalt, s_cbSalt,
+            s_cVerifierIterations,
+            pbVerifier, s_cbVerifier, 0));
+        BCryptCloseAlgorithmProvider(hAlgorithm, 0);
+    }
+    return hr;
+}
+
+// The caller must hold _lock (except during DLL_PROCESS_DETACH).
+void AuthorizationCache::_WipeEntries()
+{
+    for (POSITION pos = _entries.GetStartPosition(); pos != nullptr; )
+    {
+        CEntryMap::CPair* pPair = _entries.GetNext(pos);
+        SecureZeroMemory(&pPair->m_value, sizeof(pPair->m_value));
+    }
+    _entries.RemoveAll();
+}
+
+// The caller must hold _lock.
+void AuthorizationCache::_PurgeExpired()
+{
+    ULONGLONG ullNow = GetTickCount64();
+    for (POSITION pos = _entries.GetStartPosition(); pos != nullptr; )
+    {
+        POSITION posEntry = pos;
+        CEntryMap::CPair* pPair = _entries.GetNext(pos);
+        if (pPair->m_value.ullExpires <= ullNow)
+        {
+            SecureZeroMemory(&pPair->m_value, sizeof(pPair->m_value));
+            _entries.RemoveAtPos(posEntry);
+        }
+    }
+}
+
+// While there are entries, sets the timer to go off when the first one expires. Stops it once the cache is empty.
+// The caller must hold _lock.
+void AuthorizationCache::_Arm()
+{
+    if (_entries.IsEmpty())
+    {
+        if (_fArmed)
+        {
+            SetThreadpoolTimer(_pTimer, nullptr, 0, 0);
+            _fArmed = false;
+            DllRelease();
+        }
+        return;
+    }
+
+    if (_pTimer == nullptr)
+    {
+        // Keep the DLL loaded while the callback runs
+        TP_CALLBACK_ENVIRON callbackEnviron;
+        InitializeThreadpoolEnvironment(&callbackEnviron);
+        SetThreadpoolCallbackLibrary(&callbackEnviron, HINST_THISDLL);
+        _pTimer = CreateThreadpoolTimer(_ExpiryCallback, this, &callbackEnviron);
+        DestroyThreadpoolEnvironment(&callbackEnviron);
+        if (_pTimer == nullptr)
+        {
+            // Expired entries will still be purged on the next lookup
+            return;
+        }
+    }
+
+    ULONGLONG ullFirstExpiry = MAXULONGLONG;
+    for (POSITION pos = _entries.GetStartPosition(); pos != nullptr; )
+    {
+        const CEntryMap::CPair* pPair = _entries.GetNext(pos);
+        if (pPair->m_value.ullExpires < ullFirstExpiry)
+        {
+            ullFirstExpiry = pPair->m_value.ullExpires;
+        }
+    }
+    ULONGLONG ullNow = GetTickCount64();
+    ULONGLONG ullDelay = ullFirstExpiry > ullNow ? ullFirstExpiry - ullNow : 0;
+
+    // A negative due time is relative, in 100 nanosecond units
+    ULARGE_INTEGER ulDueTime;
+    ulDueTime.QuadPart = static_cast<ULONGLONG>(-static_cast<LONGLONG>(ullDelay * 10000));
+    FILETIME ftDueTime;
+    ftDueTime.dwLowDateTime = ulDueTime.LowPart;
+    ftDueTime.dwHighDateTime = ulDueTime.HighPart;
+    SetThreadpoolTimer(_pTimer, &ftDueTime, 0, 0);
+
+    if (!_fArmed)
+    {
+        // The timer calls into this DLL, so the DLL must stay loaded until it is stopped
+        _fArmed = true;
+        DllAddRef();
+    }
+}
+
+VOID CALLBACK AuthorizationCache::_ExpiryCallback(_Inout_ PTP_CALLBACK_INSTANCE /*pInstance*/, _Inout_opt_ PVOID pContext, _Inout_ PTP_TIMER /*pTimer*/)
+{
+    AuthorizationCache* pCache = static_cast<AuthorizationCache*>(pContext);
+    AcquireSRWLockExclusive(&pCache->_lock);
+    pCache->_PurgeExpired();
+    pCache->_Arm();
+    ReleaseSRWLockExclusive(&pCache->_lock);
+}
+
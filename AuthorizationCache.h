@@ -0,0 +1,73 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+
+// Remembers recently verified room responsibles, so kicking several sessions in a row does not need a
+// full interactive logon and group enumeration every time.
+//
+// Entries are keyed by the normalized DOMAIN\USER and hold a salted PBKDF2 verifier of the password
+// (never the password itself) and the AUTHORIZATION_RIGHT flags the room responsible has. Entries expire after
+// the configured time to live, at which point they are wiped; the whole cache is also wiped when the
+// configuration changes and when the DLL is unloaded.
+class AuthorizationCache
+{
+    static const DWORD s_cbSalt = 16;
+    static const DWORD s_cbVerifier = 32;
+
+public:
+    // A salted PBKDF2 verifier of a single password, to check later that the same password is entered again.
+    struct PASSWORD_VERIFIER
+    {
+        BYTE        rgbSalt[s_cbSalt];
+        BYTE        rgbVerifier[s_cbVerifier];
+    };
+
+    static AuthorizationCache& Instance();
+
+    // Makes a verifier of pszPassword with a new salt. The caller should wipe it with SecureZeroMemory when done.
+    static HRESULT CreateVerifier(_In_ PCWSTR pszPassword, _Out_ PASSWORD_VERIFIER* pVerifier);
+
+    // Returns S_OK if pszPassword is the password verifier was made of, S_FALSE if not.
+    static HRESULT CheckVerifier(_In_ const PASSWORD_VERIFIER& verifier, _In_ PCWSTR pszPassword);
+
+    // Returns S_OK with *pdwRights set if there is a live entry for the user and pszPassword matches it,
+    // or S_FALSE if the user has to be verified the normal way.
+    HRESULT Lookup(_In_ PCWSTR pszDomain, _In_ PCWSTR pszUsername, _In_ PCWSTR pszPassword, _Out_ DWORD* pdwRights);
+
+    // Remembers the outcome of a successful logon for dwTtlSeconds. Does nothing if dwTtlSeconds is 0.
+    HRESULT Store(_In_ PCWSTR pszDomain, _In_ PCWSTR pszUsername, _In_ PCWSTR pszPassword, DWORD dwRights, DWORD dwTtlSeconds);
+
+    // Wipes all entries. Called by ConfigStore when the configuration changes.
+    void Clear();
+
+    // Wipes all entries without taking the lock; only for DLL_PROCESS_DETACH.
+    void WipeOnDetach();
+
+private:
+    AuthorizationCache();
+    ~AuthorizationCache();
+
+    struct ENTRY
+    {
+        PASSWORD_VERIFIER verifier;
+        ULONGLONG   ullExpires;             // GetTickCount64 value after which the entry is no longer used.
+        DWORD       dwRights;
+    };
+    typedef ATL::CAtlMap<ATL::CStringW, ENTRY> CEntryMap;
+
+    static void _MakeKey(_In_ PCWSTR pszDomain, _In_ PCWSTR pszUsername, _Out_ ATL::CStringW* pstrKey);
+    static HRESULT _DeriveVerifier(_In_ PCWSTR pszPassword, _In_reads_bytes_(s_cbSalt) const BYTE* pbSalt, _Out_writes_bytes_all_(s_cbVerifier) BYTE* pbVerifier);
+    static VOID CALLBACK _ExpiryCallback(_Inout_ PTP_CALLBACK_INSTANCE pInstance, _Inout_opt_ PVOID pContext, _Inout_ PTP_TIMER pTimer);
+
+    void _WipeEntries();
+    void _PurgeExpired();
+    void _Arm();
+
+    SRWLOCK     _lock;              // Guards everything below.
+    CEntryMap   _entries;
+    PTP_TIMER   _pTimer;            // Wipes entries when they expire.
+    bool        _fArmed;            // While armed, the timer holds a reference on the DLL.
+};
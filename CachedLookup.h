@@ -0,0 +1,78 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include <windows.h>
+
+// The result of a lookup that gives the same answer for as long as the DLL is loaded (e.g. the ID of an
+// authentication package), done once and then shared by every thread.
+//
+// The first Get calls the lookup function; threads that call Get meanwhile wait for it instead of doing the
+// same lookup. A failed lookup is not remembered, so the next Get tries again. Invalidate forgets the value,
+// for when the caller finds out that it no longer works.
+template <typename T>
+class CachedLookup
+{
+public:
+    typedef HRESULT (*PFN_LOOKUP)(_Out_ T* pValue);
+
+    explicit CachedLookup(_In_ PFN_LOOKUP pfnLookup) :
+        _pfnLookup(pfnLookup),
+        _fValid(false),
+        _value()
+    {
+        InitializeSRWLock(&_lock);
+    }
+
+    HRESULT Get(_Out_ T* pValue)
+    {
+        AcquireSRWLockShared(&_lock);
+        bool fValid = _fValid;
+        if (fValid)
+        {
+            *pValue = _value;
+        }
+        ReleaseSRWLockShared(&_lock);
+        if (fValid)
+        {
+            return S_OK;
+        }
+
+        HRESULT hr = S_OK;
+        AcquireSRWLockExclusive(&_lock);
+        if (!_fValid)
+        {
+            // Under the lock, so a lookup that is slow (or fails) is done by one thread at a time
+            T value;
+            hr = _pfnLookup(&value);
+            if (SUCCEEDED(hr))
+            {
+                _value = value;
+                _fValid = true;
+            }
+        }
+        if (SUCCEEDED(hr))
+        {
+            *pValue = _value;
+        }
+        ReleaseSRWLockExclusive(&_lock);
+        return hr;
+    }
+
+    void Invalidate()
+    {
+        AcquireSRWLockExclusive(&_lock);
+        _fValid = false;
+        ReleaseSRWLockExclusive(&_lock);
+    }
+
+private:
+    CachedLookup(const CachedLookup&) = delete;
+    CachedLookup& operator=(const CachedLookup&) = delete;
+
+    PFN_LOOKUP  _pfnLookup;
+    SRWLOCK     _lock;      // Guards _fValid and _value.
+    bool        _fValid;
+    T           _value;
+};
@@ -0,0 +1,336 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "ConfigStore.h"
+#include "AuthorizationCache.h"
+#include "Dll.h"
+
+// If changes to the settings cannot be watched, the watcher thread reads them again at this interval instead.
+static const DWORD s_msPollInterval = 60000;
+
+RegistryConfigSource::RegistryConfigSource() :
+    _hKey(nullptr)
+{
+}
+
+RegistryConfigSource::~RegistryConfigSource()
+{
+    if (_hKey != nullptr)
+    {
+        RegCloseKey(_hKey);
+    }
+}
+
+// Reads the settings from key (Software\GEWISUnlock), or gives every setting its default if key is nullptr.
+static HRESULT _LoadSettings(_In_opt_ HKEY key, _Inout_ Config* pConfig)
+{
+    ATL::CAtlArray<AUTHORIZED_GROUP> rgGroups;
+    HRESULT hr = GetAuthorizedGroups(key, &rgGroups);
+    for (size_t i = 0; SUCCEEDED(hr) && i < rgGroups.GetCount(); i++)
+    {
+        const AUTHORIZED_GROUP& group = rgGroups[i];
+        hr = pConfig->authorizedGroups.Add(const_cast<SID*>(group.sid.GetPSID()), group.dwRights);
+        if (SUCCEEDED(hr) && (group.dwRights & AR_KICK) && pConfig->kickGroups.Add(group.sid) == static_cast<size_t>(-1))
+        {
+            hr = E_OUTOFMEMORY;
+        }
+        if (SUCCEEDED(hr) && (group.dwRights & AR_KICK_PROTECTED) && pConfig->kickProtectedGroups.Add(group.sid) == static_cast<size_t>(-1))
+        {
+            hr = E_OUTOFMEMORY;
+        }
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = GetProtectedApplications(key, &pConfig->protectedApps, &pConfig->appCloseTimeouts);
+    }
+    if (SUCCEEDED(hr))
+    {
+        pConfig->dwAuthorizationCacheTtl = GetAuthorizationCacheTtl(key);
+        pConfig->fPrefetch = GetPrefetchEnabled(key);
+        pConfig->dwReclaimLockedAfter = GetReclaimLockedAfter(key);
+        pConfig->dwLogoffTimeout = GetLogoffTimeout(key);
+        pConfig->dwAppCloseTimeout = GetAppCloseTimeout(key);
+        hr = GetDefaultDomain(key, &pConfig->strDefaultDomain);
+    }
+    return hr;
+}
+
+HRESULT RegistryConfigSource::Load(_Inout_ Config* pConfig)
+{
+    // Every setting is read from the same key, so it is opened once; without it, all settings get their default
+    HKEY key;
+    if (RegOpenKeyEx(HKEY_LOCAL_MACHINE, TEXT("Software\\GEWISUnlock\\"), 0, KEY_QUERY_VALUE, &key) != ERROR_SUCCESS)
+    {
+        key = nullptr;
+    }
+
+    HRESULT hr = _LoadSettings(key, pConfig);
+
+    if (key != nullptr)
+    {
+        RegCloseKey(key);
+    }
+    return hr;
+}
+
+HRESULT RegistryConfigSource::NotifyChange(_In_ HANDLE hChanged)
+{
+    LSTATUS status = ERROR_SUCCESS;
+    if (_hKey == nullptr)
+    {
+        status = RegOpenKeyEx(HKEY_LOCAL_MACHINE, TEXT("Software\\GEWISUnlock\\"), 0, KEY_NOTIFY, &_hKey);
+    }
+    if (status == ERROR_SUCCESS)
+    {
+        // The notification has to outlive the thread that registers it
+        status = RegNotifyChangeKeyValue(_hKey, FALSE, REG_NOTIFY_CHANGE_LAST_SET | REG_NOTIFY_THREAD_AGNOSTIC, hChanged, TRUE);
+    }
+    return HRESULT_FROM_WIN32(status);
+}
+
+ConfigStore& ConfigStore::Instance()
+{
+    static ConfigStore s_store;
+    return s_store;
+}
+
+ConfigStore::ConfigStore() :
+    _pSource(new(std::nothrow) RegistryConfigSource()),
+    _cUsers(0),
+    _hThread(nullptr),
+    _hStopEvent(nullptr),
+    _hChangedEvent(nullptr),
+    _fNotifying(false)
+{
+    InitializeSRWLock(&_sourceLock);
+    InitializeSRWLock(&_eventsLock);
+    InitializeSRWLock(&_usersLock);
+}
+
+ConfigStore::~ConfigStore()
+{
+    // The watcher thread is stopped by the last Release; see ProcessIndex::~ProcessIndex.
+    if (_hThread != nullptr)
+    {
+        CloseHandle(_hThread);
+    }
+    if (_hStopEvent != nullptr)
+    {
+        CloseHandle(_hStopEvent);
+    }
+    if (_hChangedEvent != nullptr)
+    {
+        CloseHandle(_hChangedEvent);
+    }
+}
+
+void ConfigStore::AddRef()
+{
+    AcquireSRWLockExclusive(&_usersLock);
+    if (_cUsers++ == 0)
+    {
+        // If the watcher cannot be started, we keep using the settings we read last.
+        _Start();
+    }
+    ReleaseSRWLockExclusive(&_usersLock);
+}
+
+void ConfigStore::Release()
+{
+    AcquireSRWLockExclusive(&_usersLock);
+    if (_cUsers > 0 && --_cUsers == 0)
+    {
+        _Stop();
+    }
+    ReleaseSRWLockExclusive(&_usersLock);
+}
+
+std::shared_ptr<const Config> ConfigStore::Current()
+{
+    std::shared_ptr<const Config> pConfig = std::atomic_load(&_pConfig);
+    if (!pConfig)
+    {
+        _Reload();
+        pConfig = std::atomic_load(&_pConfig);
+    }
+    if (!pConfig)
+    {
+        // The settings could not be read (e.g. out of memory); the defaults at least keep Multivers protected
+        pConfig = std::shared_ptr<const Config>(_GetDefaults(), [](const Config*) {});
+    }
+    return pConfig;
+}
+
+// The settings as if none of them were set, read once. If even that fails, the authorized groups are
+// left (partly) empty, which denies rather than allows.
+const Config* ConfigStore::_GetDefaults()
+{
+    struct DEFAULT_CONFIG : Config
+    {
+        DEFAULT_CONFIG()
+        {
+            _LoadSettings(nullptr, this);
+        }
+    };
+    static const DEFAULT_CONFIG s_defaults;
+    return &s_defaults;
+}
+
+void ConfigStore::AddChangeEvent(_In_ HANDLE hChanged)
+{
+    AcquireSRWLockExclusive(&_eventsLock);
+    _changeEvents.Add(hChanged);
+    ReleaseSRWLockExclusive(&_eventsLock);
+}
+
+void ConfigStore::RemoveChangeEvent(_In_ HANDLE hChanged)
+{
+    AcquireSRWLockExclusive(&_eventsLock);
+    for (size_t i = 0; i < _changeEvents.GetCount(); i++)
+    {
+        if (_changeEvents[i] == hChanged)
+        {
+            _changeEvents.RemoveAt(i);
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&_eventsLock);
+}
+
+void ConfigStore::SetSource(_In_ std::unique_ptr<ConfigSource> pSource)
+{
+    AcquireSRWLockExclusive(&_sourceLock);
+    _pSource = std::move(pSource);
+    ReleaseSRWLockExclusive(&_sourceLock);
+    std::atomic_store(&_pConfig, std::shared_ptr<const Config>());
+}
+
+// Reads the settings and publishes them as the current snapshot.
+HRESULT ConfigStore::_Reload()
+{
+    std::shared_ptr<Config> pConfig;
+    HRESULT hr = E_OUTOFMEMORY;
+
+    AcquireSRWLockExclusive(&_sourceLock);
+    if (_pSource)
+    {
+        pConfig = std::make_shared<Config>();
+        hr = _pSource->Load(pConfig.get());
+    }
+    ReleaseSRWLockExclusive(&_sourceLock);
+
+    if (SUCCEEDED(hr))
+    {
+        std::shared_ptr<const Config> pOldConfig = std::atomic_exchange(&_pConfig, std::shared_ptr<const Config>(pConfig));
+
+        // Decisions made under other authorized groups can no longer be trusted, and entries may have been stored
+        // for longer than the cache now allows. Other changes (and reading the same settings again) keep the cache.
+        if (pOldConfig &&
+            (!pOldConfig->authorizedGroups.Equals(pConfig->authorizedGroups) ||
+             pOldConfig->dwAuthorizationCacheTtl != pConfig->dwAuthorizationCacheTtl))
+        {
+            AuthorizationCache::Instance().Clear();
+        }
+
+        AcquireSRWLockShared(&_eventsLock);
+        for (size_t i = 0; i < _changeEvents.GetCount(); i++)
+        {
+            SetEvent(_changeEvents[i]);
+        }
+        ReleaseSRWLockShared(&_eventsLock);
+    }
+    return hr;
+}
+
+HRESULT ConfigStore::_Start()
+{
+    HRESULT hr = S_OK;
+    if (_hThread == nullptr)
+    {
+        _hStopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        _hChangedEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (_hStopEvent != nullptr && _hChangedEvent != nullptr)
+        {
+            // Watch for changes before reading, so a change in between is not missed
+            AcquireSRWLockExclusive(&_sourceLock);
+            _fNotifying = _pSource && SUCCEEDED(_pSource->NotifyChange(_hChangedEvent));
+            ReleaseSRWLockExclusive(&_sourceLock);
+
+            _Reload();
+
+            // The watcher thread runs our code, so the DLL must stay loaded while it exists.
+            DllAddRef();
+            _hThread = CreateThread(nullptr, 0, _WatcherThreadProc, this, 0, nullptr);
+            if (_hThread == nullptr)
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+                DllRelease();
+            }
+        }
+        else
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        if (FAILED(hr))
+        {
+            if (_hStopEvent != nullptr)
+            {
+                CloseHandle(_hStopEvent);
+                _hStopEvent = nullptr;
+            }
+            if (_hChangedEvent != nullptr)
+            {
+                CloseHandle(_hChangedEvent);
+                _hChangedEvent = nullptr;
+            }
+        }
+    }
+    return hr;
+}
+
+void ConfigStore::_Stop()
+{
+    if (_hThread != nullptr)
+    {
+        SetEvent(_hStopEvent);
+        WaitForSingleObject(_hThread, INFINITE);
+        CloseHandle(_hThread);
+        CloseHandle(_hStopEvent);
+        CloseHandle(_hChangedEvent);
+        _hThread = nullptr;
+        _hStopEvent = nullptr;
+        _hChangedEvent = nullptr;
+    }
+}
+
+DWORD WINAPI ConfigStore::_WatcherThreadProc(_In_ LPVOID lpParameter)
+{
+    static_cast<ConfigStore*>(lpParameter)->_WatchChanges();
+    DllRelease();
+    return 0;
+}
+
+void ConfigStore::_WatchChanges()
+{
+    HANDLE rghWait[] = { _hStopEvent, _hChangedEvent };
+    bool fStop = false;
+    while (!fStop)
+    {
+        DWORD dwWait = WaitForMultipleObjects(ARRAYSIZE(rghWait), rghWait, FALSE, _fNotifying ? INFINITE : s_msPollInterval);
+        if (dwWait == WAIT_OBJECT_0 + 1 || dwWait == WAIT_TIMEOUT)
+        {
+            // A notification fires only once, so register the next one before reading the settings
+            AcquireSRWLockExclusive(&_sourceLock);
+            _fNotifying = _pSource && SUCCEEDED(_pSource->NotifyChange(_hChangedEvent));
+            ReleaseSRWLockExclusive(&_sourceLock);
+
+            _Reload();
+        }
+        else
+        {
+            fStop = true;
+        }
+    }
+}
@@ -0,0 +1,106 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+#include "SidSet.h"
+#include <memory>
+
+// An immutable snapshot of the settings in HKLM\SOFTWARE\GEWISUnlock (see README.md).
+struct Config
+{
+    SidSet              authorizedGroups;           // Every authorized group, with the rights it grants.
+    ATL::CAtlArray<ATL::CSid> kickGroups;           // The groups with AR_KICK, for messages; not looked up yet, so copy before AccountName.
+    ATL::CAtlArray<ATL::CSid> kickProtectedGroups;  // The groups with AR_KICK_PROTECTED, likewise.
+    CProtectedAppMap    protectedApps;
+    CAppCloseTimeoutMap appCloseTimeouts;           // In seconds, for the protected applications that have their own.
+    DWORD               dwAppCloseTimeout = 30;     // In seconds; for the other protected applications. 0 terminates them right away.
+    DWORD               dwAuthorizationCacheTtl = 0; // In seconds; 0 turns the authorization cache off.
+    ATL::CStringW       strDefaultDomain;           // For user names without a domain, if the signed-in user has none either.
+    bool                fPrefetch = true;           // Whether SetUsageScenario starts the WarmState prefetch.
+    DWORD               dwReclaimLockedAfter = 0;   // In minutes; 0 turns the SessionReclaimer off.
+    DWORD               dwLogoffTimeout = 60;       // In seconds; how long a kick waits for a session to sign out before offering to force it.
+};
+
+// Where the settings come from. Only the registry is used by the credential provider,
+// but keeping this separate lets the store be driven by another source.
+class ConfigSource
+{
+public:
+    virtual ~ConfigSource() {}
+
+    // Reads the current settings into pConfig.
+    virtual HRESULT Load(_Inout_ Config* pConfig) = 0;
+
+    // Sets hChanged (once) the next time the settings change. Fails if changes cannot be watched,
+    // in which case the caller has to poll.
+    virtual HRESULT NotifyChange(_In_ HANDLE hChanged) = 0;
+};
+
+// Reads the settings from HKLM\SOFTWARE\GEWISUnlock.
+class RegistryConfigSource : public ConfigSource
+{
+public:
+    RegistryConfigSource();
+    virtual ~RegistryConfigSource();
+
+    HRESULT Load(_Inout_ Config* pConfig) override;
+    HRESULT NotifyChange(_In_ HANDLE hChanged) override;
+
+private:
+    HKEY _hKey;     // Opened with KEY_NOTIFY the first time NotifyChange is called.
+};
+
+// Process-wide holder of the current Config.
+//
+// The settings are read once when the first provider is created and published as an immutable
+// snapshot, so the submit path only needs an atomic load instead of registry reads. Reading them does not
+// look up accounts, which could wait for a domain controller while LogonUI creates the provider.
+// While the store is in use, a background thread waits for the settings to change, reads them again
+// and swaps in the new snapshot. Readers that still hold the old snapshot can keep using it.
+class ConfigStore
+{
+public:
+    static ConfigStore& Instance();
+
+    // Users of the store (the provider) keep it alive with AddRef/Release. The first reference
+    // reads the settings and starts the watcher thread, the last one stops it again.
+    void AddRef();
+    void Release();
+
+    // Never returns null; if nothing was loaded yet, the settings are read on the spot. If they cannot be
+    // read at all, this returns the built-in defaults.
+    std::shared_ptr<const Config> Current();
+
+    // hChanged is set every time a new snapshot is published.
+    void AddChangeEvent(_In_ HANDLE hChanged);
+    void RemoveChangeEvent(_In_ HANDLE hChanged);
+
+    // Replaces the source of the settings. Only allowed while the store is not in use.
+    void SetSource(_In_ std::unique_ptr<ConfigSource> pSource);
+
+private:
+    ConfigStore();
+    ~ConfigStore();
+
+    static const Config* _GetDefaults();
+    HRESULT _Reload();
+    HRESULT _Start();
+    void _Stop();
+
+    static DWORD WINAPI _WatcherThreadProc(_In_ LPVOID lpParameter);
+    void _WatchChanges();
+
+    std::shared_ptr<const Config>   _pConfig;           // Only accessed through std::atomic_load/atomic_store.
+    SRWLOCK                         _sourceLock;        // Guards _pSource.
+    std::unique_ptr<ConfigSource>   _pSource;
+    SRWLOCK                         _eventsLock;        // Guards _changeEvents.
+    ATL::CAtlArray<HANDLE>          _changeEvents;
+    SRWLOCK                         _usersLock;         // Guards _cUsers and starting/stopping the watcher thread.
+    long                            _cUsers;
+    HANDLE                          _hThread;
+    HANDLE                          _hStopEvent;
+    HANDLE                          _hChangedEvent;     // Set by _pSource when the settings change.
+    bool                            _fNotifying;        // Whether _pSource will set _hChangedEvent; if not, the watcher thread polls.
+};
@@ -10,6 +10,8 @@
 #include <unknwn.h>
 #include "Dll.h"
 #include "helpers.h"
+#include "AuthorizationCache.h"
+#include "SpanTrace.h"
 
 static long g_cRef = 0;   // global dll reference count
 HINSTANCE g_hinst = NULL; // global dll hinstance
@@ -130,6 +132,23 @@ STDAPI DllGetClassObject(__in REFCLSID rclsid, __in REFIID riid, __deref_out voi
     return CClassFactory_CreateInstance(rclsid, riid, ppv);
 }
 
+#ifdef _DEBUG
+SessionSource* g_pTestSessionSource = nullptr;
+LogonBackend* g_pTestLogonBackend = nullptr;
+
+// Lets GEWISUnlockHost --fake replace the sessions and the logon of the room responsible, so a kick can be tried
+// without signing anyone out. The caller keeps the objects alive while the provider is loaded; null restores
+// Windows. Only exported by Debug builds, so an installed Release build never uses anything else, and only works
+// with a host built in the same configuration, as the objects cross the DLL boundary.
+STDAPI SetTestBackends(_In_opt_ SessionSource* pSessionSource, _In_opt_ LogonBackend* pLogonBackend)
+{
+#pragma comment(linker, "/EXPORT:" __FUNCTION__ "=" __FUNCDNAME__)
+    g_pTestSessionSource = pSessionSource;
+    g_pTestLogonBackend = pLogonBackend;
+    return S_OK;
+}
+#endif
+
 STDAPI_(BOOL) DllMain(__in HINSTANCE hinstDll, __in DWORD dwReason, __in void*)
 {
     switch (dwReason)
@@ -138,6 +157,10 @@ STDAPI_(BOOL) DllMain(__in HINSTANCE hinstDll, __in DWORD dwReason, __in void*)
         DisableThreadLibraryCalls(hinstDll);
         break;
     case DLL_PROCESS_DETACH:
+        // Do not leave password verifiers behind in the process
+        AuthorizationCache::Instance().WipeOnDetach();
+        SpanTrace::Unregister();
+        break;
     case DLL_THREAD_ATTACH:
     case DLL_THREAD_DETACH:
         break;
@@ -14,3 +14,13 @@ extern HINSTANCE g_hinst;
 
 void DllAddRef();
 void DllRelease();
+
+#ifdef _DEBUG
+class SessionSource;
+class LogonBackend;
+
+// Set by SetTestBackends, which GEWISUnlockHost --fake calls; credentials that are created afterwards use
+// these instead of the sessions and accounts of this machine. Debug builds only.
+extern SessionSource* g_pTestSessionSource;
+extern LogonBackend* g_pTestLogonBackend;
+#endif
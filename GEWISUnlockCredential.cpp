@@ -14,6 +14,15 @@
 #include "GEWISUnlockCredential.h"
 #include "guid.h"
 #include "helpers.h"
+#include "AuthorizationCache.h"
+#include "ConfigStore.h"
+#include "SpanTrace.h"
+#include "Metrics.h"
+#include "AccountName.h"
+#include "TileImage.h"
+#include "WarmState.h"
+#include "AppCloser.h"
+#include <new>
 
 // The following is used for our direct sign in functions in the serialization
 #include <atlstr.h>
@@ -24,6 +33,99 @@
 #include <wtsapi32.h>
 #pragma comment(lib, "wtsapi32.lib")
 
+// Posted by the protected application watcher and the kick pipeline to our notify window
+#define WM_PROTECTED_APPS_CHANGED (WM_APP + 1)
+#define WM_KICK_PROGRESS          (WM_APP + 2)
+#define WM_KICK_DONE              (WM_APP + 3)
+static const WCHAR s_szNotifyWindowClass[] = L"GEWISUnlockNotifyWindow";
+
+// While sessions are signing out, the notify window checks on them this often
+static const UINT_PTR s_uLogoffTimerId = 1;
+static const UINT s_uLogoffPollMs = 1000;
+
+// Builds the text for GFI_MULTIVERS_TEXT, e.g. "Warning: Multi.exe, Exact.exe running!"
+static HRESULT _FormatProtectedAppWarning(_In_ const ATL::CAtlArray<ATL::CStringW>& rgRunning, _Outptr_result_nullonfailure_ PWSTR* ppwszWarning)
+{
+    if (rgRunning.GetCount() == 0)
+    {
+        return SHStrDupW(L"Multivers is not running (should not be shown)", ppwszWarning);
+    }
+
+    ATL::CStringW strWarning = L"Warning: ";
+    for (size_t i = 0; i < rgRunning.GetCount(); i++)
+    {
+        if (i > 0)
+        {
+            strWarning += L", ";
+        }
+        strWarning += rgRunning[i];
+    }
+    strWarning += L" running!";
+    return SHStrDupW(strWarning, ppwszWarning);
+}
+
+// Whether two entries of the session list are the same sign-in. Session IDs are reused once their user signs out.
+static bool _IsSameSession(_In_ const SESSION_INFO& session1, _In_ const SESSION_INFO& session2)
+{
+    if (session1.fCurrent || session2.fCurrent)
+    {
+        return session1.fCurrent && session2.fCurrent;
+    }
+    return session1.dwSessionId == session2.dwSessionId && session1.strUser == session2.strUser;
+}
+
+// Checks that a session that was selected a while ago still belongs to the same user, so nobody who signed in
+// to it since is signed out instead, and that its user has not come back to it meanwhile. Our own session cannot
+// change hands while we show it.
+static HRESULT _CheckSessionOwner(_In_ SessionSource* pSource, _In_ const SESSION_INFO& session)
+{
+    if (session.fCurrent)
+    {
+        return S_OK;
+    }
+    SESSION_INFO current;
+    HRESULT hr = pSource->Query(session.dwSessionId, &current);
+    if (SUCCEEDED(hr) && current.strUser != session.strUser)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_NO_SUCH_LOGON_SESSION);
+    }
+    else if (SUCCEEDED(hr) && !IsSessionUnattended(current))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_BUSY);
+    }
+    return hr;
+}
+
+// Formats groups as e.g. 'A', 'B' for a message, or as "a group that allows this" if there are none. Only called
+// on the pipeline thread, as looking the groups up can wait for a domain controller.
+static void _FormatGroupNames(_In_ const ATL::CAtlArray<ATL::CSid>& rgGroups, _Out_ ATL::CStringW* pstrNames)
+{
+    pstrNames->Empty();
+    for (size_t i = 0; i < rgGroups.GetCount(); i++)
+    {
+        // A copy, as the lookup caches its result in the CSid and the snapshot is shared by all threads
+        ATL::CSid sid(rgGroups[i]);
+
+        // Groups we cannot look up (e.g. while the domain controller is unreachable) are shown by their SID
+        PCWSTR pszName = sid.AccountName();
+        if (pszName == nullptr || *pszName == L'\0')
+        {
+            pszName = sid.Sid();
+        }
+
+        if (!pstrNames->IsEmpty())
+        {
+            pstrNames->Append(L", ");
+        }
+        pstrNames->AppendFormat(L"'%s'", pszName);
+    }
+
+    if (pstrNames->IsEmpty())
+    {
+        *pstrNames = L"a group that allows this";
+    }
+}
+
 GEWISUnlockCredential::GEWISUnlockCredential() :
     _cRef(1),
     _pCredProvCredentialEvents(nullptr),
@@ -31,10 +133,37 @@ GEWISUnlockCredential::GEWISUnlockCredential() :
     _pszQualifiedUserName(nullptr),
     _fIsLocalUser(false),
     _fChecked(false),
-    _dwComboIndex(0)
+    _dwComboIndex(0),
+    _pSessionSource(&_wtsSessionSource),
+    _pLogonBackend(&_interactiveLogon),
+    _hwndNotify(nullptr),
+    _pKickRequest(nullptr),
+    _logoff(),
+    _fResultPending(false),
+    _cpgsrResult(CPGSR_NO_CREDENTIAL_NOT_FINISHED),
+    _pCredProvEvents(nullptr),
+    _upAdviseContext(0)
 {
     DllAddRef();
 
+#ifdef _DEBUG
+    if (g_pTestSessionSource != nullptr)
+    {
+        _pSessionSource = g_pTestSessionSource;
+    }
+    if (g_pTestLogonBackend != nullptr)
+    {
+        _pLogonBackend = g_pTestLogonBackend;
+    }
+#endif
+
+    // We use a login session to verify the room responsible before signing off the user, so we can also use another account.
+    // These stages run in the background, see _StartKick.
+    _kickPipeline.AddStage(L"Checking your username and password...", _KickLogonStage);
+    _kickPipeline.AddStage(L"Checking whether you may sign off other users...", _KickGroupStage);
+    _kickPipeline.AddStage(L"Closing the protected applications...", _KickCloseAppsStage);
+    _kickPipeline.AddStage(L"Signing off the user...", _KickLogoffStage);
+
     ZeroMemory(_rgCredProvFieldDescriptors, sizeof(_rgCredProvFieldDescriptors));
     ZeroMemory(_rgFieldStatePairs, sizeof(_rgFieldStatePairs));
     ZeroMemory(_rgFieldStrings, sizeof(_rgFieldStrings));
@@ -42,11 +171,16 @@ GEWISUnlockCredential::GEWISUnlockCredential() :
 
 GEWISUnlockCredential::~GEWISUnlockCredential()
 {
-    if (_rgFieldStrings[GFI_PASSWORD])
-    {
-        size_t lenPassword = wcslen(_rgFieldStrings[GFI_PASSWORD]);
-        SecureZeroMemory(_rgFieldStrings[GFI_PASSWORD], lenPassword * sizeof(*_rgFieldStrings[GFI_PASSWORD]));
-    }
+    _kickPipeline.Cancel();
+    _kickPipeline.Wait();
+    _OnKickDone();
+    _FinishLogoff(true);
+    SetProviderEvents(nullptr, 0);
+
+    _protectedAppWatcher.Stop();
+    _DestroyNotifyWindow();
+
+    // _usernameField and _passwordField wipe themselves
     for (int i = 0; i < ARRAYSIZE(_rgFieldStrings); i++)
     {
         CoTaskMemFree(_rgFieldStrings[i]);
@@ -65,6 +199,7 @@ HRESULT GEWISUnlockCredential::Initialize(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpu
     _In_ FIELD_STATE_PAIR const* rgfsp,
     _In_ ICredentialProviderUser* pcpUser)
 {
+    TRACE_FUNCTION();
     HRESULT hr = S_OK;
     _cpus = cpus;
 
@@ -91,11 +226,21 @@ HRESULT GEWISUnlockCredential::Initialize(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpu
     }
     if (SUCCEEDED(hr))
     {
-        hr = pcpUser->GetStringValue(PKEY_Identity_QualifiedUserName, &_rgFieldStrings[GFI_USERNAME]);
+        hr = _usernameField.Initialize();
     }
     if (SUCCEEDED(hr))
     {
-        hr = SHStrDupW(L"", &_rgFieldStrings[GFI_PASSWORD]);
+        hr = _passwordField.Initialize();
+    }
+    if (SUCCEEDED(hr))
+    {
+        PWSTR pwzQualifiedUserName;
+        hr = pcpUser->GetStringValue(PKEY_Identity_QualifiedUserName, &pwzQualifiedUserName);
+        if (SUCCEEDED(hr))
+        {
+            hr = _usernameField.Set(pwzQualifiedUserName);
+            CoTaskMemFree(pwzQualifiedUserName);
+        }
     }
     if (SUCCEEDED(hr))
     {
@@ -103,29 +248,45 @@ HRESULT GEWISUnlockCredential::Initialize(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpu
     }
     if (SUCCEEDED(hr))
     {
-        hr = SHStrDupW(L"Kick user with Multivers open", &_rgFieldStrings[GFI_MULTIVERS_CHECKBOX]);
+        hr = SHStrDupW(L"Kick user with these applications open", &_rgFieldStrings[GFI_MULTIVERS_CHECKBOX]);
     }
     if (SUCCEEDED(hr))
     {
         hr = SHStrDupW(L"About GEWISUnlock", &_rgFieldStrings[GFI_MOREINFO_LINK]);
     }
     if (SUCCEEDED(hr))
+    {
+        hr = SHStrDupW(L"", &_rgFieldStrings[GFI_STATUS_TEXT]);
+    }
+    if (SUCCEEDED(hr))
     {
         hr = pcpUser->GetStringValue(PKEY_Identity_QualifiedUserName, &_pszQualifiedUserName);
     }
-
     if (SUCCEEDED(hr))
     {
-        if (MultiversRunning())
+        // Only show the list if there is something to choose
+        _EnumerateSessions();
+        if (_rgSessions.GetCount() <= 1)
         {
-            hr = SHStrDupW(L"Warning: Multivers is running!", &_rgFieldStrings[GFI_MULTIVERS_TEXT]);
+            _rgFieldStatePairs[GFI_SESSIONS] = { CPFS_HIDDEN, CPFIS_NONE };
         }
-        else
+        hr = SHStrDupW(L"", &_rgFieldStrings[GFI_SESSIONS]);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        // This is only the initial state; once we are advised, the watcher keeps these fields up to date.
+        // The provider usually had the processes scanned in the background already.
+        ATL::CAtlArray<RUNNING_APP> rgAll;
+        WarmState::Instance().GetRunningProtectedApps(&rgAll);
+        ATL::CAtlArray<ATL::CStringW> rgRunning;
+        _SelectProtectedApps(rgAll, &rgRunning);
+        if (rgRunning.GetCount() == 0)
         {
             _rgFieldStatePairs[GFI_MULTIVERS_TEXT] = { CPFS_HIDDEN, CPFIS_NONE };
             _rgFieldStatePairs[GFI_MULTIVERS_CHECKBOX] = { CPFS_HIDDEN, CPFIS_NONE };
-            hr = SHStrDupW(L"Multivers is not running (should not be shown)", &_rgFieldStrings[GFI_MULTIVERS_TEXT]);
         }
+        hr = _FormatProtectedAppWarning(rgRunning, &_rgFieldStrings[GFI_MULTIVERS_TEXT]);
     }
 
     if (SUCCEEDED(hr))
@@ -137,18 +298,46 @@ HRESULT GEWISUnlockCredential::Initialize(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpu
 }
 
 // LogonUI calls this in order to give us a callback in case we need to notify it of anything.
+// While we have the callback, we watch for protected applications starting and stopping.
 HRESULT GEWISUnlockCredential::Advise(_In_ ICredentialProviderCredentialEvents* pcpce)
 {
+    TRACE_FUNCTION();
     if (_pCredProvCredentialEvents != nullptr)
     {
         _pCredProvCredentialEvents->Release();
+        _pCredProvCredentialEvents = nullptr;
+    }
+    HRESULT hr = pcpce->QueryInterface(IID_PPV_ARGS(&_pCredProvCredentialEvents));
+    if (SUCCEEDED(hr) && !_protectedAppWatcher.IsStarted())
+    {
+        // Not being able to watch is not fatal; we then check once more when submitting.
+        if (SUCCEEDED(_CreateNotifyWindow()) &&
+            SUCCEEDED(_protectedAppWatcher.Start(_hwndNotify, WM_PROTECTED_APPS_CHANGED)))
+        {
+            // Things may have changed since Initialize
+            _UpdateProtectedAppFields();
+        }
     }
-    return pcpce->QueryInterface(IID_PPV_ARGS(&_pCredProvCredentialEvents));
+    return hr;
 }
 
 // LogonUI calls this to tell us to release the callback.
 HRESULT GEWISUnlockCredential::UnAdvise()
 {
+    TRACE_FUNCTION();
+    // Without a callback we cannot report anything anymore, so a kick that has not signed off anyone yet is abandoned.
+    // Its thread is not waited for, which could freeze the lock screen; a stage that is running stops soon, and
+    // the notify window stays until the pipeline tells it so (see _OnKickDone).
+    _kickPipeline.Cancel();
+    _OnKickDone();
+    _FinishLogoff(true);
+
+    _protectedAppWatcher.Stop();
+    if (_pKickRequest == nullptr)
+    {
+        _DestroyNotifyWindow();
+    }
+
     if (_pCredProvCredentialEvents)
     {
         _pCredProvCredentialEvents->Release();
@@ -157,6 +346,298 @@ HRESULT GEWISUnlockCredential::UnAdvise()
     return S_OK;
 }
 
+// Creates a message-only window on the calling (apartment) thread, so background threads can hand
+// work back to this thread; ICredentialProviderCredentialEvents may only be called from here.
+HRESULT GEWISUnlockCredential::_CreateNotifyWindow()
+{
+    HRESULT hr = S_OK;
+    if (_hwndNotify == nullptr)
+    {
+        WNDCLASSEXW wc = { sizeof(wc) };
+        wc.lpfnWndProc = _NotifyWndProc;
+        wc.hInstance = HINST_THISDLL;
+        wc.lpszClassName = s_szNotifyWindowClass;
+        if (!RegisterClassExW(&wc) && GetLastError() != ERROR_CLASS_ALREADY_EXISTS)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            _hwndNotify = CreateWindowExW(0, s_szNotifyWindowClass, nullptr, 0, 0, 0, 0, 0, HWND_MESSAGE, nullptr, HINST_THISDLL, nullptr);
+            if (_hwndNotify != nullptr)
+            {
+                SetWindowLongPtr(_hwndNotify, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(this));
+            }
+            else
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+            }
+        }
+    }
+    return hr;
+}
+
+void GEWISUnlockCredential::_DestroyNotifyWindow()
+{
+    if (_hwndNotify != nullptr)
+    {
+        DestroyWindow(_hwndNotify);
+        _hwndNotify = nullptr;
+        UnregisterClassW(s_szNotifyWindowClass, HINST_THISDLL);
+    }
+}
+
+LRESULT CALLBACK GEWISUnlockCredential::_NotifyWndProc(_In_ HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+    GEWISUnlockCredential* pCredential = reinterpret_cast<GEWISUnlockCredential*>(GetWindowLongPtr(hwnd, GWLP_USERDATA));
+    if (pCredential != nullptr)
+    {
+        switch (uMsg)
+        {
+        case WM_PROTECTED_APPS_CHANGED:
+            pCredential->_UpdateProtectedAppFields();
+            return 0;
+        case WM_KICK_PROGRESS:
+            pCredential->_OnKickProgress(static_cast<size_t>(wParam));
+            return 0;
+        case WM_KICK_DONE:
+            pCredential->_OnKickDone();
+            return 0;
+        case WM_WTSSESSION_CHANGE:
+            if (wParam == WTS_SESSION_LOGOFF)
+            {
+                ULONGLONG ullNow = GetTickCount64();
+                pCredential->_OnSessionSignedOut(static_cast<DWORD>(lParam), ullNow);
+                pCredential->_UpdateLogoff(ullNow);
+            }
+            return 0;
+        case WM_TIMER:
+            if (wParam == s_uLogoffTimerId)
+            {
+                pCredential->_OnLogoffTimer();
+            }
+            return 0;
+        }
+    }
+    return DefWindowProc(hwnd, uMsg, wParam, lParam);
+}
+
+// Shows or hides the protected application warning and checkbox based on what the watcher last saw
+// in the selected sessions.
+void GEWISUnlockCredential::_UpdateProtectedAppFields()
+{
+    ATL::CAtlArray<RUNNING_APP> rgAll;
+    _GetRunningProtectedApps(&rgAll);
+    ATL::CAtlArray<ATL::CStringW> rgRunning;
+    _SelectProtectedApps(rgAll, &rgRunning);
+
+    PWSTR pwszWarning;
+    if (SUCCEEDED(_FormatProtectedAppWarning(rgRunning, &pwszWarning)))
+    {
+        CoTaskMemFree(_rgFieldStrings[GFI_MULTIVERS_TEXT]);
+        _rgFieldStrings[GFI_MULTIVERS_TEXT] = pwszWarning;
+    }
+
+    CREDENTIAL_PROVIDER_FIELD_STATE cpfs = rgRunning.GetCount() > 0 ? CPFS_DISPLAY_IN_SELECTED_TILE : CPFS_HIDDEN;
+    _rgFieldStatePairs[GFI_MULTIVERS_TEXT].cpfs = cpfs;
+    _rgFieldStatePairs[GFI_MULTIVERS_CHECKBOX].cpfs = cpfs;
+
+    if (_pCredProvCredentialEvents)
+    {
+        _pCredProvCredentialEvents->BeginFieldUpdates();
+        _pCredProvCredentialEvents->SetFieldString(this, GFI_MULTIVERS_TEXT, _rgFieldStrings[GFI_MULTIVERS_TEXT]);
+        _pCredProvCredentialEvents->SetFieldState(this, GFI_MULTIVERS_TEXT, cpfs);
+        _pCredProvCredentialEvents->SetFieldState(this, GFI_MULTIVERS_CHECKBOX, cpfs);
+        _pCredProvCredentialEvents->EndFieldUpdates();
+    }
+}
+
+// Whether any protected application is running in the selected sessions. While we are advised, this is what
+// the watcher last saw, so submitting does not have to look at the running processes.
+bool GEWISUnlockCredential::_ProtectedAppsRunning()
+{
+    ATL::CStringW strRunning;
+    _GetRunningProtectedApps(&strRunning);
+    return !strRunning.IsEmpty();
+}
+
+// Lists the sessions for GFI_SESSIONS: this one and the other sessions that nobody is using (e.g. someone working
+// over Remote Desktop is not signed out from here). If they cannot be listed, there is only this session.
+void GEWISUnlockCredential::_EnumerateSessions()
+{
+    _rgSessions.RemoveAll();
+    _dwComboIndex = 0;
+    if (FAILED(_pSessionSource->Enumerate(&_rgSessions)))
+    {
+        _rgSessions.RemoveAll();
+    }
+    for (size_t i = _rgSessions.GetCount(); i-- > 0; )
+    {
+        if (!_rgSessions[i].fCurrent && !IsSessionUnattended(_rgSessions[i]))
+        {
+            _rgSessions.RemoveAt(i);
+        }
+    }
+
+    if (_rgSessions.GetCount() == 0 || !_rgSessions[0].fCurrent)
+    {
+        SESSION_INFO session;
+        session.dwSessionId = WTS_CURRENT_SESSION;
+        session.strUser = _pszQualifiedUserName;
+        session.state = WTSActive;
+        session.fLocked = true;
+        session.ullIdleSeconds = 0;
+        session.fCurrent = true;
+        _rgSessions.InsertAt(0, session);
+    }
+}
+
+// Lists the sessions again, since the list can be on screen for hours: states and idle times change, and a session ID
+// can belong to someone else by now. Keeps the selection if the selected sessions are still the same sign-ins; if not,
+// selects the first item (this session) again and returns false.
+bool GEWISUnlockCredential::_RefreshSessions()
+{
+    ATL::CAtlArray<SESSION_INFO> rgSelected;
+    bool fAll = _dwComboIndex >= _rgSessions.GetCount();
+    bool fKept = SUCCEEDED(_GetSelectedSessions(&rgSelected));
+    DWORD cOldItems = _GetComboItemCount();
+
+    _EnumerateSessions();
+
+    // "All of the sessions above" only means the same if nobody signed in or out meanwhile
+    DWORD dwIndex = 0;
+    fKept = fKept && (!fAll || rgSelected.GetCount() == _rgSessions.GetCount());
+    for (size_t i = 0; fKept && i < rgSelected.GetCount(); i++)
+    {
+        bool fFound = false;
+        for (size_t j = 0; !fFound && j < _rgSessions.GetCount(); j++)
+        {
+            if (_IsSameSession(rgSelected[i], _rgSessions[j]))
+            {
+                dwIndex = static_cast<DWORD>(j);
+                fFound = true;
+            }
+        }
+        fKept = fFound;
+    }
+    if (fKept)
+    {
+        _dwComboIndex = fAll ? static_cast<DWORD>(_rgSessions.GetCount()) : dwIndex;
+    }
+
+    CREDENTIAL_PROVIDER_FIELD_STATE cpfs = _rgSessions.GetCount() > 1 ? CPFS_DISPLAY_IN_SELECTED_TILE : CPFS_HIDDEN;
+    _rgFieldStatePairs[GFI_SESSIONS].cpfs = cpfs;
+    if (_pCredProvCredentialEvents)
+    {
+        _pCredProvCredentialEvents->BeginFieldUpdates();
+        for (DWORD i = cOldItems; i > 0; i--)
+        {
+            _pCredProvCredentialEvents->DeleteFieldComboBoxItem(this, GFI_SESSIONS, i - 1);
+        }
+        for (DWORD i = 0; i < _GetComboItemCount(); i++)
+        {
+            PWSTR pwszItem;
+            if (SUCCEEDED(GetComboBoxValueAt(GFI_SESSIONS, i, &pwszItem)))
+            {
+                _pCredProvCredentialEvents->AppendFieldComboBoxItem(this, GFI_SESSIONS, pwszItem);
+                CoTaskMemFree(pwszItem);
+            }
+        }
+        _pCredProvCredentialEvents->SetFieldComboBoxSelectedItem(this, GFI_SESSIONS, _dwComboIndex);
+        _pCredProvCredentialEvents->SetFieldState(this, GFI_SESSIONS, cpfs);
+        _pCredProvCredentialEvents->EndFieldUpdates();
+    }
+
+    // Whether to warn depends on the sessions that are selected
+    _UpdateProtectedAppFields();
+    return fKept;
+}
+
+// The number of items in GFI_SESSIONS: the sessions, and an item to select all of them if there is more than one.
+DWORD GEWISUnlockCredential::_GetComboItemCount() const
+{
+    DWORD cSessions = static_cast<DWORD>(_rgSessions.GetCount());
+    return cSessions > 1 ? cSessions + 1 : cSessions;
+}
+
+// The sessions selected in GFI_SESSIONS.
+HRESULT GEWISUnlockCredential::_GetSelectedSessions(_Out_ ATL::CAtlArray<SESSION_INFO>* prgTargets)
+{
+    prgTargets->RemoveAll();
+    if (_dwComboIndex < _rgSessions.GetCount())
+    {
+        return prgTargets->Add(_rgSessions[_dwComboIndex]) != static_cast<size_t>(-1) ? S_OK : E_OUTOFMEMORY;
+    }
+    prgTargets->Copy(_rgSessions);
+    return prgTargets->GetCount() == _rgSessions.GetCount() ? S_OK : E_OUTOFMEMORY;
+}
+
+// The protected applications that are running in any session. Uses the watcher if it is started.
+void GEWISUnlockCredential::_GetRunningProtectedApps(_Out_ ATL::CAtlArray<RUNNING_APP>* prgRunning)
+{
+    if (_protectedAppWatcher.IsStarted())
+    {
+        _protectedAppWatcher.GetRunning(prgRunning);
+    }
+    else
+    {
+        GetRunningProtectedApplications(prgRunning);
+    }
+}
+
+// Picks the applications of rgRunning that run in the sessions selected in GFI_SESSIONS, so a Multivers in
+// someone else's session does not get in the way of signing out this one. prgSessionIds, if given, receives
+// the selected sessions in which any of them run.
+void GEWISUnlockCredential::_SelectProtectedApps(_In_ const ATL::CAtlArray<RUNNING_APP>& rgRunning,
+    _Out_ ATL::CAtlArray<ATL::CStringW>* prgNames, _Out_opt_ ATL::CAtlArray<DWORD>* prgSessionIds)
+{
+    prgNames->RemoveAll();
+    if (prgSessionIds != nullptr)
+    {
+        prgSessionIds->RemoveAll();
+    }
+
+    ATL::CAtlArray<SESSION_INFO> rgSelected;
+    if (FAILED(_GetSelectedSessions(&rgSelected)))
+    {
+        return;
+    }
+    for (size_t i = 0; i < rgSelected.GetCount(); i++)
+    {
+        GetRunningInSession(rgRunning, rgSelected[i].dwSessionId, prgNames);
+        if (prgSessionIds != nullptr)
+        {
+            // Names are listed once, so an application that also runs in an earlier session did not add one
+            ATL::CAtlArray<ATL::CStringW> rgInSession;
+            GetRunningInSession(rgRunning, rgSelected[i].dwSessionId, &rgInSession);
+            if (rgInSession.GetCount() > 0)
+            {
+                prgSessionIds->Add(rgSelected[i].dwSessionId);
+            }
+        }
+    }
+}
+
+// The names of the protected applications that are running in the selected sessions, separated by ", ".
+void GEWISUnlockCredential::_GetRunningProtectedApps(_Out_ ATL::CStringW* pstrRunning)
+{
+    ATL::CAtlArray<RUNNING_APP> rgAll;
+    _GetRunningProtectedApps(&rgAll);
+    ATL::CAtlArray<ATL::CStringW> rgRunning;
+    _SelectProtectedApps(rgAll, &rgRunning);
+
+    pstrRunning->Empty();
+    for (size_t i = 0; i < rgRunning.GetCount(); i++)
+    {
+        if (i > 0)
+        {
+            *pstrRunning += L", ";
+        }
+        *pstrRunning += rgRunning[i];
+    }
+}
+
 // LogonUI calls this function when our tile is selected (zoomed)
 // If you simply want fields to show/hide based on the selected state,
 // there's no need to do anything here - you can set that up in the
@@ -165,11 +646,18 @@ HRESULT GEWISUnlockCredential::UnAdvise()
 // selected, you would do it here.
 HRESULT GEWISUnlockCredential::SetSelected(_Out_ BOOL* pbAutoLogon)
 {
+    TRACE_FUNCTION();
     HRESULT hr = S_OK;
 
     // Do not automatically submit on selecting
     *pbAutoLogon = FALSE;
 
+    // The list was made when the credential was created, which can be hours ago
+    if (!_kickPipeline.IsRunning() && _logoffTracker.GetPhase() == LP_IDLE)
+    {
+        _RefreshSessions();
+    }
+
     return hr;
 }
 
@@ -178,19 +666,26 @@ HRESULT GEWISUnlockCredential::SetSelected(_Out_ BOOL* pbAutoLogon)
 // is to clear out the password field.
 HRESULT GEWISUnlockCredential::SetDeselected()
 {
+    TRACE_FUNCTION();
     HRESULT hr = S_OK;
-    if (_rgFieldStrings[GFI_PASSWORD])
+
+    // Stop a kick that is still verifying; its result will not be reported
+    if (_kickPipeline.IsRunning())
     {
-        size_t lenPassword = wcslen(_rgFieldStrings[GFI_PASSWORD]);
-        SecureZeroMemory(_rgFieldStrings[GFI_PASSWORD], lenPassword * sizeof(*_rgFieldStrings[GFI_PASSWORD]));
+        _kickPipeline.Cancel();
+        _SetStatusField(nullptr);
+    }
 
-        CoTaskMemFree(_rgFieldStrings[GFI_PASSWORD]);
-        hr = SHStrDupW(L"", &_rgFieldStrings[GFI_PASSWORD]);
+    // Walking away from the offer to force sessions that timed out means not forcing them
+    if (_logoffTracker.GetPhase() == LP_TIMED_OUT)
+    {
+        _FinishLogoff(false);
+    }
 
-        if (SUCCEEDED(hr) && _pCredProvCredentialEvents)
-        {
-            _pCredProvCredentialEvents->SetFieldString(this, GFI_PASSWORD, _rgFieldStrings[GFI_PASSWORD]);
-        }
+    _passwordField.Clear();
+    if (_pCredProvCredentialEvents)
+    {
+        _pCredProvCredentialEvents->SetFieldString(this, GFI_PASSWORD, _passwordField.Get());
     }
 
     return hr;
@@ -202,6 +697,7 @@ HRESULT GEWISUnlockCredential::GetFieldState(DWORD dwFieldID,
     _Out_ CREDENTIAL_PROVIDER_FIELD_STATE* pcpfs,
     _Out_ CREDENTIAL_PROVIDER_FIELD_INTERACTIVE_STATE* pcpfis)
 {
+    TRACE_FUNCTION();
     HRESULT hr;
 
     // Validate our parameters.
@@ -221,6 +717,7 @@ HRESULT GEWISUnlockCredential::GetFieldState(DWORD dwFieldID,
 // Sets ppwsz to the string value of the field at the index dwFieldID
 HRESULT GEWISUnlockCredential::GetStringValue(DWORD dwFieldID, _Outptr_result_nullonfailure_ PWSTR* ppwsz)
 {
+    TRACE_FUNCTION();
     HRESULT hr;
     *ppwsz = nullptr;
 
@@ -229,7 +726,8 @@ HRESULT GEWISUnlockCredential::GetStringValue(DWORD dwFieldID, _Outptr_result_nu
     {
         // Make a copy of the string and return that. The caller
         // is responsible for freeing it.
-        hr = SHStrDupW(_rgFieldStrings[dwFieldID], ppwsz);
+        SecureFieldBuffer* pSecureField = _GetSecureField(dwFieldID);
+        hr = SHStrDupW(pSecureField != nullptr ? pSecureField->Get() : _rgFieldStrings[dwFieldID], ppwsz);
     }
     else
     {
@@ -241,23 +739,16 @@ HRESULT GEWISUnlockCredential::GetStringValue(DWORD dwFieldID, _Outptr_result_nu
 
 // Get the image to show in the user tile
 // Trial and error learns that it should be a A8R8G8B8 bitmap image (4*8 = 32 bits)
+// LogonUI asks for this on every repaint, so the decoded (and scaled) image is kept in TileImage
 HRESULT GEWISUnlockCredential::GetBitmapValue(DWORD dwFieldID, _Outptr_result_nullonfailure_ HBITMAP* phbmp)
 {
+    TRACE_FUNCTION();
     HRESULT hr;
     *phbmp = nullptr;
 
     if ((GFI_TILEIMAGE == dwFieldID))
     {
-        HBITMAP hbmp = LoadBitmap(HINST_THISDLL, MAKEINTRESOURCE(IDB_TILE_IMAGE));
-        if (hbmp != nullptr)
-        {
-            hr = S_OK;
-            *phbmp = hbmp;
-        }
-        else
-        {
-            hr = HRESULT_FROM_WIN32(GetLastError());
-        }
+        hr = TileImage::Instance().GetBitmap(phbmp);
     }
     else
     {
@@ -273,6 +764,7 @@ HRESULT GEWISUnlockCredential::GetBitmapValue(DWORD dwFieldID, _Outptr_result_nu
 // should be below the submit button.
 HRESULT GEWISUnlockCredential::GetSubmitButtonValue(DWORD dwFieldID, _Out_ DWORD* pdwAdjacentTo)
 {
+    TRACE_FUNCTION();
     HRESULT hr;
 
     if (GFI_SUBMIT_BUTTON == dwFieldID)
@@ -290,13 +782,20 @@ HRESULT GEWISUnlockCredential::GetSubmitButtonValue(DWORD dwFieldID, _Out_ DWORD
 }
 
 // Sets the value of a field which can accept a string as a value.
-// This is called on each keystroke when a user types into an edit field
+// This is called on each keystroke when a user types into an edit field, so the value is
+// overwritten in place (see SecureFieldBuffer) instead of being reallocated every time.
 HRESULT GEWISUnlockCredential::SetStringValue(DWORD dwFieldID, _In_ PCWSTR pwz)
 {
+    TRACE_FUNCTION();
     HRESULT hr;
 
     // Validate parameters.
-    if (dwFieldID < ARRAYSIZE(_rgCredProvFieldDescriptors) &&
+    SecureFieldBuffer* pSecureField = _GetSecureField(dwFieldID);
+    if (pSecureField != nullptr)
+    {
+        hr = pSecureField->Set(pwz);
+    }
+    else if (dwFieldID < ARRAYSIZE(_rgCredProvFieldDescriptors) &&
         (CPFT_EDIT_TEXT == _rgCredProvFieldDescriptors[dwFieldID].cpft ||
             CPFT_PASSWORD_TEXT == _rgCredProvFieldDescriptors[dwFieldID].cpft))
     {
@@ -315,6 +814,7 @@ HRESULT GEWISUnlockCredential::SetStringValue(DWORD dwFieldID, _In_ PCWSTR pwz)
 // Returns whether a checkbox is checked or not as well as its label.
 HRESULT GEWISUnlockCredential::GetCheckboxValue(DWORD dwFieldID, _Out_ BOOL* pbChecked, _Outptr_result_nullonfailure_ PWSTR* ppwszLabel)
 {
+    TRACE_FUNCTION();
     HRESULT hr;
     *ppwszLabel = nullptr;
 
@@ -336,6 +836,7 @@ HRESULT GEWISUnlockCredential::GetCheckboxValue(DWORD dwFieldID, _Out_ BOOL* pbC
 // Sets whether the specified checkbox is checked or not.
 HRESULT GEWISUnlockCredential::SetCheckboxValue(DWORD dwFieldID, BOOL bChecked)
 {
+    TRACE_FUNCTION();
     HRESULT hr;
 
     // Validate parameters.
@@ -357,6 +858,7 @@ HRESULT GEWISUnlockCredential::SetCheckboxValue(DWORD dwFieldID, BOOL bChecked)
 // currently selected item (pdwSelectedItem).
 HRESULT GEWISUnlockCredential::GetComboBoxValueCount(DWORD dwFieldID, _Out_ DWORD* pcItems, _Deref_out_range_(< , *pcItems) _Out_ DWORD* pdwSelectedItem)
 {
+    TRACE_FUNCTION();
     HRESULT hr;
     *pcItems = 0;
     *pdwSelectedItem = 0;
@@ -365,8 +867,8 @@ HRESULT GEWISUnlockCredential::GetComboBoxValueCount(DWORD dwFieldID, _Out_ DWOR
     if (dwFieldID < ARRAYSIZE(_rgCredProvFieldDescriptors) &&
         (CPFT_COMBOBOX == _rgCredProvFieldDescriptors[dwFieldID].cpft))
     {
-        *pcItems = ARRAYSIZE(s_rgComboBoxStrings);
-        *pdwSelectedItem = 0;
+        *pcItems = _GetComboItemCount();
+        *pdwSelectedItem = _dwComboIndex < *pcItems ? _dwComboIndex : 0;
         hr = S_OK;
     }
     else
@@ -380,6 +882,7 @@ HRESULT GEWISUnlockCredential::GetComboBoxValueCount(DWORD dwFieldID, _Out_ DWOR
 // Called iteratively to fill the combobox with the string (ppwszItem) at index dwItem.
 HRESULT GEWISUnlockCredential::GetComboBoxValueAt(DWORD dwFieldID, DWORD dwItem, _Outptr_result_nullonfailure_ PWSTR* ppwszItem)
 {
+    TRACE_FUNCTION();
     HRESULT hr;
     *ppwszItem = nullptr;
 
@@ -387,7 +890,20 @@ HRESULT GEWISUnlockCredential::GetComboBoxValueAt(DWORD dwFieldID, DWORD dwItem,
     if (dwFieldID < ARRAYSIZE(_rgCredProvFieldDescriptors) &&
         (CPFT_COMBOBOX == _rgCredProvFieldDescriptors[dwFieldID].cpft))
     {
-        hr = SHStrDupW(s_rgComboBoxStrings[dwItem], ppwszItem);
+        if (dwItem < _rgSessions.GetCount())
+        {
+            ATL::CStringW strDescription;
+            FormatSessionDescription(_rgSessions[dwItem], &strDescription);
+            hr = SHStrDupW(strDescription, ppwszItem);
+        }
+        else if (dwItem == _rgSessions.GetCount() && dwItem > 1)
+        {
+            hr = SHStrDupW(L"All of the sessions above", ppwszItem);
+        }
+        else
+        {
+            hr = E_INVALIDARG;
+        }
     }
     else
     {
@@ -400,13 +916,18 @@ HRESULT GEWISUnlockCredential::GetComboBoxValueAt(DWORD dwFieldID, DWORD dwItem,
 // Called when the user changes the selected item in the combobox.
 HRESULT GEWISUnlockCredential::SetComboBoxSelectedValue(DWORD dwFieldID, DWORD dwSelectedItem)
 {
+    TRACE_FUNCTION();
     HRESULT hr;
 
-    // Validate parameters.
+    // Validate parameters. An item past the end must not end up meaning "All of the sessions above".
     if (dwFieldID < ARRAYSIZE(_rgCredProvFieldDescriptors) &&
-        (CPFT_COMBOBOX == _rgCredProvFieldDescriptors[dwFieldID].cpft))
+        (CPFT_COMBOBOX == _rgCredProvFieldDescriptors[dwFieldID].cpft) &&
+        dwSelectedItem < _GetComboItemCount())
     {
         _dwComboIndex = dwSelectedItem;
+
+        // Whether to warn depends on the sessions that are selected
+        _UpdateProtectedAppFields();
         hr = S_OK;
     }
     else
@@ -420,6 +941,7 @@ HRESULT GEWISUnlockCredential::SetComboBoxSelectedValue(DWORD dwFieldID, DWORD d
 // Called when the user clicks a command link.
 HRESULT GEWISUnlockCredential::CommandLinkClicked(DWORD dwFieldID)
 {
+    TRACE_FUNCTION();
     HRESULT hr = S_OK;
 
     // Validate parameter.
@@ -451,82 +973,795 @@ HRESULT GEWISUnlockCredential::CommandLinkClicked(DWORD dwFieldID)
     return hr;
 }
 
-// Collect the username and password into a serialized credential for the correct usage scenario
-// (logon/unlock is what's demonstrated in this sample).  LogonUI then passes these credentials
-// back to the system to log on.
-HRESULT GEWISUnlockCredential::GetSerialization(_Out_ CREDENTIAL_PROVIDER_GET_SERIALIZATION_RESPONSE* pcpgsr,
-    _Out_ CREDENTIAL_PROVIDER_CREDENTIAL_SERIALIZATION* pcpcs,
-    _Outptr_result_maybenull_ PWSTR* ppwszOptionalStatusText,
-    _Out_ CREDENTIAL_PROVIDER_STATUS_ICON* pcpsiOptionalStatusIcon)
+void GEWISUnlockCredential::SetProviderEvents(_In_opt_ ICredentialProviderEvents* pcpe, UINT_PTR upAdviseContext)
 {
-    HRESULT hr = E_UNEXPECTED;
-    *pcpgsr = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
-    *ppwszOptionalStatusText = nullptr;
-    *pcpsiOptionalStatusIcon = CPSI_NONE;
-    ZeroMemory(pcpcs, sizeof(*pcpcs));
-
-    // Store the Window owner so we can create message boxes later
-    HWND hwndOwner = NULL;
-    if (_pCredProvCredentialEvents)
+    if (_pCredProvEvents != nullptr)
     {
-        _pCredProvCredentialEvents->OnCreatingWindow(&hwndOwner);
+        _pCredProvEvents->Release();
+    }
+    _pCredProvEvents = pcpe;
+    _upAdviseContext = upAdviseContext;
+    if (_pCredProvEvents != nullptr)
+    {
+        _pCredProvEvents->AddRef();
     }
+}
 
-    BOOL multiChecked;
-    PWSTR multiLabel; //We don't use this
-    GEWISUnlockCredential::GetCheckboxValue(GFI_MULTIVERS_CHECKBOX, &multiChecked, &multiLabel);
-    if (!multiChecked && MultiversRunning())
+// Shows pwszStatus below the form, or hides the status field if pwszStatus is nullptr.
+void GEWISUnlockCredential::_SetStatusField(_In_opt_ PCWSTR pwszStatus)
+{
+    PWSTR pwszCopy;
+    if (SUCCEEDED(SHStrDupW(pwszStatus != nullptr ? pwszStatus : L"", &pwszCopy)))
     {
-        *pcpgsr = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
-        SHStrDupW(L"You are trying to sign out a user while Multivers is running.\r\nTo confirm, please check the box indicating that you understand the risks of doing that.", ppwszOptionalStatusText);
-        return HRESULT(S_OK);
+        CoTaskMemFree(_rgFieldStrings[GFI_STATUS_TEXT]);
+        _rgFieldStrings[GFI_STATUS_TEXT] = pwszCopy;
     }
+    _rgFieldStatePairs[GFI_STATUS_TEXT].cpfs = pwszStatus != nullptr ? CPFS_DISPLAY_IN_SELECTED_TILE : CPFS_HIDDEN;
 
-    // For local user, the domain and user name can be split from _pszQualifiedUserName (domain\username).
-    // CredPackAuthenticationBuffer() cannot be used because it doesn't work in the unlock scenario.
-    if (_fIsLocalUser)
+    if (_pCredProvCredentialEvents)
+    {
+        _pCredProvCredentialEvents->BeginFieldUpdates();
+        _pCredProvCredentialEvents->SetFieldString(this, GFI_STATUS_TEXT, _rgFieldStrings[GFI_STATUS_TEXT]);
+        _pCredProvCredentialEvents->SetFieldState(this, GFI_STATUS_TEXT, _rgFieldStatePairs[GFI_STATUS_TEXT].cpfs);
+        _pCredProvCredentialEvents->EndFieldUpdates();
+    }
+}
+
+// First kick stage: log on as the room responsible to verify their username and password.
+HRESULT GEWISUnlockCredential::_KickLogonStage(_Inout_ void* pContext)
+{
+    TRACE_FUNCTION();
+    KICK_REQUEST* pRequest = static_cast<KICK_REQUEST*>(pContext);
+
+    // If this room responsible was verified recently, we can skip the logon and the group check
+    DWORD dwRights;
+    if (AuthorizationCache::Instance().Lookup(pRequest->strDomain, pRequest->strUsername, pRequest->password.Get(), &dwRights) == S_OK)
+    {
+        pRequest->fVerifiedFromCache = true;
+        return _CheckRights(pRequest, dwRights) ? S_OK : S_FALSE;
+    }
+
+    LONGLONG llStart = Metrics::Now();
+    HRESULT hr = pRequest->pLogonBackend->Logon(pRequest->strDomain.IsEmpty() ? nullptr : static_cast<PCWSTR>(pRequest->strDomain), pRequest->strUsername,
+        pRequest->pwzProtectedPassword, &pRequest->token);
+    Metrics::Instance().ObserveSince(MH_LOGON, llStart);
+    if (FAILED(hr))
+    {
+        _AuditKick(pRequest, AO_LOGON_FAILED);
+        pRequest->cpgsr = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
+        pRequest->strStatus = L"Incorrect password or username.";
+        return S_FALSE;
+    }
+    return S_OK;
+}
+
+// Second kick stage: check whether the room responsible is a member of an authorized group that allows this kick.
+HRESULT GEWISUnlockCredential::_KickGroupStage(_Inout_ void* pContext)
+{
+    TRACE_FUNCTION();
+    KICK_REQUEST* pRequest = static_cast<KICK_REQUEST*>(pContext);
+    if (pRequest->fVerifiedFromCache)
+    {
+        return S_OK;
+    }
+
+    LONGLONG llStart = Metrics::Now();
+    const TOKEN_GROUPS* pGroups;
+    if (FAILED(QueryTokenGroups(pRequest->token.GetHandle(), pRequest->prgbTokenGroups, &pGroups)))
+    {
+        Metrics::Instance().Increment(MC_ERRORS);
+        pRequest->cpgsr = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
+        pRequest->strStatus = L"Unable to check group membership which is needed to determine if you can sign out other users.";
+        return S_FALSE;
+    }
+
+    // The authorized groups (and what they may do) are stored in the registry
+    std::shared_ptr<const Config> pConfig = ConfigStore::Instance().Current();
+
+    // Iterate over all enabled groups of the user and collect the rights of those that are authorized
+    // We use this because we can't easily determine membership of the authorized groups nor are we guaranteed the user has access to the groups
+    // the code below may omit groups the user can't read, but sometimes these are also included. (If you happen to do this, please verify this in detail)
+    DWORD dwRights = pConfig->authorizedGroups.LookupGroups(pGroups);
+    Metrics::Instance().ObserveSince(MH_GROUP_CHECK, llStart);
+
+    AuthorizationCache::Instance().Store(pRequest->strDomain, pRequest->strUsername, pRequest->password.Get(), dwRights, pConfig->dwAuthorizationCacheTtl);
+
+    return _CheckRights(pRequest, dwRights) ? S_OK : S_FALSE;
+}
+
+// Whether the room responsible may do this kick with the AUTHORIZATION_RIGHT flags in dwRights. If not, explains why in the request.
+bool GEWISUnlockCredential::_CheckRights(_Inout_ KICK_REQUEST* pRequest, DWORD dwRights)
+{
+    std::shared_ptr<const Config> pConfig = ConfigStore::Instance().Current();
+
+    if (!(dwRights & AR_KICK))
+    {
+        Metrics::Instance().Increment(MC_DENIALS);
+        _AuditKick(pRequest, AO_DENIED);
+        pRequest->cpgsr = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
+        ATL::CStringW strGroups;
+        _FormatGroupNames(pConfig->kickGroups, &strGroups);
+        pRequest->strStatus.Format(L"It does not look like you are a member of %s which is required to sign off another user.\r\n\r\nPlease contact your system administrator if you think this is an error.",
+            strGroups.GetString());
+        return false;
+    }
+
+    if (pRequest->fProtectedAppsRunning && !(dwRights & AR_KICK_PROTECTED))
+    {
+        Metrics::Instance().Increment(MC_DENIALS);
+        _AuditKick(pRequest, AO_DENIED);
+        pRequest->cpgsr = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
+        ATL::CStringW strGroups;
+        _FormatGroupNames(pConfig->kickProtectedGroups, &strGroups);
+        pRequest->strStatus.Format(L"You may sign off other users, but not while Multivers (or another protected application) is running. That requires being a member of %s.\r\n\r\nPlease contact your system administrator if you think this is an error.",
+            strGroups.GetString());
+        return false;
+    }
+
+    return true;
+}
+
+// Third kick stage: when the room responsible confirmed signing out while protected applications are running,
+// ask those applications to close first, so they can save their data, instead of having them end with the session.
+HRESULT GEWISUnlockCredential::_KickCloseAppsStage(_Inout_ void* pContext)
+{
+    TRACE_FUNCTION();
+    KICK_REQUEST* pRequest = static_cast<KICK_REQUEST*>(pContext);
+    if (!pRequest->fProtectedAppsRunning)
+    {
+        return S_OK;
+    }
+
+    // A session whose applications cannot be asked is left to signing out, as before. One that changed hands since it was
+    // selected is not signed out at all (see _KickLogoffStage), so its applications are left alone too.
+    AppCloser closer;
+    for (size_t i = 0; i < pRequest->rgTargets.GetCount(); i++)
+    {
+        const SESSION_INFO& session = pRequest->rgTargets[i];
+        bool fProtected = false;
+        for (size_t j = 0; !fProtected && j < pRequest->rgProtectedSessions.GetCount(); j++)
+        {
+            fProtected = pRequest->rgProtectedSessions[j] == session.dwSessionId;
+        }
+        if (fProtected && pRequest->pSessionSource != nullptr && SUCCEEDED(_CheckSessionOwner(pRequest->pSessionSource, session)))
+        {
+            closer.AddSession(session.dwSessionId);
+        }
+    }
+    HRESULT hr = closer.Wait(pRequest->hCancelEvent);
+
+    // For the audit log: what became of each of them
+    ATL::CStringW strApps;
+    for (size_t i = 0; i < closer.GetCount(); i++)
+    {
+        const CLOSING_APP& app = closer.GetApp(i);
+        PCWSTR pszOutcome = L"left to sign out";
+        if (app.outcome == ACO_CLOSED)
+        {
+            Metrics::Instance().Increment(MC_APPS_CLOSED);
+            pszOutcome = L"closed";
+        }
+        else if (app.outcome == ACO_TERMINATED)
+        {
+            Metrics::Instance().Increment(MC_APPS_TERMINATED);
+            pszOutcome = L"terminated";
+        }
+        strApps.AppendFormat(L"%s%s (%s)", strApps.IsEmpty() ? L"" : L", ", app.strName.GetString(), pszOutcome);
+    }
+    if (!strApps.IsEmpty())
+    {
+        pRequest->strProtectedApps = strApps;
+    }
+
+    if (hr == HRESULT_FROM_WIN32(ERROR_CANCELLED) && closer.GetCount() > 0)
+    {
+        // The applications were asked to close, and may have been terminated already. Leaving the sessions without
+        // them is worse than finishing the kick, so sign them out anyway; the credential follows them as usual.
+        hr = _KickLogoffStage(pContext);
+        return SUCCEEDED(hr) ? S_FALSE : hr;
+    }
+    return S_OK;
+}
+
+// Last kick stage: ask the selected sessions to sign out, except our own. This does not wait for them;
+// the credential follows them from the apartment thread (see _StartLogoffTracking), so an application
+// that hangs while closing cannot hang us too.
+HRESULT GEWISUnlockCredential::_KickLogoffStage(_Inout_ void* pContext)
+{
+    TRACE_FUNCTION();
+    KICK_REQUEST* pRequest = static_cast<KICK_REQUEST*>(pContext);
+    if (pRequest->pSessionSource == nullptr)
+    {
+        // The source could not be allocated when the credential was created
+        return E_OUTOFMEMORY;
+    }
+    if (!pRequest->rgIssued.SetCount(pRequest->rgTargets.GetCount()))
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    // https://learn.microsoft.com/en-us/windows/win32/api/wtsapi32/nf-wtsapi32-wtslogoffsession
+    // A session that is gone, or that someone else signed in to since it was selected, is reported as failed.
+    for (size_t i = 0; i < pRequest->rgTargets.GetCount(); i++)
+    {
+        const SESSION_INFO& session = pRequest->rgTargets[i];
+        HRESULT hr = _CheckSessionOwner(pRequest->pSessionSource, session);
+        if (SUCCEEDED(hr) && !session.fCurrent)
+        {
+            hr = pRequest->pSessionSource->BeginLogoff(session.dwSessionId);
+        }
+        pRequest->rgIssued[i] = hr;
+    }
+    pRequest->fLogoffIssued = true;
+    return S_OK;
+}
+
+// Adds the outcome of a kick to the audit log.
+// pszVictim is the user of one session, if the outcome is only about that one.
+void GEWISUnlockCredential::_AuditKick(_In_ const KICK_REQUEST* pRequest, AUDIT_OUTCOME outcome, _In_opt_ PCWSTR pszVictim)
+{
+    AUDIT_RECORD record;
+    record.ullTime = AuditLog::Now();
+    record.outcome = outcome;
+    record.dwLatencyMs = static_cast<DWORD>(GetTickCount64() - pRequest->ullStartTime);
+    record.strResponsible = pRequest->strResponsible;
+    record.strVictim = pszVictim != nullptr ? pszVictim : pRequest->strVictim.GetString();
+    record.strProtectedApps = pRequest->strProtectedApps;
+    AuditLog::Instance().Write(record);
+}
+
+// Starts verifying the room responsible and signing off the user in the background.
+// On success, the request takes ownership of pwzProtectedPassword.
+HRESULT GEWISUnlockCredential::_StartKick(_In_ const ACCOUNT_NAME& user, _In_ PWSTR pwzProtectedPassword)
+{
+    // GetSerialization does not get here while an earlier kick is running or not collected yet (see _OnKickDone)
+    HRESULT hr = _CreateNotifyWindow();
+    if (SUCCEEDED(hr))
+    {
+        _pKickRequest = new(std::nothrow) KICK_REQUEST();
+        if (_pKickRequest != nullptr)
+        {
+            GetLogonNames(user, &_pKickRequest->strDomain, &_pKickRequest->strUsername);
+            _pKickRequest->pwzProtectedPassword = pwzProtectedPassword;
+            _pKickRequest->cpgsr = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
+            _pKickRequest->prgbTokenGroups = &_rgbTokenGroups;
+            _pKickRequest->ullStartTime = GetTickCount64();
+            _pKickRequest->strResponsible = _usernameField.Get();
+            _pKickRequest->pSessionSource = _pSessionSource;
+            _pKickRequest->pLogonBackend = _pLogonBackend;
+            _pKickRequest->hCancelEvent = _kickPipeline.GetCancelEvent();
+
+            // Only what runs in the selected sessions is at stake
+            LONGLONG llStart = Metrics::Now();
+            ATL::CAtlArray<RUNNING_APP> rgRunning;
+            _GetRunningProtectedApps(&rgRunning);
+            Metrics::Instance().ObserveSince(MH_PROCESS_SCAN, llStart);
+            ATL::CAtlArray<ATL::CStringW> rgNames;
+            _SelectProtectedApps(rgRunning, &rgNames, &_pKickRequest->rgProtectedSessions);
+            _pKickRequest->fProtectedAppsRunning = _pKickRequest->rgProtectedSessions.GetCount() > 0;
+            for (size_t i = 0; i < rgNames.GetCount(); i++)
+            {
+                _pKickRequest->strProtectedApps += (i == 0) ? rgNames[i] : L", " + rgNames[i];
+            }
+
+            hr = _GetSelectedSessions(&_pKickRequest->rgTargets);
+            for (size_t i = 0; SUCCEEDED(hr) && i < _pKickRequest->rgTargets.GetCount(); i++)
+            {
+                _pKickRequest->strVictim += (i == 0) ? _pKickRequest->rgTargets[i].strUser : L", " + _pKickRequest->rgTargets[i].strUser;
+            }
+            if (SUCCEEDED(hr))
+            {
+                hr = _pKickRequest->password.Initialize();
+            }
+            if (SUCCEEDED(hr))
+            {
+                hr = _pKickRequest->password.Set(_passwordField.Get());
+            }
+            if (SUCCEEDED(hr))
+            {
+                hr = _kickPipeline.Start(_pKickRequest, _hwndNotify, WM_KICK_PROGRESS, WM_KICK_DONE);
+            }
+            if (FAILED(hr))
+            {
+                // The caller still owns the protected password
+                _pKickRequest->pwzProtectedPassword = nullptr;
+                _WipeKickRequest();
+            }
+        }
+        else
+        {
+            hr = E_OUTOFMEMORY;
+        }
+    }
+    return hr;
+}
+
+void GEWISUnlockCredential::_OnKickProgress(size_t iStage)
+{
+    if (_pKickRequest != nullptr && !_kickPipeline.IsCancelled())
+    {
+        _SetStatusField(_kickPipeline.GetStageProgress(iStage));
+    }
+}
+
+// Collects the outcome of the kick pipeline (if it ran and was not cancelled) and cleans up the request.
+void GEWISUnlockCredential::_OnKickDone()
+{
+    if (_pKickRequest == nullptr || _kickPipeline.IsRunning())
+    {
+        return;
+    }
+    _kickPipeline.Wait();
+
+    // Once the sessions were asked to sign out, we follow them even if the kick was cancelled meanwhile
+    HRESULT hr = _kickPipeline.GetResult();
+    bool fTracking = false;
+    if (_pKickRequest->fLogoffIssued)
+    {
+        hr = _StartLogoffTracking();
+        fTracking = SUCCEEDED(hr);
+    }
+
+    if (!fTracking && hr != HRESULT_FROM_WIN32(ERROR_CANCELLED))
     {
-        PWSTR pwzProtectedPassword;
-        hr = ProtectIfNecessaryAndCopyPassword(_rgFieldStrings[GFI_PASSWORD], _cpus, &pwzProtectedPassword);
         if (SUCCEEDED(hr))
         {
-            PWSTR pszDomain = L"";
-            PWSTR pszUsername = L"";
-            PWSTR currentUser = L"";
-            hr = SplitDomainAndUsername(_pszQualifiedUserName, &pszDomain, &currentUser);
-            if (wcschr(_rgFieldStrings[GFI_USERNAME], L'\\') == nullptr)
+            _cpgsrResult = _pKickRequest->cpgsr;
+            _strResultStatus = _pKickRequest->strStatus;
+        }
+        else
+        {
+            _cpgsrResult = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
+            _strResultStatus = L"An error occured and the user could not be signed out.";
+        }
+        _fResultPending = true;
+    }
+
+    _WipeKickRequest();
+
+    if (_pCredProvCredentialEvents == nullptr)
+    {
+        // The kick was still finishing a stage when LogonUI called UnAdvise; stop following it as UnAdvise would have
+        _FinishLogoff(true);
+        _DestroyNotifyWindow();
+        return;
+    }
+
+    if (fTracking)
+    {
+        // Shows the progress, or reports the result right away if nothing has to be waited for
+        _UpdateLogoff(GetTickCount64());
+        return;
+    }
+
+    _SetStatusField(nullptr);
+
+    // Have LogonUI call GetSerialization again (see GEWISUnlockProvider::GetCredentialCount) to report the result.
+    // Without the provider's callback, the result is reported the next time the room responsible submits.
+    if (_fResultPending && _pCredProvEvents != nullptr)
+    {
+        _pCredProvEvents->CredentialsChanged(_upAdviseContext);
+    }
+}
+
+// Takes over the sign-out that the last kick stage started: the sessions are followed through session
+// notifications and a timer on the notify window, until they are gone or the LogoffTimeout passes.
+HRESULT GEWISUnlockCredential::_StartLogoffTracking()
+{
+    _logoff.strResponsible = _pKickRequest->strResponsible;
+    _logoff.strProtectedApps = _pKickRequest->strProtectedApps;
+    _logoff.ullStartTime = _pKickRequest->ullStartTime;
+    _logoff.llStart = Metrics::Now();
+    _logoff.pSessionSource = _pKickRequest->pSessionSource;
+    _logoff.fCurrent = false;
+    _logoff.fNotifying = false;
+    _logoff.fOffered = false;
+    _logoff.fVerifier = SUCCEEDED(AuthorizationCache::CreateVerifier(_pKickRequest->password.Get(), &_logoff.verifier));
+
+    // The current session is signed out last, once we are done with the others
+    ATL::CAtlArray<SESSION_INFO> rgOthers;
+    ATL::CAtlArray<HRESULT> rgIssued;
+    HRESULT hr = S_OK;
+    for (size_t i = 0; SUCCEEDED(hr) && i < _pKickRequest->rgTargets.GetCount(); i++)
+    {
+        const SESSION_INFO& session = _pKickRequest->rgTargets[i];
+        if (session.fCurrent)
+        {
+            _logoff.current = session;
+            _logoff.fCurrent = true;
+        }
+        else if (rgOthers.Add(session) == static_cast<size_t>(-1) || rgIssued.Add(_pKickRequest->rgIssued[i]) == static_cast<size_t>(-1))
+        {
+            hr = E_OUTOFMEMORY;
+        }
+    }
+
+    std::shared_ptr<const Config> pConfig = ConfigStore::Instance().Current();
+    if (SUCCEEDED(hr))
+    {
+        hr = _logoffTracker.Start(rgOthers, rgIssued, GetTickCount64(), static_cast<ULONGLONG>(pConfig->dwLogoffTimeout) * 1000);
+    }
+    if (SUCCEEDED(hr) && _logoffTracker.GetPhase() != LP_FINISHED)
+    {
+        // The notification only saves waiting for the next poll, so it does not matter if it cannot be registered
+        _logoff.fNotifying = WTSRegisterSessionNotification(_hwndNotify, NOTIFY_FOR_ALL_SESSIONS) != FALSE;
+        if (!SetTimer(_hwndNotify, s_uLogoffTimerId, s_uLogoffPollMs, nullptr))
+        {
+            // Without the timer we would never notice a timeout
+            _logoffTracker.Abandon();
+        }
+    }
+    return hr;
+}
+
+void GEWISUnlockCredential::_OnSessionSignedOut(DWORD dwSessionId, ULONGLONG ullNow)
+{
+    if (_logoffTracker.OnSignedOut(dwSessionId, ullNow))
+    {
+        Metrics::Instance().ObserveSince(MH_LOGOFF, _logoff.llStart);
+    }
+}
+
+void GEWISUnlockCredential::_OnLogoffTimer()
+{
+    ULONGLONG ullNow = GetTickCount64();
+
+    // In case a notification was missed, or we could not register for them
+    for (size_t cSignedOut = _logoffTracker.Poll(_logoff.pSessionSource, ullNow); cSignedOut > 0; cSignedOut--)
+    {
+        Metrics::Instance().ObserveSince(MH_LOGOFF, _logoff.llStart);
+    }
+
+    _logoffTracker.OnTick(ullNow);
+    _UpdateLogoff(ullNow);
+}
+
+// Shows how the sign-out is going, offers to force the sessions that timed out, or reports the result.
+void GEWISUnlockCredential::_UpdateLogoff(ULONGLONG ullNow)
+{
+    ATL::CStringW strStatus;
+    switch (_logoffTracker.GetPhase())
+    {
+    case LP_WAITING:
+    case LP_FORCING:
+        _logoffTracker.FormatProgress(ullNow, &strStatus);
+        _SetStatusField(strStatus);
+        break;
+
+    case LP_TIMED_OUT:
+        if (!_logoff.fOffered)
+        {
+            // Keep waiting meanwhile; a session that still signs out finishes the sign-out as usual
+            _logoff.fOffered = true;
+            ATL::CStringW strPending;
+            _logoffTracker.GetUsers(LS_PENDING, &strPending);
+            strStatus.Format(L"%s did not sign out within %u seconds, probably because an application is not responding.\r\n\r\nEnter your password and press Kick again to close the remaining applications forcefully (unsaved work will be lost), or select another tile to stop waiting.",
+                strPending.GetString(), ConfigStore::Instance().Current()->dwLogoffTimeout);
+            _SetStatusField(strStatus);
+
+            // Whoever presses Kick to force has to enter the password again, so it cannot be someone walking by
+            _passwordField.Clear();
+            if (_pCredProvCredentialEvents)
             {
-                // The user did not specify a domain, so we have to assume they mean the same domain as the current user
-                if (SUCCEEDED(hr))
-                {
-                    //We are able to get a domain from the current user
-                    pszUsername = StrDupW(_rgFieldStrings[GFI_USERNAME]);
-                }
+                _pCredProvCredentialEvents->SetFieldString(this, GFI_PASSWORD, _passwordField.Get());
             }
 
-            // We don't have a username yet
-            if (wcslen(pszUsername) == 0)
+            _cpgsrResult = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
+            _strResultStatus = strStatus;
+            _fResultPending = true;
+            if (_pCredProvEvents != nullptr)
             {
-                hr = SplitDomainAndUsername(_rgFieldStrings[GFI_USERNAME], &pszDomain, &pszUsername);
+                _pCredProvEvents->CredentialsChanged(_upAdviseContext);
             }
+        }
+        break;
+
+    case LP_FINISHED:
+        _FinishLogoff(false);
+        break;
+
+    default:
+        break;
+    }
+}
+
+// Whether the username and password fields hold the room responsible who started the sign-out. The name is
+// parsed as for the kick; the password is checked against the verifier made when the kick was verified, so this
+// does not need a logon on the thread of LogonUI.
+bool GEWISUnlockCredential::_IsLogoffResponsible()
+{
+    if (!_logoff.fVerifier)
+    {
+        return false;
+    }
+
+    std::shared_ptr<const Config> pConfig = ConfigStore::Instance().Current();
+    std::wstring_view defaultDomain(pConfig->strDefaultDomain, pConfig->strDefaultDomain.GetLength());
+    ACCOUNT_NAME currentUser;
+    if (_pszQualifiedUserName != nullptr && SUCCEEDED(ParseAccountName(_pszQualifiedUserName, defaultDomain, &currentUser)))
+    {
+        defaultDomain = currentUser.domain;
+    }
+
+    ACCOUNT_NAME responsible;
+    ACCOUNT_NAME enteredUser;
+    return SUCCEEDED(ParseAccountName(_logoff.strResponsible, defaultDomain, &responsible)) &&
+        SUCCEEDED(ParseAccountName(_usernameField.Get(), defaultDomain, &enteredUser)) &&
+        IsSameAccount(responsible, enteredUser) &&
+        AuthorizationCache::CheckVerifier(_logoff.verifier, _passwordField.Get()) == S_OK;
+}
+
+// The room responsible confirmed that the sessions that timed out may be forced: terminate what is left in them.
+void GEWISUnlockCredential::_ForceLogoff()
+{
+    ULONGLONG ullNow = GetTickCount64();
+    _logoffTracker.Force(ullNow);
+    for (size_t i = 0; i < _logoffTracker.GetCount(); i++)
+    {
+        const LOGOFF_TARGET& target = _logoffTracker.GetTarget(i);
+        if (target.state == LS_PENDING)
+        {
+            // Ask again as well, in case the first request gave up on the application that did not close
+            _logoff.pSessionSource->TerminateProcesses(target.session.dwSessionId);
+            _logoff.pSessionSource->BeginLogoff(target.session.dwSessionId);
+        }
+    }
+    _UpdateLogoff(ullNow);
+}
+
+// Stops following the sign-out, writes the outcome of every session to the audit log, signs out the current
+// session if it was selected, and reports the result. With fCancelled (LogonUI no longer shows us), the sessions
+// that are still signing out are recorded as requested rather than failed, the current session is left alone
+// and nothing is reported.
+void GEWISUnlockCredential::_FinishLogoff(bool fCancelled)
+{
+    if (_logoffTracker.GetPhase() == LP_IDLE)
+    {
+        return;
+    }
+    if (!fCancelled)
+    {
+        _logoffTracker.Abandon();
+    }
+
+    if (_hwndNotify != nullptr)
+    {
+        KillTimer(_hwndNotify, s_uLogoffTimerId);
+        if (_logoff.fNotifying)
+        {
+            WTSUnRegisterSessionNotification(_hwndNotify);
+        }
+    }
+    _logoff.fNotifying = false;
+    SecureZeroMemory(&_logoff.verifier, sizeof(_logoff.verifier));
+    _logoff.fVerifier = false;
+
+    size_t cTargets = _logoffTracker.GetCount();
+    size_t cSignedOut = 0;
+    ATL::CStringW strFailed;
+    for (size_t i = 0; i < _logoffTracker.GetCount(); i++)
+    {
+        const LOGOFF_TARGET& target = _logoffTracker.GetTarget(i);
+        if (target.state == LS_SIGNED_OUT)
+        {
+            Metrics::Instance().Increment(MC_KICKS);
+            _AuditLogoff(target.session, target.fForced ? AO_SIGNED_OUT_FORCED : AO_SIGNED_OUT);
+            cSignedOut++;
+        }
+        else if (target.state == LS_PENDING)
+        {
+            // We stopped watching, but the session may well still sign out
+            _AuditLogoff(target.session, AO_SIGN_OUT_REQUESTED);
+        }
+        else
+        {
+            Metrics::Instance().Increment(MC_ERRORS);
+            _AuditLogoff(target.session, AO_SIGN_OUT_FAILED);
+            strFailed += strFailed.IsEmpty() ? target.session.strUser : L", " + target.session.strUser;
+        }
+    }
+    _logoffTracker.Reset();
+
+    if (_logoff.fCurrent && !fCancelled)
+    {
+        cTargets++;
+
+        // This process ends with the session, so nothing can be written once it signs out
+        _AuditLogoff(_logoff.current, AO_SIGN_OUT_REQUESTED);
+        AuditLog::Instance().Flush();
+        if (SUCCEEDED(_logoff.pSessionSource->BeginLogoff(_logoff.current.dwSessionId)))
+        {
+            cSignedOut++;
+        }
+        else
+        {
+            Metrics::Instance().Increment(MC_ERRORS);
+            _AuditLogoff(_logoff.current, AO_SIGN_OUT_FAILED);
+            strFailed += strFailed.IsEmpty() ? _logoff.current.strUser : L", " + _logoff.current.strUser;
+        }
+        AuditLog::Instance().Flush();
+    }
+
+    _SetStatusField(nullptr);
+    if (fCancelled)
+    {
+        return;
+    }
 
+    // When only other sessions were signed out, the room responsible stays on this tile and can continue.
+    // It worked, we tell the user (they won't see it in Win10 and Win11 if this session was signed out, but we don't mind because it is clear what happened)
+    _cpgsrResult = _logoff.fCurrent ? CPGSR_NO_CREDENTIAL_FINISHED : CPGSR_NO_CREDENTIAL_NOT_FINISHED;
+    if (cTargets == 1)
+    {
+        _strResultStatus = cSignedOut == 1 ? L"The user was successfully signed out." : L"An error occured and the user could not be signed out.";
+    }
+    else if (strFailed.IsEmpty())
+    {
+        _strResultStatus.Format(L"All %Iu sessions were successfully signed out.", cTargets);
+    }
+    else
+    {
+        _strResultStatus.Format(L"%Iu of %Iu sessions were signed out. An error occured and these users could not be signed out: %s.",
+            cSignedOut, cTargets, strFailed.GetString());
+    }
+    _fResultPending = true;
+
+    // Have LogonUI call GetSerialization again to report the result
+    if (_pCredProvEvents != nullptr)
+    {
+        _pCredProvEvents->CredentialsChanged(_upAdviseContext);
+    }
+}
+
+// Adds the outcome of signing out one session to the audit log.
+void GEWISUnlockCredential::_AuditLogoff(_In_ const SESSION_INFO& session, AUDIT_OUTCOME outcome)
+{
+    AUDIT_RECORD record;
+    record.ullTime = AuditLog::Now();
+    record.outcome = outcome;
+    record.dwLatencyMs = static_cast<DWORD>(GetTickCount64() - _logoff.ullStartTime);
+    record.strResponsible = _logoff.strResponsible;
+    record.strVictim = session.strUser;
+    record.strProtectedApps = _logoff.strProtectedApps;
+    AuditLog::Instance().Write(record);
+}
+
+// Collect the username and password into a serialized credential for the correct usage scenario
+// (logon/unlock is what's demonstrated in this sample).  LogonUI then passes these credentials
+// back to the system to log on.
+HRESULT GEWISUnlockCredential::GetSerialization(_Out_ CREDENTIAL_PROVIDER_GET_SERIALIZATION_RESPONSE* pcpgsr,
+    _Out_ CREDENTIAL_PROVIDER_CREDENTIAL_SERIALIZATION* pcpcs,
+    _Outptr_result_maybenull_ PWSTR* ppwszOptionalStatusText,
+    _Out_ CREDENTIAL_PROVIDER_STATUS_ICON* pcpsiOptionalStatusIcon)
+{
+    TRACE_FUNCTION();
+    HRESULT hr = E_UNEXPECTED;
+    *pcpgsr = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
+    *ppwszOptionalStatusText = nullptr;
+    *pcpsiOptionalStatusIcon = CPSI_NONE;
+    ZeroMemory(pcpcs, sizeof(*pcpcs));
+
+    // A kick has finished in the background; this is LogonUI asking for the result
+    if (_fResultPending)
+    {
+        _fResultPending = false;
+        *pcpgsr = _cpgsrResult;
+        if (!_strResultStatus.IsEmpty())
+        {
+            SHStrDupW(_strResultStatus, ppwszOptionalStatusText);
+        }
+        return HRESULT(S_OK);
+    }
+
+    // Pressing Kick again after sessions timed out is the room responsible agreeing to force them
+    if (_logoffTracker.GetPhase() == LP_TIMED_OUT)
+    {
+        *pcpgsr = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
+        if (_IsLogoffResponsible())
+        {
+            _ForceLogoff();
+        }
+        else
+        {
+            SHStrDupW(L"Only the room responsible who started signing out these sessions can force it. Please enter their username and password.", ppwszOptionalStatusText);
+        }
+        return HRESULT(S_OK);
+    }
+
+    // A kick that was cancelled may still be finishing its stage, or be done without _OnKickDone having run yet
+    if (_kickPipeline.IsRunning() || _pKickRequest != nullptr || _logoffTracker.GetPhase() != LP_IDLE)
+    {
+        *pcpgsr = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
+        SHStrDupW(L"Still busy, please wait a moment.", ppwszOptionalStatusText);
+        return HRESULT(S_OK);
+    }
+
+    // Make sure the selection still means the users that were shown; the logoff stage checks again
+    if (!_RefreshSessions())
+    {
+        *pcpgsr = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
+        SHStrDupW(L"The selected session was signed out or changed meanwhile, so the list of sessions was updated. Please check which session to sign out and press Kick again.", ppwszOptionalStatusText);
+        return HRESULT(S_OK);
+    }
+
+    // Store the Window owner so we can create message boxes later
+    HWND hwndOwner = NULL;
+    if (_pCredProvCredentialEvents)
+    {
+        _pCredProvCredentialEvents->OnCreatingWindow(&hwndOwner);
+    }
+
+    BOOL multiChecked;
+    PWSTR multiLabel; //We don't use this
+    GEWISUnlockCredential::GetCheckboxValue(GFI_MULTIVERS_CHECKBOX, &multiChecked, &multiLabel);
+    CoTaskMemFree(multiLabel);
+    ATL::CStringW strProtectedApps;
+    if (!multiChecked)
+    {
+        _GetRunningProtectedApps(&strProtectedApps);
+    }
+    if (!strProtectedApps.IsEmpty())
+    {
+        Metrics::Instance().Increment(MC_PROTECTED_BLOCKED);
+
+        // Nobody was verified yet, so the room responsible is just the name that was entered.
+        // The victims are the users of the selected sessions, as for a kick.
+        ATL::CAtlArray<SESSION_INFO> rgSelected;
+        _GetSelectedSessions(&rgSelected);
+        AUDIT_RECORD record;
+        record.ullTime = AuditLog::Now();
+        record.outcome = AO_BLOCKED_PROTECTED;
+        record.dwLatencyMs = 0;
+        record.strResponsible = _usernameField.Get();
+        for (size_t i = 0; i < rgSelected.GetCount(); i++)
+        {
+            record.strVictim += (i == 0) ? rgSelected[i].strUser : L", " + rgSelected[i].strUser;
+        }
+        record.strProtectedApps = strProtectedApps;
+        AuditLog::Instance().Write(record);
+
+        *pcpgsr = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
+        SHStrDupW(L"You are trying to sign out a user while Multivers (or another protected application) is running.\r\nTo confirm, please check the box indicating that you understand the risks of doing that.", ppwszOptionalStatusText);
+        return HRESULT(S_OK);
+    }
+
+    // For local user, the domain and user name can be split from _pszQualifiedUserName (domain\username).
+    // CredPackAuthenticationBuffer() cannot be used because it doesn't work in the unlock scenario.
+    if (_fIsLocalUser)
+    {
+        PWSTR pwzProtectedPassword;
+        hr = ProtectIfNecessaryAndCopyPassword(_passwordField.Get(), _cpus, &pwzProtectedPassword);
+        if (SUCCEEDED(hr))
+        {
+            // A name without a domain means the domain of the user that is signed in (or the default domain if that is unknown)
+            std::shared_ptr<const Config> pConfig = ConfigStore::Instance().Current();
+            std::wstring_view defaultDomain(pConfig->strDefaultDomain, pConfig->strDefaultDomain.GetLength());
+            ACCOUNT_NAME currentUser;
+            bool fHaveCurrentUser = _pszQualifiedUserName != nullptr &&
+                SUCCEEDED(ParseAccountName(_pszQualifiedUserName, defaultDomain, &currentUser));
+
+            ACCOUNT_NAME targetUser;
+            hr = ParseAccountName(_usernameField.Get(), fHaveCurrentUser ? currentUser.domain : defaultDomain, &targetUser);
             if (SUCCEEDED(hr))
             {
-                if (currentUser != nullptr && wcscmp(currentUser, pszUsername) == 0)
+                if (fHaveCurrentUser && IsSameAccount(currentUser, targetUser))
                 {
                     // The current user is the same one as the one trying to unlock the computer
                     // so we just open the session
                     // If this check fails, no harm done; Windows will return a "This computer is locked. Only the signed-in user can unlock the computer"
+                    ATL::CStringW strDomain;
+                    ATL::CStringW strUsername;
+                    GetLogonNames(targetUser, &strDomain, &strUsername);
 
                     KERB_INTERACTIVE_UNLOCK_LOGON kiul;
-                    hr = KerbInteractiveUnlockLogonInit(pszDomain, pszUsername, pwzProtectedPassword, _cpus, &kiul);
+                    hr = KerbInteractiveUnlockLogonInit(strDomain.GetBuffer(), strUsername.GetBuffer(), pwzProtectedPassword, _cpus, &kiul);
                     if (SUCCEEDED(hr))
                     {
                         hr = KerbInteractiveUnlockLogonPack(kiul, &pcpcs->rgbSerialization, &pcpcs->cbSerialization);
                         if (SUCCEEDED(hr))
                         {
                             ULONG ulAuthPackage;
-                            hr = RetrieveNegotiateAuthPackage(&ulAuthPackage);
+                            hr = WarmState::Instance().GetNegotiateAuthPackage(&ulAuthPackage);
                             if (SUCCEEDED(hr))
                             {
                                 // We set the credential and tell Windows we are done
@@ -537,91 +1772,35 @@ HRESULT GEWISUnlockCredential::GetSerialization(_Out_ CREDENTIAL_PROVIDER_GET_SE
                             }
                         }
                     }
+                    strDomain.ReleaseBuffer();
+                    strUsername.ReleaseBuffer();
                 }
                 else
                 {
-                    // We use a login session to verify the user before passing on serialization so we can also use another account
-                    ATL::CAccessToken aToken;
-
-                    // If there are cases where the user that is unlcoking the workstation does not have "Log on to this workstation interactively" permissions (e.g. admin accounts)
-                    // You may decide to perform a LOGON32_LOGON_NETWORK login (but that will exclude users who can't "Access this computer over the network")
-                    // https://learn.microsoft.com/en-us/windows/win32/secauthz/account-rights-constants
-                    if (!aToken.LogonUserW(pszUsername, pszDomain, pwzProtectedPassword, LOGON32_LOGON_INTERACTIVE, LOGON32_PROVIDER_DEFAULT))
-                    {
-                        //Sleep(5000);
-                        *pcpgsr = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
-                        SHStrDupW(L"Incorrect password or username.", ppwszOptionalStatusText);
-                        return HRESULT(S_OK);
-                    }
-
-                    ATL::CTokenGroups groups;
-                    if (!aToken.GetGroups(&groups))
+                    // Verifying the room responsible and signing off can take a while (e.g. with a slow domain controller),
+                    // so that happens in the background. Once it is done, we ask LogonUI to call us again for the result.
+                    hr = _StartKick(targetUser, pwzProtectedPassword);
+                    if (SUCCEEDED(hr))
                     {
+                        // The kick request owns the password now
+                        pwzProtectedPassword = nullptr;
                         *pcpgsr = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
-                        SHStrDupW(L"Unable to check group membership which is needed to determine if you can sign out other users.", ppwszOptionalStatusText);
-                        return HRESULT(S_OK);
-                    }
-
-                    // Get the group of which users must be a member from that is stored in the registry
-                    ATL::CSid::CSidArray groupSids;
-                    ATL::CAtlArray<DWORD> groupAttribs;
-                    ATL::CSid authorizedGroup;
-                    GetAuthorizedGroup(&authorizedGroup);
-
-                    // Iterate over all groups and check if the user is a member
-                    // We use this because we can't easily determine membership of the authorizedGroup nor are we guaranteed the user has access to the group
-                    // the code below may omit groups the user can't read, but sometimes these are also included. (If you happen to do this, please verify this in detail)
-                    bool bIsAuthorized = false;
-                    groups.GetSidsAndAttributes(&groupSids, &groupAttribs);
-                    for (UINT i = 0; !bIsAuthorized && i < groupSids.GetCount(); ++i)
-                        bIsAuthorized = groupSids.GetAt(i) == authorizedGroup;
-
-                    // Check wheter the new user has permission
-                    if (bIsAuthorized)
-                    {
-                        // https://learn.microsoft.com/en-us/windows/win32/api/wtsapi32/nf-wtsapi32-wtslogoffsession
-                        if (WTSLogoffSession(WTS_CURRENT_SERVER_HANDLE, WTS_CURRENT_SESSION, true) != 0)
-                        {
-                            // It worked, we tell the user (they won't see it in Win10 and Win11, but we don't mind because it is clear what happened)
-                            *pcpgsr = CPGSR_NO_CREDENTIAL_FINISHED;
-                            SHStrDupW(L"The user was successfully signed out.", ppwszOptionalStatusText);
-                            return HRESULT(S_OK);
-                        }
-                        else
-                        {
-                            *pcpgsr = CPGSR_NO_CREDENTIAL_FINISHED;
-                            SHStrDupW(L"An error occured and the user could not be signed out.", ppwszOptionalStatusText);
-                            return HRESULT(S_OK);
-                        }
                     }
                     else
                     {
-                        PWSTR errorMessage = static_cast<PWSTR>(CoTaskMemAlloc(sizeof(wchar_t) * 256));
-                        if (errorMessage != nullptr)
-                        {
-                            ZeroMemory(errorMessage, sizeof(wchar_t) * 255);
-                            StringCchCat(errorMessage, 255, L"It does not look like you are a member of '");
-                            StringCchCat(errorMessage, 255, ATL::CSid(authorizedGroup).AccountName());
-                            StringCchCat(errorMessage, 255, L"' which is required to sign off another user.\r\n\r\nPlease contact your system administrator if you think this is an error.");
-
-                            *pcpgsr = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
-                            SHStrDupW(errorMessage, ppwszOptionalStatusText);
-                            return HRESULT(S_OK);
-                        }
+                        Metrics::Instance().Increment(MC_ERRORS);
+                        *pcpgsr = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
+                        SHStrDupW(L"An error occured and the user could not be signed out.", ppwszOptionalStatusText);
+                        hr = S_OK;
                     }
-
                 }
             }
             else
             {
                 *pcpgsr = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
                 SHStrDupW(L"Unable to split domain name and username. Perhaps the username was malformed.", ppwszOptionalStatusText);
-                return HRESULT(S_OK);
+                hr = S_OK;
             }
-            CoTaskMemFree(pszDomain);
-            CoTaskMemFree(pszUsername);
-            CoTaskMemFree(currentUser);
-
         }
         CoTaskMemFree(pwzProtectedPassword);
     }
@@ -658,11 +1837,18 @@ HRESULT GEWISUnlockCredential::ReportResult(NTSTATUS ntsStatus,
     _Outptr_result_maybenull_ PWSTR* ppwszOptionalStatusText,
     _Out_ CREDENTIAL_PROVIDER_STATUS_ICON* pcpsiOptionalStatusIcon)
 {
+    TRACE_FUNCTION();
     *ppwszOptionalStatusText = nullptr;
     *pcpsiOptionalStatusIcon = CPSI_NONE;
 
     DWORD dwStatusInfo = (DWORD)-1;
 
+    // The package ID we serialized is remembered for as long as we are loaded; if LSA no longer knows it, look it up again next time
+    if (ntsStatus == STATUS_NO_SUCH_PACKAGE)
+    {
+        InvalidateNegotiateAuthPackage();
+    }
+
     // Look for a match on status and substatus.
     for (DWORD i = 0; i < ARRAYSIZE(s_rgLogonStatusInfo); i++)
     {
@@ -698,6 +1884,7 @@ HRESULT GEWISUnlockCredential::ReportResult(NTSTATUS ntsStatus,
 // Gets the SID of the user corresponding to the credential.
 HRESULT GEWISUnlockCredential::GetUserSid(_Outptr_result_nullonfailure_ PWSTR* ppszSid)
 {
+    TRACE_FUNCTION();
     *ppszSid = nullptr;
     HRESULT hr = E_UNEXPECTED;
     if (_pszUserSid != nullptr)
@@ -714,6 +1901,7 @@ HRESULT GEWISUnlockCredential::GetUserSid(_Outptr_result_nullonfailure_ PWSTR* p
 HRESULT GEWISUnlockCredential::GetFieldOptions(DWORD dwFieldID,
     _Out_ CREDENTIAL_PROVIDER_CREDENTIAL_FIELD_OPTIONS* pcpcfo)
 {
+    TRACE_FUNCTION();
     *pcpcfo = CPCFO_NONE;
 
     if (dwFieldID == GFI_PASSWORD)
@@ -727,3 +1915,30 @@ HRESULT GEWISUnlockCredential::GetFieldOptions(DWORD dwFieldID,
 
     return S_OK;
 }
+
+// Wipes the passwords in the kick request and frees it.
+void GEWISUnlockCredential::_WipeKickRequest()
+{
+    if (_pKickRequest->pwzProtectedPassword != nullptr)
+    {
+        SecureZeroMemory(_pKickRequest->pwzProtectedPassword, wcslen(_pKickRequest->pwzProtectedPassword) * sizeof(wchar_t));
+        CoTaskMemFree(_pKickRequest->pwzProtectedPassword);
+    }
+    // The unprotected copy wipes itself
+    delete _pKickRequest;
+    _pKickRequest = nullptr;
+}
+
+// The edit fields whose values are kept in a SecureFieldBuffer instead of _rgFieldStrings, or nullptr.
+SecureFieldBuffer* GEWISUnlockCredential::_GetSecureField(DWORD dwFieldID)
+{
+    switch (dwFieldID)
+    {
+    case GFI_USERNAME:
+        return &_usernameField;
+    case GFI_PASSWORD:
+        return &_passwordField;
+    default:
+        return nullptr;
+    }
+}
@@ -15,6 +15,16 @@
 #include "common.h"
 #include "dll.h"
 #include "resource.h"
+#include "ProtectedAppWatcher.h"
+#include "VerificationPipeline.h"
+#include "SecureFieldBuffer.h"
+#include "AccountName.h"
+#include "AuditLog.h"
+#include "AuthorizationCache.h"
+#include "SessionSource.h"
+#include "LogonBackend.h"
+#include "LogoffTracker.h"
+#include <memory>
 
 class GEWISUnlockCredential : public ICredentialProviderCredential2, ICredentialProviderCredentialWithFieldOptions
 {
@@ -94,9 +104,95 @@ public:
                        _In_ ICredentialProviderUser *pcpUser);
     GEWISUnlockCredential();
 
+    // The provider's callback, used to have LogonUI call GetSerialization again once a kick has finished.
+    void SetProviderEvents(_In_opt_ ICredentialProviderEvents *pcpe, UINT_PTR upAdviseContext);
+
+    // Whether a kick has finished and GetSerialization should be called to report its result.
+    bool HasPendingResult() const
+    {
+        return _fResultPending;
+    }
+
   private:
 
     virtual ~GEWISUnlockCredential();
+    static LRESULT CALLBACK _NotifyWndProc(_In_ HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
+    HRESULT _CreateNotifyWindow();
+    void _DestroyNotifyWindow();
+    void _UpdateProtectedAppFields();
+    bool _ProtectedAppsRunning();
+    void _GetRunningProtectedApps(_Out_ ATL::CAtlArray<RUNNING_APP> *prgRunning);
+    void _SelectProtectedApps(_In_ const ATL::CAtlArray<RUNNING_APP> &rgRunning, _Out_ ATL::CAtlArray<ATL::CStringW> *prgNames,
+        _Out_opt_ ATL::CAtlArray<DWORD> *prgSessionIds = nullptr);
+    void _GetRunningProtectedApps(_Out_ ATL::CStringW *pstrRunning);
+    void _EnumerateSessions();
+    bool _RefreshSessions();
+    DWORD _GetComboItemCount() const;
+    HRESULT _GetSelectedSessions(_Out_ ATL::CAtlArray<SESSION_INFO> *prgTargets);
+    void _SetStatusField(_In_opt_ PCWSTR pwszStatus);
+    HRESULT _StartKick(_In_ const ACCOUNT_NAME& user, _In_ PWSTR pwzProtectedPassword);
+    void _OnKickProgress(size_t iStage);
+    void _OnKickDone();
+    void _WipeKickRequest();
+    HRESULT _StartLogoffTracking();
+    void _OnSessionSignedOut(DWORD dwSessionId, ULONGLONG ullNow);
+    void _OnLogoffTimer();
+    void _UpdateLogoff(ULONGLONG ullNow);
+    bool _IsLogoffResponsible();
+    void _ForceLogoff();
+    void _FinishLogoff(bool fCancelled);
+    void _AuditLogoff(_In_ const SESSION_INFO& session, AUDIT_OUTCOME outcome);
+    SecureFieldBuffer *_GetSecureField(DWORD dwFieldID);
+    static HRESULT _KickLogonStage(_Inout_ void *pContext);
+    static HRESULT _KickGroupStage(_Inout_ void *pContext);
+    static HRESULT _KickCloseAppsStage(_Inout_ void *pContext);
+    static HRESULT _KickLogoffStage(_Inout_ void *pContext);
+    struct KICK_REQUEST;
+    static bool _CheckRights(_Inout_ KICK_REQUEST *pRequest, DWORD dwRights);
+    static void _AuditKick(_In_ const KICK_REQUEST *pRequest, AUDIT_OUTCOME outcome, _In_opt_ PCWSTR pszVictim = nullptr);
+
+    // Everything the background kick stages need; owned by the credential while the pipeline runs.
+    struct KICK_REQUEST
+    {
+        ATL::CStringW                                   strDomain;
+        ATL::CStringW                                   strUsername;
+        PWSTR                                           pwzProtectedPassword;
+        SecureFieldBuffer                               password;               // Unprotected copy, to check against the authorization cache.
+        bool                                            fVerifiedFromCache;
+        bool                                            fProtectedAppsRunning;  // In rgTargets, when the kick was submitted.
+        ATL::CAtlArray<DWORD>                           rgProtectedSessions;    // The sessions of rgTargets in which they were running.
+        ATL::CAccessToken                               token;
+        ATL::CAtlArray<BYTE>                            *prgbTokenGroups;       // Buffer for the groups in token; see _rgbTokenGroups.
+        CREDENTIAL_PROVIDER_GET_SERIALIZATION_RESPONSE  cpgsr;                  // The outcome, once the pipeline has finished.
+        ATL::CStringW                                   strStatus;
+        ATL::CStringW                                   strResponsible;         // For the audit log: the name as entered,
+        ATL::CStringW                                   strVictim;              // the users of the selected sessions,
+        ATL::CStringW                                   strProtectedApps;       // the protected applications that were running (and how they were closed)
+        ULONGLONG                                       ullStartTime;           // and when the kick was submitted (GetTickCount64).
+        ATL::CAtlArray<SESSION_INFO>                    rgTargets;              // The sessions to sign out.
+        SessionSource                                   *pSessionSource;
+        LogonBackend                                    *pLogonBackend;
+        HANDLE                                          hCancelEvent;           // Of the pipeline, for stages that wait.
+        ATL::CAtlArray<HRESULT>                         rgIssued;               // Whether each of rgTargets was asked to sign out.
+        bool                                            fLogoffIssued;          // The last stage ran; the credential follows the sign-out from here.
+    };
+
+    // What is left of the kick while its sessions sign out (see _StartLogoffTracking); the request itself is gone by then.
+    struct LOGOFF_CONTEXT
+    {
+        ATL::CStringW                                   strResponsible;         // For the audit log, as in KICK_REQUEST.
+        ATL::CStringW                                   strProtectedApps;
+        ULONGLONG                                       ullStartTime;
+        LONGLONG                                        llStart;                // For MH_LOGOFF (Metrics::Now).
+        SessionSource                                   *pSessionSource;
+        bool                                            fCurrent;               // Whether the current session was selected too; it is signed out last.
+        SESSION_INFO                                    current;
+        bool                                            fNotifying;             // Registered for session change notifications.
+        bool                                            fOffered;               // Forcing the sessions that timed out was offered.
+        AuthorizationCache::PASSWORD_VERIFIER           verifier;               // Of the password of the room responsible, who has to enter it again to force.
+        bool                                            fVerifier;              // Without one, forcing is not possible.
+    };
+
     long                                    _cRef;
     CREDENTIAL_PROVIDER_USAGE_SCENARIO      _cpus;                                          // The usage scenario for which we were enumerated.
     CREDENTIAL_PROVIDER_FIELD_DESCRIPTOR    _rgCredProvFieldDescriptors[GFI_NUM_FIELDS];    // An array holding the type and name of each field in the tile.
@@ -107,6 +203,25 @@ public:
     ICredentialProviderCredentialEvents2*    _pCredProvCredentialEvents;                    // Used to update fields.
                                                                                             // CredentialEvents2 for Begin and EndFieldUpdates.
     BOOL                                    _fChecked;                                      // Tracks the state of our checkbox.
-    DWORD                                   _dwComboIndex;                                  // Tracks the current index of our combobox.
+    DWORD                                   _dwComboIndex;                                  // The selected item of GFI_SESSIONS: an index in _rgSessions, or _rgSessions.GetCount() for all of them.
+    WtsSessionSource                        _wtsSessionSource;
+    SessionSource                           *_pSessionSource;                               // _wtsSessionSource, or the fake one of SetTestBackends.
+    InteractiveLogonBackend                 _interactiveLogon;
+    LogonBackend                            *_pLogonBackend;                                // _interactiveLogon, or the fake one of SetTestBackends.
+    ATL::CAtlArray<SESSION_INFO>            _rgSessions;                                    // The sessions in GFI_SESSIONS, the current (locked) one first.
     bool                                    _fIsLocalUser;                                  // If the cred prov is assosiating with a local user tile
+    ProtectedAppWatcher                     _protectedAppWatcher;                           // Keeps GFI_MULTIVERS_TEXT and GFI_MULTIVERS_CHECKBOX up to date while we are advised.
+    HWND                                    _hwndNotify;                                    // Message-only window on the apartment thread that receives background updates.
+    VerificationPipeline                    _kickPipeline;                                  // Verifies the room responsible and signs off the user in the background.
+    KICK_REQUEST                            *_pKickRequest;                                 // The kick in progress, if any.
+    LogoffTracker                           _logoffTracker;                                 // The sessions of the last kick that are signing out, if any.
+    LOGOFF_CONTEXT                          _logoff;
+    SecureFieldBuffer                       _usernameField;                                 // The values of GFI_USERNAME and GFI_PASSWORD; see SetStringValue.
+    SecureFieldBuffer                       _passwordField;                                 // _rgFieldStrings is not used for these two fields.
+    ATL::CAtlArray<BYTE>                    _rgbTokenGroups;                                // Reused by every kick, so reading the (often 150+) groups of a token does not allocate.
+    bool                                    _fResultPending;                                // A kick has finished; report it from GetSerialization.
+    CREDENTIAL_PROVIDER_GET_SERIALIZATION_RESPONSE _cpgsrResult;
+    ATL::CStringW                           _strResultStatus;
+    ICredentialProviderEvents               *_pCredProvEvents;                              // The provider's callback (see SetProviderEvents).
+    UINT_PTR                                _upAdviseContext;
 };
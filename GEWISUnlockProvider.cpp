@@ -10,17 +10,48 @@
 #include "GEWISUnlockProvider.h"
 #include "GEWISUnlockCredential.h"
 #include "guid.h"
+#include "ProcessIndex.h"
+#include "ConfigStore.h"
+#include "SpanTrace.h"
+#include "Metrics.h"
+#include "AuditLog.h"
+#include "WarmState.h"
+#include "SessionReclaimer.h"
 
 GEWISUnlockProvider::GEWISUnlockProvider() :
     _cRef(1),
     _pCredential(nullptr),
     _pCredProviderUserArray(nullptr),
+    _pCredProviderEvents(nullptr),
+    _upAdviseContext(0),
     // The last two are merely set becuase of best practices
     // but will be redefined in SetUsageScenario
     _cpus(CPUS_INVALID),
-    _fRecreateEnumeratedCredentials(false)
+    _fRecreateEnumeratedCredentials(false),
+    _llUsageScenarioStart(0),
+    _fPrefetched(false),
+    _fFirstTileReported(true)
 {
     DllAddRef();
+    SpanTrace::Register();
+
+    // Read the settings now rather than on every submit, and keep them current from then on
+    ConfigStore::Instance().AddRef();
+
+    // Start keeping track of running processes now, so checking for Multivers later is cheap
+    ProcessIndex::Instance().AddRef();
+
+    // Export the metrics while LogonUI shows us
+    Metrics::Instance().AddRef();
+
+    // Write the audit log in the background while kicks can happen
+    AuditLog::Instance().AddRef();
+
+    // Allow SetUsageScenario to start fetching what the tile needs
+    WarmState::Instance().AddRef();
+
+    // Sign out sessions that stay locked for too long, if that is configured
+    SessionReclaimer::Instance().AddRef();
 }
 
 GEWISUnlockProvider::~GEWISUnlockProvider()
@@ -35,7 +66,14 @@ GEWISUnlockProvider::~GEWISUnlockProvider()
         _pCredProviderUserArray->Release();
         _pCredProviderUserArray = nullptr;
     }
+    UnAdvise();
 
+    SessionReclaimer::Instance().Release();
+    WarmState::Instance().Release();
+    AuditLog::Instance().Release();
+    Metrics::Instance().Release();
+    ProcessIndex::Instance().Release();
+    ConfigStore::Instance().Release();
     DllRelease();
 }
 
@@ -45,6 +83,7 @@ HRESULT GEWISUnlockProvider::SetUsageScenario(
     CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus,
     DWORD /*dwFlags*/)
 {
+    TRACE_FUNCTION();
     HRESULT hr;
 
     // Decide which scenarios to support here. Returning E_NOTIMPL simply tells the caller
@@ -57,6 +96,15 @@ HRESULT GEWISUnlockProvider::SetUsageScenario(
         // while we need the ICredentialProviderUserArray during enumeration in ICredentialProvider::GetCredentialCount()
         _cpus = cpus;
         _fRecreateEnumeratedCredentials = true;
+
+        // LogonUI will ask for our tile shortly; in the meantime, scan the processes and connect to LSA in the background
+        _llUsageScenarioStart = Metrics::Now();
+        _fPrefetched = ConfigStore::Instance().Current()->fPrefetch;
+        _fFirstTileReported = false;
+        if (_fPrefetched)
+        {
+            WarmState::Instance().Prefetch();
+        }
         hr = S_OK;
         break;
 
@@ -87,22 +135,45 @@ HRESULT GEWISUnlockProvider::SetUsageScenario(
 HRESULT GEWISUnlockProvider::SetSerialization(
     _In_ CREDENTIAL_PROVIDER_CREDENTIAL_SERIALIZATION const* /*pcpcs*/)
 {
+    TRACE_FUNCTION();
     return E_NOTIMPL;
 }
 
 // Called by LogonUI to give you a callback.  Providers often use the callback if they
 // some event would cause them to need to change the set of tiles that they enumerated.
+// We use it when a kick that runs in the background has finished, so LogonUI asks our
+// credential for the result.
 HRESULT GEWISUnlockProvider::Advise(
-    _In_ ICredentialProviderEvents* /*pcpe*/,
-    _In_ UINT_PTR /*upAdviseContext*/)
+    _In_ ICredentialProviderEvents* pcpe,
+    _In_ UINT_PTR upAdviseContext)
 {
-    return E_NOTIMPL;
+    TRACE_FUNCTION();
+    UnAdvise();
+    _pCredProviderEvents = pcpe;
+    _pCredProviderEvents->AddRef();
+    _upAdviseContext = upAdviseContext;
+    if (_pCredential != nullptr)
+    {
+        _pCredential->SetProviderEvents(_pCredProviderEvents, _upAdviseContext);
+    }
+    return S_OK;
 }
 
 // Called by LogonUI when the ICredentialProviderEvents callback is no longer valid.
 HRESULT GEWISUnlockProvider::UnAdvise()
 {
-    return E_NOTIMPL;
+    TRACE_FUNCTION();
+    if (_pCredential != nullptr)
+    {
+        _pCredential->SetProviderEvents(nullptr, 0);
+    }
+    if (_pCredProviderEvents != nullptr)
+    {
+        _pCredProviderEvents->Release();
+        _pCredProviderEvents = nullptr;
+    }
+    _upAdviseContext = 0;
+    return S_OK;
 }
 
 // Called by LogonUI to determine the number of fields in your tiles.  This
@@ -114,6 +185,7 @@ HRESULT GEWISUnlockProvider::UnAdvise()
 HRESULT GEWISUnlockProvider::GetFieldDescriptorCount(
     _Out_ DWORD* pdwCount)
 {
+    TRACE_FUNCTION();
     *pdwCount = GFI_NUM_FIELDS;
     return S_OK;
 }
@@ -123,6 +195,7 @@ HRESULT GEWISUnlockProvider::GetFieldDescriptorAt(
     DWORD dwIndex,
     _Outptr_result_nullonfailure_ CREDENTIAL_PROVIDER_FIELD_DESCRIPTOR** ppcpfd)
 {
+    TRACE_FUNCTION();
     HRESULT hr;
     *ppcpfd = nullptr;
 
@@ -151,6 +224,7 @@ HRESULT GEWISUnlockProvider::GetCredentialCount(
     _Out_ DWORD* pdwDefault,
     _Out_ BOOL* pbAutoLogonWithDefault)
 {
+    TRACE_FUNCTION();
     *pdwDefault = CREDENTIAL_PROVIDER_NO_DEFAULT;
     *pbAutoLogonWithDefault = FALSE;
 
@@ -163,6 +237,13 @@ HRESULT GEWISUnlockProvider::GetCredentialCount(
 
     *pdwCount = 1;
 
+    // A kick finished in the background and asked to be collected (see GEWISUnlockCredential::_OnKickDone)
+    if (_pCredential != nullptr && _pCredential->HasPendingResult())
+    {
+        *pdwDefault = 0;
+        *pbAutoLogonWithDefault = TRUE;
+    }
+
     return S_OK;
 }
 
@@ -172,6 +253,7 @@ HRESULT GEWISUnlockProvider::GetCredentialAt(
     DWORD dwIndex,
     _Outptr_result_nullonfailure_ ICredentialProviderCredential** ppcpc)
 {
+    TRACE_FUNCTION();
     HRESULT hr = E_INVALIDARG;
     *ppcpc = nullptr;
 
@@ -179,6 +261,13 @@ HRESULT GEWISUnlockProvider::GetCredentialAt(
     {
         hr = _pCredential->QueryInterface(IID_PPV_ARGS(ppcpc));
     }
+
+    // Time to first tile, to see what prefetching gains (it can be turned off with the Prefetch setting)
+    if (SUCCEEDED(hr) && !_fFirstTileReported)
+    {
+        _fFirstTileReported = true;
+        Metrics::Instance().ObserveSince(_fPrefetched ? MH_FIRST_TILE : MH_FIRST_TILE_COLD, _llUsageScenarioStart);
+    }
     return hr;
 }
 
@@ -186,6 +275,7 @@ HRESULT GEWISUnlockProvider::GetCredentialAt(
 // Sets the User Array with the list of users to be enumerated on the logon screen.
 HRESULT GEWISUnlockProvider::SetUserArray(_In_ ICredentialProviderUserArray* users)
 {
+    TRACE_FUNCTION();
     if (_pCredProviderUserArray)
     {
         _pCredProviderUserArray->Release();
@@ -213,6 +303,7 @@ void GEWISUnlockProvider::_ReleaseEnumeratedCredentials()
 {
     if (_pCredential != nullptr)
     {
+        _pCredential->SetProviderEvents(nullptr, 0);
         _pCredential->Release();
         _pCredential = nullptr;
     }
@@ -235,7 +326,11 @@ HRESULT GEWISUnlockProvider::_EnumerateCredentials()
                 if (_pCredential != nullptr)
                 {
                     hr = _pCredential->Initialize(_cpus, s_rgCredProvFieldDescriptors, s_rgFieldStatePairs, pCredUser);
-                    if (FAILED(hr))
+                    if (SUCCEEDED(hr))
+                    {
+                        _pCredential->SetProviderEvents(_pCredProviderEvents, _upAdviseContext);
+                    }
+                    else
                     {
                         _pCredential->Release();
                         _pCredential = nullptr;
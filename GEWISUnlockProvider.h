@@ -82,5 +82,10 @@ private:
     bool                                    _fRecreateEnumeratedCredentials;
     CREDENTIAL_PROVIDER_USAGE_SCENARIO      _cpus;
     ICredentialProviderUserArray            *_pCredProviderUserArray;
+    ICredentialProviderEvents               *_pCredProviderEvents;      // Used to have LogonUI collect the result of a kick.
+    UINT_PTR                                _upAdviseContext;
+    LONGLONG                                _llUsageScenarioStart;     // Metrics::Now() at SetUsageScenario, for the time to the first tile.
+    bool                                    _fPrefetched;              // Whether SetUsageScenario started the WarmState prefetch.
+    bool                                    _fFirstTileReported;
 
 };
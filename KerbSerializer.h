@@ -0,0 +1,179 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Writes and reads packed KERB_INTERACTIVE_UNLOCK_LOGON buffers, the serialization LogonUI hands to LSA.
+//
+// A packed buffer is the struct followed by the domain, username and password, where the Buffer
+// member of each UNICODE_STRING holds the offset of the string from the start of the buffer instead
+// of a pointer. The struct looks different for 32-bit and 64-bit processes (a 32-bit credential
+// provider running under WOW64 produces the 32-bit one), so the layout is not taken from the compiler
+// but written out here field by field. That way one call writes the whole buffer, for either layout,
+// and converting between the two layouts is reading one and writing the other.
+//
+// Only standard C++ is used, so this header does not depend on the Windows SDK. All Windows targets
+// are little-endian, and so are the integers in the buffer.
+class KerbSerializer
+{
+public:
+    enum LAYOUT
+    {
+        KSL_32,     // 36 bytes: UNICODE_STRING is 8 bytes with a 32-bit Buffer.
+        KSL_64,     // 64 bytes: UNICODE_STRING is 16 bytes with a 64-bit Buffer, and MessageType is padded to 8 bytes.
+        KSL_NATIVE = sizeof(void*) == 8 ? KSL_64 : KSL_32,
+    };
+
+    // A string that is not null-terminated; cb is in bytes.
+    struct STRING
+    {
+        const void* pv;
+        uint16_t    cb;
+    };
+
+    struct LOGON
+    {
+        uint32_t    uMessageType;   // A KERB_LOGON_SUBMIT_TYPE.
+        STRING      domain;
+        STRING      username;
+        STRING      password;
+    };
+
+    static constexpr size_t GetHeaderSize(LAYOUT layout)
+    {
+        return layout == KSL_64 ? 64 : 36;
+    }
+
+    // The exact number of bytes Write needs. The strings are each shorter than 64 KB, so this does not overflow.
+    static size_t GetPackedSize(LAYOUT layout, const LOGON& logon)
+    {
+        return GetHeaderSize(layout) + logon.domain.cb + logon.username.cb + logon.password.cb;
+    }
+
+    // Writes logon into pb, which must be GetPackedSize(layout, logon) bytes. LogonId is left zero.
+    static void Write(LAYOUT layout, const LOGON& logon, uint8_t* pb)
+    {
+        size_t cbHeader = GetHeaderSize(layout);
+        memset(pb, 0, cbHeader);
+        _Write32(pb, logon.uMessageType);
+
+        size_t ibString = cbHeader;
+        const STRING* rgStrings[] = { &logon.domain, &logon.username, &logon.password };
+        for (size_t i = 0; i < 3; i++)
+        {
+            uint8_t* pbString = pb + _GetStringOffset(layout, i);
+            _Write16(pbString, rgStrings[i]->cb);       // Length
+            _Write16(pbString + 2, rgStrings[i]->cb);   // MaximumLength
+            if (layout == KSL_64)
+            {
+                _Write32(pbString + 8, static_cast<uint32_t>(ibString));
+            }
+            else
+            {
+                _Write32(pbString + 4, static_cast<uint32_t>(ibString));
+            }
+
+            if (rgStrings[i]->cb != 0)
+            {
+                memcpy(pb + ibString, rgStrings[i]->pv, rgStrings[i]->cb);
+            }
+            ibString += rgStrings[i]->cb;
+        }
+    }
+
+    // Why Read rejected a buffer.
+    enum RESULT
+    {
+        KSR_OK,
+        KSR_TOO_SMALL,          // The buffer is smaller than the struct.
+        KSR_ODD_LENGTH,         // Length or MaximumLength is not a whole number of UTF-16 characters.
+        KSR_BAD_LENGTH,         // Length is larger than MaximumLength.
+        KSR_MISALIGNED,         // A string does not start on a UTF-16 character boundary.
+        KSR_OUT_OF_RANGE,       // A string starts in the struct, ends past the buffer or has no offset but a length.
+        KSR_OVERLAP,            // Two strings share bytes.
+    };
+
+    // Reads and checks a packed buffer of cb bytes. The strings in *plogon point into pb, and are only
+    // filled in if the whole buffer is valid: each string (up to its MaximumLength) has to lie after
+    // the struct and within the buffer, start on an even offset, and not overlap another string.
+    static RESULT Read(LAYOUT layout, const uint8_t* pb, size_t cb, LOGON* plogon)
+    {
+        size_t cbHeader = GetHeaderSize(layout);
+        if (cb < cbHeader)
+        {
+            return KSR_TOO_SMALL;
+        }
+
+        uint64_t rgibStrings[3];
+        uint16_t rgcbStrings[3];
+        uint16_t rgcbMaxStrings[3];
+        for (size_t i = 0; i < 3; i++)
+        {
+            const uint8_t* pbString = pb + _GetStringOffset(layout, i);
+            rgcbStrings[i] = _Read16(pbString);
+            rgcbMaxStrings[i] = _Read16(pbString + 2);
+            rgibStrings[i] = layout == KSL_64 ? _Read64(pbString + 8) : _Read32(pbString + 4);
+
+            if ((rgcbStrings[i] | rgcbMaxStrings[i]) & 1)
+            {
+                return KSR_ODD_LENGTH;
+            }
+            if (rgcbStrings[i] > rgcbMaxStrings[i])
+            {
+                return KSR_BAD_LENGTH;
+            }
+            if (rgibStrings[i] & 1)
+            {
+                return KSR_MISALIGNED;
+            }
+
+            if (rgcbMaxStrings[i] == 0)
+            {
+                // An empty string may have any offset (usually 0 or the end of the previous string); it is not used
+                continue;
+            }
+
+            // Compared this way round so a huge offset cannot wrap around
+            if (rgibStrings[i] < cbHeader || rgibStrings[i] > cb || rgcbMaxStrings[i] > cb - rgibStrings[i])
+            {
+                return KSR_OUT_OF_RANGE;
+            }
+
+            for (size_t j = 0; j < i; j++)
+            {
+                if (rgcbMaxStrings[j] != 0 &&
+                    rgibStrings[i] < rgibStrings[j] + rgcbMaxStrings[j] &&
+                    rgibStrings[j] < rgibStrings[i] + rgcbMaxStrings[i])
+                {
+                    return KSR_OVERLAP;
+                }
+            }
+        }
+
+        plogon->uMessageType = _Read32(pb);
+        STRING* rgStrings[] = { &plogon->domain, &plogon->username, &plogon->password };
+        for (size_t i = 0; i < 3; i++)
+        {
+            rgStrings[i]->pv = rgcbMaxStrings[i] != 0 ? pb + rgibStrings[i] : nullptr;
+            rgStrings[i]->cb = rgcbStrings[i];
+        }
+        return KSR_OK;
+    }
+
+private:
+    // Offset of the i-th UNICODE_STRING (LogonDomainName, UserName, Password) in the struct.
+    static constexpr size_t _GetStringOffset(LAYOUT layout, size_t i)
+    {
+        return layout == KSL_64 ? 8 + 16 * i : 4 + 8 * i;
+    }
+
+    static void _Write16(uint8_t* pb, uint16_t u) { memcpy(pb, &u, sizeof(u)); }
+    static void _Write32(uint8_t* pb, uint32_t u) { memcpy(pb, &u, sizeof(u)); }
+    static uint16_t _Read16(const uint8_t* pb) { uint16_t u; memcpy(&u, pb, sizeof(u)); return u; }
+    static uint32_t _Read32(const uint8_t* pb) { uint32_t u; memcpy(&u, pb, sizeof(u)); return u; }
+    static uint64_t _Read64(const uint8_t* pb) { uint64_t u; memcpy(&u, pb, sizeof(u)); return u; }
+};
@@ -0,0 +1,188 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "LogoffTracker.h"
+
+LogoffTracker::LogoffTracker() :
+    _phase(LP_IDLE),
+    _ullStart(0),
+    _ullTimeout(0),
+    _ullDeadline(0)
+{
+}
+
+HRESULT LogoffTracker::Start(_In_ const ATL::CAtlArray<SESSION_INFO>& rgTargets, _In_ const ATL::CAtlArray<HRESULT>& rgIssued,
+    ULONGLONG ullNow, ULONGLONG ullTimeout)
+{
+    Reset();
+    if (!_rgTargets.SetCount(rgTargets.GetCount()))
+    {
+        return E_OUTOFMEMORY;
+    }
+    for (size_t i = 0; i < rgTargets.GetCount(); i++)
+    {
+        LOGOFF_TARGET& target = _rgTargets[i];
+        target.session = rgTargets[i];
+        target.state = (i < rgIssued.GetCount() && SUCCEEDED(rgIssued[i])) ? LS_PENDING : LS_FAILED;
+        target.fForced = false;
+        target.ullDuration = 0;
+    }
+
+    _phase = LP_WAITING;
+    _ullStart = ullNow;
+    _ullTimeout = ullTimeout;
+    _ullDeadline = ullNow + ullTimeout;
+    _FinishIfDone();
+    return S_OK;
+}
+
+bool LogoffTracker::OnSignedOut(DWORD dwSessionId, ULONGLONG ullNow)
+{
+    bool fFound = false;
+    for (size_t i = 0; i < _rgTargets.GetCount(); i++)
+    {
+        // A session that signs out after we stopped waiting (LS_TIMED_OUT) stays timed out; it was already reported
+        LOGOFF_TARGET& target = _rgTargets[i];
+        if (target.session.dwSessionId == dwSessionId && target.state == LS_PENDING)
+        {
+            target.state = LS_SIGNED_OUT;
+            target.ullDuration = ullNow - _ullStart;
+            fFound = true;
+        }
+    }
+    _FinishIfDone();
+    return fFound;
+}
+
+size_t LogoffTracker::Poll(_In_ SessionSource* pSource, ULONGLONG ullNow)
+{
+    size_t cSignedOut = 0;
+    for (size_t i = 0; i < _rgTargets.GetCount(); i++)
+    {
+        const LOGOFF_TARGET& target = _rgTargets[i];
+        SESSION_INFO session;
+        if (target.state == LS_PENDING &&
+            (FAILED(pSource->Query(target.session.dwSessionId, &session)) || session.strUser != target.session.strUser) &&
+            OnSignedOut(target.session.dwSessionId, ullNow))
+        {
+            cSignedOut++;
+        }
+    }
+    return cSignedOut;
+}
+
+void LogoffTracker::OnTick(ULONGLONG ullNow)
+{
+    if (ullNow < _ullDeadline)
+    {
+        return;
+    }
+
+    if (_phase == LP_WAITING)
+    {
+        _phase = LP_TIMED_OUT;
+    }
+    else if (_phase == LP_FORCING)
+    {
+        // Even without its applications it did not go; there is nothing more we can do
+        Abandon();
+    }
+}
+
+void LogoffTracker::Force(ULONGLONG ullNow)
+{
+    if (_phase != LP_TIMED_OUT)
+    {
+        return;
+    }
+    for (size_t i = 0; i < _rgTargets.GetCount(); i++)
+    {
+        if (_rgTargets[i].state == LS_PENDING)
+        {
+            _rgTargets[i].fForced = true;
+        }
+    }
+    _phase = LP_FORCING;
+    _ullDeadline = ullNow + _ullTimeout;
+}
+
+void LogoffTracker::Abandon()
+{
+    if (_phase == LP_IDLE)
+    {
+        return;
+    }
+    for (size_t i = 0; i < _rgTargets.GetCount(); i++)
+    {
+        if (_rgTargets[i].state == LS_PENDING)
+        {
+            _rgTargets[i].state = LS_TIMED_OUT;
+        }
+    }
+    _phase = LP_FINISHED;
+}
+
+void LogoffTracker::Reset()
+{
+    _rgTargets.RemoveAll();
+    _phase = LP_IDLE;
+}
+
+size_t LogoffTracker::GetCount(LOGOFF_STATE state) const
+{
+    size_t c = 0;
+    for (size_t i = 0; i < _rgTargets.GetCount(); i++)
+    {
+        if (_rgTargets[i].state == state)
+        {
+            c++;
+        }
+    }
+    return c;
+}
+
+void LogoffTracker::GetUsers(LOGOFF_STATE state, _Out_ ATL::CStringW* pstrUsers) const
+{
+    pstrUsers->Empty();
+    for (size_t i = 0; i < _rgTargets.GetCount(); i++)
+    {
+        if (_rgTargets[i].state == state)
+        {
+            if (!pstrUsers->IsEmpty())
+            {
+                *pstrUsers += L", ";
+            }
+            *pstrUsers += _rgTargets[i].session.strUser;
+        }
+    }
+}
+
+void LogoffTracker::FormatProgress(ULONGLONG ullNow, _Out_ ATL::CStringW* pstrProgress) const
+{
+    ATL::CStringW strPending;
+    GetUsers(LS_PENDING, &strPending);
+    ULONGLONG ullSeconds = (ullNow - _ullStart) / 1000;
+
+    if (_phase == LP_FORCING)
+    {
+        pstrProgress->Format(L"Closing the remaining applications of %s (%llu s)...", strPending.GetString(), ullSeconds);
+    }
+    else if (_rgTargets.GetCount() == 1)
+    {
+        pstrProgress->Format(L"Signing out %s (%llu s)...", strPending.GetString(), ullSeconds);
+    }
+    else
+    {
+        pstrProgress->Format(L"Signing out %Iu of %Iu sessions, waiting for %s (%llu s)...",
+            GetCount(LS_PENDING), _rgTargets.GetCount(), strPending.GetString(), ullSeconds);
+    }
+}
+
+void LogoffTracker::_FinishIfDone()
+{
+    if ((_phase == LP_WAITING || _phase == LP_TIMED_OUT || _phase == LP_FORCING) && GetCount(LS_PENDING) == 0)
+    {
+        _phase = LP_FINISHED;
+    }
+}
@@ -0,0 +1,100 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+#include "SessionSource.h"
+
+// Where one session is in signing out.
+enum LOGOFF_STATE
+{
+    LS_PENDING,     // Asked to sign out, but still there.
+    LS_SIGNED_OUT,
+    LS_FAILED,      // Could not even be asked to sign out.
+    LS_TIMED_OUT,   // Still there when we stopped waiting.
+};
+
+// Where the sign-out as a whole is.
+enum LOGOFF_PHASE
+{
+    LP_IDLE,
+    LP_WAITING,     // Waiting for the sessions to sign out.
+    LP_TIMED_OUT,   // Some sessions did not sign out in time; waiting for the room responsible to decide whether to force them.
+    LP_FORCING,     // The remaining processes of those sessions were terminated; waiting for them once more.
+    LP_FINISHED,
+};
+
+struct LOGOFF_TARGET
+{
+    SESSION_INFO    session;
+    LOGOFF_STATE    state;
+    bool            fForced;        // Its remaining processes were terminated.
+    ULONGLONG       ullDuration;    // From Start until it signed out.
+};
+
+// Follows a sign-out of several sessions that was started without waiting for it (WTSLogoffSession with bWait
+// set to FALSE), so nothing blocks on an application that hangs while closing.
+//
+// This only keeps the state; the owner feeds it with what happened and the time, and acts on the phase:
+// OnSignedOut when a session is gone (a WTS_SESSION_LOGOFF notification), Poll and OnTick regularly to see the
+// sessions that went without one and to check the deadline. Times are in milliseconds of any clock.
+class LogoffTracker
+{
+public:
+    LogoffTracker();
+
+    // Starts following rgTargets. rgIssued holds, for each of them, whether asking it to sign out worked.
+    HRESULT Start(_In_ const ATL::CAtlArray<SESSION_INFO>& rgTargets, _In_ const ATL::CAtlArray<HRESULT>& rgIssued,
+        ULONGLONG ullNow, ULONGLONG ullTimeout);
+
+    // Returns whether dwSessionId was one of the sessions we were waiting for.
+    bool OnSignedOut(DWORD dwSessionId, ULONGLONG ullNow);
+
+    // Asks pSource about every pending session, in case its notification was missed or could not be registered for:
+    // a session is gone once Query fails or someone else is signed in to it. Returns how many sessions signed out.
+    size_t Poll(_In_ SessionSource* pSource, ULONGLONG ullNow);
+
+    void OnTick(ULONGLONG ullNow);
+
+    // In LP_TIMED_OUT: the owner terminates the remaining processes of the pending sessions, and we wait for them again.
+    void Force(ULONGLONG ullNow);
+
+    // Stops waiting; the pending sessions have timed out.
+    void Abandon();
+
+    // Back to LP_IDLE, forgetting the targets.
+    void Reset();
+
+    LOGOFF_PHASE GetPhase() const
+    {
+        return _phase;
+    }
+
+    size_t GetCount() const
+    {
+        return _rgTargets.GetCount();
+    }
+
+    const LOGOFF_TARGET& GetTarget(size_t i) const
+    {
+        return _rgTargets[i];
+    }
+
+    size_t GetCount(LOGOFF_STATE state) const;
+
+    // The users of the sessions in state, separated by ", ".
+    void GetUsers(LOGOFF_STATE state, _Out_ ATL::CStringW* pstrUsers) const;
+
+    // For the status field, e.g. "Signing out 1 of 3 sessions, waiting for GEWISWG\m1234 (12 s)...".
+    void FormatProgress(ULONGLONG ullNow, _Out_ ATL::CStringW* pstrProgress) const;
+
+private:
+    void _FinishIfDone();
+
+    ATL::CAtlArray<LOGOFF_TARGET>   _rgTargets;
+    LOGOFF_PHASE                    _phase;
+    ULONGLONG                       _ullStart;
+    ULONGLONG                       _ullTimeout;
+    ULONGLONG                       _ullDeadline;   // Of the current wait (LP_WAITING or LP_FORCING).
+};
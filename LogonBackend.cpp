@@ -0,0 +1,17 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "LogonBackend.h"
+
+HRESULT InteractiveLogonBackend::Logon(_In_opt_ PCWSTR pszDomain, _In_ PCWSTR pszUsername, _In_ PCWSTR pszPassword, _Inout_ ATL::CAccessToken* pToken)
+{
+    // If there are cases where the user that is unlcoking the workstation does not have "Log on to this workstation interactively" permissions (e.g. admin accounts)
+    // You may decide to perform a LOGON32_LOGON_NETWORK login (but that will exclude users who can't "Access this computer over the network")
+    // https://learn.microsoft.com/en-us/windows/win32/secauthz/account-rights-constants
+    if (!pToken->LogonUserW(pszUsername, pszDomain, pszPassword, LOGON32_LOGON_INTERACTIVE, LOGON32_PROVIDER_DEFAULT))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    return S_OK;
+}
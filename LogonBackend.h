@@ -0,0 +1,26 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+
+// How the room responsible is verified: a logon that gives a token, whose groups are then checked against the
+// authorized groups. The credential uses InteractiveLogonBackend; keeping this separate lets a kick be tried
+// without a real account (see GEWISUnlockHost --fake).
+class LogonBackend
+{
+public:
+    virtual ~LogonBackend() {}
+
+    // Logs on as the user and puts the token in pToken. pszDomain is null for a UPN. pszPassword may be
+    // protected with CredProtectW, as LogonUser accepts. Fails if the username or password is wrong.
+    virtual HRESULT Logon(_In_opt_ PCWSTR pszDomain, _In_ PCWSTR pszUsername, _In_ PCWSTR pszPassword, _Inout_ ATL::CAccessToken* pToken) = 0;
+};
+
+// An interactive logon through LogonUser, so the room responsible needs "Allow log on locally" on this machine.
+class InteractiveLogonBackend : public LogonBackend
+{
+public:
+    HRESULT Logon(_In_opt_ PCWSTR pszDomain, _In_ PCWSTR pszUsername, _In_ PCWSTR pszPassword, _Inout_ ATL::CAccessToken* pToken) override;
+};
@@ -0,0 +1,252 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "Metrics.h"
+#include "Dll.h"
+
+static const DWORD s_dwExportPeriodMs = 15 * 1000;
+
+const LONGLONG Metrics::s_rgllBucketBounds[Metrics::s_cBucketBounds] =
+{
+    100, 250, 500,
+    1000, 2500, 5000,
+    10000, 25000, 50000,
+    100000, 250000, 500000,
+    1000000, 2500000, 5000000,
+    10000000, 30000000, 60000000,
+};
+
+static const struct
+{
+    PCSTR pszName;
+    PCSTR pszHelp;
+} s_rgHistogramInfo[MH_COUNT] =
+{
+    { "gewisunlock_logon_duration_seconds", "Time LogonUser took to verify a room responsible." },
+    { "gewisunlock_group_check_duration_seconds", "Time taken to check the groups of a room responsible." },
+    { "gewisunlock_process_scan_duration_seconds", "Time taken to look for running protected applications." },
+    { "gewisunlock_logoff_duration_seconds", "Time from asking a session to sign out until it was gone." },
+    { "gewisunlock_first_tile_duration_seconds", "Time from SetUsageScenario until the tile was handed to LogonUI, with prefetching." },
+    { "gewisunlock_first_tile_cold_duration_seconds", "Time from SetUsageScenario until the tile was handed to LogonUI, without prefetching." },
+};
+
+static const struct
+{
+    PCSTR pszName;
+    PCSTR pszHelp;
+} s_rgCounterInfo[MC_COUNT] =
+{
+    { "gewisunlock_kicks_total", "Users that were signed out." },
+    { "gewisunlock_denials_total", "Kicks refused because the room responsible did not have the rights." },
+    { "gewisunlock_protected_blocked_total", "Kicks stopped because a protected application was running." },
+    { "gewisunlock_errors_total", "Kicks that failed." },
+    { "gewisunlock_reclaimed_total", "Sessions signed out automatically because they were locked for too long." },
+    { "gewisunlock_apps_closed_total", "Protected applications that closed when asked before signing out." },
+    { "gewisunlock_apps_terminated_total", "Protected applications that were terminated because they did not close in time." },
+};
+
+Metrics& Metrics::Instance()
+{
+    static Metrics s_metrics;
+    return s_metrics;
+}
+
+Metrics::Metrics() :
+    _rgHistograms(),
+    _rgllCounters(),
+    _llChanges(0),
+    _llExportedChanges(-1),
+    _dwSessionId(0),
+    _cUsers(0),
+    _pTimer(nullptr)
+{
+    InitializeSRWLock(&_exportLock);
+    InitializeSRWLock(&_usersLock);
+    ProcessIdToSessionId(GetCurrentProcessId(), &_dwSessionId);
+}
+
+Metrics::~Metrics()
+{
+    // The timer is closed by the last Release
+}
+
+void Metrics::AddRef()
+{
+    AcquireSRWLockExclusive(&_usersLock);
+    if (_cUsers++ == 0)
+    {
+        TP_CALLBACK_ENVIRON callbackEnviron;
+        InitializeThreadpoolEnvironment(&callbackEnviron);
+        SetThreadpoolCallbackLibrary(&callbackEnviron, HINST_THISDLL);
+        _pTimer = CreateThreadpoolTimer(_ExportCallback, this, &callbackEnviron);
+        DestroyThreadpoolEnvironment(&callbackEnviron);
+
+        // Without the timer, the metrics are still exported by the last Release
+        if (_pTimer != nullptr)
+        {
+            ULARGE_INTEGER uliDueTime;
+            uliDueTime.QuadPart = static_cast<ULONGLONG>(-static_cast<LONGLONG>(s_dwExportPeriodMs) * 10000);
+            FILETIME ftDueTime;
+            ftDueTime.dwHighDateTime = uliDueTime.HighPart;
+            ftDueTime.dwLowDateTime = uliDueTime.LowPart;
+            SetThreadpoolTimer(_pTimer, &ftDueTime, s_dwExportPeriodMs, s_dwExportPeriodMs / 10);
+        }
+    }
+    ReleaseSRWLockExclusive(&_usersLock);
+}
+
+void Metrics::Release()
+{
+    AcquireSRWLockExclusive(&_usersLock);
+    if (_cUsers > 0 && --_cUsers == 0)
+    {
+        if (_pTimer != nullptr)
+        {
+            SetThreadpoolTimer(_pTimer, nullptr, 0, 0);
+            WaitForThreadpoolTimerCallbacks(_pTimer, TRUE);
+            CloseThreadpoolTimer(_pTimer);
+            _pTimer = nullptr;
+        }
+
+        // Do not lose what happened since the last export (e.g. the kick that just finished)
+        _Export();
+    }
+    ReleaseSRWLockExclusive(&_usersLock);
+}
+
+LONGLONG Metrics::Now()
+{
+    LARGE_INTEGER li;
+    QueryPerformanceCounter(&li);
+    return li.QuadPart;
+}
+
+void Metrics::ObserveSince(METRIC_HISTOGRAM histogram, LONGLONG llStart)
+{
+    static LONGLONG s_llFrequency = 0;
+    if (s_llFrequency == 0)
+    {
+        LARGE_INTEGER li;
+        QueryPerformanceFrequency(&li);
+        s_llFrequency = li.QuadPart;
+    }
+    LONGLONG llMicroseconds = (Now() - llStart) * 1000000 / s_llFrequency;
+
+    size_t iBucket = 0;
+    while (iBucket < s_cBucketBounds && llMicroseconds > s_rgllBucketBounds[iBucket])
+    {
+        iBucket++;
+    }
+
+    HISTOGRAM& hist = _rgHistograms[histogram];
+    InterlockedIncrement64(&hist.rgcBuckets[iBucket]);
+    InterlockedAdd64(&hist.llSumMicroseconds, llMicroseconds);
+    InterlockedIncrement64(&_llChanges);
+}
+
+void Metrics::Increment(METRIC_COUNTER counter)
+{
+    InterlockedIncrement64(&_rgllCounters[counter]);
+    InterlockedIncrement64(&_llChanges);
+}
+
+VOID CALLBACK Metrics::_ExportCallback(_Inout_ PTP_CALLBACK_INSTANCE /*pInstance*/, _Inout_opt_ PVOID pContext, _Inout_ PTP_TIMER /*pTimer*/)
+{
+    static_cast<Metrics*>(pContext)->_Export();
+}
+
+// Writes the metrics to the file, if they changed since the last time.
+HRESULT Metrics::_Export()
+{
+    AcquireSRWLockExclusive(&_exportLock);
+    LONG64 llChanges = _llChanges;
+    if (llChanges == _llExportedChanges)
+    {
+        ReleaseSRWLockExclusive(&_exportLock);
+        return S_FALSE;
+    }
+
+    ATL::CStringW strDirectory;
+    HRESULT hr = GetDataDirectory(L"metrics", &strDirectory);
+    ATL::CStringA strText;
+    if (SUCCEEDED(hr))
+    {
+        hr = _Format(&strText);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        ATL::CStringW strFile;
+        strFile.Format(L"%s\\gewisunlock_session%lu.prom", strDirectory.GetString(), _dwSessionId);
+        ATL::CStringW strTempFile = strFile + L".tmp";
+
+        HANDLE hFile = CreateFileW(strTempFile, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (hFile != INVALID_HANDLE_VALUE)
+        {
+            DWORD cbWritten;
+            if (!WriteFile(hFile, strText.GetString(), static_cast<DWORD>(strText.GetLength()), &cbWritten, nullptr))
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+            }
+            CloseHandle(hFile);
+
+            if (SUCCEEDED(hr) && !MoveFileExW(strTempFile, strFile, MOVEFILE_REPLACE_EXISTING))
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+            }
+            if (FAILED(hr))
+            {
+                DeleteFileW(strTempFile);
+            }
+        }
+        else
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        _llExportedChanges = llChanges;
+    }
+    ReleaseSRWLockExclusive(&_exportLock);
+    return hr;
+}
+
+// Formats the metrics in the Prometheus text exposition format.
+HRESULT Metrics::_Format(_Out_ ATL::CStringA* pstrText)
+{
+    pstrText->Empty();
+    for (size_t i = 0; i < MH_COUNT; i++)
+    {
+        const HISTOGRAM& hist = _rgHistograms[i];
+        PCSTR pszName = s_rgHistogramInfo[i].pszName;
+        pstrText->AppendFormat("# HELP %s %s\n# TYPE %s histogram\n", pszName, s_rgHistogramInfo[i].pszHelp, pszName);
+
+        // The buckets are read one at a time, so the total may be a little behind a bucket that changes meanwhile
+        LONG64 cTotal = 0;
+        for (size_t iBucket = 0; iBucket <= s_cBucketBounds; iBucket++)
+        {
+            cTotal += hist.rgcBuckets[iBucket];
+            if (iBucket < s_cBucketBounds)
+            {
+                pstrText->AppendFormat("%s_bucket{session=\"%lu\",le=\"%g\"} %lld\n", pszName, _dwSessionId, s_rgllBucketBounds[iBucket] / 1e6, cTotal);
+            }
+            else
+            {
+                pstrText->AppendFormat("%s_bucket{session=\"%lu\",le=\"+Inf\"} %lld\n", pszName, _dwSessionId, cTotal);
+            }
+        }
+        pstrText->AppendFormat("%s_sum{session=\"%lu\"} %.6f\n", pszName, _dwSessionId, hist.llSumMicroseconds / 1e6);
+        pstrText->AppendFormat("%s_count{session=\"%lu\"} %lld\n", pszName, _dwSessionId, cTotal);
+    }
+
+    for (size_t i = 0; i < MC_COUNT; i++)
+    {
+        PCSTR pszName = s_rgCounterInfo[i].pszName;
+        pstrText->AppendFormat("# HELP %s %s\n# TYPE %s counter\n%s{session=\"%lu\"} %lld\n",
+            pszName, s_rgCounterInfo[i].pszHelp, pszName, pszName, _dwSessionId, _rgllCounters[i]);
+    }
+    return S_OK;
+}
@@ -0,0 +1,85 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+
+// The latencies that are measured, each in a histogram.
+enum METRIC_HISTOGRAM
+{
+    MH_LOGON,           // LogonUser for the room responsible.
+    MH_GROUP_CHECK,     // Reading the groups of the room responsible and looking them up.
+    MH_PROCESS_SCAN,    // Looking for running protected applications when a kick is submitted; the watcher's lookups do not count.
+    MH_LOGOFF,          // From asking a session to sign out until it is gone.
+    MH_FIRST_TILE,      // From SetUsageScenario until LogonUI has our tile, with prefetching.
+    MH_FIRST_TILE_COLD, // Likewise, with prefetching turned off.
+    MH_COUNT,
+};
+
+// The events that are counted.
+enum METRIC_COUNTER
+{
+    MC_KICKS,               // Users that were signed out.
+    MC_DENIALS,             // Kicks refused because the room responsible lacked the rights.
+    MC_PROTECTED_BLOCKED,   // Kicks stopped because a protected application was running and the box was not checked.
+    MC_ERRORS,              // Kicks that failed, e.g. because signing out did not work.
+    MC_RECLAIMED,           // Sessions signed out automatically because they were locked for too long.
+    MC_APPS_CLOSED,         // Protected applications that closed by themselves before their session was signed out.
+    MC_APPS_TERMINATED,     // Protected applications that did not close in time and were terminated.
+    MC_COUNT,
+};
+
+// Always-on counters and latency histograms, written to a Prometheus text file so the node monitoring
+// (node_exporter's textfile collector) can pick them up.
+//
+// Updating a metric is a few interlocked operations on process-wide counters. While a provider exists,
+// a threadpool timer writes all metrics every 15 seconds (if anything changed) to
+// %ProgramData%\GEWISUnlock\metrics\gewisunlock_session<N>.prom, where N is the session of this LogonUI.
+// The file is written under another name first and then renamed, so a scrape never sees half a file.
+class Metrics
+{
+public:
+    static Metrics& Instance();
+
+    // The provider keeps the exporter running with AddRef/Release.
+    void AddRef();
+    void Release();
+
+    // A timestamp to pass to ObserveSince.
+    static LONGLONG Now();
+
+    // Adds the time since llStart (from Now) to the histogram.
+    void ObserveSince(METRIC_HISTOGRAM histogram, LONGLONG llStart);
+
+    void Increment(METRIC_COUNTER counter);
+
+private:
+    Metrics();
+    ~Metrics();
+
+    // Upper bounds of the histogram buckets in microseconds; a last bucket counts everything above.
+    static const size_t s_cBucketBounds = 18;
+    static const LONGLONG s_rgllBucketBounds[s_cBucketBounds];
+
+    struct HISTOGRAM
+    {
+        volatile LONG64 rgcBuckets[s_cBucketBounds + 1];    // Not cumulative, unlike in the exported file.
+        volatile LONG64 llSumMicroseconds;
+    };
+
+    static VOID CALLBACK _ExportCallback(_Inout_ PTP_CALLBACK_INSTANCE pInstance, _Inout_opt_ PVOID pContext, _Inout_ PTP_TIMER pTimer);
+    HRESULT _Export();
+    HRESULT _Format(_Out_ ATL::CStringA* pstrText);
+
+    HISTOGRAM           _rgHistograms[MH_COUNT];
+    volatile LONG64     _rgllCounters[MC_COUNT];
+    volatile LONG64     _llChanges;             // Incremented on every update, to skip exports when nothing changed.
+    LONG64              _llExportedChanges;     // _llChanges at the last export; guarded by _exportLock.
+    DWORD               _dwSessionId;
+
+    SRWLOCK             _exportLock;            // Serializes exports.
+    SRWLOCK             _usersLock;             // Guards _cUsers and _pTimer.
+    long                _cUsers;
+    PTP_TIMER           _pTimer;
+};
@@ -0,0 +1,427 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "ProcessIndex.h"
+#include "Dll.h"
+#include <wtsapi32.h>
+#pragma comment(lib, "wtsapi32.lib")
+
+// Process start/stop notifications come from WMI
+#include <wbemidl.h>
+#include <atlbase.h>
+#pragma comment(lib, "wbemuuid.lib")
+
+// How long the watcher thread waits for an event before checking whether it should stop.
+static const long s_msEventWaitInterval = 250;
+
+ProcessIndex& ProcessIndex::Instance()
+{
+    static ProcessIndex s_index;
+    return s_index;
+}
+
+ProcessIndex::ProcessIndex() :
+    _fLive(false),
+    _cUsers(0),
+    _hThread(nullptr),
+    _hStopEvent(nullptr)
+{
+    InitializeSRWLock(&_lock);
+    InitializeSRWLock(&_usersLock);
+}
+
+ProcessIndex::~ProcessIndex()
+{
+    // The watcher thread is stopped by the last Release; by the time the DLL is unloaded
+    // there is nothing left to wait for (and we could not wait under the loader lock anyway).
+    if (_hThread != nullptr)
+    {
+        CloseHandle(_hThread);
+    }
+    if (_hStopEvent != nullptr)
+    {
+        CloseHandle(_hStopEvent);
+    }
+}
+
+void ProcessIndex::AddRef()
+{
+    AcquireSRWLockExclusive(&_usersLock);
+    if (_cUsers++ == 0)
+    {
+        // If the watcher cannot be started, FindRunning falls back to snapshots.
+        _Start();
+    }
+    ReleaseSRWLockExclusive(&_usersLock);
+}
+
+void ProcessIndex::Release()
+{
+    AcquireSRWLockExclusive(&_usersLock);
+    if (_cUsers > 0 && --_cUsers == 0)
+    {
+        _Stop();
+    }
+    ReleaseSRWLockExclusive(&_usersLock);
+}
+
+void ProcessIndex::FoldExeName(_In_ PCWSTR pszExeName, _Out_ ATL::CStringW* pstrFolded)
+{
+    *pstrFolded = pszExeName;
+    int cchFolded = pstrFolded->GetLength();
+    CharUpperBuffW(pstrFolded->GetBuffer(), static_cast<DWORD>(cchFolded));
+    pstrFolded->ReleaseBuffer(cchFolded);
+}
+
+bool ProcessIndex::IsLive()
+{
+    AcquireSRWLockShared(&_lock);
+    bool fLive = _fLive;
+    ReleaseSRWLockShared(&_lock);
+    return fLive;
+}
+
+HRESULT ProcessIndex::FindRunning(_In_ const CProtectedAppMap& apps, _Inout_ ATL::CAtlArray<RUNNING_APP>* prgRunning)
+{
+    HRESULT hr = S_OK;
+
+    AcquireSRWLockShared(&_lock);
+    bool fLive = _fLive;
+    ReleaseSRWLockShared(&_lock);
+
+    if (fLive)
+    {
+        AcquireSRWLockShared(&_lock);
+    }
+    else
+    {
+        // Nobody is keeping the index current, so we have to look at the process table ourselves.
+        AcquireSRWLockExclusive(&_lock);
+        hr = _BuildFromSnapshot();
+    }
+
+    for (POSITION posSession = SUCCEEDED(hr) ? _sessionCounts.GetStartPosition() : nullptr; posSession != nullptr; )
+    {
+        const CSessionCountMap::CPair* pSession = _sessionCounts.GetNext(posSession);
+        for (POSITION pos = pSession->m_value->GetStartPosition(); pos != nullptr; )
+        {
+            const CRunningCountMap::CPair* pRunning = pSession->m_value->GetNext(pos);
+            const CProtectedAppMap::CPair* pApp = apps.Lookup(pRunning->m_key);
+            if (pApp != nullptr)
+            {
+                RUNNING_APP app;
+                app.dwSessionId = pSession->m_key;
+                app.strName = pApp->m_value;
+                prgRunning->Add(app);
+            }
+        }
+    }
+
+    if (fLive)
+    {
+        ReleaseSRWLockShared(&_lock);
+    }
+    else
+    {
+        ReleaseSRWLockExclusive(&_lock);
+    }
+
+    return hr;
+}
+
+void ProcessIndex::AddChangeEvent(_In_ HANDLE hChanged)
+{
+    AcquireSRWLockExclusive(&_lock);
+    _changeEvents.Add(hChanged);
+    ReleaseSRWLockExclusive(&_lock);
+}
+
+void ProcessIndex::RemoveChangeEvent(_In_ HANDLE hChanged)
+{
+    AcquireSRWLockExclusive(&_lock);
+    for (size_t i = 0; i < _changeEvents.GetCount(); i++)
+    {
+        if (_changeEvents[i] == hChanged)
+        {
+            _changeEvents.RemoveAt(i);
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&_lock);
+}
+
+// The caller must hold _lock.
+void ProcessIndex::_SignalChanged()
+{
+    for (size_t i = 0; i < _changeEvents.GetCount(); i++)
+    {
+        SetEvent(_changeEvents[i]);
+    }
+}
+
+HRESULT ProcessIndex::_Start()
+{
+    HRESULT hr = S_OK;
+    if (_hThread == nullptr)
+    {
+        _hStopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        if (_hStopEvent != nullptr)
+        {
+            // The watcher thread runs our code, so the DLL must stay loaded while it exists.
+            DllAddRef();
+            _hThread = CreateThread(nullptr, 0, _WatcherThreadProc, this, 0, nullptr);
+            if (_hThread == nullptr)
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+                DllRelease();
+                CloseHandle(_hStopEvent);
+                _hStopEvent = nullptr;
+            }
+        }
+        else
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+    return hr;
+}
+
+void ProcessIndex::_Stop()
+{
+    if (_hThread != nullptr)
+    {
+        SetEvent(_hStopEvent);
+        WaitForSingleObject(_hThread, INFINITE);
+        CloseHandle(_hThread);
+        CloseHandle(_hStopEvent);
+        _hThread = nullptr;
+        _hStopEvent = nullptr;
+    }
+}
+
+// Replaces the contents of the index with a fresh snapshot of the processes, which also tells in which session
+// each of them runs. The caller must hold _lock exclusively.
+HRESULT ProcessIndex::_BuildFromSnapshot()
+{
+    PWTS_PROCESS_INFOW pProcesses;
+    DWORD cProcesses;
+    if (!WTSEnumerateProcessesW(WTS_CURRENT_SERVER_HANDLE, 0, 1, &pProcesses, &cProcesses))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    _processes.RemoveAll();
+    _sessionCounts.RemoveAll();
+
+    PROCESS_ENTRY entry;
+    for (DWORD i = 0; i < cProcesses; i++)
+    {
+        // The System Idle Process has no name
+        FoldExeName(pProcesses[i].pProcessName != nullptr ? pProcesses[i].pProcessName : L"", &entry.strFolded);
+        entry.dwSessionId = pProcesses[i].SessionId;
+        _processes.SetAt(pProcesses[i].ProcessId, entry);
+        _AddRunning(entry.dwSessionId, entry.strFolded);
+    }
+
+    WTSFreeMemory(pProcesses);
+    return S_OK;
+}
+
+// Counts one more running instance of a case-folded executable name in a session, and returns whether it is the first
+// one there. The caller must hold _lock exclusively.
+bool ProcessIndex::_AddRunning(DWORD dwSessionId, _In_ const ATL::CStringW& strFolded)
+{
+    CSessionCountMap::CPair* pSession = _sessionCounts.Lookup(dwSessionId);
+    if (pSession == nullptr)
+    {
+        ATL::CAutoPtr<CRunningCountMap> pCounts(new(std::nothrow) CRunningCountMap());
+        if (pCounts == nullptr)
+        {
+            return false;
+        }
+        pSession = _sessionCounts.GetAt(_sessionCounts.SetAt(dwSessionId, pCounts));
+    }
+
+    CRunningCountMap::CPair* pCount = pSession->m_value->Lookup(strFolded);
+    if (pCount != nullptr)
+    {
+        ++pCount->m_value;
+        return false;
+    }
+    pSession->m_value->SetAt(strFolded, 1);
+    return true;
+}
+
+void ProcessIndex::_OnProcessStarted(DWORD dwProcessId, DWORD dwSessionId, _In_ PCWSTR pszExeName)
+{
+    PROCESS_ENTRY entry;
+    FoldExeName(pszExeName, &entry.strFolded);
+    entry.dwSessionId = dwSessionId;
+
+    AcquireSRWLockExclusive(&_lock);
+    // A process that started between subscribing and taking the snapshot is reported twice.
+    if (_processes.Lookup(dwProcessId) == nullptr)
+    {
+        _processes.SetAt(dwProcessId, entry);
+        if (_AddRunning(dwSessionId, entry.strFolded))
+        {
+            _SignalChanged();
+        }
+    }
+    ReleaseSRWLockExclusive(&_lock);
+}
+
+void ProcessIndex::_OnProcessStopped(DWORD dwProcessId)
+{
+    AcquireSRWLockExclusive(&_lock);
+    CProcessMap::CPair* pProcess = _processes.Lookup(dwProcessId);
+    if (pProcess != nullptr)
+    {
+        const PROCESS_ENTRY& entry = pProcess->m_value;
+        CSessionCountMap::CPair* pSession = _sessionCounts.Lookup(entry.dwSessionId);
+        CRunningCountMap::CPair* pCount = pSession != nullptr ? pSession->m_value->Lookup(entry.strFolded) : nullptr;
+        if (pCount != nullptr && --pCount->m_value == 0)
+        {
+            pSession->m_value->RemoveKey(entry.strFolded);
+            if (pSession->m_value->IsEmpty())
+            {
+                // The session is gone, or about to be; session IDs are reused
+                _sessionCounts.RemoveKey(entry.dwSessionId);
+            }
+            _SignalChanged();
+        }
+        _processes.RemoveKey(dwProcessId);
+    }
+    ReleaseSRWLockExclusive(&_lock);
+}
+
+DWORD WINAPI ProcessIndex::_WatcherThreadProc(_In_ LPVOID lpParameter)
+{
+    ProcessIndex* pIndex = static_cast<ProcessIndex*>(lpParameter);
+    HRESULT hr = pIndex->_WatchProcessEvents();
+
+    // Whatever happened, the index is no longer being kept current.
+    AcquireSRWLockExclusive(&pIndex->_lock);
+    pIndex->_fLive = false;
+    pIndex->_SignalChanged();
+    ReleaseSRWLockExclusive(&pIndex->_lock);
+
+    DllRelease();
+    return static_cast<DWORD>(hr);
+}
+
+// Returns the session of a process that just started, for when Win32_ProcessStartTrace does not say.
+static DWORD _GetProcessSessionId(DWORD dwProcessId, _In_ const VARIANT& varSessionId)
+{
+    // Converting an empty value would give session 0
+    ATL::CComVariant varConverted;
+    if (varSessionId.vt != VT_EMPTY && varSessionId.vt != VT_NULL && SUCCEEDED(varConverted.ChangeType(VT_UI4, &varSessionId)))
+    {
+        return varConverted.ulVal;
+    }
+
+    // If the process is gone already, it does not matter where it ran
+    DWORD dwSessionId;
+    return ProcessIdToSessionId(dwProcessId, &dwSessionId) ? dwSessionId : WTS_CURRENT_SESSION;
+}
+
+// Returns the executable name (without path) of a running process. Win32_ProcessStartTrace only gives us
+// the kernel's image name, which is truncated to 15 characters, so we prefer asking the process itself.
+static void _GetProcessExeName(DWORD dwProcessId, _In_ PCWSTR pszTraceName, _Out_ ATL::CStringW* pstrExeName)
+{
+    *pstrExeName = pszTraceName;
+
+    HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, dwProcessId);
+    if (hProcess != nullptr)
+    {
+        WCHAR szImagePath[MAX_PATH];
+        DWORD cchImagePath = ARRAYSIZE(szImagePath);
+        if (QueryFullProcessImageNameW(hProcess, 0, szImagePath, &cchImagePath))
+        {
+            *pstrExeName = PathFindFileNameW(szImagePath);
+        }
+        CloseHandle(hProcess);
+    }
+}
+
+// Subscribes to process start/stop events, builds the index and keeps it current until _hStopEvent is set.
+HRESULT ProcessIndex::_WatchProcessEvents()
+{
+    HRESULT hr = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+    if (SUCCEEDED(hr))
+    {
+        ATL::CComPtr<IWbemLocator> pLocator;
+        hr = pLocator.CoCreateInstance(CLSID_WbemLocator, nullptr, CLSCTX_INPROC_SERVER);
+        if (SUCCEEDED(hr))
+        {
+            ATL::CComPtr<IWbemServices> pServices;
+            hr = pLocator->ConnectServer(ATL::CComBSTR(L"ROOT\\CIMV2"), nullptr, nullptr, nullptr, 0, nullptr, nullptr, &pServices);
+            if (SUCCEEDED(hr))
+            {
+                hr = CoSetProxyBlanket(pServices, RPC_C_AUTHN_WINNT, RPC_C_AUTHZ_NONE, nullptr,
+                    RPC_C_AUTHN_LEVEL_CALL, RPC_C_IMP_LEVEL_IMPERSONATE, nullptr, EOAC_NONE);
+            }
+            if (SUCCEEDED(hr))
+            {
+                // Win32_ProcessTrace is the base class of both Win32_ProcessStartTrace and Win32_ProcessStopTrace
+                ATL::CComPtr<IEnumWbemClassObject> pEvents;
+                hr = pServices->ExecNotificationQuery(ATL::CComBSTR(L"WQL"), ATL::CComBSTR(L"SELECT * FROM Win32_ProcessTrace"),
+                    WBEM_FLAG_RETURN_IMMEDIATELY | WBEM_FLAG_FORWARD_ONLY, nullptr, &pEvents);
+                if (SUCCEEDED(hr))
+                {
+                    // Only take the snapshot once we are subscribed, so no process can slip through in between.
+                    AcquireSRWLockExclusive(&_lock);
+                    hr = _BuildFromSnapshot();
+                    _fLive = SUCCEEDED(hr);
+                    _SignalChanged();
+                    ReleaseSRWLockExclusive(&_lock);
+
+                    while (SUCCEEDED(hr) && WaitForSingleObject(_hStopEvent, 0) == WAIT_TIMEOUT)
+                    {
+                        ATL::CComPtr<IWbemClassObject> pEvent;
+                        ULONG cReturned = 0;
+                        hr = pEvents->Next(s_msEventWaitInterval, 1, &pEvent, &cReturned);
+                        if (WBEM_S_TIMEDOUT == hr)
+                        {
+                            hr = S_OK;
+                        }
+                        else if (SUCCEEDED(hr) && cReturned == 0)
+                        {
+                            // The subscription was cancelled from the other side.
+                            hr = E_ABORT;
+                        }
+                        else if (SUCCEEDED(hr))
+                        {
+                            ATL::CComVariant varClass;
+                            ATL::CComVariant varProcessId;
+                            ATL::CComVariant varProcessName;
+                            ATL::CComVariant varSessionId;
+                            if (SUCCEEDED(pEvent->Get(L"__CLASS", 0, &varClass, nullptr, nullptr)) && varClass.vt == VT_BSTR &&
+                                SUCCEEDED(pEvent->Get(L"ProcessID", 0, &varProcessId, nullptr, nullptr)) &&
+                                SUCCEEDED(varProcessId.ChangeType(VT_UI4)))
+                            {
+                                if (wcscmp(varClass.bstrVal, L"Win32_ProcessStartTrace") == 0)
+                                {
+                                    if (SUCCEEDED(pEvent->Get(L"ProcessName", 0, &varProcessName, nullptr, nullptr)) && varProcessName.vt == VT_BSTR)
+                                    {
+                                        ATL::CStringW strExeName;
+                                        _GetProcessExeName(varProcessId.ulVal, varProcessName.bstrVal, &strExeName);
+                                        pEvent->Get(L"SessionID", 0, &varSessionId, nullptr, nullptr);
+                                        _OnProcessStarted(varProcessId.ulVal, _GetProcessSessionId(varProcessId.ulVal, varSessionId), strExeName);
+                                    }
+                                }
+                                else if (wcscmp(varClass.bstrVal, L"Win32_ProcessStopTrace") == 0)
+                                {
+                                    _OnProcessStopped(varProcessId.ulVal);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        CoUninitialize();
+    }
+    return hr;
+}
@@ -0,0 +1,79 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+#include <atlcoll.h>
+#include <atlstr.h>
+
+// Process-wide index of the executables that are running on this machine, per session.
+//
+// The index is built once from a snapshot of the processes and their sessions and is then kept current by a background
+// thread that listens for Win32_ProcessTrace (process start/stop) events. This means that
+// asking whether an executable is running is a hash lookup instead of a walk over every process.
+// Names are stored case-folded, so lookups can use plain (case-sensitive) hashing.
+// If the event subscription cannot be set up (or breaks), the index falls back to rebuilding
+// itself from a fresh snapshot on every query, which is what we did before.
+class ProcessIndex
+{
+public:
+    static ProcessIndex& Instance();
+
+    // Users of the index (the provider) keep it alive with AddRef/Release. The first reference
+    // starts the watcher thread, the last one stops it again.
+    void AddRef();
+    void Release();
+
+    // Appends every application in apps that is running to prgRunning, once for each session it runs in.
+    // This is a single pass over the distinct running executables, independent of the size of apps.
+    HRESULT FindRunning(_In_ const CProtectedAppMap& apps, _Inout_ ATL::CAtlArray<RUNNING_APP>* prgRunning);
+
+    // Whether the index is kept current by events. If not, every query takes a snapshot instead.
+    bool IsLive();
+
+    // hChanged is set whenever an executable starts or stops running in a session (not for every instance),
+    // and when the index starts or stops being live.
+    void AddChangeEvent(_In_ HANDLE hChanged);
+    void RemoveChangeEvent(_In_ HANDLE hChanged);
+
+    // Case-folds an executable name the same way the index and CProtectedAppMap keys are folded.
+    static void FoldExeName(_In_ PCWSTR pszExeName, _Out_ ATL::CStringW* pstrFolded);
+
+private:
+    ProcessIndex();
+    ~ProcessIndex();
+
+    HRESULT _Start();
+    void _Stop();
+
+    HRESULT _BuildFromSnapshot();
+    bool _AddRunning(DWORD dwSessionId, _In_ const ATL::CStringW& strFolded);
+    void _OnProcessStarted(DWORD dwProcessId, DWORD dwSessionId, _In_ PCWSTR pszExeName);
+    void _OnProcessStopped(DWORD dwProcessId);
+    void _SignalChanged();
+
+    static DWORD WINAPI _WatcherThreadProc(_In_ LPVOID lpParameter);
+    HRESULT _WatchProcessEvents();
+
+    struct PROCESS_ENTRY
+    {
+        ATL::CStringW   strFolded;          // Case-folded executable name.
+        DWORD           dwSessionId;
+    };
+
+    typedef ATL::CAtlMap<DWORD, PROCESS_ENTRY> CProcessMap;
+    typedef ATL::CAtlMap<ATL::CStringW, DWORD> CRunningCountMap;
+    typedef ATL::CAtlMap<DWORD, ATL::CAutoPtr<CRunningCountMap>, ATL::CElementTraits<DWORD>,
+        ATL::CAutoPtrElementTraits<CRunningCountMap>> CSessionCountMap;
+
+    SRWLOCK             _lock;              // Guards _processes, _sessionCounts, _fLive and _changeEvents.
+    CProcessMap         _processes;         // Process ID -> executable name and session.
+    CSessionCountMap    _sessionCounts;     // Session ID -> case-folded executable name -> number of running instances.
+    bool                _fLive;             // Whether the watcher thread is keeping the index current.
+    ATL::CAtlArray<HANDLE> _changeEvents;   // Events to set when the set of running executables changes.
+    SRWLOCK             _usersLock;         // Guards _cUsers and starting/stopping the watcher thread.
+    long                _cUsers;            // Number of AddRef calls without a matching Release.
+    HANDLE              _hThread;
+    HANDLE              _hStopEvent;
+};
@@ -0,0 +1,158 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "ProtectedAppWatcher.h"
+#include "ProcessIndex.h"
+#include "ConfigStore.h"
+#include "Dll.h"
+#include <algorithm>
+
+// If the process index is not being kept current by events, we re-evaluate at this interval instead.
+static const DWORD s_msFallbackInterval = 2000;
+
+ProtectedAppWatcher::ProtectedAppWatcher() :
+    _hwndNotify(nullptr),
+    _uMsg(0),
+    _hThread(nullptr),
+    _hStopEvent(nullptr),
+    _hChangedEvent(nullptr)
+{
+    InitializeSRWLock(&_lock);
+}
+
+ProtectedAppWatcher::~ProtectedAppWatcher()
+{
+    Stop();
+}
+
+HRESULT ProtectedAppWatcher::Start(_In_ HWND hwndNotify, UINT uMsg)
+{
+    HRESULT hr = S_OK;
+    if (_hThread == nullptr)
+    {
+        _hwndNotify = hwndNotify;
+        _uMsg = uMsg;
+        _hStopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        _hChangedEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (_hStopEvent != nullptr && _hChangedEvent != nullptr)
+        {
+            ProcessIndex::Instance().AddChangeEvent(_hChangedEvent);
+            ConfigStore::Instance().AddChangeEvent(_hChangedEvent);
+
+            // Evaluate once up front, so GetRunning is meaningful as soon as we return
+            _Evaluate();
+
+            DllAddRef();
+            _hThread = CreateThread(nullptr, 0, _ThreadProc, this, 0, nullptr);
+            if (_hThread == nullptr)
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+                DllRelease();
+                ProcessIndex::Instance().RemoveChangeEvent(_hChangedEvent);
+                ConfigStore::Instance().RemoveChangeEvent(_hChangedEvent);
+            }
+        }
+        else
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        if (FAILED(hr))
+        {
+            if (_hStopEvent != nullptr)
+            {
+                CloseHandle(_hStopEvent);
+                _hStopEvent = nullptr;
+            }
+            if (_hChangedEvent != nullptr)
+            {
+                CloseHandle(_hChangedEvent);
+                _hChangedEvent = nullptr;
+            }
+        }
+    }
+    return hr;
+}
+
+void ProtectedAppWatcher::Stop()
+{
+    if (_hThread != nullptr)
+    {
+        SetEvent(_hStopEvent);
+        WaitForSingleObject(_hThread, INFINITE);
+        CloseHandle(_hThread);
+        _hThread = nullptr;
+
+        ProcessIndex::Instance().RemoveChangeEvent(_hChangedEvent);
+        ConfigStore::Instance().RemoveChangeEvent(_hChangedEvent);
+        CloseHandle(_hChangedEvent);
+        CloseHandle(_hStopEvent);
+        _hChangedEvent = nullptr;
+        _hStopEvent = nullptr;
+    }
+}
+
+void ProtectedAppWatcher::GetRunning(_Out_ ATL::CAtlArray<RUNNING_APP>* prgRunning)
+{
+    AcquireSRWLockShared(&_lock);
+    prgRunning->Copy(_rgRunning);
+    ReleaseSRWLockShared(&_lock);
+}
+
+DWORD WINAPI ProtectedAppWatcher::_ThreadProc(_In_ LPVOID lpParameter)
+{
+    static_cast<ProtectedAppWatcher*>(lpParameter)->_Run();
+    DllRelease();
+    return 0;
+}
+
+void ProtectedAppWatcher::_Run()
+{
+    HANDLE rghWait[] = { _hStopEvent, _hChangedEvent };
+    bool fStop = false;
+    while (!fStop)
+    {
+        if (_Evaluate())
+        {
+            PostMessage(_hwndNotify, _uMsg, 0, 0);
+        }
+
+        // The index tells us when it stops being live, so then we start looking at the interval
+        DWORD dwTimeout = ProcessIndex::Instance().IsLive() ? INFINITE : s_msFallbackInterval;
+        DWORD dwWait = WaitForMultipleObjects(ARRAYSIZE(rghWait), rghWait, FALSE, dwTimeout);
+        fStop = (dwWait != WAIT_OBJECT_0 + 1 && dwWait != WAIT_TIMEOUT);
+    }
+}
+
+static bool _IsLessRunningApp(_In_ const RUNNING_APP& left, _In_ const RUNNING_APP& right)
+{
+    return left.dwSessionId != right.dwSessionId ? left.dwSessionId < right.dwSessionId : left.strName.Compare(right.strName) < 0;
+}
+
+// Looks up which protected applications are running. Returns whether that changed since the last evaluation.
+bool ProtectedAppWatcher::_Evaluate()
+{
+    ATL::CAtlArray<RUNNING_APP> rgRunning;
+    if (FAILED(GetRunningProtectedApplications(&rgRunning)))
+    {
+        return false;
+    }
+
+    // The index lists them in hash order, which can differ between two lookups of the same applications
+    std::sort(rgRunning.GetData(), rgRunning.GetData() + rgRunning.GetCount(), _IsLessRunningApp);
+
+    AcquireSRWLockExclusive(&_lock);
+    bool fChanged = rgRunning.GetCount() != _rgRunning.GetCount();
+    for (size_t i = 0; !fChanged && i < rgRunning.GetCount(); i++)
+    {
+        fChanged = rgRunning[i].dwSessionId != _rgRunning[i].dwSessionId || rgRunning[i].strName != _rgRunning[i].strName;
+    }
+    if (fChanged)
+    {
+        _rgRunning.Copy(rgRunning);
+    }
+    ReleaseSRWLockExclusive(&_lock);
+
+    return fChanged;
+}
@@ -0,0 +1,43 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+
+// Watches which protected applications are running, and in which sessions, on behalf of a credential.
+//
+// A background thread waits for the process index or the settings to report a change, works out which protected
+// applications are running and, if that differs from what it reported last, posts uMsg to hwndNotify. Only while
+// the index is not kept current by events does it also look every few seconds.
+// The window lives on the apartment thread, so the credential can update its fields from there.
+class ProtectedAppWatcher
+{
+public:
+    ProtectedAppWatcher();
+    ~ProtectedAppWatcher();
+
+    HRESULT Start(_In_ HWND hwndNotify, UINT uMsg);
+    void Stop();
+
+    bool IsStarted() const
+    {
+        return _hThread != nullptr;
+    }
+
+    // Copies the protected applications that were running at the last evaluation. GetRunningInSession picks those of one session.
+    void GetRunning(_Out_ ATL::CAtlArray<RUNNING_APP>* prgRunning);
+
+private:
+    static DWORD WINAPI _ThreadProc(_In_ LPVOID lpParameter);
+    void _Run();
+    bool _Evaluate();
+
+    SRWLOCK                         _lock;          // Guards _rgRunning.
+    ATL::CAtlArray<RUNNING_APP>     _rgRunning;     // Protected applications running at the last evaluation, by session and name.
+    HWND                            _hwndNotify;
+    UINT                            _uMsg;
+    HANDLE                          _hThread;
+    HANDLE                          _hStopEvent;
+    HANDLE                          _hChangedEvent;
+};
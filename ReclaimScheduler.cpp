@@ -0,0 +1,153 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "ReclaimScheduler.h"
+
+ReclaimScheduler::ReclaimScheduler(_In_ SessionSource* pSource, _In_ PFN_PROTECTED_APPS_RUNNING pfnProtectedAppsRunning) :
+    _pSource(pSource),
+    _pfnProtectedAppsRunning(pfnProtectedAppsRunning),
+    _fStarted(false)
+{
+}
+
+// How long the session has been locked, remembering when it was first seen locked. Where Windows knows how long
+// the session has been idle (it does not for the console session), that counts too: someone who unlocked it and
+// locked it again between two ticks has used it.
+ULONGLONG ReclaimScheduler::_GetLockedFor(_In_ const SESSION_INFO& session, ULONGLONG ullNow)
+{
+    ATL::CAtlMap<DWORD, LOCKED_SESSION>::CPair* pPair = _lockedSessions.Lookup(session.dwSessionId);
+    if (pPair == nullptr || pPair->m_value.strUser != session.strUser)
+    {
+        LOCKED_SESSION locked;
+        locked.strUser = session.strUser;
+        locked.ullSince = ullNow;
+        locked.ullSeen = ullNow;
+        _lockedSessions.SetAt(session.dwSessionId, locked);
+        return 0;
+    }
+
+    pPair->m_value.ullSeen = ullNow;
+    ULONGLONG ullLockedFor = ullNow - pPair->m_value.ullSince;
+    if (session.ullIdleSeconds > 0 && session.ullIdleSeconds < ullLockedFor)
+    {
+        ullLockedFor = session.ullIdleSeconds;
+    }
+    return ullLockedFor;
+}
+
+// Rounds up, so a session is never signed out before its deadline.
+HRESULT ReclaimScheduler::_Schedule(DWORD dwSessionId, ULONGLONG ullDue)
+{
+    return _wheel.Schedule(dwSessionId, (ullDue + s_ullTickSeconds - 1) / s_ullTickSeconds);
+}
+
+// Notes which sessions are locked, gives the ones that are not scheduled yet a deadline, and forgets the others.
+HRESULT ReclaimScheduler::_Rescan(ULONGLONG ullNow, ULONGLONG ullThreshold)
+{
+    ATL::CAtlArray<SESSION_INFO> rgSessions;
+    HRESULT hr = _pSource->Enumerate(&rgSessions);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    for (size_t i = 0; SUCCEEDED(hr) && i < rgSessions.GetCount(); i++)
+    {
+        const SESSION_INFO& session = rgSessions[i];
+        if (!IsSessionUnattended(session))
+        {
+            _wheel.Cancel(session.dwSessionId);
+            continue;
+        }
+
+        ULONGLONG ullLockedFor = _GetLockedFor(session, ullNow);
+        if (!_wheel.IsScheduled(session.dwSessionId))
+        {
+            hr = _Schedule(session.dwSessionId, ullNow + (ullThreshold > ullLockedFor ? ullThreshold - ullLockedFor : 0));
+        }
+    }
+
+    // Unlocked and signed out sessions were not seen locked this time
+    POSITION pos = _lockedSessions.GetStartPosition();
+    while (pos != nullptr)
+    {
+        POSITION posCurrent = pos;
+        ATL::CAtlMap<DWORD, LOCKED_SESSION>::CPair* pPair = _lockedSessions.GetNext(pos);
+        if (pPair->m_value.ullSeen != ullNow)
+        {
+            _wheel.Cancel(pPair->m_key);
+            _lockedSessions.RemoveAtPos(posCurrent);
+        }
+    }
+    return hr;
+}
+
+HRESULT ReclaimScheduler::Tick(ULONGLONG ullNow, ULONGLONG ullThreshold, _Inout_ ATL::CAtlArray<SESSION_INFO>* prgDue)
+{
+    if (ullThreshold == 0)
+    {
+        // Turned off; start from scratch if it is turned on again
+        _fStarted = false;
+        return S_OK;
+    }
+    if (!_fStarted)
+    {
+        _wheel.Reset(ullNow / s_ullTickSeconds);
+        _lockedSessions.RemoveAll();
+        _fStarted = true;
+    }
+
+    HRESULT hr = _Rescan(ullNow, ullThreshold);
+    ATL::CAtlArray<DWORD> rgExpired;
+    if (SUCCEEDED(hr))
+    {
+        hr = _wheel.Advance(ullNow / s_ullTickSeconds, &rgExpired);
+    }
+
+    // The deadline was set from what was known back then, so look at each session again
+    SESSION_INFO current;
+    bool fCurrentDue = false;
+    for (size_t i = 0; SUCCEEDED(hr) && i < rgExpired.GetCount(); i++)
+    {
+        SESSION_INFO session;
+        if (FAILED(_pSource->Query(rgExpired[i], &session)) || !IsSessionUnattended(session))
+        {
+            // Signed out or unlocked meanwhile; the next tick forgets it
+            continue;
+        }
+
+        ULONGLONG ullLockedFor = _GetLockedFor(session, ullNow);
+        if (ullLockedFor < ullThreshold)
+        {
+            // Someone used it (e.g. typed at the lock screen), or someone else signed in to it, since it was scheduled
+            hr = _Schedule(session.dwSessionId, ullNow + ullThreshold - ullLockedFor);
+        }
+        else if (_pfnProtectedAppsRunning(session.dwSessionId))
+        {
+            // Never lose work in Multivers; a room responsible can still decide to sign it out
+            hr = _Schedule(session.dwSessionId, ullNow + s_ullRetrySeconds);
+        }
+        else if (session.fCurrent)
+        {
+            current = session;
+            fCurrentDue = true;
+        }
+        else
+        {
+            hr = prgDue->Add(session) != static_cast<size_t>(-1) ? S_OK : E_OUTOFMEMORY;
+        }
+    }
+
+    // Signing out the current session ends this process, so it has to come last
+    if (SUCCEEDED(hr) && fCurrentDue)
+    {
+        hr = prgDue->Add(current) != static_cast<size_t>(-1) ? S_OK : E_OUTOFMEMORY;
+    }
+    return hr;
+}
+
+HRESULT ReclaimScheduler::Postpone(DWORD dwSessionId, ULONGLONG ullNow)
+{
+    return _fStarted ? _Schedule(dwSessionId, ullNow + s_ullRetrySeconds) : S_OK;
+}
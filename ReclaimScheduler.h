@@ -0,0 +1,54 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+#include "SessionSource.h"
+#include "TimerWheel.h"
+
+// Whether a protected application (e.g. Multivers) is running that would be lost by signing out the session.
+typedef bool (*PFN_PROTECTED_APPS_RUNNING)(DWORD dwSessionId);
+
+// Decides which sessions have been locked for too long, given the time from whatever clock the caller uses.
+//
+// Windows does not say when a session was locked, so a session counts as locked from the first tick that sees it
+// locked (or disconnected); its deadline is that moment plus the threshold. All sessions are listed on every tick
+// for that, but deadlines are kept in a TimerWheel, so only the sessions that are due are queried again and checked
+// for protected applications.
+class ReclaimScheduler
+{
+public:
+    ReclaimScheduler(_In_ SessionSource* pSource, _In_ PFN_PROTECTED_APPS_RUNNING pfnProtectedAppsRunning);
+
+    // Adds the sessions that should be signed out now to prgDue, the current session last.
+    // ullNow is in seconds; ullThreshold is how many seconds a session may be locked, where 0 turns this off.
+    HRESULT Tick(ULONGLONG ullNow, ULONGLONG ullThreshold, _Inout_ ATL::CAtlArray<SESSION_INFO>* prgDue);
+
+    // For a session that Tick returned but that did not sign out: it is tried again s_ullRetrySeconds after ullNow.
+    HRESULT Postpone(DWORD dwSessionId, ULONGLONG ullNow);
+
+    // Deadlines are rounded up to whole ticks of this many seconds.
+    static const ULONGLONG s_ullTickSeconds = 60;
+
+    // How long a session that could not be signed out (or runs a protected application) waits for the next try.
+    static const ULONGLONG s_ullRetrySeconds = 15 * 60;
+
+private:
+    struct LOCKED_SESSION
+    {
+        ATL::CStringW   strUser;        // Someone else signing in to the session starts over.
+        ULONGLONG       ullSince;       // The first tick that saw it locked.
+        ULONGLONG       ullSeen;        // The last tick that saw it locked.
+    };
+
+    ULONGLONG _GetLockedFor(_In_ const SESSION_INFO& session, ULONGLONG ullNow);
+    HRESULT _Schedule(DWORD dwSessionId, ULONGLONG ullDue);
+    HRESULT _Rescan(ULONGLONG ullNow, ULONGLONG ullThreshold);
+
+    SessionSource*                          _pSource;
+    PFN_PROTECTED_APPS_RUNNING              _pfnProtectedAppsRunning;
+    TimerWheel                              _wheel;             // In ticks of s_ullTickSeconds.
+    ATL::CAtlMap<DWORD, LOCKED_SESSION>     _lockedSessions;    // By session ID.
+    bool                                    _fStarted;          // Whether _wheel was reset to the clock of the caller.
+};
@@ -0,0 +1,80 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "SecureFieldBuffer.h"
+
+static const size_t s_cbBuffer = SecureFieldBuffer::s_cchCapacity * sizeof(wchar_t);
+
+SecureFieldBuffer::SecureFieldBuffer() :
+    _pwzBuffer(nullptr),
+    _cchValue(0),
+    _fLocked(false)
+{
+}
+
+SecureFieldBuffer::~SecureFieldBuffer()
+{
+    if (_pwzBuffer != nullptr)
+    {
+        Clear();
+        if (_fLocked)
+        {
+            VirtualUnlock(_pwzBuffer, s_cbBuffer);
+        }
+        VirtualFree(_pwzBuffer, 0, MEM_RELEASE);
+    }
+}
+
+HRESULT SecureFieldBuffer::Initialize()
+{
+    if (_pwzBuffer != nullptr)
+    {
+        return S_OK;
+    }
+
+    // VirtualAlloc gives us zeroed, page-aligned memory, so the buffer does not share a page with anything else
+    _pwzBuffer = static_cast<PWSTR>(VirtualAlloc(nullptr, s_cbBuffer, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+    if (_pwzBuffer == nullptr)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    // This can fail if the process reached its working set limit; the buffer is still wiped, it just might be paged out
+    _fLocked = VirtualLock(_pwzBuffer, s_cbBuffer) != FALSE;
+    return S_OK;
+}
+
+HRESULT SecureFieldBuffer::Set(_In_ PCWSTR pwz)
+{
+    if (_pwzBuffer == nullptr)
+    {
+        return E_UNEXPECTED;
+    }
+
+    size_t cchNew;
+    HRESULT hr = StringCchLengthW(pwz, s_cchCapacity, &cchNew);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    // Wipe whatever the new value does not overwrite (e.g. after a backspace)
+    if (cchNew < _cchValue)
+    {
+        SecureZeroMemory(_pwzBuffer + cchNew, (_cchValue - cchNew) * sizeof(wchar_t));
+    }
+    memcpy(_pwzBuffer, pwz, cchNew * sizeof(wchar_t));
+    _pwzBuffer[cchNew] = L'\0';
+    _cchValue = cchNew;
+    return S_OK;
+}
+
+void SecureFieldBuffer::Clear()
+{
+    if (_pwzBuffer != nullptr)
+    {
+        SecureZeroMemory(_pwzBuffer, _cchValue * sizeof(wchar_t));
+        _cchValue = 0;
+    }
+}
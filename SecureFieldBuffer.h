@@ -0,0 +1,41 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+
+// A fixed-capacity string buffer for the edit fields of a tile (most importantly the password).
+//
+// LogonUI calls SetStringValue on every keystroke. Instead of freeing and duplicating the string each
+// time (which leaves old copies of the password on the heap), the value is overwritten in place in
+// memory that is allocated once, locked into RAM so it is not written to the page file, and wiped
+// whenever it is overwritten, cleared or freed.
+class SecureFieldBuffer
+{
+public:
+    // Enough for any username or password Windows accepts, including the terminator.
+    static const size_t s_cchCapacity = 2048;
+
+    SecureFieldBuffer();
+    ~SecureFieldBuffer();
+
+    HRESULT Initialize();
+
+    // Replaces the value; the old value is wiped. Fails (keeping the old value) if pwz does not fit.
+    HRESULT Set(_In_ PCWSTR pwz);
+
+    // Wipes the value, leaving an empty string.
+    void Clear();
+
+    // Always a valid (possibly empty) string, also before Initialize.
+    PCWSTR Get() const { return _pwzBuffer != nullptr ? _pwzBuffer : L""; }
+
+private:
+    SecureFieldBuffer(const SecureFieldBuffer&) = delete;
+    SecureFieldBuffer& operator=(const SecureFieldBuffer&) = delete;
+
+    PWSTR   _pwzBuffer;
+    size_t  _cchValue;      // Length of the value, so we only need to wipe what was used.
+    bool    _fLocked;       // Whether VirtualLock succeeded.
+};
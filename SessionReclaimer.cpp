@@ -0,0 +1,259 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "SessionReclaimer.h"
+#include "AuditLog.h"
+#include "ConfigStore.h"
+#include "LogoffTracker.h"
+#include "Metrics.h"
+#include "Dll.h"
+
+static const DWORD s_dwTickPeriodMs = 60 * 1000;
+static const DWORD s_dwLogoffPollMs = 1000;
+
+// What the audit log shows as the room responsible for a reclamation
+static const WCHAR s_szReclaimResponsible[] = L"(locked too long)";
+
+SessionReclaimer& SessionReclaimer::Instance()
+{
+    static SessionReclaimer s_reclaimer;
+    return s_reclaimer;
+}
+
+SessionReclaimer::SessionReclaimer() :
+    _hLockFile(INVALID_HANDLE_VALUE),
+    _hStopEvent(nullptr),
+    _cUsers(0),
+    _pTimer(nullptr)
+{
+    InitializeSRWLock(&_tickLock);
+    InitializeSRWLock(&_usersLock);
+}
+
+SessionReclaimer::~SessionReclaimer()
+{
+    // The timer and the lock are closed by the last Release
+}
+
+void SessionReclaimer::AddRef()
+{
+    AcquireSRWLockExclusive(&_usersLock);
+    if (_cUsers++ == 0)
+    {
+        _hStopEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        _pSource.reset(new(std::nothrow) WtsSessionSource());
+        if (_pSource != nullptr && _hStopEvent != nullptr)
+        {
+            _pScheduler.reset(new(std::nothrow) ReclaimScheduler(_pSource.get(), ProtectedAppsRunning));
+        }
+
+        TP_CALLBACK_ENVIRON callbackEnviron;
+        InitializeThreadpoolEnvironment(&callbackEnviron);
+        SetThreadpoolCallbackLibrary(&callbackEnviron, HINST_THISDLL);
+        _pTimer = _pScheduler != nullptr ? CreateThreadpoolTimer(_TickCallback, this, &callbackEnviron) : nullptr;
+        DestroyThreadpoolEnvironment(&callbackEnviron);
+
+        if (_pTimer != nullptr)
+        {
+            ULARGE_INTEGER uliDueTime;
+            uliDueTime.QuadPart = static_cast<ULONGLONG>(-static_cast<LONGLONG>(s_dwTickPeriodMs) * 10000);
+            FILETIME ftDueTime;
+            ftDueTime.dwHighDateTime = uliDueTime.HighPart;
+            ftDueTime.dwLowDateTime = uliDueTime.LowPart;
+            SetThreadpoolTimer(_pTimer, &ftDueTime, s_dwTickPeriodMs, s_dwTickPeriodMs / 10);
+        }
+    }
+    ReleaseSRWLockExclusive(&_usersLock);
+}
+
+void SessionReclaimer::Release()
+{
+    AcquireSRWLockExclusive(&_usersLock);
+    if (_cUsers > 0 && --_cUsers == 0)
+    {
+        if (_pTimer != nullptr)
+        {
+            // A tick that is waiting for sessions to sign out stops at the event, so this only waits for
+            // the call to Windows it is in
+            SetThreadpoolTimer(_pTimer, nullptr, 0, 0);
+            SetEvent(_hStopEvent);
+            WaitForThreadpoolTimerCallbacks(_pTimer, TRUE);
+            CloseThreadpoolTimer(_pTimer);
+            _pTimer = nullptr;
+        }
+        if (_hStopEvent != nullptr)
+        {
+            CloseHandle(_hStopEvent);
+            _hStopEvent = nullptr;
+        }
+
+        // Let another LogonUI take over
+        _ReleaseLock();
+        _pScheduler.reset();
+        _pSource.reset();
+    }
+    ReleaseSRWLockExclusive(&_usersLock);
+}
+
+VOID CALLBACK SessionReclaimer::_TickCallback(_Inout_ PTP_CALLBACK_INSTANCE /*pInstance*/, _Inout_opt_ PVOID pContext, _Inout_ PTP_TIMER /*pTimer*/)
+{
+    static_cast<SessionReclaimer*>(pContext)->_Tick();
+}
+
+void SessionReclaimer::_Tick()
+{
+    if (!TryAcquireSRWLockExclusive(&_tickLock))
+    {
+        return;
+    }
+
+    std::shared_ptr<const Config> pConfig = ConfigStore::Instance().Current();
+    ULONGLONG ullThreshold = static_cast<ULONGLONG>(pConfig->dwReclaimLockedAfter) * 60;
+    if (ullThreshold == 0)
+    {
+        _ReleaseLock();
+    }
+
+    ATL::CAtlArray<SESSION_INFO> rgDue;
+    if (ullThreshold == 0 || _AcquireLock())
+    {
+        _pScheduler->Tick(GetTickCount64() / 1000, ullThreshold, &rgDue);
+    }
+    if (rgDue.GetCount() > 0)
+    {
+        _Reclaim(rgDue);
+    }
+
+    ReleaseSRWLockExclusive(&_tickLock);
+}
+
+// Whether this process is the one that reclaims sessions. The lock is a file that only one process can have open.
+bool SessionReclaimer::_AcquireLock()
+{
+    if (_hLockFile == INVALID_HANDLE_VALUE)
+    {
+        ATL::CStringW strDirectory;
+        if (SUCCEEDED(GetDataDirectory(L"reclaim", &strDirectory)))
+        {
+            // Not through a link, like every file in our data directory
+            _hLockFile = CreateFileW(strDirectory + L"\\reclaim.lock", GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS,
+                FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OPEN_REPARSE_POINT, nullptr);
+        }
+    }
+    return _hLockFile != INVALID_HANDLE_VALUE;
+}
+
+void SessionReclaimer::_ReleaseLock()
+{
+    if (_hLockFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(_hLockFile);
+        _hLockFile = INVALID_HANDLE_VALUE;
+    }
+}
+
+static void _AuditReclaim(_In_ const SESSION_INFO& session, AUDIT_OUTCOME outcome, ULONGLONG ullStartTime)
+{
+    AUDIT_RECORD record;
+    record.ullTime = AuditLog::Now();
+    record.outcome = outcome;
+    record.dwLatencyMs = static_cast<DWORD>(GetTickCount64() - ullStartTime);
+    record.strResponsible = s_szReclaimResponsible;
+    record.strVictim = session.strUser;
+    AuditLog::Instance().Write(record);
+}
+
+// Asks the sessions to sign out (the current one last, as ReclaimScheduler orders them), waits at most LogoffTimeout
+// for the others, and records each in the audit log.
+void SessionReclaimer::_Reclaim(_In_ const ATL::CAtlArray<SESSION_INFO>& rgDue)
+{
+    ULONGLONG ullStartTime = GetTickCount64();
+    LONGLONG llStart = Metrics::Now();
+    size_t cOthers = rgDue.GetCount();
+    if (rgDue[cOthers - 1].fCurrent)
+    {
+        cOthers--;
+    }
+
+    ATL::CAtlArray<SESSION_INFO> rgOthers;
+    ATL::CAtlArray<HRESULT> rgIssued;
+    if (!rgOthers.SetCount(cOthers) || !rgIssued.SetCount(cOthers))
+    {
+        return;
+    }
+    for (size_t i = 0; i < cOthers; i++)
+    {
+        rgOthers[i] = rgDue[i];
+        rgIssued[i] = _pSource->BeginLogoff(rgDue[i].dwSessionId);
+    }
+
+    LogoffTracker tracker;
+    ULONGLONG ullTimeout = static_cast<ULONGLONG>(ConfigStore::Instance().Current()->dwLogoffTimeout) * 1000;
+    if (FAILED(tracker.Start(rgOthers, rgIssued, ullStartTime, ullTimeout)))
+    {
+        return;
+    }
+
+    // Polled, as session notifications need a window
+    bool fStopped = false;
+    while (tracker.GetPhase() == LP_WAITING && !fStopped)
+    {
+        fStopped = WaitForSingleObject(_hStopEvent, s_dwLogoffPollMs) == WAIT_OBJECT_0;
+        ULONGLONG ullNow = GetTickCount64();
+        for (size_t cSignedOut = tracker.Poll(_pSource.get(), ullNow); cSignedOut > 0; cSignedOut--)
+        {
+            Metrics::Instance().ObserveSince(MH_LOGOFF, llStart);
+        }
+        tracker.OnTick(ullNow);
+    }
+    if (tracker.GetPhase() == LP_TIMED_OUT)
+    {
+        // Terminating its applications is for a room responsible to decide; try again later
+        tracker.Abandon();
+    }
+
+    for (size_t i = 0; i < tracker.GetCount(); i++)
+    {
+        const LOGOFF_TARGET& target = tracker.GetTarget(i);
+        switch (target.state)
+        {
+        case LS_SIGNED_OUT:
+            Metrics::Instance().Increment(MC_RECLAIMED);
+            _AuditReclaim(target.session, AO_RECLAIMED, ullStartTime);
+            break;
+
+        case LS_PENDING:
+            // The provider went away before it signed out
+            _AuditReclaim(target.session, AO_SIGN_OUT_REQUESTED, ullStartTime);
+            break;
+
+        default:
+            Metrics::Instance().Increment(MC_ERRORS);
+            _AuditReclaim(target.session, AO_SIGN_OUT_FAILED, ullStartTime);
+            _Postpone(target.session.dwSessionId);
+            break;
+        }
+    }
+
+    if (cOthers < rgDue.GetCount() && !fStopped)
+    {
+        // This process ends with the session, so nothing can be written once it signs out
+        const SESSION_INFO& current = rgDue[cOthers];
+        _AuditReclaim(current, AO_SIGN_OUT_REQUESTED, ullStartTime);
+        AuditLog::Instance().Flush();
+        if (FAILED(_pSource->BeginLogoff(current.dwSessionId)))
+        {
+            Metrics::Instance().Increment(MC_ERRORS);
+            _AuditReclaim(current, AO_SIGN_OUT_FAILED, ullStartTime);
+            _Postpone(current.dwSessionId);
+        }
+    }
+    AuditLog::Instance().Flush();
+}
+
+// The caller must hold _tickLock.
+void SessionReclaimer::_Postpone(DWORD dwSessionId)
+{
+    _pScheduler->Postpone(dwSessionId, GetTickCount64() / 1000);
+}
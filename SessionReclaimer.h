@@ -0,0 +1,48 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+#include "ReclaimScheduler.h"
+#include <memory>
+
+// Signs out sessions that have been locked for longer than the ReclaimLockedAfter setting, from a threadpool
+// timer that runs while a provider exists. Each reclamation is written to the audit log.
+//
+// The sessions are asked to sign out without waiting for them, and then polled for at most LogoffTimeout, so a
+// session that hangs while signing out holds up neither the timer nor the provider going away. A session that
+// did not sign out is tried again later.
+//
+// Every LogonUI that loads us has a reclaimer, but only the one holding %ProgramData%\GEWISUnlock\reclaim\reclaim.lock
+// acts; the others try to take it over on every tick.
+class SessionReclaimer
+{
+public:
+    static SessionReclaimer& Instance();
+
+    // The provider keeps the timer running with AddRef/Release.
+    void AddRef();
+    void Release();
+
+private:
+    SessionReclaimer();
+    ~SessionReclaimer();
+
+    static VOID CALLBACK _TickCallback(_Inout_ PTP_CALLBACK_INSTANCE pInstance, _Inout_opt_ PVOID pContext, _Inout_ PTP_TIMER pTimer);
+    void _Tick();
+    bool _AcquireLock();
+    void _ReleaseLock();
+    void _Reclaim(_In_ const ATL::CAtlArray<SESSION_INFO>& rgDue);
+    void _Postpone(DWORD dwSessionId);
+
+    std::unique_ptr<SessionSource>      _pSource;
+    SRWLOCK                             _tickLock;      // Held by _Tick; a tick that comes while signing out takes long is skipped.
+    std::unique_ptr<ReclaimScheduler>   _pScheduler;    // Guarded by _tickLock, like _hLockFile.
+    HANDLE                              _hLockFile;     // INVALID_HANDLE_VALUE while another process reclaims.
+    HANDLE                              _hStopEvent;    // Set by the last Release, so _Reclaim stops waiting for sessions.
+
+    SRWLOCK                             _usersLock;     // Guards _cUsers and _pTimer.
+    long                                _cUsers;
+    PTP_TIMER                           _pTimer;
+};
@@ -0,0 +1,217 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "SessionSource.h"
+
+#pragma comment(lib, "wtsapi32.lib")
+
+// Fills in fLocked and ullIdleSeconds, and the user and state if pSession does not have them yet.
+static HRESULT _QueryInfoEx(DWORD dwSessionId, _Inout_ SESSION_INFO* pSession)
+{
+    PWTSINFOEXW pInfoEx;
+    DWORD cbInfoEx;
+    if (!WTSQuerySessionInformationW(WTS_CURRENT_SERVER_HANDLE, dwSessionId, WTSSessionInfoEx, reinterpret_cast<LPWSTR*>(&pInfoEx), &cbInfoEx))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    HRESULT hr = E_UNEXPECTED;
+    if (pInfoEx->Level == 1)
+    {
+        const WTSINFOEX_LEVEL1_W& infoEx = pInfoEx->Data.WTSInfoExLevel1;
+        if (pSession->strUser.IsEmpty())
+        {
+            pSession->state = infoEx.SessionState;
+            if (infoEx.DomainName[0] != L'\0')
+            {
+                pSession->strUser.Format(L"%s\\%s", infoEx.DomainName, infoEx.UserName);
+            }
+            else
+            {
+                pSession->strUser = infoEx.UserName;
+            }
+        }
+        pSession->fLocked = infoEx.SessionFlags == WTS_SESSIONSTATE_LOCK;
+
+        LONGLONG llSince = pSession->state == WTSDisconnected ? infoEx.DisconnectTime.QuadPart : infoEx.LastInputTime.QuadPart;
+        if (llSince > 0 && infoEx.CurrentTime.QuadPart > llSince)
+        {
+            pSession->ullIdleSeconds = static_cast<ULONGLONG>(infoEx.CurrentTime.QuadPart - llSince) / 10000000;
+        }
+        hr = S_OK;
+    }
+    WTSFreeMemory(pInfoEx);
+    return hr;
+}
+
+HRESULT WtsSessionSource::Enumerate(_Inout_ ATL::CAtlArray<SESSION_INFO>* prgSessions)
+{
+    DWORD dwLevel = 1;
+    PWTS_SESSION_INFO_1W rgInfo;
+    DWORD cInfo;
+    if (!WTSEnumerateSessionsExW(WTS_CURRENT_SERVER_HANDLE, &dwLevel, 0, &rgInfo, &cInfo))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    DWORD dwCurrentSessionId = WTS_CURRENT_SESSION;
+    ProcessIdToSessionId(GetCurrentProcessId(), &dwCurrentSessionId);
+
+    HRESULT hr = S_OK;
+    for (DWORD i = 0; SUCCEEDED(hr) && i < cInfo; i++)
+    {
+        // Skip the services session, listeners and sessions that only show the sign-in screen
+        const WTS_SESSION_INFO_1W& info = rgInfo[i];
+        if (info.pUserName == nullptr || info.pUserName[0] == L'\0')
+        {
+            continue;
+        }
+
+        SESSION_INFO session;
+        session.dwSessionId = info.SessionId;
+        if (info.pDomainName != nullptr && info.pDomainName[0] != L'\0')
+        {
+            session.strUser.Format(L"%s\\%s", info.pDomainName, info.pUserName);
+        }
+        else
+        {
+            session.strUser = info.pUserName;
+        }
+        session.state = info.State;
+        session.fLocked = false;
+        session.ullIdleSeconds = 0;
+        session.fCurrent = info.SessionId == dwCurrentSessionId;
+
+        // Only for the description and the lock state, so a session is still listed if this fails
+        _QueryInfoEx(info.SessionId, &session);
+
+        if (session.fCurrent)
+        {
+            hr = prgSessions->InsertAt(0, session) ? S_OK : E_OUTOFMEMORY;
+        }
+        else
+        {
+            hr = prgSessions->Add(session) != static_cast<size_t>(-1) ? S_OK : E_OUTOFMEMORY;
+        }
+    }
+
+    WTSFreeMemoryExW(WTSTypeSessionInfoLevel1, rgInfo, cInfo);
+    return hr;
+}
+
+HRESULT WtsSessionSource::Query(DWORD dwSessionId, _Out_ SESSION_INFO* pSession)
+{
+    DWORD dwCurrentSessionId = WTS_CURRENT_SESSION;
+    ProcessIdToSessionId(GetCurrentProcessId(), &dwCurrentSessionId);
+
+    pSession->dwSessionId = dwSessionId;
+    pSession->strUser.Empty();
+    pSession->state = WTSActive;
+    pSession->fLocked = false;
+    pSession->ullIdleSeconds = 0;
+    pSession->fCurrent = dwSessionId == dwCurrentSessionId;
+
+    HRESULT hr = _QueryInfoEx(dwSessionId, pSession);
+    if (SUCCEEDED(hr) && pSession->strUser.IsEmpty())
+    {
+        // Nobody is signed in (anymore)
+        hr = HRESULT_FROM_WIN32(ERROR_NO_SUCH_LOGON_SESSION);
+    }
+    return hr;
+}
+
+HRESULT WtsSessionSource::BeginLogoff(DWORD dwSessionId)
+{
+    // https://learn.microsoft.com/en-us/windows/win32/api/wtsapi32/nf-wtsapi32-wtslogoffsession
+    return WTSLogoffSession(WTS_CURRENT_SERVER_HANDLE, dwSessionId, FALSE) ? S_OK : HRESULT_FROM_WIN32(GetLastError());
+}
+
+HRESULT WtsSessionSource::TerminateProcesses(DWORD dwSessionId)
+{
+    // Only the processes of the user itself: the session also has csrss.exe, winlogon.exe and dwm.exe,
+    // which run as SYSTEM or a virtual account, and terminating csrss.exe stops the whole machine
+    ATL::CAccessToken token;
+    HANDLE hToken;
+    if (!WTSQueryUserToken(dwSessionId, &hToken))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    token.Attach(hToken);
+    ATL::CSid sidUser;
+    if (!token.GetUser(&sidUser))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    DWORD dwLevel = 0;
+    PWTS_PROCESS_INFOW rgInfo;
+    DWORD cInfo;
+    if (!WTSEnumerateProcessesExW(WTS_CURRENT_SERVER_HANDLE, &dwLevel, dwSessionId, reinterpret_cast<LPWSTR*>(&rgInfo), &cInfo))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    HRESULT hr = S_OK;
+    for (DWORD i = 0; i < cInfo; i++)
+    {
+        const WTS_PROCESS_INFOW& info = rgInfo[i];
+        if (info.pUserSid == nullptr || !EqualSid(info.pUserSid, const_cast<SID*>(sidUser.GetPSID())))
+        {
+            continue;
+        }
+
+        HANDLE hProcess = OpenProcess(PROCESS_TERMINATE, FALSE, info.ProcessId);
+        if (hProcess == nullptr || !TerminateProcess(hProcess, ERROR_PROCESS_ABORTED))
+        {
+            // Keep going; whatever is left may be enough for the session to sign out
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+        if (hProcess != nullptr)
+        {
+            CloseHandle(hProcess);
+        }
+    }
+
+    WTSFreeMemoryExW(WTSTypeProcessInfoLevel0, rgInfo, cInfo);
+    return hr;
+}
+
+void FormatSessionDescription(_In_ const SESSION_INFO& session, _Out_ ATL::CStringW* pstrDescription)
+{
+    PCWSTR pszState;
+    if (session.fCurrent)
+    {
+        pszState = L"this session";
+    }
+    else if (session.state == WTSDisconnected)
+    {
+        pszState = L"disconnected";
+    }
+    else if (session.fLocked)
+    {
+        pszState = L"locked";
+    }
+    else if (session.state == WTSActive)
+    {
+        pszState = L"active";
+    }
+    else
+    {
+        pszState = L"signed in";
+    }
+
+    ULONGLONG ullMinutes = session.ullIdleSeconds / 60;
+    if (session.fCurrent || ullMinutes == 0)
+    {
+        pstrDescription->Format(L"%s (%s)", session.strUser.GetString(), pszState);
+    }
+    else if (ullMinutes < 60)
+    {
+        pstrDescription->Format(L"%s (%s, idle for %llu min)", session.strUser.GetString(), pszState, ullMinutes);
+    }
+    else
+    {
+        pstrDescription->Format(L"%s (%s, idle for %llu h %llu min)", session.strUser.GetString(), pszState, ullMinutes / 60, ullMinutes % 60);
+    }
+}
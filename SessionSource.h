@@ -0,0 +1,58 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+#include <wtsapi32.h>
+
+// A session with a user signed in.
+struct SESSION_INFO
+{
+    DWORD                   dwSessionId;
+    ATL::CStringW           strUser;            // DOMAIN\user.
+    WTS_CONNECTSTATE_CLASS  state;
+    bool                    fLocked;
+    ULONGLONG               ullIdleSeconds;     // Since the last input, or since it was disconnected; 0 if Windows does not say (e.g. for the console).
+    bool                    fCurrent;           // The session of this LogonUI, i.e. the one that is locked.
+};
+
+// Whether nobody is using the session: it is locked, or disconnected, which cannot be used without signing in again
+// either. Only such sessions may be signed out by someone else; a session that is in use stays.
+inline bool IsSessionUnattended(_In_ const SESSION_INFO& session)
+{
+    return session.fLocked || session.state == WTSDisconnected;
+}
+
+// Where the sessions come from and how they are signed out. The credential uses WtsSessionSource;
+// keeping this separate lets the selection and sign-out logic be driven by another source.
+class SessionSource
+{
+public:
+    virtual ~SessionSource() {}
+
+    // The sessions that have a user signed in, the current session first.
+    virtual HRESULT Enumerate(_Inout_ ATL::CAtlArray<SESSION_INFO>* prgSessions) = 0;
+
+    // The current state of one session. Fails if nobody is signed in to it.
+    virtual HRESULT Query(DWORD dwSessionId, _Out_ SESSION_INFO* pSession) = 0;
+
+    // Asks the session to sign out and returns right away; the session is gone once Query fails.
+    virtual HRESULT BeginLogoff(DWORD dwSessionId) = 0;
+
+    // Terminates the processes of the user of the session, for when signing out hangs on one of them.
+    virtual HRESULT TerminateProcesses(DWORD dwSessionId) = 0;
+};
+
+// The sessions on this machine, through the Remote Desktop Services API.
+class WtsSessionSource : public SessionSource
+{
+public:
+    HRESULT Enumerate(_Inout_ ATL::CAtlArray<SESSION_INFO>* prgSessions) override;
+    HRESULT Query(DWORD dwSessionId, _Out_ SESSION_INFO* pSession) override;
+    HRESULT BeginLogoff(DWORD dwSessionId) override;
+    HRESULT TerminateProcesses(DWORD dwSessionId) override;
+};
+
+// Describes a session for the session combobox, e.g. "GEWISWG\m1234 (disconnected, idle for 3 h 20 min)".
+void FormatSessionDescription(_In_ const SESSION_INFO& session, _Out_ ATL::CStringW* pstrDescription);
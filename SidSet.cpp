@@ -0,0 +1,163 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "SidSet.h"
+
+static const size_t s_cInitialSlots = 16;
+
+SidSet::SidSet() :
+    _cSids(0)
+{
+}
+
+HRESULT SidSet::Add(_In_ PSID pSid, DWORD dwRights)
+{
+    if (!IsValidSid(pSid))
+    {
+        return E_INVALIDARG;
+    }
+
+    const BYTE* pbSid = static_cast<const BYTE*>(pSid);
+    DWORD cbSid = GetLengthSid(pSid);
+    DWORD dwHash = _Hash(pbSid, cbSid);
+
+    SLOT* pSlot = const_cast<SLOT*>(_Find(pbSid, cbSid, dwHash));
+    if (pSlot != nullptr && pSlot->cbSid != 0)
+    {
+        pSlot->dwRights |= dwRights;
+        return S_OK;
+    }
+
+    // Keep at least half of the slots empty, so probe sequences stay short
+    if ((_cSids + 1) * 2 > _rgSlots.GetCount())
+    {
+        HRESULT hr = _Grow();
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+        pSlot = const_cast<SLOT*>(_Find(pbSid, cbSid, dwHash));
+    }
+
+    size_t ibSid = _rgbSids.GetCount();
+    if (!_rgbSids.SetCount(ibSid + cbSid))
+    {
+        return E_OUTOFMEMORY;
+    }
+    memcpy(_rgbSids.GetData() + ibSid, pbSid, cbSid);
+
+    pSlot->dwHash = dwHash;
+    pSlot->ibSid = static_cast<DWORD>(ibSid);
+    pSlot->cbSid = cbSid;
+    pSlot->dwRights = dwRights;
+    _cSids++;
+    return S_OK;
+}
+
+DWORD SidSet::Lookup(_In_ PSID pSid) const
+{
+    if (_cSids == 0)
+    {
+        return AR_NONE;
+    }
+
+    const BYTE* pbSid = static_cast<const BYTE*>(pSid);
+    DWORD cbSid = GetLengthSid(pSid);
+    const SLOT* pSlot = _Find(pbSid, cbSid, _Hash(pbSid, cbSid));
+    return pSlot->cbSid != 0 ? pSlot->dwRights : AR_NONE;
+}
+
+DWORD SidSet::LookupGroups(_In_ const TOKEN_GROUPS* pGroups) const
+{
+    DWORD dwRights = AR_NONE;
+    for (DWORD i = 0; dwRights != AR_ALL && i < pGroups->GroupCount; i++)
+    {
+        // Groups that are disabled or only used to deny access (which are never enabled) do not count
+        if (pGroups->Groups[i].Attributes & SE_GROUP_ENABLED)
+        {
+            dwRights |= Lookup(pGroups->Groups[i].Sid);
+        }
+    }
+    return dwRights;
+}
+
+bool SidSet::Equals(_In_ const SidSet& other) const
+{
+    if (_cSids != other._cSids)
+    {
+        return false;
+    }
+
+    // With as many SIDs on both sides, finding each of ours in the other set is enough
+    for (size_t i = 0; i < _rgSlots.GetCount(); i++)
+    {
+        const SLOT& slot = _rgSlots[i];
+        if (slot.cbSid != 0)
+        {
+            const SLOT* pOtherSlot = other._Find(_rgbSids.GetData() + slot.ibSid, slot.cbSid, slot.dwHash);
+            if (pOtherSlot == nullptr || pOtherSlot->cbSid == 0 || pOtherSlot->dwRights != slot.dwRights)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// FNV-1a. SIDs that share a prefix (e.g. all groups of one domain) differ in their last bytes, which this mixes in well.
+DWORD SidSet::_Hash(_In_reads_bytes_(cbSid) const BYTE* pbSid, DWORD cbSid)
+{
+    DWORD dwHash = 2166136261u;
+    for (DWORD i = 0; i < cbSid; i++)
+    {
+        dwHash = (dwHash ^ pbSid[i]) * 16777619u;
+    }
+    return dwHash;
+}
+
+// Returns the slot holding the SID, or the empty slot where it would go. Returns nullptr only if there are no slots.
+const SidSet::SLOT* SidSet::_Find(_In_reads_bytes_(cbSid) const BYTE* pbSid, DWORD cbSid, DWORD dwHash) const
+{
+    size_t cSlots = _rgSlots.GetCount();
+    if (cSlots == 0)
+    {
+        return nullptr;
+    }
+
+    const SLOT* rgSlots = _rgSlots.GetData();
+    for (size_t iSlot = dwHash & (cSlots - 1); ; iSlot = (iSlot + 1) & (cSlots - 1))
+    {
+        const SLOT* pSlot = &rgSlots[iSlot];
+        if (pSlot->cbSid == 0 ||
+            (pSlot->dwHash == dwHash && pSlot->cbSid == cbSid && memcmp(_rgbSids.GetData() + pSlot->ibSid, pbSid, cbSid) == 0))
+        {
+            return pSlot;
+        }
+    }
+}
+
+// Doubles the number of slots and puts every SID in its new place.
+HRESULT SidSet::_Grow()
+{
+    size_t cSlots = _rgSlots.IsEmpty() ? s_cInitialSlots : _rgSlots.GetCount() * 2;
+
+    ATL::CAtlArray<SLOT> rgOldSlots;
+    rgOldSlots.Copy(_rgSlots);
+    if (!_rgSlots.SetCount(cSlots))
+    {
+        return E_OUTOFMEMORY;
+    }
+    ZeroMemory(_rgSlots.GetData(), cSlots * sizeof(SLOT));
+
+    for (size_t i = 0; i < rgOldSlots.GetCount(); i++)
+    {
+        const SLOT& oldSlot = rgOldSlots[i];
+        if (oldSlot.cbSid != 0)
+        {
+            SLOT* pSlot = const_cast<SLOT*>(_Find(_rgbSids.GetData() + oldSlot.ibSid, oldSlot.cbSid, oldSlot.dwHash));
+            *pSlot = oldSlot;
+        }
+    }
+    return S_OK;
+}
@@ -0,0 +1,50 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+
+// A hash set of binary SIDs, each with the AUTHORIZATION_RIGHT flags it grants.
+//
+// The SIDs are copied into one buffer and found through an open-addressing table (linear probing),
+// so checking every group of a token is one pass with a hash and at most a few memcmp calls per group,
+// instead of comparing every group against every configured SID.
+// The set is filled once when the configuration is read and is not changed afterwards.
+class SidSet
+{
+public:
+    SidSet();
+
+    // Adds pSid with dwRights. If pSid is already in the set, dwRights is added to the rights it has.
+    HRESULT Add(_In_ PSID pSid, DWORD dwRights);
+
+    // Returns the rights granted by pSid, or AR_NONE if it is not in the set.
+    DWORD Lookup(_In_ PSID pSid) const;
+
+    // Returns the combined rights granted by the enabled groups in pGroups. The SIDs are compared where
+    // they are in the buffer, so this does not allocate.
+    DWORD LookupGroups(_In_ const TOKEN_GROUPS* pGroups) const;
+
+    // Whether both sets hold the same SIDs with the same rights.
+    bool Equals(_In_ const SidSet& other) const;
+
+    size_t GetCount() const { return _cSids; }
+
+private:
+    struct SLOT
+    {
+        DWORD   dwHash;
+        DWORD   ibSid;      // Offset of the SID in _rgbSids.
+        DWORD   cbSid;      // 0 if the slot is empty.
+        DWORD   dwRights;
+    };
+
+    static DWORD _Hash(_In_reads_bytes_(cbSid) const BYTE* pbSid, DWORD cbSid);
+    const SLOT* _Find(_In_reads_bytes_(cbSid) const BYTE* pbSid, DWORD cbSid, DWORD dwHash) const;
+    HRESULT _Grow();
+
+    ATL::CAtlArray<BYTE>    _rgbSids;
+    ATL::CAtlArray<SLOT>    _rgSlots;   // The number of slots is a power of two and at least twice _cSids.
+    size_t                  _cSids;
+};
@@ -0,0 +1,180 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "SpanTrace.h"
+#include "Dll.h"
+#include <TraceLoggingProvider.h>
+
+// {17cd74a7-61ac-4153-9571-8cdebb7967bf}
+TRACELOGGING_DEFINE_PROVIDER(
+    g_hSpanTraceProvider,
+    "GEWIS-Unlock",
+    (0x17cd74a7, 0x61ac, 0x4153, 0x95, 0x71, 0x8c, 0xde, 0xbb, 0x79, 0x67, 0xbf));
+
+static const DWORD s_dwFlushPeriodMs = 1000;
+
+volatile bool SpanTrace::s_fEnabled = false;
+SpanTrace::SLOT SpanTrace::s_rgSlots[SpanTrace::s_cSlots];
+volatile LONG64 SpanTrace::s_llNextWrite = 0;
+LONG64 SpanTrace::s_llNextRead = 0;
+SRWLOCK SpanTrace::s_flushLock = SRWLOCK_INIT;
+PTP_TIMER SpanTrace::s_pTimer = nullptr;
+bool SpanTrace::s_fFlushing = false;
+volatile LONG SpanTrace::s_fRegistered = FALSE;
+
+// QPC ticks in microseconds. Split up so that it does not overflow: the ticks since boot times a million
+// would after about 10 days at the usual 10 MHz.
+static LONGLONG _TicksToMicroseconds(LONGLONG llTicks, LONGLONG llFrequency)
+{
+    return llTicks / llFrequency * 1000000 + llTicks % llFrequency * 1000000 / llFrequency;
+}
+
+void SpanTrace::Register()
+{
+    if (InterlockedCompareExchange(&s_fRegistered, TRUE, FALSE) == FALSE)
+    {
+        // Not done in DllMain: the enable callback may be called right away, and it creates a threadpool timer
+        TraceLoggingRegisterEx(g_hSpanTraceProvider, _EnableCallback, nullptr);
+    }
+}
+
+void SpanTrace::Unregister()
+{
+    if (InterlockedExchange(&s_fRegistered, FALSE) != FALSE)
+    {
+        s_fEnabled = false;
+        TraceLoggingUnregister(g_hSpanTraceProvider);
+    }
+}
+
+void SpanTrace::Record(_In_ PCSTR pszName, LONGLONG llStart, LONGLONG llEnd)
+{
+    // Claim the next slot; if the flush is behind, this overwrites the oldest span
+    LONG64 llIndex = InterlockedIncrement64(&s_llNextWrite) - 1;
+    SLOT& slot = s_rgSlots[llIndex & (s_cSlots - 1)];
+
+    InterlockedExchange64(&slot.llSequence, 0);
+    slot.pszName = pszName;
+    slot.llStart = llStart;
+    slot.llEnd = llEnd;
+    slot.dwThreadId = GetCurrentThreadId();
+    InterlockedExchange64(&slot.llSequence, llIndex + 1);
+}
+
+void NTAPI SpanTrace::_EnableCallback(_In_ LPCGUID /*pSourceId*/, ULONG ulIsEnabled, UCHAR /*uLevel*/, ULONGLONG /*ullMatchAnyKeyword*/,
+    ULONGLONG /*ullMatchAllKeyword*/, _In_opt_ PEVENT_FILTER_DESCRIPTOR /*pFilterData*/, _Inout_opt_ PVOID /*pCallbackContext*/)
+{
+    switch (ulIsEnabled)
+    {
+    case EVENT_CONTROL_CODE_ENABLE_PROVIDER:
+        s_fEnabled = true;
+        _SetFlushing(true);
+        break;
+
+    case EVENT_CONTROL_CODE_DISABLE_PROVIDER:
+        s_fEnabled = false;
+        _SetFlushing(false);
+        break;
+    }
+}
+
+// Starts or stops the timer that writes the buffered spans to ETW.
+void SpanTrace::_SetFlushing(bool fFlushing)
+{
+    AcquireSRWLockExclusive(&s_flushLock);
+    if (fFlushing && !s_fFlushing)
+    {
+        if (s_pTimer == nullptr)
+        {
+            TP_CALLBACK_ENVIRON callbackEnviron;
+            InitializeThreadpoolEnvironment(&callbackEnviron);
+            SetThreadpoolCallbackLibrary(&callbackEnviron, HINST_THISDLL);
+            s_pTimer = CreateThreadpoolTimer(_FlushCallback, nullptr, &callbackEnviron);
+            DestroyThreadpoolEnvironment(&callbackEnviron);
+        }
+
+        if (s_pTimer != nullptr)
+        {
+            // Spans from before the session started are of no use to it
+            s_llNextRead = s_llNextWrite;
+
+            ULARGE_INTEGER uliDueTime;
+            uliDueTime.QuadPart = static_cast<ULONGLONG>(-static_cast<LONGLONG>(s_dwFlushPeriodMs) * 10000);
+            FILETIME ftDueTime;
+            ftDueTime.dwHighDateTime = uliDueTime.HighPart;
+            ftDueTime.dwLowDateTime = uliDueTime.LowPart;
+            SetThreadpoolTimer(s_pTimer, &ftDueTime, s_dwFlushPeriodMs, s_dwFlushPeriodMs / 10);
+
+            s_fFlushing = true;
+            DllAddRef();
+        }
+    }
+    else if (!fFlushing && s_fFlushing)
+    {
+        SetThreadpoolTimer(s_pTimer, nullptr, 0, 0);
+        s_fFlushing = false;
+        DllRelease();
+    }
+    ReleaseSRWLockExclusive(&s_flushLock);
+}
+
+VOID CALLBACK SpanTrace::_FlushCallback(_Inout_ PTP_CALLBACK_INSTANCE /*pInstance*/, _Inout_opt_ PVOID /*pContext*/, _Inout_ PTP_TIMER /*pTimer*/)
+{
+    AcquireSRWLockExclusive(&s_flushLock);
+    _Flush();
+    ReleaseSRWLockExclusive(&s_flushLock);
+}
+
+// Writes the spans that were recorded since the last flush to ETW. The caller must hold s_flushLock.
+void SpanTrace::_Flush()
+{
+    LARGE_INTEGER liFrequency;
+    QueryPerformanceFrequency(&liFrequency);
+
+    LONG64 llNextWrite = s_llNextWrite;
+    LONG64 cDropped = 0;
+    if (llNextWrite - s_llNextRead > s_cSlots)
+    {
+        cDropped = llNextWrite - s_cSlots - s_llNextRead;
+        s_llNextRead = llNextWrite - s_cSlots;
+    }
+
+    for (; s_llNextRead < llNextWrite; s_llNextRead++)
+    {
+        const SLOT& slot = s_rgSlots[s_llNextRead & (s_cSlots - 1)];
+        LONG64 llSequence = InterlockedCompareExchange64(const_cast<LONG64*>(&slot.llSequence), 0, 0);
+        if (llSequence < s_llNextRead + 1)
+        {
+            // Still being written; pick it up on the next flush
+            break;
+        }
+
+        SLOT span;
+        span.pszName = slot.pszName;
+        span.llStart = slot.llStart;
+        span.llEnd = slot.llEnd;
+        span.dwThreadId = slot.dwThreadId;
+
+        // If a newer span was written into the slot meanwhile, the copy may be torn
+        if (llSequence != s_llNextRead + 1 || InterlockedCompareExchange64(const_cast<LONG64*>(&slot.llSequence), 0, 0) != llSequence)
+        {
+            cDropped++;
+            continue;
+        }
+
+        TraceLoggingWrite(g_hSpanTraceProvider,
+            "Span",
+            TraceLoggingString(span.pszName, "Name"),
+            TraceLoggingInt64(_TicksToMicroseconds(span.llStart, liFrequency.QuadPart), "StartMicroseconds"),
+            TraceLoggingInt64(_TicksToMicroseconds(span.llEnd - span.llStart, liFrequency.QuadPart), "DurationMicroseconds"),
+            TraceLoggingUInt32(span.dwThreadId, "ThreadId"));
+    }
+
+    if (cDropped > 0)
+    {
+        TraceLoggingWrite(g_hSpanTraceProvider,
+            "SpansDropped",
+            TraceLoggingInt64(cDropped, "Count"));
+    }
+}
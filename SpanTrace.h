@@ -0,0 +1,96 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+#include <evntprov.h>
+
+// Records how long the calls from LogonUI (and the stages of a kick) take, for when a kick "took forever".
+//
+// The spans are only recorded while an ETW session listens to the GEWIS-Unlock provider
+// (17cd74a7-61ac-4153-9571-8cdebb7967bf), e.g.:
+//   logman start gewis -p {17cd74a7-61ac-4153-9571-8cdebb7967bf} -o gewis.etl -ets
+// Otherwise a span costs one check of a flag on entry and on exit.
+//
+// Recording a span only writes it into a fixed-size ring buffer (without locks, so the calls are not
+// slowed down by each other); a threadpool timer writes the buffered spans to ETW once a second. If the
+// buffer fills up before that, the oldest spans are dropped and the number of dropped spans is reported.
+class SpanTrace
+{
+public:
+    // Registers the ETW provider; called when the first credential provider is created.
+    static void Register();
+
+    // Unregisters the ETW provider; called from DLL_PROCESS_DETACH.
+    static void Unregister();
+
+    static bool IsEnabled() { return s_fEnabled; }
+
+    // Buffers a span of pszName, which must be a string literal, from llStart to llEnd (QueryPerformanceCounter ticks).
+    static void Record(_In_ PCSTR pszName, LONGLONG llStart, LONGLONG llEnd);
+
+private:
+    static const LONG64 s_cSlots = 1024;    // A power of two.
+
+    struct SLOT
+    {
+        volatile LONG64 llSequence;         // Index of the span in the slot + 1, or 0 while it is written.
+        PCSTR           pszName;
+        LONGLONG        llStart;
+        LONGLONG        llEnd;
+        DWORD           dwThreadId;
+    };
+
+    static void NTAPI _EnableCallback(_In_ LPCGUID pSourceId, ULONG ulIsEnabled, UCHAR uLevel, ULONGLONG ullMatchAnyKeyword,
+        ULONGLONG ullMatchAllKeyword, _In_opt_ PEVENT_FILTER_DESCRIPTOR pFilterData, _Inout_opt_ PVOID pCallbackContext);
+    static VOID CALLBACK _FlushCallback(_Inout_ PTP_CALLBACK_INSTANCE pInstance, _Inout_opt_ PVOID pContext, _Inout_ PTP_TIMER pTimer);
+    static void _Flush();
+    static void _SetFlushing(bool fFlushing);
+
+    static volatile bool    s_fEnabled;
+    static SLOT             s_rgSlots[s_cSlots];
+    static volatile LONG64  s_llNextWrite;      // Index of the next span; only ever increases.
+    static LONG64           s_llNextRead;       // Index of the next span to write to ETW; only used by _Flush.
+    static SRWLOCK          s_flushLock;        // Guards s_llNextRead, s_pTimer and s_fFlushing.
+    static PTP_TIMER        s_pTimer;
+    static bool             s_fFlushing;        // While the timer runs, it holds a reference on the DLL.
+    static volatile LONG    s_fRegistered;
+};
+
+// Records the time from its construction to the end of the scope as a span.
+class TraceSpan
+{
+public:
+    explicit TraceSpan(_In_ PCSTR pszName) :
+        _pszName(pszName),
+        _llStart(0)
+    {
+        if (SpanTrace::IsEnabled())
+        {
+            LARGE_INTEGER li;
+            QueryPerformanceCounter(&li);
+            _llStart = li.QuadPart;
+        }
+    }
+
+    ~TraceSpan()
+    {
+        if (_llStart != 0)
+        {
+            LARGE_INTEGER li;
+            QueryPerformanceCounter(&li);
+            SpanTrace::Record(_pszName, _llStart, li.QuadPart);
+        }
+    }
+
+private:
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    PCSTR       _pszName;
+    LONGLONG    _llStart;   // 0 if tracing was off when the span started.
+};
+
+// Traces the rest of the enclosing function, named after that function.
+#define TRACE_FUNCTION() TraceSpan _traceFunction(__FUNCTION__)
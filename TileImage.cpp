@@ -0,0 +1,216 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "TileImage.h"
+#include "Dll.h"
+#include "resource.h"
+
+TileImage& TileImage::Instance()
+{
+    static TileImage s_image;
+    return s_image;
+}
+
+TileImage::TileImage() :
+    _cxSource(0),
+    _cySource(0)
+{
+    InitializeSRWLock(&_lock);
+}
+
+TileImage::~TileImage()
+{
+    for (POSITION pos = _variants.GetStartPosition(); pos != nullptr; )
+    {
+        DeleteObject(_variants.GetNextValue(pos));
+    }
+}
+
+HRESULT TileImage::GetBitmap(_Outptr_result_nullonfailure_ HBITMAP* phbmp)
+{
+    *phbmp = nullptr;
+    UINT uDpi = _GetScreenDpi();
+
+    // A bitmap can only be used by one thread at a time, so copying also happens under the lock
+    AcquireSRWLockExclusive(&_lock);
+    HRESULT hr = S_OK;
+    HBITMAP hbmpVariant;
+    const CVariantMap::CPair* pVariant = _variants.Lookup(uDpi);
+    if (pVariant != nullptr)
+    {
+        hbmpVariant = pVariant->m_value;
+    }
+    else
+    {
+        hr = _CreateVariant(uDpi, &hbmpVariant);
+        if (SUCCEEDED(hr))
+        {
+            _variants.SetAt(uDpi, hbmpVariant);
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        *phbmp = static_cast<HBITMAP>(CopyImage(hbmpVariant, IMAGE_BITMAP, 0, 0, LR_CREATEDIBSECTION));
+        if (*phbmp == nullptr)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+    ReleaseSRWLockExclusive(&_lock);
+
+    return hr;
+}
+
+UINT TileImage::_GetScreenDpi()
+{
+    UINT uDpi = USER_DEFAULT_SCREEN_DPI;
+    HDC hdc = GetDC(nullptr);
+    if (hdc != nullptr)
+    {
+        uDpi = static_cast<UINT>(GetDeviceCaps(hdc, LOGPIXELSY));
+        ReleaseDC(nullptr, hdc);
+    }
+    return uDpi > 0 ? uDpi : USER_DEFAULT_SCREEN_DPI;
+}
+
+// Reads the pixels of the bitmap resource into _rgPixels, if that was not done before. The caller must hold _lock.
+HRESULT TileImage::_LoadPixels()
+{
+    if (!_rgPixels.IsEmpty())
+    {
+        return S_OK;
+    }
+
+    HBITMAP hbmp = static_cast<HBITMAP>(LoadImage(HINST_THISDLL, MAKEINTRESOURCE(IDB_TILE_IMAGE), IMAGE_BITMAP, 0, 0, LR_CREATEDIBSECTION));
+    if (hbmp == nullptr)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    HRESULT hr = S_OK;
+    BITMAP bm;
+    if (GetObject(hbmp, sizeof(bm), &bm) != 0 && _rgPixels.SetCount(static_cast<size_t>(bm.bmWidth) * bm.bmHeight))
+    {
+        // Ask for top-down A8R8G8B8 rows, whatever the resource is stored as
+        BITMAPINFO bmi = {};
+        bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
+        bmi.bmiHeader.biWidth = bm.bmWidth;
+        bmi.bmiHeader.biHeight = -bm.bmHeight;
+        bmi.bmiHeader.biPlanes = 1;
+        bmi.bmiHeader.biBitCount = 32;
+        bmi.bmiHeader.biCompression = BI_RGB;
+
+        HDC hdc = GetDC(nullptr);
+        if (GetDIBits(hdc, hbmp, 0, bm.bmHeight, _rgPixels.GetData(), &bmi, DIB_RGB_COLORS) == bm.bmHeight)
+        {
+            _cxSource = bm.bmWidth;
+            _cySource = bm.bmHeight;
+        }
+        else
+        {
+            hr = E_FAIL;
+            _rgPixels.RemoveAll();
+        }
+        ReleaseDC(nullptr, hdc);
+    }
+    else
+    {
+        hr = E_OUTOFMEMORY;
+    }
+
+    DeleteObject(hbmp);
+    return hr;
+}
+
+// Makes the tile image for uDpi, resampling the resource (which is meant for 96 DPI) if needed. The caller must hold _lock.
+HRESULT TileImage::_CreateVariant(UINT uDpi, _Outptr_result_nullonfailure_ HBITMAP* phbmp)
+{
+    *phbmp = nullptr;
+    HRESULT hr = _LoadPixels();
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    LONG cx = MulDiv(_cxSource, uDpi, USER_DEFAULT_SCREEN_DPI);
+    LONG cy = MulDiv(_cySource, uDpi, USER_DEFAULT_SCREEN_DPI);
+    if (cx <= 0 || cy <= 0)
+    {
+        cx = _cxSource;
+        cy = _cySource;
+    }
+
+    BITMAPINFO bmi = {};
+    bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
+    bmi.bmiHeader.biWidth = cx;
+    bmi.bmiHeader.biHeight = -cy;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    void* pvBits;
+    HBITMAP hbmp = CreateDIBSection(nullptr, &bmi, DIB_RGB_COLORS, &pvBits, nullptr, 0);
+    if (hbmp == nullptr)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    DWORD* pPixels = static_cast<DWORD*>(pvBits);
+    const DWORD* pSource = _rgPixels.GetData();
+    if (cx == _cxSource && cy == _cySource)
+    {
+        memcpy(pPixels, pSource, _rgPixels.GetCount() * sizeof(DWORD));
+    }
+    else
+    {
+        // Bilinear resampling. Each source pixel is weighed by its alpha (i.e. premultiplied), otherwise
+        // the colour of fully transparent pixels would bleed into the edges of the image.
+        for (LONG y = 0; y < cy; y++)
+        {
+            float fy = (y + 0.5f) * _cySource / cy - 0.5f;
+            fy = fy < 0 ? 0 : fy;
+            LONG y0 = static_cast<LONG>(fy);
+            LONG y1 = y0 + 1 < _cySource ? y0 + 1 : y0;
+            float wy = fy - y0;
+
+            for (LONG x = 0; x < cx; x++)
+            {
+                float fx = (x + 0.5f) * _cxSource / cx - 0.5f;
+                fx = fx < 0 ? 0 : fx;
+                LONG x0 = static_cast<LONG>(fx);
+                LONG x1 = x0 + 1 < _cxSource ? x0 + 1 : x0;
+                float wx = fx - x0;
+
+                const DWORD rgTaps[] = { pSource[y0 * _cxSource + x0], pSource[y0 * _cxSource + x1], pSource[y1 * _cxSource + x0], pSource[y1 * _cxSource + x1] };
+                const float rgWeights[] = { (1 - wx) * (1 - wy), wx * (1 - wy), (1 - wx) * wy, wx * wy };
+
+                float rgfSum[4] = {};   // B, G, R (premultiplied) and A
+                for (int iTap = 0; iTap < ARRAYSIZE(rgTaps); iTap++)
+                {
+                    float fAlpha = static_cast<float>(rgTaps[iTap] >> 24);
+                    for (int iChannel = 0; iChannel < 3; iChannel++)
+                    {
+                        rgfSum[iChannel] += ((rgTaps[iTap] >> (8 * iChannel)) & 0xFF) * fAlpha * rgWeights[iTap];
+                    }
+                    rgfSum[3] += fAlpha * rgWeights[iTap];
+                }
+
+                DWORD dwPixel = static_cast<DWORD>(rgfSum[3] + 0.5f) << 24;
+                if (rgfSum[3] > 0)
+                {
+                    for (int iChannel = 0; iChannel < 3; iChannel++)
+                    {
+                        float fValue = rgfSum[iChannel] / rgfSum[3] + 0.5f;
+                        dwPixel |= static_cast<DWORD>(fValue > 255 ? 255 : fValue) << (8 * iChannel);
+                    }
+                }
+                pPixels[y * cx + x] = dwPixel;
+            }
+        }
+    }
+
+    *phbmp = hbmp;
+    return S_OK;
+}
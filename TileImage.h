@@ -0,0 +1,37 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+
+// Hands out the tile image without decoding the bitmap resource every time LogonUI asks for it.
+//
+// The resource is loaded once, and a variant scaled for each screen DPI we are asked about is made
+// once as well. LogonUI takes ownership of the bitmap it gets, so every caller gets its own copy.
+// The image is 32 bits per pixel with straight (not premultiplied) alpha (A8R8G8B8), like the resource.
+// While scaling, the colours are weighed by their alpha, so transparent edges do not turn dark.
+class TileImage
+{
+public:
+    static TileImage& Instance();
+
+    // Returns a copy of the tile image for the current screen DPI, which the caller must delete.
+    HRESULT GetBitmap(_Outptr_result_nullonfailure_ HBITMAP* phbmp);
+
+private:
+    TileImage();
+    ~TileImage();
+
+    static UINT _GetScreenDpi();
+    HRESULT _CreateVariant(UINT uDpi, _Outptr_result_nullonfailure_ HBITMAP* phbmp);
+    HRESULT _LoadPixels();
+
+    typedef ATL::CAtlMap<UINT, HBITMAP> CVariantMap;
+
+    SRWLOCK                 _lock;          // Guards everything below.
+    CVariantMap             _variants;      // Screen DPI -> the tile image for that DPI.
+    ATL::CAtlArray<DWORD>   _rgPixels;      // The resource as top-down A8R8G8B8 pixels, for making variants.
+    LONG                    _cxSource;
+    LONG                    _cySource;
+};
@@ -0,0 +1,89 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "TimerWheel.h"
+
+TimerWheel::TimerWheel() :
+    _ullTick(0)
+{
+}
+
+void TimerWheel::Reset(ULONGLONG ullTick)
+{
+    for (size_t i = 0; i < s_cSlots; i++)
+    {
+        _rgSlots[i].RemoveAll();
+    }
+    _dueTicks.RemoveAll();
+    _ullTick = ullTick;
+}
+
+HRESULT TimerWheel::Schedule(DWORD dwKey, ULONGLONG ullDueTick)
+{
+    if (ullDueTick <= _ullTick)
+    {
+        ullDueTick = _ullTick + 1;
+    }
+
+    ENTRY entry = { dwKey, ullDueTick };
+    if (_rgSlots[ullDueTick % s_cSlots].Add(entry) == static_cast<size_t>(-1))
+    {
+        return E_OUTOFMEMORY;
+    }
+    _dueTicks.SetAt(dwKey, ullDueTick);
+    return S_OK;
+}
+
+void TimerWheel::Cancel(DWORD dwKey)
+{
+    _dueTicks.RemoveKey(dwKey);
+}
+
+bool TimerWheel::IsScheduled(DWORD dwKey) const
+{
+    return _dueTicks.Lookup(dwKey) != nullptr;
+}
+
+HRESULT TimerWheel::Advance(ULONGLONG ullTick, _Inout_ ATL::CAtlArray<DWORD>* prgExpired)
+{
+    if (ullTick <= _ullTick)
+    {
+        return S_OK;
+    }
+
+    // After a full turn every slot has been looked at, however many ticks passed
+    ULONGLONG cSteps = ullTick - _ullTick;
+    if (cSteps > s_cSlots)
+    {
+        cSteps = s_cSlots;
+    }
+
+    HRESULT hr = S_OK;
+    for (ULONGLONG ullStep = 1; SUCCEEDED(hr) && ullStep <= cSteps; ullStep++)
+    {
+        ATL::CAtlArray<ENTRY>& rgSlot = _rgSlots[(_ullTick + ullStep) % s_cSlots];
+        for (size_t i = rgSlot.GetCount(); SUCCEEDED(hr) && i-- > 0; )
+        {
+            const ENTRY& entry = rgSlot[i];
+            const ATL::CAtlMap<DWORD, ULONGLONG>::CPair* pDue = _dueTicks.Lookup(entry.dwKey);
+            if (pDue == nullptr || pDue->m_value != entry.ullDueTick)
+            {
+                // Cancelled or rescheduled
+                rgSlot.RemoveAt(i);
+            }
+            else if (entry.ullDueTick <= ullTick)
+            {
+                hr = prgExpired->Add(entry.dwKey) != static_cast<size_t>(-1) ? S_OK : E_OUTOFMEMORY;
+                if (SUCCEEDED(hr))
+                {
+                    _dueTicks.RemoveKey(entry.dwKey);
+                    rgSlot.RemoveAt(i);
+                }
+            }
+        }
+    }
+
+    _ullTick = ullTick;
+    return hr;
+}
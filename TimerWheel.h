@@ -0,0 +1,45 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+
+// Deadlines for a set of keys (e.g. session IDs), in whole ticks of a clock that the caller advances.
+//
+// Keys are hashed by their deadline into a fixed number of slots, so Advance only looks at the slots of the
+// ticks that passed instead of at every key. A deadline further away than one turn of the wheel stays in
+// its slot until the turn in which it is due. Rescheduling or cancelling a key does not search the slots;
+// the old entry is recognised as stale and dropped when its slot comes around.
+class TimerWheel
+{
+public:
+    TimerWheel();
+
+    // Starts over at ullTick, without any keys.
+    void Reset(ULONGLONG ullTick);
+
+    // Sets the deadline of dwKey, replacing the previous one. A deadline that has passed expires on the next tick.
+    HRESULT Schedule(DWORD dwKey, ULONGLONG ullDueTick);
+
+    void Cancel(DWORD dwKey);
+
+    bool IsScheduled(DWORD dwKey) const;
+
+    // Moves the wheel forward to ullTick and adds the keys whose deadline passed to prgExpired.
+    // Expired keys are no longer scheduled.
+    HRESULT Advance(ULONGLONG ullTick, _Inout_ ATL::CAtlArray<DWORD>* prgExpired);
+
+private:
+    static const size_t s_cSlots = 64;
+
+    struct ENTRY
+    {
+        DWORD       dwKey;
+        ULONGLONG   ullDueTick;
+    };
+
+    ATL::CAtlArray<ENTRY>               _rgSlots[s_cSlots];     // Indexed by deadline modulo s_cSlots.
+    ATL::CAtlMap<DWORD, ULONGLONG>      _dueTicks;              // The current deadline of every key; entries in _rgSlots that differ are stale.
+    ULONGLONG                           _ullTick;               // The last tick that Advance handled.
+};
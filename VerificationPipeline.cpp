@@ -0,0 +1,138 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "VerificationPipeline.h"
+#include "Dll.h"
+
+VerificationPipeline::VerificationPipeline() :
+    _pContext(nullptr),
+    _hwndNotify(nullptr),
+    _uMsgProgress(0),
+    _uMsgDone(0),
+    _hThread(nullptr),
+    _fRunning(FALSE),
+    _fCancelled(FALSE),
+    _hCancelEvent(CreateEventW(nullptr, TRUE, FALSE, nullptr)),
+    _hrResult(S_OK)
+{
+}
+
+VerificationPipeline::~VerificationPipeline()
+{
+    Cancel();
+    Wait();
+    if (_hCancelEvent != nullptr)
+    {
+        CloseHandle(_hCancelEvent);
+    }
+}
+
+HRESULT VerificationPipeline::AddStage(_In_ PCWSTR pszProgress, _In_ PFN_STAGE pfnStage)
+{
+    STAGE stage = { pszProgress, pfnStage };
+    _rgStages.Add(stage);
+    return S_OK;
+}
+
+HRESULT VerificationPipeline::Start(_Inout_ void* pContext, _In_ HWND hwndNotify, UINT uMsgProgress, UINT uMsgDone)
+{
+    if (IsRunning())
+    {
+        return HRESULT_FROM_WIN32(ERROR_BUSY);
+    }
+    if (_hCancelEvent == nullptr)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    // Clean up after the previous run, if any
+    Wait();
+
+    _pContext = pContext;
+    _hwndNotify = hwndNotify;
+    _uMsgProgress = uMsgProgress;
+    _uMsgDone = uMsgDone;
+    InterlockedExchange(&_fCancelled, FALSE);
+    ResetEvent(_hCancelEvent);
+    InterlockedExchange(&_hrResult, S_OK);
+    InterlockedExchange(&_fRunning, TRUE);
+
+    HRESULT hr = S_OK;
+    DllAddRef();
+    _hThread = CreateThread(nullptr, 0, _ThreadProc, this, 0, nullptr);
+    if (_hThread == nullptr)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        InterlockedExchange(&_fRunning, FALSE);
+        DllRelease();
+    }
+    return hr;
+}
+
+void VerificationPipeline::Cancel()
+{
+    InterlockedExchange(&_fCancelled, TRUE);
+    if (_hCancelEvent != nullptr)
+    {
+        SetEvent(_hCancelEvent);
+    }
+}
+
+void VerificationPipeline::Wait()
+{
+    if (_hThread != nullptr)
+    {
+        WaitForSingleObject(_hThread, INFINITE);
+        CloseHandle(_hThread);
+        _hThread = nullptr;
+    }
+}
+
+bool VerificationPipeline::IsRunning()
+{
+    return InterlockedCompareExchange(&_fRunning, FALSE, FALSE) != FALSE;
+}
+
+bool VerificationPipeline::IsCancelled()
+{
+    return InterlockedCompareExchange(&_fCancelled, FALSE, FALSE) != FALSE;
+}
+
+PCWSTR VerificationPipeline::GetStageProgress(size_t iStage) const
+{
+    return iStage < _rgStages.GetCount() ? _rgStages[iStage].pszProgress : L"";
+}
+
+HRESULT VerificationPipeline::GetResult()
+{
+    return IsCancelled() ? HRESULT_FROM_WIN32(ERROR_CANCELLED) : static_cast<HRESULT>(InterlockedCompareExchange(&_hrResult, 0, 0));
+}
+
+DWORD WINAPI VerificationPipeline::_ThreadProc(_In_ LPVOID lpParameter)
+{
+    static_cast<VerificationPipeline*>(lpParameter)->_Run();
+    DllRelease();
+    return 0;
+}
+
+void VerificationPipeline::_Run()
+{
+    HRESULT hr = S_OK;
+    for (size_t i = 0; hr == S_OK && i < _rgStages.GetCount(); i++)
+    {
+        if (IsCancelled())
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_CANCELLED);
+        }
+        else
+        {
+            PostMessage(_hwndNotify, _uMsgProgress, i, 0);
+            hr = _rgStages[i].pfnStage(_pContext);
+        }
+    }
+
+    InterlockedExchange(&_hrResult, hr);
+    InterlockedExchange(&_fRunning, FALSE);
+    PostMessage(_hwndNotify, _uMsgDone, 0, 0);
+}
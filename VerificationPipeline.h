@@ -0,0 +1,70 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+
+// Runs a fixed sequence of slow stages (e.g. logon, group check, sign off) on a background thread,
+// so GetSerialization does not have to block LogonUI while talking to a domain controller.
+//
+// Before each stage, uMsgProgress is posted to hwndNotify with the index of the stage as WPARAM.
+// When the pipeline is finished (completed, decided early, failed or cancelled) uMsgDone is posted.
+// The window lives on the apartment thread, so the owner can update its fields from there.
+class VerificationPipeline
+{
+public:
+    // A stage returns S_OK to continue with the next stage, S_FALSE when the outcome is decided
+    // and no further stages should run, or a failure code to stop.
+    typedef HRESULT (*PFN_STAGE)(_Inout_ void* pContext);
+
+    VerificationPipeline();
+    ~VerificationPipeline();
+
+    HRESULT AddStage(_In_ PCWSTR pszProgress, _In_ PFN_STAGE pfnStage);
+
+    // pContext is passed to every stage and must stay valid until the pipeline is finished.
+    HRESULT Start(_Inout_ void* pContext, _In_ HWND hwndNotify, UINT uMsgProgress, UINT uMsgDone);
+
+    // Stages that have not started yet will not run. A stage that is running is only interrupted if it
+    // waits for GetCancelEvent; either way, its outcome is ignored.
+    void Cancel();
+
+    // Signalled once the pipeline is cancelled, for stages that wait for something.
+    HANDLE GetCancelEvent() const
+    {
+        return _hCancelEvent;
+    }
+
+    // Waits for the background thread to finish, after which the pipeline can be started again.
+    void Wait();
+
+    bool IsRunning();
+    bool IsCancelled();
+
+    PCWSTR GetStageProgress(size_t iStage) const;
+
+    // The result of the last stage that ran, or HRESULT_FROM_WIN32(ERROR_CANCELLED).
+    HRESULT GetResult();
+
+private:
+    struct STAGE
+    {
+        PCWSTR      pszProgress;
+        PFN_STAGE   pfnStage;
+    };
+
+    static DWORD WINAPI _ThreadProc(_In_ LPVOID lpParameter);
+    void _Run();
+
+    ATL::CAtlArray<STAGE>   _rgStages;
+    void*                   _pContext;
+    HWND                    _hwndNotify;
+    UINT                    _uMsgProgress;
+    UINT                    _uMsgDone;
+    HANDLE                  _hThread;
+    volatile LONG           _fRunning;
+    volatile LONG           _fCancelled;
+    HANDLE                  _hCancelEvent;  // Manual reset; set along with _fCancelled.
+    volatile LONG           _hrResult;
+};
@@ -0,0 +1,174 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "WarmState.h"
+#include "Dll.h"
+
+WarmState& WarmState::Instance()
+{
+    static WarmState s_state;
+    return s_state;
+}
+
+WarmState::WarmState() :
+    _cUsers(0),
+    _rgTasks()
+{
+    InitializeSRWLock(&_lock);
+}
+
+WarmState::~WarmState()
+{
+    // The work items are closed by the last Release
+}
+
+void WarmState::AddRef()
+{
+    AcquireSRWLockExclusive(&_lock);
+    if (_cUsers++ == 0)
+    {
+        // Without a work item, the getters simply do that work themselves
+        TP_CALLBACK_ENVIRON callbackEnviron;
+        InitializeThreadpoolEnvironment(&callbackEnviron);
+        SetThreadpoolCallbackLibrary(&callbackEnviron, HINST_THISDLL);
+        for (size_t i = 0; i < TI_COUNT; i++)
+        {
+            _rgTasks[i].pWork = CreateThreadpoolWork(_WorkCallback, &_rgTasks[i], &callbackEnviron);
+        }
+        DestroyThreadpoolEnvironment(&callbackEnviron);
+    }
+    ReleaseSRWLockExclusive(&_lock);
+}
+
+void WarmState::Release()
+{
+    PTP_WORK rgpWork[TI_COUNT] = {};
+    AcquireSRWLockExclusive(&_lock);
+    if (_cUsers > 0 && --_cUsers == 0)
+    {
+        for (size_t i = 0; i < TI_COUNT; i++)
+        {
+            rgpWork[i] = _rgTasks[i].pWork;
+            _rgTasks[i].pWork = nullptr;
+        }
+    }
+    ReleaseSRWLockExclusive(&_lock);
+
+    // Not under _lock, which the callbacks take to store their result
+    bool fClosed = false;
+    for (size_t i = 0; i < TI_COUNT; i++)
+    {
+        if (rgpWork[i] != nullptr)
+        {
+            WaitForThreadpoolWorkCallbacks(rgpWork[i], TRUE);
+            CloseThreadpoolWork(rgpWork[i]);
+            fClosed = true;
+        }
+    }
+
+    if (fClosed)
+    {
+        // The next provider should not get results that are this old
+        AcquireSRWLockExclusive(&_lock);
+        for (size_t i = 0; i < TI_COUNT; i++)
+        {
+            if (_rgTasks[i].pWork == nullptr)
+            {
+                _rgTasks[i].fSubmitted = false;
+                _rgTasks[i].fDone = false;
+            }
+        }
+        _rgRunning.RemoveAll();
+        ReleaseSRWLockExclusive(&_lock);
+    }
+}
+
+void WarmState::Prefetch()
+{
+    AcquireSRWLockExclusive(&_lock);
+    for (size_t i = 0; i < TI_COUNT; i++)
+    {
+        TASK& task = _rgTasks[i];
+
+        // Work that is still running is recent enough
+        if (task.pWork != nullptr && (!task.fSubmitted || task.fDone))
+        {
+            task.fSubmitted = true;
+            task.fDone = false;
+            SubmitThreadpoolWork(task.pWork);
+        }
+    }
+    ReleaseSRWLockExclusive(&_lock);
+}
+
+HRESULT WarmState::GetRunningProtectedApps(_Out_ ATL::CAtlArray<RUNNING_APP>* prgRunning)
+{
+    _Join(TI_PROTECTED_APPS);
+
+    AcquireSRWLockExclusive(&_lock);
+    TASK& task = _rgTasks[TI_PROTECTED_APPS];
+    bool fPrefetched = task.fDone;
+    HRESULT hr = task.hr;
+    if (fPrefetched)
+    {
+        prgRunning->Copy(_rgRunning);
+        _rgRunning.RemoveAll();
+        task.fSubmitted = false;
+        task.fDone = false;
+    }
+    ReleaseSRWLockExclusive(&_lock);
+
+    return fPrefetched ? hr : GetRunningProtectedApplications(prgRunning);
+}
+
+HRESULT WarmState::GetNegotiateAuthPackage(_Out_ ULONG* pulAuthPackage)
+{
+    // The background work fills the process-wide cache; if it failed, this tries again
+    _Join(TI_AUTH_PACKAGE);
+    return RetrieveNegotiateAuthPackage(pulAuthPackage);
+}
+
+VOID CALLBACK WarmState::_WorkCallback(_Inout_ PTP_CALLBACK_INSTANCE /*pInstance*/, _Inout_opt_ PVOID pContext, _Inout_ PTP_WORK /*pWork*/)
+{
+    WarmState& state = Instance();
+    TASK* pTask = static_cast<TASK*>(pContext);
+    TASK_ID id = static_cast<TASK_ID>(pTask - state._rgTasks);
+
+    HRESULT hr = S_OK;
+    ATL::CAtlArray<RUNNING_APP> rgRunning;
+    ULONG ulAuthPackage;
+    switch (id)
+    {
+    case TI_PROTECTED_APPS:
+        hr = GetRunningProtectedApplications(&rgRunning);
+        break;
+
+    case TI_AUTH_PACKAGE:
+        hr = RetrieveNegotiateAuthPackage(&ulAuthPackage);
+        break;
+    }
+
+    AcquireSRWLockExclusive(&state._lock);
+    if (id == TI_PROTECTED_APPS)
+    {
+        state._rgRunning.Copy(rgRunning);
+    }
+    pTask->hr = hr;
+    pTask->fDone = true;
+    ReleaseSRWLockExclusive(&state._lock);
+}
+
+// Waits for the work of the last Prefetch, if it was started.
+void WarmState::_Join(TASK_ID id)
+{
+    AcquireSRWLockShared(&_lock);
+    const TASK& task = _rgTasks[id];
+    PTP_WORK pWork = (task.fSubmitted && !task.fDone) ? task.pWork : nullptr;
+    ReleaseSRWLockShared(&_lock);
+
+    if (pWork != nullptr)
+    {
+        WaitForThreadpoolWorkCallbacks(pWork, FALSE);
+    }
+}
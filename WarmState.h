@@ -0,0 +1,60 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "helpers.h"
+
+// What the provider needs right after SetUsageScenario, fetched in the background.
+//
+// Before showing our tile, LogonUI calls GetCredentialCount, which creates the credential; that scans the
+// processes for protected applications. Submitting then connects to LSA for the authentication package.
+// Prefetch (called from SetUsageScenario) starts each of these on the threadpool at the same time, so they
+// overlap with each other and with whatever LogonUI does in between. The getters join on the background work:
+// they wait for it if it is still running and use its result, or do the work on the spot if it was never started.
+class WarmState
+{
+public:
+    static WarmState& Instance();
+
+    // The provider keeps the work items available with AddRef/Release.
+    void AddRef();
+    void Release();
+
+    // Starts fetching everything in the background. Results of an earlier Prefetch are dropped.
+    void Prefetch();
+
+    // The prefetched result is used once, by the credential that is created for the tile;
+    // later calls scan again, as the applications that run may have changed meanwhile.
+    HRESULT GetRunningProtectedApps(_Out_ ATL::CAtlArray<RUNNING_APP>* prgRunning);
+
+    HRESULT GetNegotiateAuthPackage(_Out_ ULONG* pulAuthPackage);
+
+private:
+    WarmState();
+    ~WarmState();
+
+    enum TASK_ID
+    {
+        TI_PROTECTED_APPS,
+        TI_AUTH_PACKAGE,
+        TI_COUNT,
+    };
+
+    // One piece of background work. All fields are guarded by _lock.
+    struct TASK
+    {
+        PTP_WORK        pWork;
+        bool            fSubmitted;     // Since the last Prefetch; the getters wait for the work if it is set.
+        bool            fDone;          // Whether the result of the work is available.
+        HRESULT         hr;
+    };
+
+    static VOID CALLBACK _WorkCallback(_Inout_ PTP_CALLBACK_INSTANCE pInstance, _Inout_opt_ PVOID pContext, _Inout_ PTP_WORK pWork);
+    void _Join(TASK_ID id);
+
+    SRWLOCK                         _lock;          // Guards _cUsers, the tasks and their results.
+    long                            _cUsers;
+    TASK                            _rgTasks[TI_COUNT];
+    ATL::CAtlArray<RUNNING_APP>     _rgRunning;     // Result of TI_PROTECTED_APPS.
+};
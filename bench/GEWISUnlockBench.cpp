@@ -0,0 +1,583 @@
+//
+// GEWIS, 2020-2023
+//
+
+// Times the parts of the provider that do not need LogonUI: packing the logon buffer, parsing account names,
+// checking token groups, matching running processes against the protected applications, storing a keystroke
+// in a field, the reclaim timer wheel and following a sign-out. Each benchmark is run with more and more
+// iterations until it takes long enough to time, and reported in nanoseconds per operation.
+//
+// Allocations are counted with the allocation hook of the debug CRT, which sees malloc, calloc, realloc and
+// operator new (so also the growth of CAtlArray and CAtlMap). A Release build is needed for meaningful
+// times and a Debug build for the allocation counts, so a Release build reports no counts. CStringW buffers
+// come from the process heap and are not counted; the process matching reuses one for every name, so it would
+// not allocate once that is large enough anyway.
+//
+// Usage: GEWISUnlockBench [--json]
+
+#include "AccountName.h"
+#include "LogoffTracker.h"
+#include "ProcessIndex.h"
+#include "SecureFieldBuffer.h"
+#include "SidSet.h"
+#include "TimerWheel.h"
+#include "FakeSessionSource.h"
+#include <crtdbg.h>
+#include <stdio.h>
+
+// Keeps the compiler from dropping work whose result is not used.
+static volatile ULONG_PTR s_ulSink;
+
+// ProcessIndex keeps the DLL loaded while its watcher thread runs; there is no DLL here.
+void DllAddRef()
+{
+}
+
+void DllRelease()
+{
+}
+
+#ifdef _DEBUG
+static bool s_fCounting = false;
+static ULONGLONG s_cAllocs = 0;
+static ULONGLONG s_cbAllocated = 0;
+
+static int __cdecl _AllocHook(int nAllocType, void* /* pvData */, size_t nSize, int nBlockUse, long /* lRequest */,
+    const unsigned char* /* pszFileName */, int /* nLine */)
+{
+    // Reallocating is counted too: growing an array costs as much as allocating it
+    if (s_fCounting && nBlockUse != _CRT_BLOCK && (nAllocType == _HOOK_ALLOC || nAllocType == _HOOK_REALLOC))
+    {
+        s_cAllocs++;
+        s_cbAllocated += nSize;
+    }
+    return TRUE;
+}
+#endif
+
+//
+// KerbSerializer
+//
+
+static const WCHAR s_wszDomain[] = L"GEWISWG";
+static const WCHAR s_wszUsername[] = L"m1234";
+static const WCHAR s_wszPassword[] = L"correct horse battery staple";
+
+static KerbSerializer::LOGON _GetLogon()
+{
+    KerbSerializer::LOGON logon;
+    logon.uMessageType = 2;     // KerbWorkstationUnlockLogon
+    logon.domain = { s_wszDomain, sizeof(s_wszDomain) - sizeof(WCHAR) };
+    logon.username = { s_wszUsername, sizeof(s_wszUsername) - sizeof(WCHAR) };
+    logon.password = { s_wszPassword, sizeof(s_wszPassword) - sizeof(WCHAR) };
+    return logon;
+}
+
+static void _BenchKerbWrite(ULONGLONG cOps)
+{
+    KerbSerializer::LOGON logon = _GetLogon();
+    uint8_t rgb[256];
+    for (ULONGLONG i = 0; i < cOps; i++)
+    {
+        KerbSerializer::Write(KerbSerializer::KSL_NATIVE, logon, rgb);
+        s_ulSink = rgb[0];
+    }
+}
+
+static void _BenchKerbRead(ULONGLONG cOps)
+{
+    KerbSerializer::LOGON logon = _GetLogon();
+    uint8_t rgb[256];
+    size_t cb = KerbSerializer::GetPackedSize(KerbSerializer::KSL_NATIVE, logon);
+    KerbSerializer::Write(KerbSerializer::KSL_NATIVE, logon, rgb);
+    for (ULONGLONG i = 0; i < cOps; i++)
+    {
+        KerbSerializer::LOGON read;
+        s_ulSink = KerbSerializer::Read(KerbSerializer::KSL_NATIVE, rgb, cb, &read);
+    }
+}
+
+// What a 64-bit LogonUI does with the serialization of a 32-bit provider.
+static void _BenchKerbConvert(ULONGLONG cOps)
+{
+    KerbSerializer::LOGON logon = _GetLogon();
+    uint8_t rgb32[256];
+    uint8_t rgb64[256];
+    size_t cb32 = KerbSerializer::GetPackedSize(KerbSerializer::KSL_32, logon);
+    KerbSerializer::Write(KerbSerializer::KSL_32, logon, rgb32);
+    for (ULONGLONG i = 0; i < cOps; i++)
+    {
+        KerbSerializer::LOGON read;
+        if (KerbSerializer::Read(KerbSerializer::KSL_32, rgb32, cb32, &read) == KerbSerializer::KSR_OK)
+        {
+            KerbSerializer::Write(KerbSerializer::KSL_64, read, rgb64);
+        }
+        s_ulSink = rgb64[0];
+    }
+}
+
+//
+// AccountName
+//
+
+static void _BenchParseAccountName(ULONGLONG cOps)
+{
+    static const PCWSTR s_rgpszNames[] = { L"m1234", L"GEWISWG\\m1234", L"m1234@gewis.nl", L".\\beheer" };
+    for (ULONGLONG i = 0; i < cOps; i++)
+    {
+        ACCOUNT_NAME name;
+        s_ulSink = ParseAccountName(s_rgpszNames[i % ARRAYSIZE(s_rgpszNames)], L"GEWISWG", &name);
+    }
+}
+
+static void _BenchIsSameAccount(ULONGLONG cOps)
+{
+    ACCOUNT_NAME name1;
+    ACCOUNT_NAME name2;
+    ParseAccountName(L"GEWISWG\\M1234", L"GEWISWG", &name1);
+    ParseAccountName(L"m1234", L"gewiswg", &name2);
+    for (ULONGLONG i = 0; i < cOps; i++)
+    {
+        s_ulSink = IsSameAccount(name1, name2);
+    }
+}
+
+//
+// SidSet
+//
+
+static const size_t s_cTokenGroups = 40;
+static const size_t s_cConfiguredGroups = 6;
+
+// S-1-5-21-1004336348-1177238915-682003330-dwRid, a group in a made-up domain.
+static void _InitDomainSid(DWORD dwRid, _Out_writes_bytes_(SECURITY_MAX_SID_SIZE) BYTE* pbSid)
+{
+    SID_IDENTIFIER_AUTHORITY authority = SECURITY_NT_AUTHORITY;
+    InitializeSid(pbSid, &authority, 5);
+    *GetSidSubAuthority(pbSid, 0) = SECURITY_NT_NON_UNIQUE;
+    *GetSidSubAuthority(pbSid, 1) = 1004336348;
+    *GetSidSubAuthority(pbSid, 2) = 1177238915;
+    *GetSidSubAuthority(pbSid, 3) = 682003330;
+    *GetSidSubAuthority(pbSid, 4) = dwRid;
+}
+
+static void _BenchSidSetAdd(ULONGLONG cOps)
+{
+    BYTE rgbSids[s_cConfiguredGroups][SECURITY_MAX_SID_SIZE];
+    for (size_t i = 0; i < s_cConfiguredGroups; i++)
+    {
+        _InitDomainSid(static_cast<DWORD>(5000 + i), rgbSids[i]);
+    }
+
+    // One operation is filling a set the size of a typical configuration
+    for (ULONGLONG i = 0; i < cOps; i++)
+    {
+        SidSet set;
+        for (size_t j = 0; j < s_cConfiguredGroups; j++)
+        {
+            set.Add(rgbSids[j], j % 2 == 0 ? AR_KICK : AR_ALL);
+        }
+        s_ulSink = set.GetCount();
+    }
+}
+
+// A token with s_cTokenGroups groups, of which the last one is configured: the usual case, in which every
+// group has to be looked up.
+static void _BenchSidSetLookupGroups(ULONGLONG cOps)
+{
+    SidSet set;
+    BYTE rgbSid[SECURITY_MAX_SID_SIZE];
+    for (size_t i = 0; i < s_cConfiguredGroups; i++)
+    {
+        _InitDomainSid(static_cast<DWORD>(5000 + i), rgbSid);
+        set.Add(rgbSid, AR_KICK);
+    }
+
+    BYTE rgbGroups[FIELD_OFFSET(TOKEN_GROUPS, Groups) + s_cTokenGroups * sizeof(SID_AND_ATTRIBUTES)];
+    BYTE rgbTokenSids[s_cTokenGroups][SECURITY_MAX_SID_SIZE];
+    TOKEN_GROUPS* pGroups = reinterpret_cast<TOKEN_GROUPS*>(rgbGroups);
+    pGroups->GroupCount = static_cast<DWORD>(s_cTokenGroups);
+    for (size_t i = 0; i < s_cTokenGroups; i++)
+    {
+        _InitDomainSid(i + 1 == s_cTokenGroups ? 5000 : static_cast<DWORD>(1000 + i), rgbTokenSids[i]);
+        pGroups->Groups[i].Sid = rgbTokenSids[i];
+        pGroups->Groups[i].Attributes = SE_GROUP_ENABLED;
+    }
+
+    for (ULONGLONG i = 0; i < cOps; i++)
+    {
+        s_ulSink = set.LookupGroups(pGroups);
+    }
+}
+
+//
+// ProcessIndex
+//
+
+// Protected applications as in the registry, e.g. Multivers and a few others.
+static const PCWSTR s_rgpszProtectedApps[] = { L"Multi.exe", L"MultiversOnline.exe", L"Exact.exe", L"AFAS.exe", L"Twinfield.exe" };
+
+// Executables of a busy terminal server: most processes are instances of the same few, a few run once.
+static const PCWSTR s_rgpszCommonExes[] = { L"svchost.exe", L"chrome.exe", L"msedge.exe", L"RuntimeBroker.exe",
+    L"explorer.exe", L"conhost.exe", L"OUTLOOK.EXE", L"Teams.exe", L"sihost.exe", L"ctfmon.exe" };
+
+// Matches a table of cProcesses running processes against the protected applications, as ProcessIndex does with a snapshot
+// of the processes: every name is case-folded and looked up. One operation is one process, so tables of different sizes
+// can be compared; one of every 500 processes is a protected application.
+static void _MatchProcesses(DWORD cProcesses, ULONGLONG cOps)
+{
+    CProtectedAppMap apps;
+    ATL::CStringW strFolded;
+    for (size_t i = 0; i < ARRAYSIZE(s_rgpszProtectedApps); i++)
+    {
+        ProcessIndex::FoldExeName(s_rgpszProtectedApps[i], &strFolded);
+        apps.SetAt(strFolded, s_rgpszProtectedApps[i]);
+    }
+
+    ATL::CAtlArray<ATL::CStringW> rgProcesses;
+    rgProcesses.SetCount(cProcesses);
+    for (DWORD i = 0; i < cProcesses; i++)
+    {
+        if (i % 500 == 499)
+        {
+            rgProcesses[i] = s_rgpszProtectedApps[i / 500 % ARRAYSIZE(s_rgpszProtectedApps)];
+        }
+        else if (i % 4 == 3)
+        {
+            rgProcesses[i].Format(L"Tool%u.exe", i);
+        }
+        else
+        {
+            rgProcesses[i] = s_rgpszCommonExes[i % ARRAYSIZE(s_rgpszCommonExes)];
+        }
+    }
+
+    ULONG_PTR cMatches = 0;
+    for (ULONGLONG i = 0; i < cOps; i++)
+    {
+        ProcessIndex::FoldExeName(rgProcesses[static_cast<size_t>(i % cProcesses)], &strFolded);
+        cMatches += apps.Lookup(strFolded) != nullptr;
+    }
+    s_ulSink = cMatches;
+}
+
+static void _BenchMatchProcesses100(ULONGLONG cOps)
+{
+    _MatchProcesses(100, cOps);
+}
+
+static void _BenchMatchProcesses1000(ULONGLONG cOps)
+{
+    _MatchProcesses(1000, cOps);
+}
+
+static void _BenchMatchProcesses10000(ULONGLONG cOps)
+{
+    _MatchProcesses(10000, cOps);
+}
+
+//
+// SecureFieldBuffer
+//
+
+// One keystroke in the password field: LogonUI sets the whole value again, one character longer each time,
+// until the password is complete and it starts over.
+static void _BenchSecureFieldSet(ULONGLONG cOps)
+{
+    const size_t cchPassword = ARRAYSIZE(s_wszPassword) - 1;
+    WCHAR rgwszTyped[ARRAYSIZE(s_wszPassword)][ARRAYSIZE(s_wszPassword)];
+    for (size_t cch = 0; cch <= cchPassword; cch++)
+    {
+        wcsncpy_s(rgwszTyped[cch], s_wszPassword, cch);
+    }
+
+    SecureFieldBuffer field;
+    if (FAILED(field.Initialize()))
+    {
+        return;
+    }
+    for (ULONGLONG i = 0; i < cOps; i++)
+    {
+        field.Set(rgwszTyped[i % (cchPassword + 1)]);
+    }
+    s_ulSink = field.Get()[0];
+}
+
+//
+// TimerWheel
+//
+
+static const DWORD s_cSessions = 32;
+
+// Rescheduling a session when it shows input, as ReclaimScheduler does on every scan, without any expiring.
+// The wheel is advanced after every s_cSessions operations so the stale entries are dropped as they would be.
+static void _BenchTimerWheelSchedule(ULONGLONG cOps)
+{
+    TimerWheel wheel;
+    ATL::CAtlArray<DWORD> rgExpired;
+    wheel.Reset(0);
+    for (ULONGLONG i = 0; i < cOps; i++)
+    {
+        ULONGLONG ullTick = i / s_cSessions;
+        if (i % s_cSessions == 0)
+        {
+            wheel.Advance(ullTick, &rgExpired);
+        }
+        wheel.Schedule(static_cast<DWORD>(i % s_cSessions), ullTick + 30 + i % 200);
+    }
+    s_ulSink = wheel.IsScheduled(0) + rgExpired.GetCount();
+}
+
+// One tick of a wheel with s_cSessions sessions, one of which expires and is scheduled again.
+static void _BenchTimerWheelAdvance(ULONGLONG cOps)
+{
+    TimerWheel wheel;
+    ATL::CAtlArray<DWORD> rgExpired;
+    wheel.Reset(0);
+    for (DWORD dwKey = 0; dwKey < s_cSessions; dwKey++)
+    {
+        wheel.Schedule(dwKey, dwKey + 1);
+    }
+
+    for (ULONGLONG ullTick = 1; ullTick <= cOps; ullTick++)
+    {
+        rgExpired.RemoveAll();
+        wheel.Advance(ullTick, &rgExpired);
+        for (size_t i = 0; i < rgExpired.GetCount(); i++)
+        {
+            wheel.Schedule(rgExpired[i], ullTick + s_cSessions);
+        }
+    }
+    s_ulSink = wheel.IsScheduled(0);
+}
+
+//
+// LogoffTracker
+//
+
+static const DWORD s_cTargets = 8;
+
+static void _AddTargets(_Inout_ FakeSessionSource* pSource, _Inout_ ATL::CAtlArray<SESSION_INFO>* prgTargets,
+    _Inout_ ATL::CAtlArray<HRESULT>* prgIssued)
+{
+    for (DWORD i = 0; i < s_cTargets; i++)
+    {
+        ATL::CStringW strUser;
+        strUser.Format(L"GEWISWG\\m%u", 1000 + i);
+        pSource->AddSession(2 + i, strUser, true, false, false, FLB_HUNG);
+    }
+    pSource->Enumerate(prgTargets);
+    for (size_t i = 0; i < prgTargets->GetCount(); i++)
+    {
+        prgIssued->Add(S_OK);
+    }
+}
+
+static void _BenchLogoffTrackerStart(ULONGLONG cOps)
+{
+    FakeSessionSource source;
+    ATL::CAtlArray<SESSION_INFO> rgTargets;
+    ATL::CAtlArray<HRESULT> rgIssued;
+    LogoffTracker tracker;
+    _AddTargets(&source, &rgTargets, &rgIssued);
+    for (ULONGLONG i = 0; i < cOps; i++)
+    {
+        tracker.Start(rgTargets, rgIssued, i, 60 * 1000);
+        tracker.Reset();
+    }
+}
+
+// One timer tick of the credential while s_cTargets sessions are still signing out.
+static void _BenchLogoffTrackerPoll(ULONGLONG cOps)
+{
+    FakeSessionSource source;
+    ATL::CAtlArray<SESSION_INFO> rgTargets;
+    ATL::CAtlArray<HRESULT> rgIssued;
+    LogoffTracker tracker;
+    _AddTargets(&source, &rgTargets, &rgIssued);
+    tracker.Start(rgTargets, rgIssued, 0, ~0ULL / 2);
+    for (ULONGLONG i = 0; i < cOps; i++)
+    {
+        s_ulSink = tracker.Poll(&source, i);
+        tracker.OnTick(i);
+    }
+}
+
+//
+// Running and reporting
+//
+
+typedef void (*PFN_BENCH)(ULONGLONG cOps);
+
+struct BENCH
+{
+    PCWSTR      pszName;
+    PFN_BENCH   pfnBench;
+};
+
+static const BENCH s_rgBenches[] =
+{
+    { L"KerbSerializer/Write",      _BenchKerbWrite },
+    { L"KerbSerializer/Read",       _BenchKerbRead },
+    { L"KerbSerializer/Convert",    _BenchKerbConvert },
+    { L"AccountName/Parse",         _BenchParseAccountName },
+    { L"AccountName/IsSame",        _BenchIsSameAccount },
+    { L"SidSet/Add",                _BenchSidSetAdd },
+    { L"SidSet/LookupGroups",       _BenchSidSetLookupGroups },
+    { L"ProcessIndex/Match100",     _BenchMatchProcesses100 },
+    { L"ProcessIndex/Match1000",    _BenchMatchProcesses1000 },
+    { L"ProcessIndex/Match10000",   _BenchMatchProcesses10000 },
+    { L"SecureFieldBuffer/Set",     _BenchSecureFieldSet },
+    { L"TimerWheel/Schedule",       _BenchTimerWheelSchedule },
+    { L"TimerWheel/Advance",        _BenchTimerWheelAdvance },
+    { L"LogoffTracker/Start",       _BenchLogoffTrackerStart },
+    { L"LogoffTracker/Poll",        _BenchLogoffTrackerPoll },
+};
+
+struct BENCH_RESULT
+{
+    ULONGLONG   cOps;
+    double      dblNsPerOp;
+    bool        fCounted;       // Whether the allocations below were counted (only in a Debug build).
+    double      dblAllocsPerOp;
+    double      dblBytesPerOp;
+};
+
+// A run shorter than this is not timed precisely enough, so the number of operations is increased until one is longer.
+static const ULONGLONG s_ullMinRunMs = 250;
+
+static ULONGLONG _TimeRun(_In_ const BENCH& bench, ULONGLONG cOps, _In_ const LARGE_INTEGER& liFrequency)
+{
+    LARGE_INTEGER liStart;
+    LARGE_INTEGER liEnd;
+    QueryPerformanceCounter(&liStart);
+    bench.pfnBench(cOps);
+    QueryPerformanceCounter(&liEnd);
+
+    // In nanoseconds; split up so that it does not overflow
+    ULONGLONG ullTicks = static_cast<ULONGLONG>(liEnd.QuadPart - liStart.QuadPart);
+    ULONGLONG ullFrequency = static_cast<ULONGLONG>(liFrequency.QuadPart);
+    return ullTicks / ullFrequency * 1000000000 + ullTicks % ullFrequency * 1000000000 / ullFrequency;
+}
+
+static void _Run(_In_ const BENCH& bench, _Out_ BENCH_RESULT* pResult)
+{
+    LARGE_INTEGER liFrequency;
+    QueryPerformanceFrequency(&liFrequency);
+
+    // Also warms up the caches and whatever the benchmark sets up
+    ULONGLONG cOps = 1;
+    ULONGLONG ullNs = _TimeRun(bench, cOps, liFrequency);
+    while (ullNs < s_ullMinRunMs * 1000000 && cOps < (1ULL << 40))
+    {
+        // Aim a bit past the minimum, but grow at most a hundredfold at a time in case the first runs were noisy
+        ULONGLONG cNext = ullNs == 0 ? cOps * 100 : s_ullMinRunMs * 1000000 * 6 / 5 * cOps / ullNs;
+        cOps = cNext > cOps * 100 ? cOps * 100 : cNext > cOps ? cNext : cOps + 1;
+        ullNs = _TimeRun(bench, cOps, liFrequency);
+    }
+
+    pResult->cOps = cOps;
+    pResult->dblNsPerOp = static_cast<double>(ullNs) / cOps;
+    pResult->fCounted = false;
+    pResult->dblAllocsPerOp = 0;
+    pResult->dblBytesPerOp = 0;
+
+#ifdef _DEBUG
+    // A separate run, so counting does not add to the time
+    s_cAllocs = 0;
+    s_cbAllocated = 0;
+    s_fCounting = true;
+    bench.pfnBench(cOps);
+    s_fCounting = false;
+    pResult->fCounted = true;
+    pResult->dblAllocsPerOp = static_cast<double>(s_cAllocs) / cOps;
+    pResult->dblBytesPerOp = static_cast<double>(s_cbAllocated) / cOps;
+#endif
+}
+
+static void _PrintText(_In_reads_(cResults) const BENCH_RESULT* rgResults, size_t cResults)
+{
+    wprintf(L"%-28s %14s %12s %12s %12s\n", L"benchmark", L"iterations", L"ns/op", L"allocs/op", L"bytes/op");
+    for (size_t i = 0; i < cResults; i++)
+    {
+        const BENCH_RESULT& result = rgResults[i];
+        if (result.fCounted)
+        {
+            wprintf(L"%-28s %14llu %12.1f %12.2f %12.1f\n", s_rgBenches[i].pszName, result.cOps, result.dblNsPerOp,
+                result.dblAllocsPerOp, result.dblBytesPerOp);
+        }
+        else
+        {
+            wprintf(L"%-28s %14llu %12.1f %12s %12s\n", s_rgBenches[i].pszName, result.cOps, result.dblNsPerOp, L"-", L"-");
+        }
+    }
+}
+
+// The names contain no characters that need escaping.
+static void _PrintJson(_In_reads_(cResults) const BENCH_RESULT* rgResults, size_t cResults)
+{
+#ifdef _DEBUG
+    wprintf(L"{\n  \"configuration\": \"Debug\",\n");
+#else
+    wprintf(L"{\n  \"configuration\": \"Release\",\n");
+#endif
+    wprintf(L"  \"pointer_size\": %u,\n  \"benchmarks\": [\n", static_cast<unsigned>(sizeof(void*)));
+    for (size_t i = 0; i < cResults; i++)
+    {
+        const BENCH_RESULT& result = rgResults[i];
+        wprintf(L"    { \"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.2f, ", s_rgBenches[i].pszName, result.cOps,
+            result.dblNsPerOp);
+        if (result.fCounted)
+        {
+            wprintf(L"\"allocs_per_op\": %.3f, \"bytes_per_op\": %.1f }", result.dblAllocsPerOp, result.dblBytesPerOp);
+        }
+        else
+        {
+            wprintf(L"\"allocs_per_op\": null, \"bytes_per_op\": null }");
+        }
+        wprintf(i + 1 < cResults ? L",\n" : L"\n");
+    }
+    wprintf(L"  ]\n}\n");
+}
+
+int __cdecl wmain(int argc, _In_reads_(argc) wchar_t** argv)
+{
+    bool fJson = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (_wcsicmp(argv[i], L"--json") == 0)
+        {
+            fJson = true;
+        }
+        else
+        {
+            fwprintf(stderr, L"Usage: GEWISUnlockBench [--json]\n");
+            return 2;
+        }
+    }
+
+#ifdef _DEBUG
+    _CrtSetAllocHook(_AllocHook);
+#endif
+
+    BENCH_RESULT rgResults[ARRAYSIZE(s_rgBenches)];
+    for (size_t i = 0; i < ARRAYSIZE(s_rgBenches); i++)
+    {
+        if (!fJson)
+        {
+            // The whole table is printed at the end, so show that something is happening
+            fwprintf(stderr, L"%s...\n", s_rgBenches[i].pszName);
+        }
+        _Run(s_rgBenches[i], &rgResults[i]);
+    }
+
+    if (fJson)
+    {
+        _PrintJson(rgResults, ARRAYSIZE(rgResults));
+    }
+    else
+    {
+        _PrintText(rgResults, ARRAYSIZE(rgResults));
+    }
+    return 0;
+}
@@ -16,13 +16,15 @@ enum GEWISUNLOCK_FIELD_ID
     GFI_TILEIMAGE         = 0,
     GFI_LABEL             = 1,
     GFI_HEADING           = 2,
-    GFI_USERNAME          = 3,
-    GFI_PASSWORD          = 4,
-    GFI_SUBMIT_BUTTON     = 5,
-    GFI_MOREINFO_LINK     = 6,
-    GFI_MULTIVERS_TEXT    = 7,
-    GFI_MULTIVERS_CHECKBOX= 8,
-    GFI_NUM_FIELDS        = 9,  // Note: if new fields are added, keep NUM_FIELDS last.  This is used as a count of the number of fields
+    GFI_SESSIONS          = 3,
+    GFI_USERNAME          = 4,
+    GFI_PASSWORD          = 5,
+    GFI_SUBMIT_BUTTON     = 6,
+    GFI_MOREINFO_LINK     = 7,
+    GFI_MULTIVERS_TEXT    = 8,
+    GFI_MULTIVERS_CHECKBOX= 9,
+    GFI_STATUS_TEXT       = 10,
+    GFI_NUM_FIELDS        = 11,  // Note: if new fields are added, keep NUM_FIELDS last.  This is used as a count of the number of fields
 };
 
 // The first value indicates when the tile is displayed (selected, not selected)
@@ -45,12 +47,14 @@ static const FIELD_STATE_PAIR s_rgFieldStatePairs[] =
     { CPFS_DISPLAY_IN_BOTH,            CPFIS_NONE    },    // GFI_TILEIMAGE
     { CPFS_HIDDEN,                     CPFIS_NONE    },    // GFI_LABEL
     { CPFS_DISPLAY_IN_BOTH,            CPFIS_NONE    },    // GFI_HEADING
+    { CPFS_DISPLAY_IN_SELECTED_TILE,   CPFIS_NONE    },    // GFI_SESSIONS
     { CPFS_DISPLAY_IN_SELECTED_TILE,   CPFIS_FOCUSED },    // GFI_USERNAME
     { CPFS_DISPLAY_IN_SELECTED_TILE,   CPFIS_NONE    },    // GFI_PASSWORD
     { CPFS_DISPLAY_IN_SELECTED_TILE,   CPFIS_NONE    },    // GFI_SUBMIT_BUTTON
     { CPFS_DISPLAY_IN_SELECTED_TILE,   CPFIS_NONE    },    // GFI_MOREINFO_LINK
     { CPFS_DISPLAY_IN_SELECTED_TILE,   CPFIS_NONE    },    // GFI_MULTIVERS_TEXT
     { CPFS_DISPLAY_IN_SELECTED_TILE,   CPFIS_NONE    },    // GFI_MULTIVERS_CHECKBOX
+    { CPFS_HIDDEN,                     CPFIS_NONE    },    // GFI_STATUS_TEXT
 };
 
 // Field descriptors
@@ -61,17 +65,12 @@ static const CREDENTIAL_PROVIDER_FIELD_DESCRIPTOR s_rgCredProvFieldDescriptors[]
     { GFI_TILEIMAGE,         CPFT_TILE_IMAGE,    L"Image",                      CPFG_CREDENTIAL_PROVIDER_LOGO  },
     { GFI_LABEL,             CPFT_SMALL_TEXT,    L"Tooltip",                    CPFG_CREDENTIAL_PROVIDER_LABEL },
     { GFI_HEADING,           CPFT_LARGE_TEXT,    L"Heading"                                                    },
+    { GFI_SESSIONS,          CPFT_COMBOBOX,      L"Sign out"                                                   },
     { GFI_USERNAME,          CPFT_EDIT_TEXT,     L"Username (room responsible)", CPFG_LOGON_USERNAME           },
     { GFI_PASSWORD,          CPFT_PASSWORD_TEXT, L"Password (room responsible)", CPFG_LOGON_PASSWORD           },
     { GFI_SUBMIT_BUTTON,     CPFT_SUBMIT_BUTTON, L"Submit"                                                     },
     { GFI_MOREINFO_LINK,     CPFT_COMMAND_LINK,  L"About GEWISUnlock"                                          },
     { GFI_MULTIVERS_TEXT,    CPFT_SMALL_TEXT,    L"Multivers status: "                                         },
     { GFI_MULTIVERS_CHECKBOX,CPFT_CHECKBOX,      L"Multivers checkbox: "                                       },
-};
-
-static const PWSTR s_rgComboBoxStrings[] =
-{
-    L"First",
-    L"Second",
-    L"Third",
+    { GFI_STATUS_TEXT,       CPFT_SMALL_TEXT,    L"Status"                                                     },
 };
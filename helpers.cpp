@@ -8,8 +8,14 @@
 
 
 #include "helpers.h"
+#include "ProcessIndex.h"
+#include "ConfigStore.h"
+#include "CachedLookup.h"
 #include <intsafe.h>
-#include <tlhelp32.h>
+#include <sddl.h>
+#include <aclapi.h>
+#include <shlobj.h>
+#include <wtsapi32.h>
 
 //
 // Copies the field descriptor pointed to by rcpfd into a buffer allocated
@@ -138,26 +144,6 @@ HRESULT UnicodeStringInitWithString(
     return hr;
 }
 
-//
-// The following function is intended to be used ONLY with the Kerb*Pack functions.  It does
-// no bounds-checking because its callers have precise requirements and are written to respect
-// its limitations.
-// You can read more about the UNICODE_STRING type at:
-// http://msdn.microsoft.com/library/default.asp?url=/library/en-us/secauthn/security/unicode_string.asp
-//
-static void _UnicodeStringPackedUnicodeStringCopy(
-    __in const UNICODE_STRING& rus,
-    __in PWSTR pwzBuffer,
-    __out UNICODE_STRING* pus
-)
-{
-    pus->Length = rus.Length;
-    pus->MaximumLength = rus.Length;
-    pus->Buffer = pwzBuffer;
-
-    CopyMemory(pus->Buffer, rus.Buffer, pus->Length);
-}
-
 //
 // Initialize the members of a KERB_INTERACTIVE_UNLOCK_LOGON with weak references to the
 // passed-in strings.  This is useful if you will later use KerbInteractiveUnlockLogonPack
@@ -262,60 +248,30 @@ HRESULT KerbInteractiveUnlockLogonPack(
     _Out_ DWORD* pcb
 )
 {
-    HRESULT hr;
+    static_assert(KerbSerializer::GetHeaderSize(KerbSerializer::KSL_NATIVE) == sizeof(KERB_INTERACTIVE_UNLOCK_LOGON),
+        "KerbSerializer does not match the layout of KERB_INTERACTIVE_UNLOCK_LOGON");
 
     const KERB_INTERACTIVE_LOGON* pkilIn = &rkiulIn.Logon;
-
-    // alloc space for struct plus extra for the three strings
-    DWORD cb = sizeof(rkiulIn) +
-        pkilIn->LogonDomainName.Length +
-        pkilIn->UserName.Length +
-        pkilIn->Password.Length;
-
-    KERB_INTERACTIVE_UNLOCK_LOGON* pkiulOut = (KERB_INTERACTIVE_UNLOCK_LOGON*)CoTaskMemAlloc(cb);
-    if (pkiulOut)
-    {
-        ZeroMemory(&pkiulOut->LogonId, sizeof(pkiulOut->LogonId));
-
-        //
-        // point pbBuffer at the beginning of the extra space
-        //
-        BYTE* pbBuffer = (BYTE*)pkiulOut + sizeof(*pkiulOut);
-
-        //
-        // set up the Logon structure within the KERB_INTERACTIVE_UNLOCK_LOGON
-        //
-        KERB_INTERACTIVE_LOGON* pkilOut = &pkiulOut->Logon;
-
-        pkilOut->MessageType = pkilIn->MessageType;
-
-        //
-        // copy each string,
-        // fix up appropriate buffer pointer to be offset,
-        // advance buffer pointer over copied characters in extra space
-        //
-        _UnicodeStringPackedUnicodeStringCopy(pkilIn->LogonDomainName, (PWSTR)pbBuffer, &pkilOut->LogonDomainName);
-        pkilOut->LogonDomainName.Buffer = (PWSTR)(pbBuffer - (BYTE*)pkiulOut);
-        pbBuffer += pkilOut->LogonDomainName.Length;
-
-        _UnicodeStringPackedUnicodeStringCopy(pkilIn->UserName, (PWSTR)pbBuffer, &pkilOut->UserName);
-        pkilOut->UserName.Buffer = (PWSTR)(pbBuffer - (BYTE*)pkiulOut);
-        pbBuffer += pkilOut->UserName.Length;
-
-        _UnicodeStringPackedUnicodeStringCopy(pkilIn->Password, (PWSTR)pbBuffer, &pkilOut->Password);
-        pkilOut->Password.Buffer = (PWSTR)(pbBuffer - (BYTE*)pkiulOut);
-
-        *prgb = (BYTE*)pkiulOut;
-        *pcb = cb;
-
-        hr = S_OK;
-    }
-    else
+    KerbSerializer::LOGON logon;
+    logon.uMessageType = static_cast<uint32_t>(pkilIn->MessageType);
+    logon.domain = { pkilIn->LogonDomainName.Buffer, pkilIn->LogonDomainName.Length };
+    logon.username = { pkilIn->UserName.Buffer, pkilIn->UserName.Length };
+    logon.password = { pkilIn->Password.Buffer, pkilIn->Password.Length };
+
+    // The header and the three strings are at most a few hundred kilobytes, so this fits in a DWORD
+    DWORD cb = static_cast<DWORD>(KerbSerializer::GetPackedSize(KerbSerializer::KSL_NATIVE, logon));
+    BYTE* pb = static_cast<BYTE*>(CoTaskMemAlloc(cb));
+    if (pb == nullptr)
     {
-        hr = E_OUTOFMEMORY;
+        *prgb = nullptr;
+        *pcb = 0;
+        return E_OUTOFMEMORY;
     }
 
-    return hr;
+    KerbSerializer::Write(KerbSerializer::KSL_NATIVE, logon, pb);
+    *prgb = pb;
+    *pcb = cb;
+    return S_OK;
 }
 
 //
@@ -345,7 +301,7 @@ static HRESULT _LsaInitString(
 // For more information on auth packages see this msdn page:
 // http://msdn.microsoft.com/library/default.asp?url=/library/en-us/secauthn/security/msv1_0_lm20_logon.asp
 //
-HRESULT RetrieveNegotiateAuthPackage(_Out_ ULONG* pulAuthPackage)
+static HRESULT _LookupNegotiateAuthPackage(_Out_ ULONG* pulAuthPackage)
 {
     HRESULT hr;
     HANDLE hLsa;
@@ -377,6 +333,20 @@ HRESULT RetrieveNegotiateAuthPackage(_Out_ ULONG* pulAuthPackage)
     return hr;
 }
 
+// The package ID is assigned when LSA loads the package at boot, so it is the same for as long as we are loaded.
+// Connecting to LSA is then only needed once, rather than for every unlock.
+static CachedLookup<ULONG> s_negotiateAuthPackage(_LookupNegotiateAuthPackage);
+
+HRESULT RetrieveNegotiateAuthPackage(_Out_ ULONG* pulAuthPackage)
+{
+    return s_negotiateAuthPackage.Get(pulAuthPackage);
+}
+
+void InvalidateNegotiateAuthPackage()
+{
+    s_negotiateAuthPackage.Invalidate();
+}
+
 //
 // Return a copy of pwzToProtect encrypted with the CredProtect API.
 //
@@ -507,44 +477,65 @@ HRESULT ProtectIfNecessaryAndCopyPassword(
     return hr;
 }
 
+static HRESULT _HResultFromKerbSerializerResult(KerbSerializer::RESULT result)
+{
+    switch (result)
+    {
+    case KerbSerializer::KSR_OK:
+        return S_OK;
+
+    case KerbSerializer::KSR_TOO_SMALL:
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+
+    case KerbSerializer::KSR_ODD_LENGTH:
+    case KerbSerializer::KSR_BAD_LENGTH:
+        return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+    case KerbSerializer::KSR_MISALIGNED:
+        return HRESULT_FROM_WIN32(ERROR_NOACCESS);
+
+    case KerbSerializer::KSR_OUT_OF_RANGE:
+    case KerbSerializer::KSR_OVERLAP:
+    default:
+        return HRESULT_FROM_WIN32(ERROR_INVALID_USER_BUFFER);
+    }
+}
+
 //
 // Unpack a KERB_INTERACTIVE_UNLOCK_LOGON *in place*.  That is, reset the Buffers from being offsets to
 // being real pointers.  This means, of course, that passing the resultant struct across any sort of
 // memory space boundary is not going to work -- repack it if necessary!
 //
-void KerbInteractiveUnlockLogonUnpackInPlace(
+// The buffer is checked completely before anything is changed, so on failure it is left as it was.
+// If presult is given, it receives the reason the buffer was rejected.
+//
+HRESULT KerbInteractiveUnlockLogonUnpackInPlace(
     _Inout_updates_bytes_(cb) KERB_INTERACTIVE_UNLOCK_LOGON* pkiul,
-    DWORD cb
+    DWORD cb,
+    _Out_opt_ KerbSerializer::RESULT* presult
 )
 {
-    if (sizeof(*pkiul) <= cb)
+    KerbSerializer::LOGON logon;
+    KerbSerializer::RESULT result = KerbSerializer::Read(KerbSerializer::KSL_NATIVE, reinterpret_cast<const BYTE*>(pkiul), cb, &logon);
+    if (presult != nullptr)
     {
-        KERB_INTERACTIVE_LOGON* pkil = &pkiul->Logon;
-
-        // Sanity check: if the range described by each (Buffer + MaximumSize) falls within the total bytecount,
-        // we can be pretty confident that the Buffers are actually offsets and that this is a packed credential.
-        if (((ULONG_PTR)pkil->LogonDomainName.Buffer + pkil->LogonDomainName.MaximumLength <= cb) &&
-            ((ULONG_PTR)pkil->UserName.Buffer + pkil->UserName.MaximumLength <= cb) &&
-            ((ULONG_PTR)pkil->Password.Buffer + pkil->Password.MaximumLength <= cb))
-        {
-            pkil->LogonDomainName.Buffer = pkil->LogonDomainName.Buffer
-                ? (PWSTR)((BYTE*)pkiul + (ULONG_PTR)pkil->LogonDomainName.Buffer)
-                : nullptr;
-
-            pkil->UserName.Buffer = pkil->UserName.Buffer
-                ? (PWSTR)((BYTE*)pkiul + (ULONG_PTR)pkil->UserName.Buffer)
-                : nullptr;
-
-            pkil->Password.Buffer = pkil->Password.Buffer
-                ? (PWSTR)((BYTE*)pkiul + (ULONG_PTR)pkil->Password.Buffer)
-                : nullptr;
-        }
+        *presult = result;
     }
+    if (result != KerbSerializer::KSR_OK)
+    {
+        return _HResultFromKerbSerializerResult(result);
+    }
+
+    KERB_INTERACTIVE_LOGON* pkil = &pkiul->Logon;
+    pkil->LogonDomainName.Buffer = const_cast<PWSTR>(static_cast<PCWSTR>(logon.domain.pv));
+    pkil->UserName.Buffer = const_cast<PWSTR>(static_cast<PCWSTR>(logon.username.pv));
+    pkil->Password.Buffer = const_cast<PWSTR>(static_cast<PCWSTR>(logon.password.pv));
+    return S_OK;
 }
 
 //
-// Use the CredPackAuthenticationBuffer and CredUnpackAuthenticationBuffer to convert a 32 bit WOW
-// cred blob into a 64 bit native blob by unpacking it and immediately repacking it.
+// Convert a 32 bit WOW cred blob into a 64 bit native blob. The strings are copied as they are, so a
+// protected password stays protected. The result is allocated with CoTaskMemAlloc.
 //
 HRESULT KerbInteractiveUnlockLogonRepackNative(
     _In_reads_bytes_(cbWow) BYTE* rgbWow,
@@ -553,66 +544,27 @@ HRESULT KerbInteractiveUnlockLogonRepackNative(
     _Out_ DWORD* pcbNative
 )
 {
-    HRESULT hr = E_OUTOFMEMORY;
-    PWSTR pszDomainUsername = nullptr;
-    DWORD cchDomainUsername = 0;
-    PWSTR pszPassword = nullptr;
-    DWORD cchPassword = 0;
-
     *prgbNative = nullptr;
     *pcbNative = 0;
 
-    // Unpack the 32 bit KERB structure
-    CredUnPackAuthenticationBufferW(CRED_PACK_WOW_BUFFER, rgbWow, cbWow, pszDomainUsername, &cchDomainUsername, nullptr, nullptr, pszPassword, &cchPassword);
-    if (ERROR_INSUFFICIENT_BUFFER == GetLastError())
+    KerbSerializer::LOGON logon;
+    HRESULT hr = _HResultFromKerbSerializerResult(KerbSerializer::Read(KerbSerializer::KSL_32, rgbWow, cbWow, &logon));
+    if (FAILED(hr))
     {
-        pszDomainUsername = (PWSTR)LocalAlloc(0, cchDomainUsername * sizeof(wchar_t));
-        if (pszDomainUsername)
-        {
-            pszPassword = (PWSTR)LocalAlloc(0, cchPassword * sizeof(wchar_t));
-            if (pszPassword)
-            {
-                if (CredUnPackAuthenticationBufferW(CRED_PACK_WOW_BUFFER, rgbWow, cbWow, pszDomainUsername, &cchDomainUsername, nullptr, nullptr, pszPassword, &cchPassword))
-                {
-                    hr = S_OK;
-                }
-                else
-                {
-                    hr = GetLastError();
-                }
-            }
-        }
+        return hr;
     }
 
-    // Repack native
-    if (SUCCEEDED(hr))
+    DWORD cbNative = static_cast<DWORD>(KerbSerializer::GetPackedSize(KerbSerializer::KSL_NATIVE, logon));
+    BYTE* pbNative = static_cast<BYTE*>(CoTaskMemAlloc(cbNative));
+    if (pbNative == nullptr)
     {
-        hr = E_OUTOFMEMORY;
-        CredPackAuthenticationBufferW(0, pszDomainUsername, pszPassword, *prgbNative, pcbNative);
-        if (ERROR_INSUFFICIENT_BUFFER == GetLastError())
-        {
-            *prgbNative = (BYTE*)LocalAlloc(LMEM_ZEROINIT, *pcbNative);
-            if (*prgbNative)
-            {
-                if (CredPackAuthenticationBufferW(0, pszDomainUsername, pszPassword, *prgbNative, pcbNative))
-                {
-                    hr = S_OK;
-                }
-                else
-                {
-                    LocalFree(*prgbNative);
-                }
-            }
-        }
+        return E_OUTOFMEMORY;
     }
 
-    LocalFree(pszDomainUsername);
-    if (pszPassword)
-    {
-        SecureZeroMemory(pszPassword, cchPassword * sizeof(wchar_t));
-        LocalFree(pszPassword);
-    }
-    return hr;
+    KerbSerializer::Write(KerbSerializer::KSL_NATIVE, logon, pbNative);
+    *prgbNative = pbNative;
+    *pcbNative = cbNative;
+    return S_OK;
 }
 
 // Concatonates pwszDomain and pwszUsername and places the result in *ppwszDomainUsername.
@@ -649,55 +601,109 @@ HRESULT DomainUsernameStringAlloc(
     return hr;
 }
 
-// https://cplusplus.com/reference/cwchar/wcsncpy/
-HRESULT SplitDomainAndUsername(_In_ PCWSTR pszQualifiedUserName, _Outptr_result_nullonfailure_ PWSTR* ppszDomain, _Outptr_result_nullonfailure_ PWSTR* ppszUsername)
+// The settings getters below read from HKLM\Software\GEWISUnlock, which the caller (RegistryConfigSource::Load) opens
+// once for all of them; key is nullptr if it does not exist, so every setting gets its default.
+
+// Reads a REG_DWORD value, or returns dwDefault if there is no key, no such value or it has another type.
+static DWORD _QueryDword(_In_opt_ HKEY key, _In_ PCWSTR pszValueName, DWORD dwDefault)
 {
-    HRESULT hr = E_UNEXPECTED;
-    *ppszDomain = nullptr;
-    *ppszUsername = nullptr;
-    PWSTR pszDomain;
-    PWSTR pszUsername;
-    const wchar_t* pchWhack = wcschr(pszQualifiedUserName, L'\\');
-    const wchar_t* pchEnd = pszQualifiedUserName + wcslen(pszQualifiedUserName) - 1;
+    DWORD dwValue = dwDefault;
+    if (key != nullptr)
+    {
+        DWORD dwType;
+        DWORD dwData;
+        DWORD dataSize = sizeof(dwData);
+        if (RegQueryValueEx(key, pszValueName, 0, &dwType, (LPBYTE)&dwData, &dataSize) == ERROR_SUCCESS &&
+            dwType == REG_DWORD)
+        {
+            dwValue = dwData;
+        }
+    }
 
-    if (pchWhack != nullptr)
-    { //We have found a backslash, so there is a domain
-        const wchar_t* pchDomainBegin = pszQualifiedUserName;
-        const wchar_t* pchDomainEnd = pchWhack - 1;
-        const wchar_t* pchUsernameBegin = pchWhack + 1;
-        const wchar_t* pchUsernameEnd = pchEnd;
+    return dwValue;
+}
 
-        size_t lenDomain = pchDomainEnd - pchDomainBegin + 1; // number of actual chars, NOT INCLUDING null terminated string
-        pszDomain = static_cast<PWSTR>(CoTaskMemAlloc(sizeof(wchar_t) * (lenDomain + 1)));
-        if (pszDomain != nullptr)
+// Get the domain of users that are entered without one, if the domain of the signed-in user is unknown.
+// Defaults to GEWISWG; the DefaultDomain (REG_SZ) registry value can change this.
+HRESULT GetDefaultDomain(_In_opt_ HKEY key, _Out_ ATL::CStringW* pstrDomain)
+{
+    *pstrDomain = L"GEWISWG";
+    if (key != nullptr)
+    {
+        WCHAR value[256];
+        DWORD dwType;
+        DWORD dataSize = sizeof(value);
+        if (RegQueryValueEx(key, L"DefaultDomain", 0, &dwType, (LPBYTE)value, &dataSize) == ERROR_SUCCESS &&
+            dwType == REG_SZ)
         {
-            hr = StringCchCopyN(pszDomain, lenDomain + 1, pchDomainBegin, lenDomain);
-            if (SUCCEEDED(hr))
+            // The value does not have to be null-terminated
+            size_t cchValue = dataSize / sizeof(WCHAR);
+            value[cchValue < ARRAYSIZE(value) ? cchValue : ARRAYSIZE(value) - 1] = L'\0';
+            if (value[0] != L'\0')
             {
-                size_t lenUsername = pchUsernameEnd - pchUsernameBegin + 1; // number of actual chars, NOT INCLUDING null terminated string
-                pszUsername = static_cast<PWSTR>(CoTaskMemAlloc(sizeof(wchar_t) * (lenUsername + 1)));
-                if (pszUsername != nullptr)
-                {
-                    hr = StringCchCopyN(pszUsername, lenUsername + 1, pchUsernameBegin, lenUsername);
-                    if (SUCCEEDED(hr))
-                    {
-                        *ppszDomain = pszDomain;
-                        *ppszUsername = pszUsername;
-                    }
-                    else
-                    {
-                        CoTaskMemFree(pszUsername);
-                    }
-                }
-                else
-                {
-                    hr = E_OUTOFMEMORY;
-                }
+                *pstrDomain = value;
             }
+        }
+    }
+
+    return pstrDomain->IsEmpty() ? E_OUTOFMEMORY : S_OK;
+}
+
+// Get how long (in seconds) a verified room responsible is remembered, so kicking again does not need a full logon.
+// Defaults to 5 minutes; the AuthorizationCacheTTL (REG_DWORD) registry value can change this, where 0 turns the cache off.
+DWORD GetAuthorizationCacheTtl(_In_opt_ HKEY key)
+{
+    return _QueryDword(key, L"AuthorizationCacheTTL", 300);
+}
+
+// Get whether the provider fetches what it needs in the background as soon as LogonUI picks a usage scenario.
+// Defaults to on; setting the Prefetch (REG_DWORD) registry value to 0 turns it off, to compare the time to the first tile.
+bool GetPrefetchEnabled(_In_opt_ HKEY key)
+{
+    return _QueryDword(key, L"Prefetch", 1) != 0;
+}
 
-            if (FAILED(hr))
+// Get after how many minutes of being locked a session is signed out automatically.
+// Defaults to never (0); the ReclaimLockedAfter (REG_DWORD) registry value can change this.
+DWORD GetReclaimLockedAfter(_In_opt_ HKEY key)
+{
+    return _QueryDword(key, L"ReclaimLockedAfter", 0);
+}
+
+// Get how many seconds a kick waits for a session to sign out before offering to terminate what is left in it.
+// Defaults to a minute; the LogoffTimeout (REG_DWORD) registry value can change this.
+DWORD GetLogoffTimeout(_In_opt_ HKEY key)
+{
+    DWORD dwTimeout = _QueryDword(key, L"LogoffTimeout", 60);
+    return dwTimeout > 0 ? dwTimeout : 60;
+}
+
+// Reads a REG_MULTI_SZ value into a CoTaskMemAlloc'ed buffer that always ends in two terminators.
+// Succeeds with *ppszValue set to nullptr if the value does not exist or has another type.
+static HRESULT _QueryMultiString(_In_ HKEY key, _In_ PCWSTR pszValueName, _Outptr_result_maybenull_ PWSTR* ppszValue)
+{
+    HRESULT hr = S_OK;
+    *ppszValue = nullptr;
+
+    DWORD dwType;
+    DWORD cbValue = 0;
+    if (RegQueryValueEx(key, pszValueName, 0, &dwType, nullptr, &cbValue) == ERROR_SUCCESS &&
+        dwType == REG_MULTI_SZ &&
+        cbValue > 0)
+    {
+        // Reserve room for two extra terminators in case the stored value is not properly terminated
+        DWORD cchValue = cbValue / sizeof(wchar_t) + 2;
+        PWSTR pszValue = static_cast<PWSTR>(CoTaskMemAlloc(sizeof(wchar_t) * cchValue));
+        if (pszValue != nullptr)
+        {
+            ZeroMemory(pszValue, sizeof(wchar_t) * cchValue);
+            if (RegQueryValueEx(key, pszValueName, 0, &dwType, (LPBYTE)pszValue, &cbValue) == ERROR_SUCCESS)
+            {
+                *ppszValue = pszValue;
+            }
+            else
             {
-                CoTaskMemFree(pszDomain);
+                CoTaskMemFree(pszValue);
             }
         }
         else
@@ -705,124 +711,374 @@ HRESULT SplitDomainAndUsername(_In_ PCWSTR pszQualifiedUserName, _Outptr_result_
             hr = E_OUTOFMEMORY;
         }
     }
-    else
+
+    return hr;
+}
+
+// Parses the rights in an AuthorizedGroups entry, e.g. L"kick,protected".
+static DWORD _ParseAuthorizationRights(_In_ PCWSTR pszRights)
+{
+    DWORD dwRights = AR_NONE;
+    ATL::CStringW strRights = pszRights;
+    int iStart = 0;
+    for (ATL::CStringW strRight = strRights.Tokenize(L",", iStart); iStart >= 0; strRight = strRights.Tokenize(L",", iStart))
     {
-        // Default domain that is used but only in exceptional cases (e.g. when the current user does not have a domain)
-        // which should not happen according to https://learn.microsoft.com/en-us/windows/win32/api/credentialprovider/nf-credentialprovider-icredentialprovideruser-getstringvalue
-        PWSTR defaultDomain = L"GEWISWG\\";
-        size_t newUsernameLength = (wcslen(pszQualifiedUserName) + 1 + wcslen(defaultDomain));
-        PWSTR newUsername = static_cast<PWSTR>(CoTaskMemAlloc(sizeof(wchar_t) * newUsernameLength));
-        if (newUsername != nullptr)
+        strRight.Trim();
+        if (strRight.CompareNoCase(L"kick") == 0)
         {
-            ZeroMemory(newUsername, sizeof(wchar_t) * newUsernameLength);
-            StringCchCat(newUsername, newUsernameLength, defaultDomain);
-            StringCchCat(newUsername, newUsernameLength, pszQualifiedUserName);
-            return SplitDomainAndUsername(newUsername, ppszDomain, ppszUsername);
+            dwRights |= AR_KICK;
         }
-        else
+        else if (strRight.CompareNoCase(L"protected") == 0)
         {
-            hr = E_OUTOFMEMORY;
+            dwRights |= AR_KICK_PROTECTED;
         }
-        /*
-        pszUsername = static_cast<PWSTR>(CoTaskMemAlloc(sizeof(wchar_t) * (wcslen(pszQualifiedUserName) + 1)));
-        if (pszUsername != nullptr) {
-            hr = StringCchCopyN(pszUsername, wcslen(pszQualifiedUserName) + 1, pszQualifiedUserName, wcslen(pszQualifiedUserName));
-            if (SUCCEEDED(hr))
+    }
+    return dwRights;
+}
+
+// Reads the groups of a token into prgbBuffer, which is only grown when the groups do not fit.
+// *ppGroups points into prgbBuffer, so it stays valid until the buffer is changed.
+HRESULT QueryTokenGroups(_In_ HANDLE hToken, _Inout_ ATL::CAtlArray<BYTE>* prgbBuffer, _Outptr_ const TOKEN_GROUPS** ppGroups)
+{
+    *ppGroups = nullptr;
+
+    DWORD cbNeeded = 0;
+    while (!GetTokenInformation(hToken, TokenGroups, prgbBuffer->GetData(), static_cast<DWORD>(prgbBuffer->GetCount()), &cbNeeded))
+    {
+        DWORD dwError = GetLastError();
+        if (dwError != ERROR_INSUFFICIENT_BUFFER)
+        {
+            return HRESULT_FROM_WIN32(dwError);
+        }
+
+        // Groups can be added between two calls, so we keep trying until they fit
+        if (!prgbBuffer->SetCount(cbNeeded))
+        {
+            return E_OUTOFMEMORY;
+        }
+    }
+
+    *ppGroups = reinterpret_cast<const TOKEN_GROUPS*>(prgbBuffer->GetData());
+    return S_OK;
+}
+
+// Get the groups whose members may sign off users, and what they may do.
+// Every entry of the AuthorizedGroups (REG_MULTI_SZ) registry value is a SID, optionally followed by '=' and the rights
+// it grants, e.g. "S-1-5-21-...-1234=kick". Without rights, the group may do everything.
+// If that value is not set, we fall back to AuthorizedGroup_SID (or Power Users), which gets all rights.
+HRESULT GetAuthorizedGroups(_In_opt_ HKEY key, _Out_ ATL::CAtlArray<AUTHORIZED_GROUP>* prgGroups)
+{
+    HRESULT hr = S_OK;
+    prgGroups->RemoveAll();
+
+    if (key != nullptr)
+    {
+        PWSTR pszValue;
+        hr = _QueryMultiString(key, L"AuthorizedGroups", &pszValue);
+        if (SUCCEEDED(hr) && pszValue != nullptr)
+        {
+            PWSTR pszEntry = pszValue;
+            while (*pszEntry != L'\0')
             {
-                *ppszDomain = L"TUE";
-                *ppszUsername = pszUsername;
+                PWSTR pszNextEntry = pszEntry + wcslen(pszEntry) + 1;
+                DWORD dwRights = AR_ALL;
+                PWSTR pszRights = wcschr(pszEntry, L'=');
+                if (pszRights != nullptr)
+                {
+                    *pszRights = L'\0';
+                    dwRights = _ParseAuthorizationRights(pszRights + 1);
+                }
+
+                PSID pSid;
+                if (ConvertStringSidToSid(pszEntry, &pSid))
+                {
+                    AUTHORIZED_GROUP group;
+                    group.sid = ATL::CSid(static_cast<const SID*>(pSid));
+                    group.dwRights = dwRights;
+                    prgGroups->Add(group);
+                    LocalFree(pSid);
+                }
+
+                pszEntry = pszNextEntry;
             }
-            else
+            CoTaskMemFree(pszValue);
+        }
+    }
+
+    if (SUCCEEDED(hr) && prgGroups->IsEmpty())
+    {
+        // The single group of older versions. The SID is not looked up: that can wait for a domain controller,
+        // and this is read when LogonUI creates the provider. A SID that no token has simply matches nobody.
+        AUTHORIZED_GROUP group;
+        group.sid = ATL::Sids::PowerUsers();
+        group.dwRights = AR_ALL;
+        WCHAR value[512];
+        DWORD dwType;
+        DWORD dataSize = sizeof(value) - sizeof(WCHAR);
+        if (key != nullptr &&
+            RegQueryValueEx(key, L"AuthorizedGroup_SID", 0, &dwType, (LPBYTE)value, &dataSize) == ERROR_SUCCESS &&
+            dwType == REG_SZ)
+        {
+            // The value does not have to be null-terminated
+            value[dataSize / sizeof(WCHAR)] = L'\0';
+            PSID pSid;
+            if (value[0] != L'\0' && ConvertStringSidToSid(value, &pSid))
             {
-                hr = E_OUTOFMEMORY;
+                group.sid = ATL::CSid(static_cast<const SID*>(pSid));
+                LocalFree(pSid);
             }
         }
-        else
+        prgGroups->Add(group);
+    }
+
+    return hr;
+}
+
+// The longest a kick waits for a protected application to close, whatever the registry says
+static const DWORD s_dwMaxAppCloseTimeout = 5 * 60;
+
+// Get the executables that must not be closed by accident when signing off a user.
+// By default this is only Multivers, but the ProtectedApplications (REG_MULTI_SZ) registry value can list more.
+HRESULT GetProtectedApplications(_In_opt_ HKEY key, _Out_ CProtectedAppMap* pApps, _Out_ CAppCloseTimeoutMap* pCloseTimeouts)
+{
+    HRESULT hr = S_OK;
+    pApps->RemoveAll();
+    pCloseTimeouts->RemoveAll();
+
+    if (key != nullptr)
+    {
+        PWSTR pszValue;
+        hr = _QueryMultiString(key, L"ProtectedApplications", &pszValue);
+        if (SUCCEEDED(hr) && pszValue != nullptr)
         {
-            hr = E_OUTOFMEMORY;
+            ATL::CStringW strFolded;
+            for (PCWSTR pszApp = pszValue; *pszApp != L'\0'; pszApp += wcslen(pszApp) + 1)
+            {
+                // An application may be followed by = and how many seconds it gets to close, e.g. Multi.exe=120
+                ATL::CStringW strApp(pszApp);
+                int iEquals = strApp.Find(L'=');
+                DWORD dwCloseTimeout = 0;
+                if (iEquals >= 0)
+                {
+                    dwCloseTimeout = wcstoul(strApp.GetString() + iEquals + 1, nullptr, 10);
+                    if (dwCloseTimeout > s_dwMaxAppCloseTimeout)
+                    {
+                        dwCloseTimeout = s_dwMaxAppCloseTimeout;
+                    }
+                    strApp.Truncate(iEquals);
+                    strApp.Trim();
+                }
+
+                ProcessIndex::FoldExeName(strApp, &strFolded);
+                pApps->SetAt(strFolded, strApp);
+                if (dwCloseTimeout > 0)
+                {
+                    pCloseTimeouts->SetAt(strFolded, dwCloseTimeout);
+                }
+            }
+            CoTaskMemFree(pszValue);
         }
-        */
     }
+
+    if (SUCCEEDED(hr) && pApps->IsEmpty())
+    {
+        ATL::CStringW strFolded;
+        ProcessIndex::FoldExeName(L"Multi.exe", &strFolded);
+        pApps->SetAt(strFolded, L"Multi.exe");
+    }
+
     return hr;
 }
 
-// Code freely https://stackoverflow.com/a/24646860
-HRESULT FindProcessId(_In_ LPCWSTR processName, _Out_ DWORD* processId)
+// Get how many seconds a protected application gets to close before a kick terminates it, unless set for that application.
+// Defaults to 30 seconds; the AppCloseTimeout (REG_DWORD) registry value can change this, up to s_dwMaxAppCloseTimeout.
+DWORD GetAppCloseTimeout(_In_opt_ HKEY key)
 {
-    HRESULT hr = E_UNEXPECTED;
-    *processId = 0;
-
-    // strip path
-    //LPCWSTR p = wcsrchr(processName, '\\');
-    //if (p)
-    //    processName = p + 1;
+    DWORD dwTimeout = _QueryDword(key, L"AppCloseTimeout", 30);
+    return dwTimeout < s_dwMaxAppCloseTimeout ? dwTimeout : s_dwMaxAppCloseTimeout;
+}
 
-    PROCESSENTRY32 processInfo;
-    processInfo.dwSize = sizeof(processInfo);
+// Get all protected applications that are currently running and their sessions, matched in a single pass over the process index
+HRESULT GetRunningProtectedApplications(_Out_ ATL::CAtlArray<RUNNING_APP>* prgRunning)
+{
+    prgRunning->RemoveAll();
 
-    HANDLE processesSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, NULL);
-    if (processesSnapshot == INVALID_HANDLE_VALUE)
-        return hr;
+    std::shared_ptr<const Config> pConfig = ConfigStore::Instance().Current();
+    return ProcessIndex::Instance().FindRunning(pConfig->protectedApps, prgRunning);
+}
 
-    Process32First(processesSnapshot, &processInfo);
-    if (!wcscmp(processName, processInfo.szExeFile))
+// Append the names of the applications in rgRunning that run in a session (WTS_CURRENT_SESSION for our own) to
+// prgNames, each name once
+void GetRunningInSession(_In_ const ATL::CAtlArray<RUNNING_APP>& rgRunning, DWORD dwSessionId, _Inout_ ATL::CAtlArray<ATL::CStringW>* prgNames)
+{
+    if (dwSessionId == WTS_CURRENT_SESSION && !ProcessIdToSessionId(GetCurrentProcessId(), &dwSessionId))
     {
-        CloseHandle(processesSnapshot);
-        return processInfo.th32ProcessID;
+        return;
     }
 
-    while (Process32Next(processesSnapshot, &processInfo))
+    for (size_t i = 0; i < rgRunning.GetCount(); i++)
     {
-        if (!wcscmp(processName, processInfo.szExeFile))
+        if (rgRunning[i].dwSessionId != dwSessionId)
         {
-            CloseHandle(processesSnapshot);
-            *processId = processInfo.th32ProcessID;
-            hr = S_OK;
-            return hr;
+            continue;
+        }
+
+        bool fListed = false;
+        for (size_t j = 0; !fListed && j < prgNames->GetCount(); j++)
+        {
+            fListed = (*prgNames)[j] == rgRunning[i].strName;
+        }
+        if (!fListed)
+        {
+            prgNames->Add(rgRunning[i].strName);
         }
     }
+}
 
-    CloseHandle(processesSnapshot);
-    return hr;
+// Whether any protected application (Multivers, unless configured otherwise) is running in a session
+bool ProtectedAppsRunning(DWORD dwSessionId)
+{
+    ATL::CAtlArray<RUNNING_APP> rgRunning;
+    GetRunningProtectedApplications(&rgRunning);
+
+    ATL::CAtlArray<ATL::CStringW> rgNames;
+    GetRunningInSession(rgRunning, dwSessionId, &rgNames);
+    return rgNames.GetCount() > 0;
 }
 
-// Get the SID of the authorized group
-// wmic group get name,sid on the local command line will give you the SIDs of local groups
-HRESULT GetAuthorizedGroup(_Out_ ATL::CSid* groupSid)
+// We run as SYSTEM, and everyone may create directories in ProgramData. A directory that already exists may therefore
+// have been created by another user, who would own it, could change its ACL and could put links in it to have us
+// overwrite another file. So we only use a directory that is not itself a link and that is owned by SYSTEM or the
+// administrators, and we set its owner and ACL again so that only they can write to it. If any of that fails, the
+// directory is not used. Creating it fails for other users, as they cannot make the administrators its owner.
+static HRESULT _CreateDataDirectory(_In_ PCWSTR pszDirectory)
 {
-    *groupSid = ATL::Sids::PowerUsers();
-    // Check if the registry key for an alternative SID is set and if so, try to find a group matching that SID
-    HKEY key;
-    if (RegOpenKey(HKEY_LOCAL_MACHINE, TEXT("Software\\GEWISUnlock\\"), &key) == ERROR_SUCCESS)
+    PSECURITY_DESCRIPTOR pSD;
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(L"O:BAD:P(A;OICI;GA;;;SY)(A;OICI;GA;;;BA)(A;OICI;GRGX;;;BU)", SDDL_REVISION_1, &pSD, nullptr))
     {
-        WCHAR value[512];
-        DWORD dataSize = sizeof(value);
-        if (RegQueryValueEx(key, L"AuthorizedGroup_SID", 0, NULL, (LPBYTE)value, &dataSize) == ERROR_SUCCESS &&
-            value != NULL &&
-            wcslen(value) > 0)
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), pSD, FALSE };
+
+    HRESULT hr = S_OK;
+    bool fCreated = CreateDirectoryW(pszDirectory, &sa) != FALSE;
+    if (!fCreated && GetLastError() != ERROR_ALREADY_EXISTS)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    // The directory itself, not what a junction or symbolic link in its place points to
+    HANDLE hDirectory = INVALID_HANDLE_VALUE;
+    if (SUCCEEDED(hr))
+    {
+        hDirectory = CreateFileW(pszDirectory, READ_CONTROL | WRITE_DAC | WRITE_OWNER, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, nullptr);
+        if (hDirectory == INVALID_HANDLE_VALUE)
         {
-            //::MessageBox(hwndOwner, value, L"SIDinfo", 0);
-            PSID outSid;
-            ConvertStringSidToSid(value, &outSid);
-            ATL::CSid FoundSid = ATL::CSid((const SID*)outSid);
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
 
-            // Only replace the Power Users Group if a corresponding SID was found
-            if (wcslen(FoundSid.AccountName()) > 0 &&
-                wcslen(FoundSid.Domain()) > 0)
-                *groupSid = FoundSid;
+    if (SUCCEEDED(hr))
+    {
+        FILE_ATTRIBUTE_TAG_INFO info;
+        if (!GetFileInformationByHandleEx(hDirectory, FileAttributeTagInfo, &info, sizeof(info)))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+        else if ((info.FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_REPARSE_POINT_ENCOUNTERED);
+        }
+        else if ((info.FileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_DIRECTORY);
+        }
+    }
 
-            LocalFree(outSid);
+    if (SUCCEEDED(hr))
+    {
+        PSID pOwner;
+        PSECURITY_DESCRIPTOR pCurrentSD;
+        DWORD dwError = GetSecurityInfo(hDirectory, SE_FILE_OBJECT, OWNER_SECURITY_INFORMATION, &pOwner, nullptr, nullptr, nullptr, &pCurrentSD);
+        if (dwError != ERROR_SUCCESS)
+        {
+            hr = HRESULT_FROM_WIN32(dwError);
         }
+        else
+        {
+            if (!IsWellKnownSid(pOwner, WinLocalSystemSid) && !IsWellKnownSid(pOwner, WinBuiltinAdministratorsSid))
+            {
+                hr = HRESULT_FROM_WIN32(ERROR_INVALID_OWNER);
+            }
+            LocalFree(pCurrentSD);
+        }
+    }
 
-        RegCloseKey(key);
+    if (SUCCEEDED(hr))
+    {
+        // Also undoes an administrator loosening the ACL, e.g. to let everyone read the audit log
+        PSID pOwner;
+        PACL pDacl;
+        BOOL fPresent;
+        BOOL fDefaulted;
+        DWORD dwError = ERROR_INVALID_SECURITY_DESCR;
+        if (GetSecurityDescriptorOwner(pSD, &pOwner, &fDefaulted) && GetSecurityDescriptorDacl(pSD, &fPresent, &pDacl, &fDefaulted))
+        {
+            dwError = SetSecurityInfo(hDirectory, SE_FILE_OBJECT, OWNER_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION | PROTECTED_DACL_SECURITY_INFORMATION,
+                pOwner, nullptr, pDacl, nullptr);
+        }
+        hr = HRESULT_FROM_WIN32(dwError);
     }
 
-    return S_OK;
+    if (hDirectory != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(hDirectory);
+    }
+    if (FAILED(hr) && fCreated)
+    {
+        // Do not leave a directory behind that we would refuse next time
+        RemoveDirectoryW(pszDirectory);
+    }
+    LocalFree(pSD);
+    return hr;
 }
 
-bool MultiversRunning()
+// Finds and creates %ProgramData%\GEWISUnlock.
+static HRESULT _LookupDataDirectoryBase(_Out_ ATL::CStringW* pstrBase)
 {
-    DWORD pIdMulti = 0;
-    FindProcessId(L"Multi.exe", &pIdMulti);
-    return pIdMulti > 0;
-}
\ No newline at end of file
+    PWSTR pszProgramData;
+    HRESULT hr = SHGetKnownFolderPath(FOLDERID_ProgramData, KF_FLAG_DEFAULT, nullptr, &pszProgramData);
+    if (SUCCEEDED(hr))
+    {
+        pstrBase->Format(L"%s\\GEWISUnlock", pszProgramData);
+        CoTaskMemFree(pszProgramData);
+        hr = _CreateDataDirectory(*pstrBase);
+    }
+    return hr;
+}
+
+// The metrics and the audit log ask for their directory on every write.
+static CachedLookup<ATL::CStringW> s_dataDirectoryBase(_LookupDataDirectoryBase);
+
+// Get %ProgramData%\GEWISUnlock\<pszSubdirectory>, where we keep files such as metrics and the audit log, creating it if needed.
+HRESULT GetDataDirectory(_In_ PCWSTR pszSubdirectory, _Out_ ATL::CStringW* pstrDirectory)
+{
+    HRESULT hr = HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND);
+    for (int iAttempt = 0; hr == HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND) && iAttempt < 2; iAttempt++)
+    {
+        ATL::CStringW strBase;
+        hr = s_dataDirectoryBase.Get(&strBase);
+        if (SUCCEEDED(hr))
+        {
+            pstrDirectory->Format(L"%s\\%s", strBase.GetString(), pszSubdirectory);
+            hr = _CreateDataDirectory(*pstrDirectory);
+            if (hr == HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND))
+            {
+                // Someone removed %ProgramData%\GEWISUnlock; create it again
+                s_dataDirectoryBase.Invalidate();
+            }
+        }
+    }
+    return hr;
+}
@@ -23,6 +23,8 @@
 
 #include <cguid.h>
 #include <atlsecurity.h>
+#include <atlcoll.h>
+#include <atlstr.h>
 
 #pragma warning(push)
 #pragma warning(disable: 4995)
@@ -34,7 +36,38 @@
 #include <wincred.h>
 #pragma warning(pop)
 
-
+#include "KerbSerializer.h"
+
+// Applications that should not be closed by accident when signing off a user (e.g. Multivers),
+// keyed by case-folded executable name with the executable name as configured as value.
+typedef ATL::CAtlMap<ATL::CStringW, ATL::CStringW> CProtectedAppMap;
+
+// How many seconds a protected application gets to close before it is terminated, keyed like CProtectedAppMap.
+// Applications without an entry get the AppCloseTimeout setting.
+typedef ATL::CAtlMap<ATL::CStringW, DWORD> CAppCloseTimeoutMap;
+
+// A protected application that is running in a session.
+struct RUNNING_APP
+{
+    DWORD           dwSessionId;
+    ATL::CStringW   strName;        // As configured in ProtectedApplications.
+};
+
+// What members of an authorized group may do. Combined as flags in a DWORD.
+enum AUTHORIZATION_RIGHT
+{
+    AR_NONE             = 0x0,
+    AR_KICK             = 0x1,  // Sign off the user of this workstation.
+    AR_KICK_PROTECTED   = 0x2,  // Also while a protected application (e.g. Multivers) is running.
+    AR_ALL              = AR_KICK | AR_KICK_PROTECTED,
+};
+
+// A group from the AuthorizedGroups setting, with the AUTHORIZATION_RIGHT flags it grants.
+struct AUTHORIZED_GROUP
+{
+    ATL::CSid   sid;
+    DWORD       dwRights;
+};
 
 //makes a copy of a field descriptor using CoTaskMemAlloc
 HRESULT FieldDescriptorCoAllocCopy(
@@ -70,11 +103,14 @@ HRESULT KerbInteractiveUnlockLogonPack(
     _Out_ DWORD *pcb
     );
 
-//get the authentication package that will be used for our logon attempt
+//get the authentication package that will be used for our logon attempt; it is looked up once and then remembered
 HRESULT RetrieveNegotiateAuthPackage(
     _Out_ ULONG *pulAuthPackage
     );
 
+//forget the remembered authentication package, e.g. because LSA did not recognize it
+void InvalidateNegotiateAuthPackage();
+
 //encrypt a password (if necessary) and copy it; if not, just copy it
 HRESULT ProtectIfNecessaryAndCopyPassword(
     _In_ PCWSTR pwzPassword,
@@ -89,9 +125,10 @@ HRESULT KerbInteractiveUnlockLogonRepackNative(
     _Out_ DWORD *pcbNative
     );
 
-void KerbInteractiveUnlockLogonUnpackInPlace(
+HRESULT KerbInteractiveUnlockLogonUnpackInPlace(
     _Inout_updates_bytes_(cb) KERB_INTERACTIVE_UNLOCK_LOGON *pkiul,
-    DWORD cb
+    DWORD cb,
+    _Out_opt_ KerbSerializer::RESULT *presult = nullptr
     );
 
 HRESULT DomainUsernameStringAlloc(
@@ -100,19 +137,63 @@ HRESULT DomainUsernameStringAlloc(
     _Outptr_result_nullonfailure_ PWSTR *ppwszDomainUsername
     );
 
-HRESULT SplitDomainAndUsername(
-    _In_ PCWSTR pszQualifiedUserName,
-    _Outptr_result_nullonfailure_ PWSTR *ppszDomain,
-    _Outptr_result_nullonfailure_ PWSTR *ppszUsername
+HRESULT QueryTokenGroups(
+    _In_ HANDLE hToken,
+    _Inout_ ATL::CAtlArray<BYTE> *prgbBuffer,
+    _Outptr_ const TOKEN_GROUPS **ppGroups
+);
+
+HRESULT GetAuthorizedGroups(
+    _In_opt_ HKEY key,
+    _Out_ ATL::CAtlArray<AUTHORIZED_GROUP> *prgGroups
+);
+
+HRESULT GetDefaultDomain(
+    _In_opt_ HKEY key,
+    _Out_ ATL::CStringW *pstrDomain
 );
 
-HRESULT FindProcessId(
-    _In_ LPCWSTR processName,
-    _Out_ DWORD *processId
+DWORD GetAuthorizationCacheTtl(
+    _In_opt_ HKEY key
 );
 
-HRESULT GetAuthorizedGroup(
-    _Out_ ATL::CSid *groupSid
+bool GetPrefetchEnabled(
+    _In_opt_ HKEY key
 );
 
-bool MultiversRunning();
\ No newline at end of file
+DWORD GetReclaimLockedAfter(
+    _In_opt_ HKEY key
+);
+
+DWORD GetLogoffTimeout(
+    _In_opt_ HKEY key
+);
+
+HRESULT GetDataDirectory(
+    _In_ PCWSTR pszSubdirectory,
+    _Out_ ATL::CStringW *pstrDirectory
+);
+
+HRESULT GetProtectedApplications(
+    _In_opt_ HKEY key,
+    _Out_ CProtectedAppMap *pApps,
+    _Out_ CAppCloseTimeoutMap *pCloseTimeouts
+);
+
+DWORD GetAppCloseTimeout(
+    _In_opt_ HKEY key
+);
+
+HRESULT GetRunningProtectedApplications(
+    _Out_ ATL::CAtlArray<RUNNING_APP> *prgRunning
+);
+
+void GetRunningInSession(
+    _In_ const ATL::CAtlArray<RUNNING_APP> &rgRunning,
+    DWORD dwSessionId,
+    _Inout_ ATL::CAtlArray<ATL::CStringW> *prgNames
+);
+
+bool ProtectedAppsRunning(
+    DWORD dwSessionId
+);
@@ -0,0 +1,862 @@
+//
+// GEWIS, 2020-2023
+//
+
+// Drives the credential provider the way LogonUI does when the workstation is locked, without locking it:
+// SetUsageScenario, SetUserArray, Advise, GetCredentialCount, GetCredentialAt, the credential's Advise and
+// SetSelected, typing into the fields one character at a time, and GetSerialization. How long each call takes
+// is printed, so a slow call can be found without attaching a debugger to LogonUI.
+//
+// The provider DLL is loaded and created through DllGetClassObject, like LogonUI does, so this tests the DLL
+// that is installed rather than a separate build of it. LogonUI's user array and event callbacks are replaced by
+// stubs that describe the user running this program and print what the credential asks for.
+//
+// By default the name of that user is typed, so GetSerialization only packs an unlock request, which is
+// printed and thrown away; nobody is signed out. With --kick, the given room responsible is typed instead,
+// which is verified and signs out the sessions for real, as pressing Kick would. Their password is read from
+// the console without showing it, so it does not end up in the command line of the process or the history.
+//
+// With --fake, the provider gets made-up sessions (a FakeSessionSource that signs out promptly, slowly, only
+// after its applications are terminated, or never) and a logon that accepts any username with the password
+// "fake" and gives the token of this program, so the groups of the user running it are checked. Nobody is
+// signed out and no account is needed. The provider takes them through SetTestBackends, which only a Debug
+// build of the DLL exports, and only works with a host of the same configuration.
+//
+// Usage: GEWISUnlockHost [--dll <path>] [--fake] [--kick <username>]
+
+#include <initguid.h>
+#include "helpers.h"
+#include "common.h"
+#include "guid.h"
+#include "LogonBackend.h"
+#include "FakeSessionSource.h"
+#include <propkey.h>
+#include <stdio.h>
+
+static const PCWSTR s_pszDefaultDll = L"GEWISUnlockV2CredentialProvider.dll";
+static const PCWSTR s_pszDummyPassword = L"not checked";
+static const PCWSTR s_pszFakePassword = L"fake";
+
+// How long the fake sessions that sign out slowly, or once their applications are terminated, take.
+static const ULONGLONG s_ullFakeLogoffMs = 5 * 1000;
+
+// How long to wait for a kick to finish in the background (verifying, signing out and the timeout for that).
+static const DWORD s_dwKickWaitMs = 5 * 60 * 1000;
+
+static LARGE_INTEGER s_liFrequency;
+
+// With --fake; its clock follows GetTickCount64, as LogoffTracker's does.
+static FakeSessionSource* s_pFakeSessions = nullptr;
+
+static LONGLONG _Now()
+{
+    LARGE_INTEGER li;
+    QueryPerformanceCounter(&li);
+    return li.QuadPart;
+}
+
+static double _MsSince(LONGLONG llStart)
+{
+    return static_cast<double>(_Now() - llStart) * 1000 / static_cast<double>(s_liFrequency.QuadPart);
+}
+
+static void _Report(_In_ PCWSTR pszCall, HRESULT hr, LONGLONG llStart)
+{
+    wprintf(L"%-32s %10.3f ms   0x%08lX\n", pszCall, _MsSince(llStart), static_cast<unsigned long>(hr));
+}
+
+// The user whose tile LogonUI would show: the one running this program.
+class HostUser : public ICredentialProviderUser
+{
+public:
+    HostUser() : _cRef(1)
+    {
+    }
+
+    HRESULT Initialize()
+    {
+        ATL::CAccessToken token;
+        ATL::CSid sid;
+        if (!token.GetProcessToken(TOKEN_QUERY) || !token.GetUser(&sid))
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+        _strSid = sid.Sid();
+
+        WCHAR wszName[256];
+        ULONG cchName = ARRAYSIZE(wszName);
+        if (!GetUserNameExW(NameSamCompatible, wszName, &cchName))
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+        _strQualifiedUserName = wszName;
+        return S_OK;
+    }
+
+    PCWSTR GetQualifiedUserName() const
+    {
+        return _strQualifiedUserName;
+    }
+
+    // IUnknown
+    IFACEMETHODIMP QueryInterface(_In_ REFIID riid, _COM_Outptr_ void** ppv)
+    {
+        static const QITAB qit[] =
+        {
+            QITABENT(HostUser, ICredentialProviderUser),
+            { 0 },
+        };
+        return QISearch(this, qit, riid, ppv);
+    }
+
+    IFACEMETHODIMP_(ULONG) AddRef()
+    {
+        return InterlockedIncrement(&_cRef);
+    }
+
+    IFACEMETHODIMP_(ULONG) Release()
+    {
+        long cRef = InterlockedDecrement(&_cRef);
+        if (!cRef)
+            delete this;
+        return cRef;
+    }
+
+    // ICredentialProviderUser
+    IFACEMETHODIMP GetSid(_Outptr_result_nullonfailure_ PWSTR* ppszSid)
+    {
+        return SHStrDupW(_strSid, ppszSid);
+    }
+
+    IFACEMETHODIMP GetProviderID(_Out_ GUID* pguidProviderID)
+    {
+        // The credential only serves local user tiles
+        *pguidProviderID = Identity_LocalUserProvider;
+        return S_OK;
+    }
+
+    IFACEMETHODIMP GetStringValue(_In_ REFPROPERTYKEY key, _Outptr_result_nullonfailure_ PWSTR* ppszValue)
+    {
+        *ppszValue = nullptr;
+        if (IsEqualPropertyKey(key, PKEY_Identity_QualifiedUserName) || IsEqualPropertyKey(key, PKEY_Identity_DisplayName))
+        {
+            return SHStrDupW(_strQualifiedUserName, ppszValue);
+        }
+        if (IsEqualPropertyKey(key, PKEY_Identity_UserName))
+        {
+            int ichWhack = _strQualifiedUserName.Find(L'\\');
+            return SHStrDupW(_strQualifiedUserName.Mid(ichWhack + 1), ppszValue);
+        }
+        return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+    }
+
+    IFACEMETHODIMP GetValue(_In_ REFPROPERTYKEY /* key */, _Out_ PROPVARIANT* pv)
+    {
+        PropVariantInit(pv);
+        return E_NOTIMPL;
+    }
+
+private:
+    ~HostUser()
+    {
+    }
+
+    long            _cRef;
+    ATL::CStringW   _strSid;
+    ATL::CStringW   _strQualifiedUserName;  // DOMAIN\user.
+};
+
+class HostUserArray : public ICredentialProviderUserArray
+{
+public:
+    HostUserArray(_In_ HostUser* pUser) : _cRef(1), _pUser(pUser)
+    {
+        _pUser->AddRef();
+    }
+
+    // IUnknown
+    IFACEMETHODIMP QueryInterface(_In_ REFIID riid, _COM_Outptr_ void** ppv)
+    {
+        static const QITAB qit[] =
+        {
+            QITABENT(HostUserArray, ICredentialProviderUserArray),
+            { 0 },
+        };
+        return QISearch(this, qit, riid, ppv);
+    }
+
+    IFACEMETHODIMP_(ULONG) AddRef()
+    {
+        return InterlockedIncrement(&_cRef);
+    }
+
+    IFACEMETHODIMP_(ULONG) Release()
+    {
+        long cRef = InterlockedDecrement(&_cRef);
+        if (!cRef)
+            delete this;
+        return cRef;
+    }
+
+    // ICredentialProviderUserArray
+    IFACEMETHODIMP SetProviderFilter(_In_ REFGUID /* guidProviderToFilterTo */)
+    {
+        return S_OK;
+    }
+
+    IFACEMETHODIMP GetAccountOptions(_Out_ CREDENTIAL_PROVIDER_ACCOUNT_OPTIONS* pcpao)
+    {
+        *pcpao = CPAO_NONE;
+        return S_OK;
+    }
+
+    IFACEMETHODIMP GetCount(_Out_ DWORD* pdwUserCount)
+    {
+        *pdwUserCount = 1;
+        return S_OK;
+    }
+
+    IFACEMETHODIMP GetAt(DWORD dwIndex, _COM_Outptr_ ICredentialProviderUser** ppUser)
+    {
+        *ppUser = nullptr;
+        if (dwIndex != 0)
+        {
+            return E_INVALIDARG;
+        }
+        return _pUser->QueryInterface(IID_PPV_ARGS(ppUser));
+    }
+
+private:
+    ~HostUserArray()
+    {
+        _pUser->Release();
+    }
+
+    long        _cRef;
+    HostUser*   _pUser;
+};
+
+// What the provider tells LogonUI: that a kick finished in the background and its result can be collected.
+class HostProviderEvents : public ICredentialProviderEvents
+{
+public:
+    HostProviderEvents() : _cRef(1), _fCredentialsChanged(false)
+    {
+    }
+
+    bool HaveCredentialsChanged() const
+    {
+        return _fCredentialsChanged;
+    }
+
+    void ResetCredentialsChanged()
+    {
+        _fCredentialsChanged = false;
+    }
+
+    // IUnknown
+    IFACEMETHODIMP QueryInterface(_In_ REFIID riid, _COM_Outptr_ void** ppv)
+    {
+        static const QITAB qit[] =
+        {
+            QITABENT(HostProviderEvents, ICredentialProviderEvents),
+            { 0 },
+        };
+        return QISearch(this, qit, riid, ppv);
+    }
+
+    IFACEMETHODIMP_(ULONG) AddRef()
+    {
+        return InterlockedIncrement(&_cRef);
+    }
+
+    IFACEMETHODIMP_(ULONG) Release()
+    {
+        long cRef = InterlockedDecrement(&_cRef);
+        if (!cRef)
+            delete this;
+        return cRef;
+    }
+
+    // ICredentialProviderEvents
+    IFACEMETHODIMP CredentialsChanged(UINT_PTR upAdviseContext)
+    {
+        wprintf(L"  CredentialsChanged(%Iu)\n", upAdviseContext);
+        _fCredentialsChanged = true;
+        return S_OK;
+    }
+
+private:
+    ~HostProviderEvents()
+    {
+    }
+
+    long    _cRef;
+    bool    _fCredentialsChanged;
+};
+
+// A logon for --fake: any username with s_pszFakePassword is accepted and gets the token of this program.
+class FakeLogonBackend : public LogonBackend
+{
+public:
+    HRESULT Logon(_In_opt_ PCWSTR pszDomain, _In_ PCWSTR pszUsername, _In_ PCWSTR pszPassword, _Inout_ ATL::CAccessToken* pToken) override
+    {
+        wprintf(L"  Logon(%s%s%s)\n", pszDomain != nullptr ? pszDomain : L"", pszDomain != nullptr ? L"\\" : L"", pszUsername);
+
+        // The credential protects the password, as LogonUser accepts it
+        WCHAR wszPassword[CREDUI_MAX_PASSWORD_LENGTH + 1];
+        DWORD cchPassword = ARRAYSIZE(wszPassword);
+        CRED_PROTECTION_TYPE protectionType;
+        HRESULT hr = S_OK;
+        if (CredIsProtectedW(const_cast<PWSTR>(pszPassword), &protectionType) && protectionType != CredUnprotected)
+        {
+            if (!CredUnprotectW(FALSE, const_cast<PWSTR>(pszPassword), static_cast<DWORD>(wcslen(pszPassword) + 1), wszPassword, &cchPassword))
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+            }
+        }
+        else
+        {
+            hr = StringCchCopyW(wszPassword, ARRAYSIZE(wszPassword), pszPassword);
+        }
+
+        if (SUCCEEDED(hr) && wcscmp(wszPassword, s_pszFakePassword) != 0)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_LOGON_FAILURE);
+        }
+        if (SUCCEEDED(hr) && !pToken->GetProcessToken(TOKEN_QUERY))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+        SecureZeroMemory(wszPassword, sizeof(wszPassword));
+        return hr;
+    }
+};
+
+// Sessions for --fake: the locked one of the user running this program, and one locked session for each way of
+// signing out. No real session has these IDs, so no protected application runs in them and none is closed.
+static void _AddFakeSessions(_Inout_ FakeSessionSource* pSessions, _In_ PCWSTR pszCurrentUser)
+{
+    pSessions->SetNow(GetTickCount64());
+    pSessions->AddSession(1000, pszCurrentUser, true, true);
+    pSessions->AddSession(1001, L"FAKE\\prompt", true, false, true, FLB_PROMPT);
+    pSessions->AddSession(1002, L"FAKE\\slow", true, false, true, FLB_SLOW, s_ullFakeLogoffMs);
+    pSessions->AddSession(1003, L"FAKE\\stuck", true, false, true, FLB_STUCK, s_ullFakeLogoffMs);
+    pSessions->AddSession(1004, L"FAKE\\hung", true, false, true, FLB_HUNG);
+    pSessions->AddSession(1005, L"FAKE\\failing", true, false, true, FLB_FAIL);
+}
+
+// Reads a line from the console without echoing it, for the password. Input that is not a console (e.g. a pipe)
+// is read as it is.
+static HRESULT _ReadPassword(_In_ PCWSTR pszUsername, _Out_writes_(cchPassword) PWSTR pszPassword, size_t cchPassword)
+{
+    fwprintf(stderr, L"Password of %s: ", pszUsername);
+    HANDLE hInput = GetStdHandle(STD_INPUT_HANDLE);
+    DWORD dwMode;
+    bool fConsole = GetConsoleMode(hInput, &dwMode) != FALSE;
+    if (fConsole)
+    {
+        SetConsoleMode(hInput, dwMode & ~ENABLE_ECHO_INPUT);
+    }
+
+    HRESULT hr = S_OK;
+    if (fgetws(pszPassword, static_cast<int>(cchPassword), stdin) == nullptr)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+        pszPassword[0] = L'\0';
+    }
+    pszPassword[wcscspn(pszPassword, L"\r\n")] = L'\0';
+
+    if (fConsole)
+    {
+        SetConsoleMode(hInput, dwMode);
+        fwprintf(stderr, L"\n");
+    }
+    return hr;
+}
+
+// Runs the message loop until pEvents says the credentials changed or dwTimeoutMs passes, as LogonUI runs one on this thread.
+// The credential gets its session and protected application notifications, and its timers, through it.
+static void _PumpMessages(DWORD dwTimeoutMs, _In_opt_ const HostProviderEvents* pEvents)
+{
+    ULONGLONG ullDeadline = GetTickCount64() + dwTimeoutMs;
+    for (;;)
+    {
+        if (s_pFakeSessions != nullptr)
+        {
+            s_pFakeSessions->SetNow(GetTickCount64());
+        }
+
+        MSG msg;
+        while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE))
+        {
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+        }
+
+        ULONGLONG ullNow = GetTickCount64();
+        if ((pEvents != nullptr && pEvents->HaveCredentialsChanged()) || ullNow >= ullDeadline)
+        {
+            return;
+        }
+        MsgWaitForMultipleObjects(0, nullptr, FALSE, static_cast<DWORD>(ullDeadline - ullNow), QS_ALLINPUT);
+    }
+}
+
+// What the credential tells LogonUI to show. Only printed; the fields that matter while following a kick are
+// the strings (the status text in particular) and which fields are shown.
+class HostCredentialEvents : public ICredentialProviderCredentialEvents2
+{
+public:
+    HostCredentialEvents() : _cRef(1)
+    {
+    }
+
+    // IUnknown
+    IFACEMETHODIMP QueryInterface(_In_ REFIID riid, _COM_Outptr_ void** ppv)
+    {
+        static const QITAB qit[] =
+        {
+            QITABENT(HostCredentialEvents, ICredentialProviderCredentialEvents),
+            QITABENT(HostCredentialEvents, ICredentialProviderCredentialEvents2),
+            { 0 },
+        };
+        return QISearch(this, qit, riid, ppv);
+    }
+
+    IFACEMETHODIMP_(ULONG) AddRef()
+    {
+        return InterlockedIncrement(&_cRef);
+    }
+
+    IFACEMETHODIMP_(ULONG) Release()
+    {
+        long cRef = InterlockedDecrement(&_cRef);
+        if (!cRef)
+            delete this;
+        return cRef;
+    }
+
+    // ICredentialProviderCredentialEvents
+    IFACEMETHODIMP SetFieldState(_In_ ICredentialProviderCredential* /* pcpc */, DWORD dwFieldID, CREDENTIAL_PROVIDER_FIELD_STATE cpfs)
+    {
+        wprintf(L"  SetFieldState(%lu, %d)\n", dwFieldID, cpfs);
+        return S_OK;
+    }
+
+    IFACEMETHODIMP SetFieldInteractiveState(_In_ ICredentialProviderCredential* /* pcpc */, DWORD dwFieldID,
+        CREDENTIAL_PROVIDER_FIELD_INTERACTIVE_STATE cpfis)
+    {
+        wprintf(L"  SetFieldInteractiveState(%lu, %d)\n", dwFieldID, cpfis);
+        return S_OK;
+    }
+
+    IFACEMETHODIMP SetFieldString(_In_ ICredentialProviderCredential* /* pcpc */, DWORD dwFieldID, _In_opt_ PCWSTR psz)
+    {
+        wprintf(L"  SetFieldString(%lu, \"%s\")\n", dwFieldID, psz != nullptr ? psz : L"");
+        return S_OK;
+    }
+
+    IFACEMETHODIMP SetFieldCheckbox(_In_ ICredentialProviderCredential* /* pcpc */, DWORD dwFieldID, BOOL bChecked,
+        _In_opt_ PCWSTR /* pszLabel */)
+    {
+        wprintf(L"  SetFieldCheckbox(%lu, %d)\n", dwFieldID, bChecked);
+        return S_OK;
+    }
+
+    IFACEMETHODIMP SetFieldBitmap(_In_ ICredentialProviderCredential* /* pcpc */, DWORD dwFieldID, _In_opt_ HBITMAP /* hbmp */)
+    {
+        wprintf(L"  SetFieldBitmap(%lu)\n", dwFieldID);
+        return S_OK;
+    }
+
+    IFACEMETHODIMP SetFieldComboBoxSelectedItem(_In_ ICredentialProviderCredential* /* pcpc */, DWORD dwFieldID, DWORD dwSelectedItem)
+    {
+        wprintf(L"  SetFieldComboBoxSelectedItem(%lu, %lu)\n", dwFieldID, dwSelectedItem);
+        return S_OK;
+    }
+
+    IFACEMETHODIMP DeleteFieldComboBoxItem(_In_ ICredentialProviderCredential* /* pcpc */, DWORD dwFieldID, DWORD dwItem)
+    {
+        wprintf(L"  DeleteFieldComboBoxItem(%lu, %lu)\n", dwFieldID, dwItem);
+        return S_OK;
+    }
+
+    IFACEMETHODIMP AppendFieldComboBoxItem(_In_ ICredentialProviderCredential* /* pcpc */, DWORD dwFieldID, _In_ PCWSTR pszItem)
+    {
+        wprintf(L"  AppendFieldComboBoxItem(%lu, \"%s\")\n", dwFieldID, pszItem);
+        return S_OK;
+    }
+
+    IFACEMETHODIMP SetFieldSubmitButton(_In_ ICredentialProviderCredential* /* pcpc */, DWORD dwFieldID, DWORD dwAdjacentTo)
+    {
+        wprintf(L"  SetFieldSubmitButton(%lu, %lu)\n", dwFieldID, dwAdjacentTo);
+        return S_OK;
+    }
+
+    IFACEMETHODIMP OnCreatingWindow(_Out_ HWND* phwndOwner)
+    {
+        *phwndOwner = GetConsoleWindow();
+        return S_OK;
+    }
+
+    // ICredentialProviderCredentialEvents2
+    IFACEMETHODIMP BeginFieldUpdates()
+    {
+        return S_OK;
+    }
+
+    IFACEMETHODIMP EndFieldUpdates()
+    {
+        return S_OK;
+    }
+
+    IFACEMETHODIMP SetFieldOptions(_In_ ICredentialProviderCredential* /* pcpc */, DWORD dwFieldID,
+        CREDENTIAL_PROVIDER_CREDENTIAL_FIELD_OPTIONS cpcfo)
+    {
+        wprintf(L"  SetFieldOptions(%lu, 0x%x)\n", dwFieldID, cpcfo);
+        return S_OK;
+    }
+
+private:
+    ~HostCredentialEvents()
+    {
+    }
+
+    long    _cRef;
+};
+
+static PCWSTR _GetResponseName(CREDENTIAL_PROVIDER_GET_SERIALIZATION_RESPONSE cpgsr)
+{
+    switch (cpgsr)
+    {
+    case CPGSR_NO_CREDENTIAL_NOT_FINISHED:  return L"CPGSR_NO_CREDENTIAL_NOT_FINISHED";
+    case CPGSR_NO_CREDENTIAL_FINISHED:      return L"CPGSR_NO_CREDENTIAL_FINISHED";
+    case CPGSR_RETURN_CREDENTIAL_FINISHED:  return L"CPGSR_RETURN_CREDENTIAL_FINISHED";
+    case CPGSR_RETURN_NO_CREDENTIAL_FINISHED: return L"CPGSR_RETURN_NO_CREDENTIAL_FINISHED";
+    }
+    return L"?";
+}
+
+// Calls GetSerialization and prints what came back. The serialization holds the password, so it is wiped.
+static HRESULT _GetSerialization(_In_ ICredentialProviderCredential* pCredential, _In_ PCWSTR pszCall,
+    _Out_ CREDENTIAL_PROVIDER_GET_SERIALIZATION_RESPONSE* pcpgsr)
+{
+    CREDENTIAL_PROVIDER_CREDENTIAL_SERIALIZATION cpcs = {};
+    PWSTR pszStatus = nullptr;
+    CREDENTIAL_PROVIDER_STATUS_ICON cpsi = CPSI_NONE;
+    LONGLONG llStart = _Now();
+    HRESULT hr = pCredential->GetSerialization(pcpgsr, &cpcs, &pszStatus, &cpsi);
+    _Report(pszCall, hr, llStart);
+    if (SUCCEEDED(hr))
+    {
+        wprintf(L"  %s, %lu bytes for package %lu\n", _GetResponseName(*pcpgsr), cpcs.cbSerialization, cpcs.ulAuthenticationPackage);
+        if (pszStatus != nullptr)
+        {
+            wprintf(L"  \"%s\"\n", pszStatus);
+        }
+    }
+    if (cpcs.rgbSerialization != nullptr)
+    {
+        SecureZeroMemory(cpcs.rgbSerialization, cpcs.cbSerialization);
+        CoTaskMemFree(cpcs.rgbSerialization);
+    }
+    CoTaskMemFree(pszStatus);
+    return hr;
+}
+
+// Types psz into the field one character at a time, as LogonUI calls SetStringValue on every keystroke.
+static HRESULT _Type(_In_ ICredentialProviderCredential* pCredential, DWORD dwFieldID, _In_ PCWSTR psz, _In_ PCWSTR pszCall)
+{
+    HRESULT hr = S_OK;
+    double dblTotalMs = 0;
+    double dblMaxMs = 0;
+    size_t cch = wcslen(psz);
+    ATL::CStringW strTyped;
+    for (size_t i = 0; SUCCEEDED(hr) && i < cch; i++)
+    {
+        strTyped.AppendChar(psz[i]);
+        LONGLONG llStart = _Now();
+        hr = pCredential->SetStringValue(dwFieldID, strTyped);
+        double dblMs = _MsSince(llStart);
+        dblTotalMs += dblMs;
+        dblMaxMs = dblMs > dblMaxMs ? dblMs : dblMaxMs;
+    }
+    SecureZeroMemory(strTyped.GetBuffer(), strTyped.GetLength() * sizeof(WCHAR));
+    strTyped.ReleaseBuffer();
+    wprintf(L"%-32s %10.3f ms   0x%08lX   %Iu keystrokes, at most %.3f ms\n", pszCall, dblTotalMs,
+        static_cast<unsigned long>(hr), cch, dblMaxMs);
+    return hr;
+}
+
+static HRESULT _Run(_In_ ICredentialProvider* pProvider, _In_ HostUser* pUser, _In_ PCWSTR pszUsername, _In_ PCWSTR pszPassword)
+{
+    LONGLONG llStart = _Now();
+    HRESULT hr = pProvider->SetUsageScenario(CPUS_UNLOCK_WORKSTATION, 0);
+    _Report(L"SetUsageScenario", hr, llStart);
+
+    if (SUCCEEDED(hr))
+    {
+        ICredentialProviderSetUserArray* pSetUserArray;
+        hr = pProvider->QueryInterface(IID_PPV_ARGS(&pSetUserArray));
+        if (SUCCEEDED(hr))
+        {
+            HostUserArray* pUserArray = new HostUserArray(pUser);
+            llStart = _Now();
+            hr = pSetUserArray->SetUserArray(pUserArray);
+            _Report(L"SetUserArray", hr, llStart);
+            pUserArray->Release();
+            pSetUserArray->Release();
+        }
+    }
+
+    HostProviderEvents* pProviderEvents = new HostProviderEvents();
+    if (SUCCEEDED(hr))
+    {
+        llStart = _Now();
+        hr = pProvider->Advise(pProviderEvents, 1);
+        _Report(L"Advise", hr, llStart);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        DWORD cFields = 0;
+        llStart = _Now();
+        hr = pProvider->GetFieldDescriptorCount(&cFields);
+        for (DWORD i = 0; SUCCEEDED(hr) && i < cFields; i++)
+        {
+            CREDENTIAL_PROVIDER_FIELD_DESCRIPTOR* pcpfd;
+            hr = pProvider->GetFieldDescriptorAt(i, &pcpfd);
+            if (SUCCEEDED(hr))
+            {
+                CoTaskMemFree(pcpfd->pszLabel);
+                CoTaskMemFree(pcpfd);
+            }
+        }
+        _Report(L"GetFieldDescriptorCount/At", hr, llStart);
+    }
+
+    DWORD cCredentials = 0;
+    if (SUCCEEDED(hr))
+    {
+        DWORD dwDefault;
+        BOOL fAutoLogonWithDefault;
+        llStart = _Now();
+        hr = pProvider->GetCredentialCount(&cCredentials, &dwDefault, &fAutoLogonWithDefault);
+        _Report(L"GetCredentialCount", hr, llStart);
+        if (SUCCEEDED(hr) && cCredentials == 0)
+        {
+            wprintf(L"The provider has no tile for %s.\n", pUser->GetQualifiedUserName());
+            hr = E_FAIL;
+        }
+    }
+
+    ICredentialProviderCredential* pCredential = nullptr;
+    if (SUCCEEDED(hr))
+    {
+        llStart = _Now();
+        hr = pProvider->GetCredentialAt(0, &pCredential);
+        _Report(L"GetCredentialAt", hr, llStart);
+    }
+
+    HostCredentialEvents* pCredentialEvents = new HostCredentialEvents();
+    bool fAdvised = false;
+    if (SUCCEEDED(hr))
+    {
+        llStart = _Now();
+        hr = pCredential->Advise(pCredentialEvents);
+        _Report(L"Credential Advise", hr, llStart);
+        fAdvised = SUCCEEDED(hr);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        BOOL fAutoLogon;
+        llStart = _Now();
+        hr = pCredential->SetSelected(&fAutoLogon);
+        _Report(L"SetSelected", hr, llStart);
+
+        // LogonUI shows the tile before anyone types; let the credential handle what it posted meanwhile
+        _PumpMessages(100, nullptr);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = _Type(pCredential, GFI_USERNAME, pszUsername, L"SetStringValue (username)");
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = _Type(pCredential, GFI_PASSWORD, pszPassword, L"SetStringValue (password)");
+    }
+
+    CREDENTIAL_PROVIDER_GET_SERIALIZATION_RESPONSE cpgsr = CPGSR_NO_CREDENTIAL_FINISHED;
+    if (SUCCEEDED(hr))
+    {
+        hr = _GetSerialization(pCredential, L"GetSerialization", &cpgsr);
+    }
+
+    // A kick runs in the background; the provider says when its result is there, like it does to LogonUI
+    if (SUCCEEDED(hr) && cpgsr == CPGSR_NO_CREDENTIAL_NOT_FINISHED)
+    {
+        llStart = _Now();
+        _PumpMessages(s_dwKickWaitMs, pProviderEvents);
+        if (pProviderEvents->HaveCredentialsChanged())
+        {
+            _Report(L"(kick in the background)", S_OK, llStart);
+            pProviderEvents->ResetCredentialsChanged();
+            hr = _GetSerialization(pCredential, L"GetSerialization (result)", &cpgsr);
+        }
+    }
+
+    if (pCredential != nullptr)
+    {
+        llStart = _Now();
+        pCredential->SetDeselected();
+        if (fAdvised)
+        {
+            pCredential->UnAdvise();
+        }
+        pCredential->Release();
+        _Report(L"SetDeselected/UnAdvise/Release", S_OK, llStart);
+    }
+    pCredentialEvents->Release();
+
+    llStart = _Now();
+    pProvider->UnAdvise();
+    _Report(L"UnAdvise", S_OK, llStart);
+    pProviderEvents->Release();
+    return hr;
+}
+
+int __cdecl wmain(int argc, _In_reads_(argc) wchar_t** argv)
+{
+    PCWSTR pszDll = s_pszDefaultDll;
+    PCWSTR pszUsername = nullptr;
+    bool fFake = false;
+    bool fUsage = false;
+    for (int i = 1; i < argc && !fUsage; i++)
+    {
+        if (_wcsicmp(argv[i], L"--dll") == 0 && i + 1 < argc)
+        {
+            pszDll = argv[++i];
+        }
+        else if (_wcsicmp(argv[i], L"--fake") == 0)
+        {
+            fFake = true;
+        }
+        else if (_wcsicmp(argv[i], L"--kick") == 0 && i + 1 < argc)
+        {
+            pszUsername = argv[++i];
+        }
+        else
+        {
+            fUsage = true;
+        }
+    }
+    if (fUsage)
+    {
+        fwprintf(stderr, L"Usage: GEWISUnlockHost [--dll <path>] [--fake] [--kick <username>]\n");
+        return 2;
+    }
+
+    // Only a kick checks the password
+    WCHAR wszPassword[CREDUI_MAX_PASSWORD_LENGTH + 1];
+    StringCchCopyW(wszPassword, ARRAYSIZE(wszPassword), s_pszDummyPassword);
+    if (pszUsername != nullptr && FAILED(_ReadPassword(pszUsername, wszPassword, ARRAYSIZE(wszPassword))))
+    {
+        fwprintf(stderr, L"No password was entered.\n");
+        return 2;
+    }
+
+    QueryPerformanceFrequency(&s_liFrequency);
+    HRESULT hr = CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED);
+    if (FAILED(hr))
+    {
+        fwprintf(stderr, L"CoInitializeEx failed: 0x%08lX\n", static_cast<unsigned long>(hr));
+        return 1;
+    }
+
+    HostUser* pUser = new HostUser();
+    hr = pUser->Initialize();
+    if (SUCCEEDED(hr))
+    {
+        // Typing our own name makes the credential unlock instead of kick
+        pszUsername = pszUsername != nullptr ? pszUsername : pUser->GetQualifiedUserName();
+        wprintf(L"Tile of %s, typing %s%s\n\n", pUser->GetQualifiedUserName(), pszUsername, fFake ? L", with fake sessions and logon" : L"");
+        wprintf(L"%-32s %13s   %-10s\n", L"call", L"time", L"result");
+    }
+
+    HMODULE hmod = nullptr;
+    if (SUCCEEDED(hr))
+    {
+        LONGLONG llStart = _Now();
+        hmod = LoadLibraryW(pszDll);
+        hr = hmod != nullptr ? S_OK : HRESULT_FROM_WIN32(GetLastError());
+        _Report(L"LoadLibrary", hr, llStart);
+    }
+
+    // The credential picks up the backends when it is created, so they have to be set before
+    FakeSessionSource fakeSessions;
+    FakeLogonBackend fakeLogon;
+    typedef HRESULT(STDAPICALLTYPE* PFN_SET_TEST_BACKENDS)(SessionSource*, LogonBackend*);
+    PFN_SET_TEST_BACKENDS pfnSetTestBackends = nullptr;
+    if (SUCCEEDED(hr) && fFake)
+    {
+        pfnSetTestBackends = reinterpret_cast<PFN_SET_TEST_BACKENDS>(GetProcAddress(hmod, "SetTestBackends"));
+        if (pfnSetTestBackends == nullptr)
+        {
+            fwprintf(stderr, L"%s is not a Debug build, so it cannot use fake sessions.\n", pszDll);
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+        else
+        {
+            _AddFakeSessions(&fakeSessions, pUser->GetQualifiedUserName());
+            s_pFakeSessions = &fakeSessions;
+            hr = pfnSetTestBackends(&fakeSessions, &fakeLogon);
+        }
+    }
+
+    ICredentialProvider* pProvider = nullptr;
+    if (SUCCEEDED(hr))
+    {
+        typedef HRESULT(STDAPICALLTYPE* PFN_DLL_GET_CLASS_OBJECT)(REFCLSID, REFIID, void**);
+        PFN_DLL_GET_CLASS_OBJECT pfnDllGetClassObject = reinterpret_cast<PFN_DLL_GET_CLASS_OBJECT>(GetProcAddress(hmod, "DllGetClassObject"));
+        hr = pfnDllGetClassObject != nullptr ? S_OK : HRESULT_FROM_WIN32(GetLastError());
+
+        IClassFactory* pFactory = nullptr;
+        LONGLONG llStart = _Now();
+        if (SUCCEEDED(hr))
+        {
+            hr = pfnDllGetClassObject(CLSID_GEWUnlockv2, IID_PPV_ARGS(&pFactory));
+        }
+        if (SUCCEEDED(hr))
+        {
+            hr = pFactory->CreateInstance(nullptr, IID_PPV_ARGS(&pProvider));
+            pFactory->Release();
+        }
+        _Report(L"CreateInstance", hr, llStart);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = _Run(pProvider, pUser, pszUsername, wszPassword);
+
+        LONGLONG llStart = _Now();
+        pProvider->Release();
+        _Report(L"Release", S_OK, llStart);
+    }
+    pUser->Release();
+    SecureZeroMemory(wszPassword, sizeof(wszPassword));
+
+    if (pfnSetTestBackends != nullptr)
+    {
+        pfnSetTestBackends(nullptr, nullptr);
+        s_pFakeSessions = nullptr;
+    }
+    if (hmod != nullptr)
+    {
+        FreeLibrary(hmod);
+    }
+    CoUninitialize();
+    return SUCCEEDED(hr) ? 0 : 1;
+}
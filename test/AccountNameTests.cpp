@@ -0,0 +1,151 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "CppUnitTest.h"
+#include "AccountName.h"
+#include <string>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace Microsoft { namespace VisualStudio { namespace CppUnitTestFramework {
+
+template<> inline std::wstring ToString<ACCOUNT_NAME_FORMAT>(const ACCOUNT_NAME_FORMAT& format)
+{
+    switch (format)
+    {
+    case ANF_PLAIN:         return L"ANF_PLAIN";
+    case ANF_DOWN_LEVEL:    return L"ANF_DOWN_LEVEL";
+    case ANF_LOCAL:         return L"ANF_LOCAL";
+    case ANF_UPN:           return L"ANF_UPN";
+    }
+    return std::to_wstring(format);
+}
+
+}}}
+
+namespace GEWISUnlockTests
+{
+    static const std::wstring_view s_defaultDomain = L"GEWISWG";
+
+    TEST_CLASS(AccountNameTests)
+    {
+    public:
+        TEST_METHOD(ParsesPlainName)
+        {
+            ACCOUNT_NAME name;
+            Assert::IsTrue(SUCCEEDED(ParseAccountName(L"m1234", s_defaultDomain, &name)));
+            Assert::AreEqual(ANF_PLAIN, name.format);
+            _AssertPart(L"GEWISWG", name.domain);
+            _AssertPart(L"m1234", name.username);
+            _AssertPart(L"", name.upn);
+        }
+
+        TEST_METHOD(ParsesDownLevelName)
+        {
+            ACCOUNT_NAME name;
+            Assert::IsTrue(SUCCEEDED(ParseAccountName(L"OTHERDOM\\m1234", s_defaultDomain, &name)));
+            Assert::AreEqual(ANF_DOWN_LEVEL, name.format);
+            _AssertPart(L"OTHERDOM", name.domain);
+            _AssertPart(L"m1234", name.username);
+        }
+
+        TEST_METHOD(ParsesLocalName)
+        {
+            ACCOUNT_NAME name;
+            Assert::IsTrue(SUCCEEDED(ParseAccountName(L".\\beheer", s_defaultDomain, &name)));
+            Assert::AreEqual(ANF_LOCAL, name.format);
+            _AssertPart(L".", name.domain);
+            _AssertPart(L"beheer", name.username);
+        }
+
+        TEST_METHOD(ParsesUpn)
+        {
+            ACCOUNT_NAME name;
+            Assert::IsTrue(SUCCEEDED(ParseAccountName(L"m1234@gewis.nl", s_defaultDomain, &name)));
+            Assert::AreEqual(ANF_UPN, name.format);
+            _AssertPart(L"gewis.nl", name.domain);
+            _AssertPart(L"m1234", name.username);
+            _AssertPart(L"m1234@gewis.nl", name.upn);
+        }
+
+        TEST_METHOD(RejectsEmptyParts)
+        {
+            for (PCWSTR pszName : { L"", L"\\m1234", L"GEWISWG\\", L"\\", L"@gewis.nl", L"m1234@", L"@" })
+            {
+                _AssertRejected(pszName, s_defaultDomain);
+            }
+
+            // Without a default domain, a plain name has no domain either
+            _AssertRejected(L"m1234", std::wstring_view());
+        }
+
+        TEST_METHOD(RejectsTwoSeparators)
+        {
+            for (PCWSTR pszName : { L"GEWISWG\\m1234@gewis.nl", L"m1234@gewis.nl\\x", L"a\\b\\c", L"a@b@c", L".\\.\\beheer" })
+            {
+                _AssertRejected(pszName, s_defaultDomain);
+            }
+        }
+
+        TEST_METHOD(SameAccountIgnoresCase)
+        {
+            Assert::IsTrue(_IsSameAccount(L"GEWISWG\\m1234", L"gewiswg\\M1234"));
+            Assert::IsTrue(_IsSameAccount(L"m1234", L"GEWISWG\\m1234"));
+            Assert::IsFalse(_IsSameAccount(L"GEWISWG\\m1234", L"GEWISWG\\m1235"));
+        }
+
+        TEST_METHOD(SameAccountComparesNetBiosDomains)
+        {
+            Assert::IsFalse(_IsSameAccount(L"GEWISWG\\m1234", L"OTHERDOM\\m1234"));
+            Assert::IsFalse(_IsSameAccount(L"m1234", L"OTHERDOM\\m1234"));
+        }
+
+        TEST_METHOD(SameAccountSkipsOtherDomains)
+        {
+            // A UPN suffix or "." cannot be compared with a NetBIOS domain name, so only the user names are
+            Assert::IsTrue(_IsSameAccount(L"GEWISWG\\m1234", L"m1234@gewis.nl"));
+            Assert::IsTrue(_IsSameAccount(L".\\m1234", L"GEWISWG\\m1234"));
+            Assert::IsTrue(_IsSameAccount(L"m1234@gewis.nl", L"M1234@example.com"));
+            Assert::IsFalse(_IsSameAccount(L"m1234@gewis.nl", L"GEWISWG\\m1235"));
+        }
+
+        TEST_METHOD(LogonNamesOfUpnAreWholeName)
+        {
+            ACCOUNT_NAME name;
+            ATL::CStringW strDomain;
+            ATL::CStringW strUsername;
+            Assert::IsTrue(SUCCEEDED(ParseAccountName(L"m1234@gewis.nl", s_defaultDomain, &name)));
+            GetLogonNames(name, &strDomain, &strUsername);
+            Assert::AreEqual(L"", strDomain.GetString());
+            Assert::AreEqual(L"m1234@gewis.nl", strUsername.GetString());
+
+            Assert::IsTrue(SUCCEEDED(ParseAccountName(L"m1234", s_defaultDomain, &name)));
+            GetLogonNames(name, &strDomain, &strUsername);
+            Assert::AreEqual(L"GEWISWG", strDomain.GetString());
+            Assert::AreEqual(L"m1234", strUsername.GetString());
+        }
+
+    private:
+        static void _AssertPart(_In_ PCWSTR pszExpected, std::wstring_view part)
+        {
+            Assert::AreEqual(pszExpected, std::wstring(part).c_str());
+        }
+
+        static void _AssertRejected(_In_ PCWSTR pszName, std::wstring_view defaultDomain)
+        {
+            ACCOUNT_NAME name;
+            Assert::AreEqual(HRESULT_FROM_WIN32(ERROR_INVALID_ACCOUNT_NAME), ParseAccountName(pszName, defaultDomain, &name), pszName);
+            Assert::IsTrue(name.domain.empty() && name.username.empty() && name.upn.empty(), pszName);
+        }
+
+        static bool _IsSameAccount(_In_ PCWSTR pszName1, _In_ PCWSTR pszName2)
+        {
+            ACCOUNT_NAME name1;
+            ACCOUNT_NAME name2;
+            Assert::IsTrue(SUCCEEDED(ParseAccountName(pszName1, s_defaultDomain, &name1)), pszName1);
+            Assert::IsTrue(SUCCEEDED(ParseAccountName(pszName2, s_defaultDomain, &name2)), pszName2);
+            return IsSameAccount(name1, name2);
+        }
+    };
+}
@@ -0,0 +1,195 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "FakeSessionSource.h"
+
+FakeSessionSource::FakeSessionSource() :
+    _ullNow(0)
+{
+}
+
+void FakeSessionSource::AddSession(DWORD dwSessionId, _In_ PCWSTR pszUser, bool fLocked, bool fCurrent, bool fReportsIdle,
+    FAKE_LOGOFF_BEHAVIOR behavior, ULONGLONG ullLogoffTime)
+{
+    FAKE_SESSION session;
+    session.info.dwSessionId = dwSessionId;
+    session.info.strUser = pszUser;
+    session.info.state = WTSActive;
+    session.info.fLocked = fLocked;
+    session.info.ullIdleSeconds = 0;
+    session.info.fCurrent = fCurrent;
+    session.fReportsIdle = fReportsIdle;
+    session.ullLastInput = _ullNow;
+    session.behavior = behavior;
+    session.ullLogoffTime = ullLogoffTime;
+    session.ullGoneAt = s_ullNever;
+    session.cLogoffs = 0;
+    session.fTerminated = false;
+    _rgSessions.Add(session);
+}
+
+void FakeSessionSource::SetLocked(DWORD dwSessionId, bool fLocked)
+{
+    FAKE_SESSION* pSession = _Find(dwSessionId);
+    if (pSession != nullptr)
+    {
+        pSession->info.fLocked = fLocked;
+    }
+}
+
+void FakeSessionSource::Input(DWORD dwSessionId)
+{
+    FAKE_SESSION* pSession = _Find(dwSessionId);
+    if (pSession != nullptr)
+    {
+        pSession->ullLastInput = _ullNow;
+    }
+}
+
+void FakeSessionSource::SignOut(DWORD dwSessionId)
+{
+    FAKE_SESSION* pSession = _Find(dwSessionId);
+    if (pSession != nullptr && pSession->ullGoneAt > _ullNow)
+    {
+        pSession->ullGoneAt = _ullNow;
+    }
+}
+
+void FakeSessionSource::ReplaceUser(DWORD dwSessionId, _In_ PCWSTR pszUser)
+{
+    FAKE_SESSION* pSession = _Find(dwSessionId);
+    if (pSession != nullptr)
+    {
+        FAKE_SESSION session = *pSession;
+        SignOut(dwSessionId);
+        AddSession(dwSessionId, pszUser, false, session.info.fCurrent, session.fReportsIdle, session.behavior, session.ullLogoffTime);
+    }
+}
+
+size_t FakeSessionSource::GetLogoffCount(DWORD dwSessionId) const
+{
+    size_t cLogoffs = 0;
+    for (size_t i = 0; i < _rgSessions.GetCount(); i++)
+    {
+        if (_rgSessions[i].info.dwSessionId == dwSessionId)
+        {
+            cLogoffs += _rgSessions[i].cLogoffs;
+        }
+    }
+    return cLogoffs;
+}
+
+bool FakeSessionSource::WasTerminated(DWORD dwSessionId) const
+{
+    const FAKE_SESSION* pSession = _Find(dwSessionId);
+    return pSession != nullptr && pSession->fTerminated;
+}
+
+HRESULT FakeSessionSource::Enumerate(_Inout_ ATL::CAtlArray<SESSION_INFO>* prgSessions)
+{
+    prgSessions->RemoveAll();
+
+    // The current session first, like WtsSessionSource
+    for (int iPass = 0; iPass < 2; iPass++)
+    {
+        for (size_t i = 0; i < _rgSessions.GetCount(); i++)
+        {
+            const FAKE_SESSION& session = _rgSessions[i];
+            if (session.ullGoneAt > _ullNow && session.info.fCurrent == (iPass == 0))
+            {
+                SESSION_INFO info;
+                _GetInfo(session, &info);
+                prgSessions->Add(info);
+            }
+        }
+    }
+    return S_OK;
+}
+
+HRESULT FakeSessionSource::Query(DWORD dwSessionId, _Out_ SESSION_INFO* pSession)
+{
+    const FAKE_SESSION* pFakeSession = _Find(dwSessionId);
+    if (pFakeSession == nullptr || pFakeSession->ullGoneAt <= _ullNow)
+    {
+        return HRESULT_FROM_WIN32(ERROR_NO_SUCH_LOGON_SESSION);
+    }
+    _GetInfo(*pFakeSession, pSession);
+    return S_OK;
+}
+
+HRESULT FakeSessionSource::BeginLogoff(DWORD dwSessionId)
+{
+    FAKE_SESSION* pSession = _Find(dwSessionId);
+    if (pSession == nullptr || pSession->ullGoneAt <= _ullNow)
+    {
+        return HRESULT_FROM_WIN32(ERROR_NO_SUCH_LOGON_SESSION);
+    }
+
+    pSession->cLogoffs++;
+    ULONGLONG ullGoneAt = s_ullNever;
+    switch (pSession->behavior)
+    {
+    case FLB_PROMPT:
+        ullGoneAt = _ullNow;
+        break;
+    case FLB_SLOW:
+        ullGoneAt = _ullNow + pSession->ullLogoffTime;
+        break;
+    case FLB_STUCK:
+        // Asking again after terminating its processes does not matter, they are going anyway
+        ullGoneAt = pSession->fTerminated ? _ullNow + pSession->ullLogoffTime : s_ullNever;
+        break;
+    case FLB_HUNG:
+        break;
+    case FLB_FAIL:
+        return HRESULT_FROM_WIN32(ERROR_ACCESS_DENIED);
+    }
+
+    // Asking again does not make it go later
+    if (ullGoneAt < pSession->ullGoneAt)
+    {
+        pSession->ullGoneAt = ullGoneAt;
+    }
+    return S_OK;
+}
+
+HRESULT FakeSessionSource::TerminateProcesses(DWORD dwSessionId)
+{
+    FAKE_SESSION* pSession = _Find(dwSessionId);
+    if (pSession == nullptr || pSession->ullGoneAt <= _ullNow)
+    {
+        return HRESULT_FROM_WIN32(ERROR_NO_SUCH_LOGON_SESSION);
+    }
+
+    pSession->fTerminated = true;
+    if (pSession->behavior == FLB_STUCK && pSession->cLogoffs > 0 && _ullNow + pSession->ullLogoffTime < pSession->ullGoneAt)
+    {
+        pSession->ullGoneAt = _ullNow + pSession->ullLogoffTime;
+    }
+    return S_OK;
+}
+
+// The last session with the ID, which is the one that is signed in if any is.
+FakeSessionSource::FAKE_SESSION* FakeSessionSource::_Find(DWORD dwSessionId)
+{
+    return const_cast<FAKE_SESSION*>(static_cast<const FakeSessionSource*>(this)->_Find(dwSessionId));
+}
+
+const FakeSessionSource::FAKE_SESSION* FakeSessionSource::_Find(DWORD dwSessionId) const
+{
+    for (size_t i = _rgSessions.GetCount(); i-- > 0; )
+    {
+        if (_rgSessions[i].info.dwSessionId == dwSessionId)
+        {
+            return &_rgSessions[i];
+        }
+    }
+    return nullptr;
+}
+
+void FakeSessionSource::_GetInfo(_In_ const FAKE_SESSION& session, _Out_ SESSION_INFO* pSession) const
+{
+    *pSession = session.info;
+    pSession->ullIdleSeconds = session.fReportsIdle ? _ullNow - session.ullLastInput : 0;
+}
@@ -0,0 +1,82 @@
+//
+// GEWIS, 2020-2023
+//
+
+#pragma once
+#include "SessionSource.h"
+
+// How a fake session reacts to BeginLogoff.
+enum FAKE_LOGOFF_BEHAVIOR
+{
+    FLB_PROMPT,     // Gone right away.
+    FLB_SLOW,       // Gone ullLogoffTime after BeginLogoff.
+    FLB_STUCK,      // An application does not close: only gone ullLogoffTime after its processes are terminated.
+    FLB_HUNG,       // Never gone, not even after terminating its processes.
+    FLB_FAIL,       // BeginLogoff fails.
+};
+
+// Sessions that a test sets up, on a clock that the test moves forward with SetNow. The clock has whatever
+// unit the code under test uses (milliseconds for LogoffTracker, seconds for ReclaimScheduler), and so do the
+// delays and idle times here. Windows would also send notifications; this does not, so the code under test
+// has to notice by itself that a session is gone.
+class FakeSessionSource : public SessionSource
+{
+public:
+    FakeSessionSource();
+
+    void SetNow(ULONGLONG ullNow)
+    {
+        _ullNow = ullNow;
+    }
+
+    ULONGLONG GetNow() const
+    {
+        return _ullNow;
+    }
+
+    // With fReportsIdle, the session says how long ago its last input was (see Input); otherwise it says 0,
+    // as the console session does.
+    void AddSession(DWORD dwSessionId, _In_ PCWSTR pszUser, bool fLocked, bool fCurrent = false, bool fReportsIdle = false,
+        FAKE_LOGOFF_BEHAVIOR behavior = FLB_PROMPT, ULONGLONG ullLogoffTime = 0);
+
+    void SetLocked(DWORD dwSessionId, bool fLocked);
+
+    // Someone types or moves the mouse in the session, now.
+    void Input(DWORD dwSessionId);
+
+    // The user signs out by themselves, without anyone asking.
+    void SignOut(DWORD dwSessionId);
+
+    // The session is signed out and someone else signs in to it, so it gets the same ID.
+    void ReplaceUser(DWORD dwSessionId, _In_ PCWSTR pszUser);
+
+    size_t GetLogoffCount(DWORD dwSessionId) const;
+    bool WasTerminated(DWORD dwSessionId) const;
+
+    HRESULT Enumerate(_Inout_ ATL::CAtlArray<SESSION_INFO>* prgSessions) override;
+    HRESULT Query(DWORD dwSessionId, _Out_ SESSION_INFO* pSession) override;
+    HRESULT BeginLogoff(DWORD dwSessionId) override;
+    HRESULT TerminateProcesses(DWORD dwSessionId) override;
+
+private:
+    static const ULONGLONG s_ullNever = ~0ULL;
+
+    struct FAKE_SESSION
+    {
+        SESSION_INFO            info;
+        bool                    fReportsIdle;
+        ULONGLONG               ullLastInput;
+        FAKE_LOGOFF_BEHAVIOR    behavior;
+        ULONGLONG               ullLogoffTime;
+        ULONGLONG               ullGoneAt;      // s_ullNever until it is on its way out.
+        size_t                  cLogoffs;
+        bool                    fTerminated;
+    };
+
+    FAKE_SESSION* _Find(DWORD dwSessionId);
+    const FAKE_SESSION* _Find(DWORD dwSessionId) const;
+    void _GetInfo(_In_ const FAKE_SESSION& session, _Out_ SESSION_INFO* pSession) const;
+
+    ATL::CAtlArray<FAKE_SESSION>    _rgSessions;    // Including the ones that are gone, for GetLogoffCount.
+    ULONGLONG                       _ullNow;
+};
@@ -0,0 +1,288 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "CppUnitTest.h"
+#include "KerbSerializer.h"
+#include <windows.h>
+#include <ntsecapi.h>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace Microsoft { namespace VisualStudio { namespace CppUnitTestFramework {
+
+template<> inline std::wstring ToString<KerbSerializer::RESULT>(const KerbSerializer::RESULT& result)
+{
+    switch (result)
+    {
+    case KerbSerializer::KSR_OK:            return L"KSR_OK";
+    case KerbSerializer::KSR_TOO_SMALL:     return L"KSR_TOO_SMALL";
+    case KerbSerializer::KSR_ODD_LENGTH:    return L"KSR_ODD_LENGTH";
+    case KerbSerializer::KSR_BAD_LENGTH:    return L"KSR_BAD_LENGTH";
+    case KerbSerializer::KSR_MISALIGNED:    return L"KSR_MISALIGNED";
+    case KerbSerializer::KSR_OUT_OF_RANGE:  return L"KSR_OUT_OF_RANGE";
+    case KerbSerializer::KSR_OVERLAP:       return L"KSR_OVERLAP";
+    }
+    return std::to_wstring(result);
+}
+
+}}}
+
+namespace GEWISUnlockTests
+{
+    static const KerbSerializer::LAYOUT s_rgLayouts[] = { KerbSerializer::KSL_32, KerbSerializer::KSL_64 };
+
+    TEST_CLASS(KerbSerializerTests)
+    {
+    public:
+        TEST_METHOD(NativeLayoutMatchesWindows)
+        {
+            // The layout the compiler gives this process is the one written out by hand
+            Assert::AreEqual(sizeof(KERB_INTERACTIVE_UNLOCK_LOGON), KerbSerializer::GetHeaderSize(KerbSerializer::KSL_NATIVE));
+
+            KERB_INTERACTIVE_UNLOCK_LOGON kiul;
+            ZeroMemory(&kiul, sizeof(kiul));
+            kiul.Logon.MessageType = KerbWorkstationUnlockLogon;
+            kiul.Logon.LogonDomainName.Length = 14;
+            kiul.Logon.LogonDomainName.MaximumLength = 14;
+            kiul.Logon.LogonDomainName.Buffer = reinterpret_cast<PWSTR>(sizeof(kiul));
+            kiul.Logon.UserName.Length = 10;
+            kiul.Logon.UserName.MaximumLength = 10;
+            kiul.Logon.UserName.Buffer = reinterpret_cast<PWSTR>(sizeof(kiul) + 14);
+            kiul.Logon.Password.Length = 0;
+            kiul.Logon.Password.MaximumLength = 0;
+            kiul.Logon.Password.Buffer = reinterpret_cast<PWSTR>(sizeof(kiul) + 24);
+
+            KerbSerializer::LOGON logon = _GetLogon(L"GEWISWG", L"m1234", L"");
+            std::vector<uint8_t> rgb = _Write(KerbSerializer::KSL_NATIVE, logon);
+            Assert::AreEqual(0, memcmp(&kiul, rgb.data(), sizeof(kiul)));
+        }
+
+        TEST_METHOD(RoundTrips)
+        {
+            for (KerbSerializer::LAYOUT layout : s_rgLayouts)
+            {
+                KerbSerializer::LOGON logon = _GetLogon(L"GEWISWG", L"m1234", L"correct horse battery staple");
+                std::vector<uint8_t> rgb = _Write(layout, logon);
+                Assert::AreEqual(KerbSerializer::GetHeaderSize(layout) + (7 + 5 + 28) * sizeof(WCHAR), rgb.size());
+
+                KerbSerializer::LOGON read;
+                Assert::AreEqual(KerbSerializer::KSR_OK, KerbSerializer::Read(layout, rgb.data(), rgb.size(), &read));
+                _AssertSame(logon, read);
+
+                // The strings are read in place
+                Assert::IsTrue(read.domain.pv == rgb.data() + KerbSerializer::GetHeaderSize(layout));
+            }
+        }
+
+        TEST_METHOD(RoundTripsEmptyStrings)
+        {
+            // A UPN has no domain
+            for (KerbSerializer::LAYOUT layout : s_rgLayouts)
+            {
+                KerbSerializer::LOGON logon = _GetLogon(L"", L"m1234@gewis.nl", L"");
+                std::vector<uint8_t> rgb = _Write(layout, logon);
+
+                KerbSerializer::LOGON read;
+                Assert::AreEqual(KerbSerializer::KSR_OK, KerbSerializer::Read(layout, rgb.data(), rgb.size(), &read));
+                _AssertSame(logon, read);
+                Assert::IsNull(read.domain.pv);
+                Assert::IsNull(read.password.pv);
+            }
+        }
+
+        TEST_METHOD(ConvertsBetweenLayouts)
+        {
+            // What a 64-bit LogonUI does with the buffer of a 32-bit provider, and the other way round
+            KerbSerializer::LOGON logon = _GetLogon(L"GEWISWG", L"m1234", L"correct horse battery staple");
+            std::vector<uint8_t> rgb32 = _Write(KerbSerializer::KSL_32, logon);
+
+            KerbSerializer::LOGON read32;
+            Assert::AreEqual(KerbSerializer::KSR_OK, KerbSerializer::Read(KerbSerializer::KSL_32, rgb32.data(), rgb32.size(), &read32));
+            std::vector<uint8_t> rgb64 = _Write(KerbSerializer::KSL_64, read32);
+            Assert::AreEqual(rgb32.size() + 64 - 36, rgb64.size());
+
+            KerbSerializer::LOGON read64;
+            Assert::AreEqual(KerbSerializer::KSR_OK, KerbSerializer::Read(KerbSerializer::KSL_64, rgb64.data(), rgb64.size(), &read64));
+            _AssertSame(logon, read64);
+
+            std::vector<uint8_t> rgbBack = _Write(KerbSerializer::KSL_32, read64);
+            Assert::IsTrue(rgb32 == rgbBack);
+        }
+
+        TEST_METHOD(RejectsTooSmall)
+        {
+            for (KerbSerializer::LAYOUT layout : s_rgLayouts)
+            {
+                std::vector<uint8_t> rgb = _Write(layout, _GetLogon(L"", L"", L""));
+                _AssertRejected(KerbSerializer::KSR_TOO_SMALL, layout, rgb, rgb.size() - 1);
+                _AssertRejected(KerbSerializer::KSR_TOO_SMALL, layout, rgb, 0);
+            }
+        }
+
+        TEST_METHOD(RejectsOddLength)
+        {
+            for (KerbSerializer::LAYOUT layout : s_rgLayouts)
+            {
+                std::vector<uint8_t> rgb = _WriteDefault(layout);
+                _Set16(&rgb, _GetStringOffset(layout, 1), 9);
+                _AssertRejected(KerbSerializer::KSR_ODD_LENGTH, layout, rgb, rgb.size());
+
+                rgb = _WriteDefault(layout);
+                _Set16(&rgb, _GetStringOffset(layout, 2) + 2, 57);
+                _AssertRejected(KerbSerializer::KSR_ODD_LENGTH, layout, rgb, rgb.size());
+            }
+        }
+
+        TEST_METHOD(RejectsLengthOverMaximumLength)
+        {
+            for (KerbSerializer::LAYOUT layout : s_rgLayouts)
+            {
+                std::vector<uint8_t> rgb = _WriteDefault(layout);
+                _Set16(&rgb, _GetStringOffset(layout, 0), 16);
+                _AssertRejected(KerbSerializer::KSR_BAD_LENGTH, layout, rgb, rgb.size());
+            }
+        }
+
+        TEST_METHOD(RejectsMisaligned)
+        {
+            for (KerbSerializer::LAYOUT layout : s_rgLayouts)
+            {
+                std::vector<uint8_t> rgb = _WriteDefault(layout);
+                _SetBuffer(&rgb, layout, 1, _GetBuffer(rgb, layout, 1) + 1);
+                _AssertRejected(KerbSerializer::KSR_MISALIGNED, layout, rgb, rgb.size());
+            }
+        }
+
+        TEST_METHOD(RejectsOutOfRange)
+        {
+            for (KerbSerializer::LAYOUT layout : s_rgLayouts)
+            {
+                // Starting in the struct
+                std::vector<uint8_t> rgb = _WriteDefault(layout);
+                _SetBuffer(&rgb, layout, 0, KerbSerializer::GetHeaderSize(layout) - 2);
+                _AssertRejected(KerbSerializer::KSR_OUT_OF_RANGE, layout, rgb, rgb.size());
+
+                // Ending past the buffer, also when only MaximumLength does
+                rgb = _WriteDefault(layout);
+                _AssertRejected(KerbSerializer::KSR_OUT_OF_RANGE, layout, rgb, rgb.size() - 2);
+                _Set16(&rgb, _GetStringOffset(layout, 2) + 2, 58);
+                _AssertRejected(KerbSerializer::KSR_OUT_OF_RANGE, layout, rgb, rgb.size());
+
+                // Starting past the buffer, and an offset that wraps around when the length is added to it
+                rgb = _WriteDefault(layout);
+                _SetBuffer(&rgb, layout, 2, rgb.size() + 2);
+                _AssertRejected(KerbSerializer::KSR_OUT_OF_RANGE, layout, rgb, rgb.size());
+                _SetBuffer(&rgb, layout, 2, layout == KerbSerializer::KSL_64 ? ~1ULL : 0xFFFFFFFE);
+                _AssertRejected(KerbSerializer::KSR_OUT_OF_RANGE, layout, rgb, rgb.size());
+
+                // No offset, but a length
+                rgb = _WriteDefault(layout);
+                _SetBuffer(&rgb, layout, 1, 0);
+                _AssertRejected(KerbSerializer::KSR_OUT_OF_RANGE, layout, rgb, rgb.size());
+            }
+        }
+
+        TEST_METHOD(RejectsOverlap)
+        {
+            for (KerbSerializer::LAYOUT layout : s_rgLayouts)
+            {
+                // The password starting where the username does, and at its last character
+                std::vector<uint8_t> rgb = _WriteDefault(layout);
+                uint64_t ibUsername = _GetBuffer(rgb, layout, 1);
+                _SetBuffer(&rgb, layout, 2, ibUsername);
+                _AssertRejected(KerbSerializer::KSR_OVERLAP, layout, rgb, rgb.size());
+                _SetBuffer(&rgb, layout, 2, ibUsername + 8);
+                _AssertRejected(KerbSerializer::KSR_OVERLAP, layout, rgb, rgb.size());
+            }
+        }
+
+        TEST_METHOD(AcceptsEmptyStringAnywhere)
+        {
+            // An empty string is not used, so its offset does not matter
+            for (KerbSerializer::LAYOUT layout : s_rgLayouts)
+            {
+                std::vector<uint8_t> rgb = _Write(layout, _GetLogon(L"", L"m1234", L"secret"));
+                _SetBuffer(&rgb, layout, 0, 0);
+                KerbSerializer::LOGON read;
+                Assert::AreEqual(KerbSerializer::KSR_OK, KerbSerializer::Read(layout, rgb.data(), rgb.size(), &read));
+                _SetBuffer(&rgb, layout, 0, _GetBuffer(rgb, layout, 1));
+                Assert::AreEqual(KerbSerializer::KSR_OK, KerbSerializer::Read(layout, rgb.data(), rgb.size(), &read));
+            }
+        }
+
+    private:
+        // GEWISWG (14 bytes), m1234 (10 bytes) and correct horse battery staple (56 bytes), one after the other
+        static std::vector<uint8_t> _WriteDefault(KerbSerializer::LAYOUT layout)
+        {
+            return _Write(layout, _GetLogon(L"GEWISWG", L"m1234", L"correct horse battery staple"));
+        }
+
+        // Where the i-th UNICODE_STRING (LogonDomainName, UserName, Password) is in the struct.
+        static size_t _GetStringOffset(KerbSerializer::LAYOUT layout, size_t i)
+        {
+            return layout == KerbSerializer::KSL_64 ? 8 + 16 * i : 4 + 8 * i;
+        }
+
+        static void _Set16(_Inout_ std::vector<uint8_t>* prgb, size_t ib, uint16_t u)
+        {
+            memcpy(prgb->data() + ib, &u, sizeof(u));
+        }
+
+        static uint64_t _GetBuffer(const std::vector<uint8_t>& rgb, KerbSerializer::LAYOUT layout, size_t i)
+        {
+            uint64_t ib = 0;
+            size_t ibBuffer = _GetStringOffset(layout, i) + (layout == KerbSerializer::KSL_64 ? 8 : 4);
+            memcpy(&ib, rgb.data() + ibBuffer, layout == KerbSerializer::KSL_64 ? 8 : 4);
+            return ib;
+        }
+
+        static void _SetBuffer(_Inout_ std::vector<uint8_t>* prgb, KerbSerializer::LAYOUT layout, size_t i, uint64_t ib)
+        {
+            size_t ibBuffer = _GetStringOffset(layout, i) + (layout == KerbSerializer::KSL_64 ? 8 : 4);
+            memcpy(prgb->data() + ibBuffer, &ib, layout == KerbSerializer::KSL_64 ? 8 : 4);
+        }
+
+        // Read fails with expected for the first cb bytes of rgb, and leaves the logon alone.
+        static void _AssertRejected(KerbSerializer::RESULT expected, KerbSerializer::LAYOUT layout, const std::vector<uint8_t>& rgb, size_t cb)
+        {
+            KerbSerializer::LOGON read = {};
+            read.uMessageType = 0xDEADBEEF;
+            Assert::AreEqual(expected, KerbSerializer::Read(layout, rgb.data(), cb, &read));
+            Assert::AreEqual(0xDEADBEEFU, read.uMessageType);
+            Assert::IsNull(read.username.pv);
+        }
+
+        static KerbSerializer::STRING _GetString(_In_ PCWSTR psz)
+        {
+            return { psz, static_cast<uint16_t>(wcslen(psz) * sizeof(WCHAR)) };
+        }
+
+        static KerbSerializer::LOGON _GetLogon(_In_ PCWSTR pszDomain, _In_ PCWSTR pszUsername, _In_ PCWSTR pszPassword)
+        {
+            return { KerbWorkstationUnlockLogon, _GetString(pszDomain), _GetString(pszUsername), _GetString(pszPassword) };
+        }
+
+        static std::vector<uint8_t> _Write(KerbSerializer::LAYOUT layout, const KerbSerializer::LOGON& logon)
+        {
+            std::vector<uint8_t> rgb(KerbSerializer::GetPackedSize(layout, logon));
+            KerbSerializer::Write(layout, logon, rgb.data());
+            return rgb;
+        }
+
+        static void _AssertSame(const KerbSerializer::STRING& expected, const KerbSerializer::STRING& actual)
+        {
+            Assert::AreEqual(static_cast<size_t>(expected.cb), static_cast<size_t>(actual.cb));
+            Assert::IsTrue(expected.cb == 0 || memcmp(expected.pv, actual.pv, expected.cb) == 0);
+        }
+
+        static void _AssertSame(const KerbSerializer::LOGON& expected, const KerbSerializer::LOGON& actual)
+        {
+            Assert::AreEqual(expected.uMessageType, actual.uMessageType);
+            _AssertSame(expected.domain, actual.domain);
+            _AssertSame(expected.username, actual.username);
+            _AssertSame(expected.password, actual.password);
+        }
+    };
+}
@@ -0,0 +1,273 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "CppUnitTest.h"
+#include "LogoffTracker.h"
+#include "FakeSessionSource.h"
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace Microsoft { namespace VisualStudio { namespace CppUnitTestFramework {
+
+template<> inline std::wstring ToString<LOGOFF_PHASE>(const LOGOFF_PHASE& phase)
+{
+    switch (phase)
+    {
+    case LP_IDLE:       return L"LP_IDLE";
+    case LP_WAITING:    return L"LP_WAITING";
+    case LP_TIMED_OUT:  return L"LP_TIMED_OUT";
+    case LP_FORCING:    return L"LP_FORCING";
+    case LP_FINISHED:   return L"LP_FINISHED";
+    }
+    return std::to_wstring(phase);
+}
+
+template<> inline std::wstring ToString<LOGOFF_STATE>(const LOGOFF_STATE& state)
+{
+    switch (state)
+    {
+    case LS_PENDING:    return L"LS_PENDING";
+    case LS_SIGNED_OUT: return L"LS_SIGNED_OUT";
+    case LS_FAILED:     return L"LS_FAILED";
+    case LS_TIMED_OUT:  return L"LS_TIMED_OUT";
+    }
+    return std::to_wstring(state);
+}
+
+}}}
+
+namespace GEWISUnlockTests
+{
+    // In milliseconds, like GetTickCount64
+    static const ULONGLONG s_ullTimeout = 60 * 1000;
+    static const ULONGLONG s_ullPoll = 1000;
+
+    TEST_CLASS(LogoffTrackerTests)
+    {
+    public:
+        TEST_METHOD(PromptLogoffFinishesOnFirstPoll)
+        {
+            _source.AddSession(2, L"GEWISWG\\m1234", true);
+            _Start();
+            Assert::AreEqual(LP_WAITING, _tracker.GetPhase());
+
+            _Step(s_ullPoll);
+            Assert::AreEqual(LP_FINISHED, _tracker.GetPhase());
+            Assert::AreEqual(LS_SIGNED_OUT, _tracker.GetTarget(0).state);
+            Assert::IsFalse(_tracker.GetTarget(0).fForced);
+        }
+
+        TEST_METHOD(SlowLogoffIsWaitedFor)
+        {
+            _source.AddSession(2, L"GEWISWG\\m1234", true, false, false, FLB_SLOW, 5000);
+            _Start();
+
+            _StepUntil(4000);
+            Assert::AreEqual(LP_WAITING, _tracker.GetPhase());
+            Assert::AreEqual(LS_PENDING, _tracker.GetTarget(0).state);
+
+            _Step(5000);
+            Assert::AreEqual(LP_FINISHED, _tracker.GetPhase());
+            Assert::AreEqual(LS_SIGNED_OUT, _tracker.GetTarget(0).state);
+            Assert::AreEqual(5000ULL, _tracker.GetTarget(0).ullDuration);
+        }
+
+        TEST_METHOD(StuckLogoffTimesOutAndIsForced)
+        {
+            _source.AddSession(2, L"GEWISWG\\m1234", true, false, false, FLB_STUCK, 2000);
+            _Start();
+
+            _StepUntil(s_ullTimeout - s_ullPoll);
+            Assert::AreEqual(LP_WAITING, _tracker.GetPhase());
+
+            // The room responsible is offered to force it; meanwhile the session is still pending
+            _Step(s_ullTimeout);
+            Assert::AreEqual(LP_TIMED_OUT, _tracker.GetPhase());
+            Assert::AreEqual(LS_PENDING, _tracker.GetTarget(0).state);
+            Assert::IsFalse(_source.WasTerminated(2));
+
+            // What the credential does when Kick is pressed again
+            _tracker.Force(s_ullTimeout);
+            _source.TerminateProcesses(2);
+            _source.BeginLogoff(2);
+            Assert::AreEqual(LP_FORCING, _tracker.GetPhase());
+
+            _StepUntil(s_ullTimeout + 2000 - s_ullPoll);
+            Assert::AreEqual(LP_FORCING, _tracker.GetPhase());
+
+            _Step(s_ullTimeout + 2000);
+            Assert::AreEqual(LP_FINISHED, _tracker.GetPhase());
+            Assert::AreEqual(LS_SIGNED_OUT, _tracker.GetTarget(0).state);
+            Assert::IsTrue(_tracker.GetTarget(0).fForced);
+            Assert::AreEqual(static_cast<size_t>(2), _source.GetLogoffCount(2));
+        }
+
+        TEST_METHOD(HungLogoffIsGivenUpAfterForcing)
+        {
+            _source.AddSession(2, L"GEWISWG\\m1234", true, false, false, FLB_HUNG);
+            _Start();
+
+            _StepUntil(s_ullTimeout);
+            Assert::AreEqual(LP_TIMED_OUT, _tracker.GetPhase());
+
+            _tracker.Force(s_ullTimeout);
+            _source.TerminateProcesses(2);
+            _StepUntil(2 * s_ullTimeout - s_ullPoll);
+            Assert::AreEqual(LP_FORCING, _tracker.GetPhase());
+
+            _Step(2 * s_ullTimeout);
+            Assert::AreEqual(LP_FINISHED, _tracker.GetPhase());
+            Assert::AreEqual(LS_TIMED_OUT, _tracker.GetTarget(0).state);
+        }
+
+        TEST_METHOD(TimedOutSessionMaySignOutBeforeForcing)
+        {
+            _source.AddSession(2, L"GEWISWG\\m1234", true, false, false, FLB_SLOW, s_ullTimeout + 5000);
+            _Start();
+
+            _StepUntil(s_ullTimeout);
+            Assert::AreEqual(LP_TIMED_OUT, _tracker.GetPhase());
+
+            // Nobody pressed Kick again, but it went by itself
+            _StepUntil(s_ullTimeout + 5000);
+            Assert::AreEqual(LP_FINISHED, _tracker.GetPhase());
+            Assert::AreEqual(LS_SIGNED_OUT, _tracker.GetTarget(0).state);
+            Assert::IsFalse(_tracker.GetTarget(0).fForced);
+        }
+
+        TEST_METHOD(SlowAndStuckTogether)
+        {
+            _source.AddSession(2, L"GEWISWG\\m1234", true, false, false, FLB_SLOW, 3000);
+            _source.AddSession(3, L"GEWISWG\\m5678", true, false, false, FLB_STUCK, 1000);
+            _source.AddSession(4, L"GEWISWG\\m9012", true);
+            _Start();
+
+            _StepUntil(3000);
+            Assert::AreEqual(LP_WAITING, _tracker.GetPhase());
+            Assert::AreEqual(static_cast<size_t>(2), _tracker.GetCount(LS_SIGNED_OUT));
+            Assert::AreEqual(static_cast<size_t>(1), _tracker.GetCount(LS_PENDING));
+
+            ATL::CStringW strPending;
+            _tracker.GetUsers(LS_PENDING, &strPending);
+            Assert::AreEqual(L"GEWISWG\\m5678", strPending.GetString());
+
+            _StepUntil(s_ullTimeout);
+            Assert::AreEqual(LP_TIMED_OUT, _tracker.GetPhase());
+
+            // Leaving the tile instead of forcing gives up on it
+            _tracker.Abandon();
+            Assert::AreEqual(LP_FINISHED, _tracker.GetPhase());
+            Assert::AreEqual(LS_TIMED_OUT, _tracker.GetTarget(1).state);
+            Assert::AreEqual(LS_SIGNED_OUT, _tracker.GetTarget(0).state);
+            Assert::AreEqual(LS_SIGNED_OUT, _tracker.GetTarget(2).state);
+        }
+
+        TEST_METHOD(MissedNotificationIsFoundByPolling)
+        {
+            _source.AddSession(2, L"GEWISWG\\m1234", true, false, false, FLB_SLOW, 1500);
+            _Start();
+
+            // No WTS_SESSION_LOGOFF arrives; only polling notices it is gone
+            _Step(1000);
+            Assert::AreEqual(LP_WAITING, _tracker.GetPhase());
+            _source.SetNow(2000);
+            Assert::AreEqual(static_cast<size_t>(1), _tracker.Poll(&_source, 2000));
+            Assert::AreEqual(LP_FINISHED, _tracker.GetPhase());
+
+            // The notification that was late counts nothing twice
+            Assert::IsFalse(_tracker.OnSignedOut(2, 2500));
+            Assert::AreEqual(2000ULL, _tracker.GetTarget(0).ullDuration);
+        }
+
+        TEST_METHOD(NotificationBeforePoll)
+        {
+            _source.AddSession(2, L"GEWISWG\\m1234", true, false, false, FLB_SLOW, 1500);
+            _source.AddSession(3, L"GEWISWG\\m5678", true, false, false, FLB_SLOW, 1500);
+            _Start();
+
+            Assert::IsTrue(_tracker.OnSignedOut(3, 1500));
+            Assert::IsFalse(_tracker.OnSignedOut(7, 1500));
+            Assert::AreEqual(LP_WAITING, _tracker.GetPhase());
+
+            _source.SetNow(2000);
+            Assert::AreEqual(static_cast<size_t>(1), _tracker.Poll(&_source, 2000));
+            Assert::AreEqual(LP_FINISHED, _tracker.GetPhase());
+            Assert::AreEqual(1500ULL, _tracker.GetTarget(1).ullDuration);
+        }
+
+        TEST_METHOD(SomeoneElseSigningInCountsAsSignedOut)
+        {
+            _source.AddSession(2, L"GEWISWG\\m1234", true, false, false, FLB_HUNG);
+            _Start();
+
+            // The session ID is reused before the poll sees it gone
+            _source.SetNow(500);
+            _source.ReplaceUser(2, L"GEWISWG\\m5678");
+            _Step(s_ullPoll);
+            Assert::AreEqual(LP_FINISHED, _tracker.GetPhase());
+            Assert::AreEqual(LS_SIGNED_OUT, _tracker.GetTarget(0).state);
+        }
+
+        TEST_METHOD(FailedRequestIsNotWaitedFor)
+        {
+            _source.AddSession(2, L"GEWISWG\\m1234", true, false, false, FLB_FAIL);
+            _source.AddSession(3, L"GEWISWG\\m5678", true, false, false, FLB_SLOW, 3000);
+            _Start();
+            Assert::AreEqual(LS_FAILED, _tracker.GetTarget(0).state);
+            Assert::AreEqual(LS_PENDING, _tracker.GetTarget(1).state);
+
+            _StepUntil(3000);
+            Assert::AreEqual(LP_FINISHED, _tracker.GetPhase());
+            Assert::AreEqual(LS_FAILED, _tracker.GetTarget(0).state);
+        }
+
+        TEST_METHOD(OnlyFailedRequestsFinishRightAway)
+        {
+            _source.AddSession(2, L"GEWISWG\\m1234", true, false, false, FLB_FAIL);
+            _Start();
+            Assert::AreEqual(LP_FINISHED, _tracker.GetPhase());
+            Assert::AreEqual(LS_FAILED, _tracker.GetTarget(0).state);
+        }
+
+    private:
+        // Asks every session but the current one to sign out at time 0, and starts following them.
+        void _Start()
+        {
+            ATL::CAtlArray<SESSION_INFO> rgSessions;
+            ATL::CAtlArray<SESSION_INFO> rgTargets;
+            ATL::CAtlArray<HRESULT> rgIssued;
+            _source.SetNow(0);
+            Assert::IsTrue(SUCCEEDED(_source.Enumerate(&rgSessions)));
+            for (size_t i = 0; i < rgSessions.GetCount(); i++)
+            {
+                if (!rgSessions[i].fCurrent)
+                {
+                    rgTargets.Add(rgSessions[i]);
+                    rgIssued.Add(_source.BeginLogoff(rgSessions[i].dwSessionId));
+                }
+            }
+            Assert::IsTrue(SUCCEEDED(_tracker.Start(rgTargets, rgIssued, 0, s_ullTimeout)));
+        }
+
+        // One timer tick of the credential, without notifications.
+        void _Step(ULONGLONG ullNow)
+        {
+            _source.SetNow(ullNow);
+            _tracker.Poll(&_source, ullNow);
+            _tracker.OnTick(ullNow);
+        }
+
+        // Timer ticks every s_ullPoll up to and including ullUntil.
+        void _StepUntil(ULONGLONG ullUntil)
+        {
+            for (ULONGLONG ullNow = (_source.GetNow() / s_ullPoll + 1) * s_ullPoll; ullNow <= ullUntil; ullNow += s_ullPoll)
+            {
+                _Step(ullNow);
+            }
+        }
+
+        FakeSessionSource   _source;
+        LogoffTracker       _tracker;
+    };
+}
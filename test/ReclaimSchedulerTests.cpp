@@ -0,0 +1,175 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "CppUnitTest.h"
+#include "ReclaimScheduler.h"
+#include "FakeSessionSource.h"
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace GEWISUnlockTests
+{
+    // In seconds, like the clock of SessionReclaimer
+    static const ULONGLONG s_ullThreshold = 30 * 60;
+    static const ULONGLONG s_ullTick = ReclaimScheduler::s_ullTickSeconds;
+    static const ULONGLONG s_ullRetry = ReclaimScheduler::s_ullRetrySeconds;
+
+    // The session that runs a protected application, if any
+    static DWORD s_dwProtectedSession = static_cast<DWORD>(-1);
+
+    static bool _ProtectedAppsRunning(DWORD dwSessionId)
+    {
+        return dwSessionId == s_dwProtectedSession;
+    }
+
+    TEST_CLASS(ReclaimSchedulerTests)
+    {
+    public:
+        ReclaimSchedulerTests() :
+            _scheduler(&_source, _ProtectedAppsRunning)
+        {
+            s_dwProtectedSession = static_cast<DWORD>(-1);
+        }
+
+        TEST_METHOD(LockedSessionIsDueAfterThreshold)
+        {
+            _source.AddSession(2, L"GEWISWG\\m1234", true);
+            Assert::AreEqual(s_ullThreshold, _FirstDue(2, 0));
+        }
+
+        TEST_METHOD(ThresholdCountsFromFirstSeenLocked)
+        {
+            // The console does not report idle time; being locked for a while before we looked does not count
+            _source.SetNow(600);
+            _source.AddSession(1, L"GEWISWG\\m1234", true, true);
+            Assert::AreEqual(600 + s_ullThreshold, _FirstDue(1, 600));
+        }
+
+        TEST_METHOD(UnlockedSessionStartsOver)
+        {
+            _source.AddSession(2, L"GEWISWG\\m1234", true);
+            _TickUntil(0, 900);
+
+            _source.SetLocked(2, false);
+            _Tick(960);
+            _source.SetLocked(2, true);
+            Assert::AreEqual(1020 + s_ullThreshold, _FirstDue(2, 1020));
+        }
+
+        TEST_METHOD(InputReschedules)
+        {
+            // Someone types at the lock screen without unlocking; the session was in use
+            _source.AddSession(2, L"GEWISWG\\m1234", true, false, true);
+            _TickUntil(0, 1200);
+            _source.Input(2);
+            Assert::AreEqual(1200 + s_ullThreshold, _FirstDue(2, 1260));
+        }
+
+        TEST_METHOD(SomeoneElseSigningInStartsOver)
+        {
+            _source.AddSession(2, L"GEWISWG\\m1234", true);
+            _TickUntil(0, 1500);
+
+            _source.SetNow(1530);
+            _source.ReplaceUser(2, L"GEWISWG\\m5678");
+            _source.SetLocked(2, true);
+            Assert::AreEqual(1560 + s_ullThreshold, _FirstDue(2, 1560));
+        }
+
+        TEST_METHOD(ProtectedAppIsRetriedLater)
+        {
+            _source.AddSession(2, L"GEWISWG\\m1234", true);
+            s_dwProtectedSession = 2;
+            _TickUntil(0, s_ullThreshold + s_ullRetry);
+            Assert::AreEqual(static_cast<size_t>(0), _rgDue.GetCount());
+
+            // Multivers was closed in between, but the next try only comes at its time
+            s_dwProtectedSession = static_cast<DWORD>(-1);
+            Assert::AreEqual(s_ullThreshold + 2 * s_ullRetry, _FirstDue(2, s_ullThreshold + s_ullRetry + s_ullTick));
+        }
+
+        TEST_METHOD(PostponedSessionIsRetriedLater)
+        {
+            _source.AddSession(2, L"GEWISWG\\m1234", true, false, false, FLB_HUNG);
+            ULONGLONG ullDue = _FirstDue(2, 0);
+            Assert::AreEqual(s_ullThreshold, ullDue);
+
+            // What SessionReclaimer does when it did not sign out
+            Assert::IsTrue(SUCCEEDED(_scheduler.Postpone(2, ullDue)));
+            Assert::AreEqual(ullDue + s_ullRetry, _FirstDue(2, ullDue + s_ullTick));
+        }
+
+        TEST_METHOD(CurrentSessionIsLast)
+        {
+            _source.AddSession(1, L"GEWISWG\\m1234", true, true);
+            _source.AddSession(2, L"GEWISWG\\m5678", true);
+            _source.AddSession(3, L"GEWISWG\\m9012", true);
+            _TickUntil(0, s_ullThreshold);
+
+            Assert::AreEqual(static_cast<size_t>(3), _rgDue.GetCount());
+            Assert::IsFalse(_rgDue[0].fCurrent);
+            Assert::IsFalse(_rgDue[1].fCurrent);
+            Assert::IsTrue(_rgDue[2].fCurrent);
+        }
+
+        TEST_METHOD(SignedOutSessionIsForgotten)
+        {
+            _source.AddSession(2, L"GEWISWG\\m1234", true);
+            _TickUntil(0, 600);
+            _source.SignOut(2);
+            _TickUntil(660, 2 * s_ullThreshold);
+            Assert::AreEqual(static_cast<size_t>(0), _rgDue.GetCount());
+        }
+
+        TEST_METHOD(TurnedOff)
+        {
+            _source.AddSession(2, L"GEWISWG\\m1234", true);
+            for (ULONGLONG ullNow = 0; ullNow <= 2 * s_ullThreshold; ullNow += s_ullTick)
+            {
+                _source.SetNow(ullNow);
+                Assert::IsTrue(SUCCEEDED(_scheduler.Tick(ullNow, 0, &_rgDue)));
+            }
+            Assert::AreEqual(static_cast<size_t>(0), _rgDue.GetCount());
+        }
+
+    private:
+        void _Tick(ULONGLONG ullNow)
+        {
+            _source.SetNow(ullNow);
+            Assert::IsTrue(SUCCEEDED(_scheduler.Tick(ullNow, s_ullThreshold, &_rgDue)));
+        }
+
+        // Ticks every s_ullTick from ullFrom up to and including ullUntil, collecting the sessions that are due in _rgDue.
+        void _TickUntil(ULONGLONG ullFrom, ULONGLONG ullUntil)
+        {
+            for (ULONGLONG ullNow = ullFrom; ullNow <= ullUntil; ullNow += s_ullTick)
+            {
+                _Tick(ullNow);
+            }
+        }
+
+        // Ticks from ullFrom until dwSessionId is due, and returns when that was.
+        ULONGLONG _FirstDue(DWORD dwSessionId, ULONGLONG ullFrom)
+        {
+            for (ULONGLONG ullNow = ullFrom; ullNow <= ullFrom + 10 * s_ullThreshold; ullNow += s_ullTick)
+            {
+                _rgDue.RemoveAll();
+                _Tick(ullNow);
+                for (size_t i = 0; i < _rgDue.GetCount(); i++)
+                {
+                    if (_rgDue[i].dwSessionId == dwSessionId)
+                    {
+                        return ullNow;
+                    }
+                }
+            }
+            Assert::Fail(L"The session never became due");
+            return 0;
+        }
+
+        FakeSessionSource               _source;
+        ReclaimScheduler                _scheduler;
+        ATL::CAtlArray<SESSION_INFO>    _rgDue;
+    };
+}
@@ -0,0 +1,215 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "CppUnitTest.h"
+#include "SidSet.h"
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace GEWISUnlockTests
+{
+    static const DWORD s_ridKick = 5000;
+    static const DWORD s_ridKickProtected = 5001;
+    static const DWORD s_ridOther = 1000;
+
+    TEST_CLASS(SidSetTests)
+    {
+    public:
+        TEST_METHOD(LooksUpAddedSids)
+        {
+            SidSet set;
+            Assert::AreEqual<DWORD>(AR_NONE, set.Lookup(_Sid(s_ridKick).rgb));
+
+            Assert::AreEqual(S_OK, set.Add(_Sid(s_ridKick).rgb, AR_KICK));
+            Assert::AreEqual(S_OK, set.Add(_Sid(s_ridKickProtected).rgb, AR_KICK_PROTECTED));
+            Assert::AreEqual<size_t>(2, set.GetCount());
+            Assert::AreEqual<DWORD>(AR_KICK, set.Lookup(_Sid(s_ridKick).rgb));
+            Assert::AreEqual<DWORD>(AR_KICK_PROTECTED, set.Lookup(_Sid(s_ridKickProtected).rgb));
+            Assert::AreEqual<DWORD>(AR_NONE, set.Lookup(_Sid(s_ridOther).rgb));
+        }
+
+        TEST_METHOD(AddingSidAgainCombinesRights)
+        {
+            SidSet set;
+            Assert::AreEqual(S_OK, set.Add(_Sid(s_ridKick).rgb, AR_KICK));
+            Assert::AreEqual(S_OK, set.Add(_Sid(s_ridKick).rgb, AR_KICK_PROTECTED));
+            Assert::AreEqual<size_t>(1, set.GetCount());
+            Assert::AreEqual<DWORD>(AR_ALL, set.Lookup(_Sid(s_ridKick).rgb));
+        }
+
+        TEST_METHOD(RejectsInvalidSid)
+        {
+            SidSet set;
+            BYTE rgbSid[SECURITY_MAX_SID_SIZE] = {};
+            Assert::AreEqual(E_INVALIDARG, set.Add(rgbSid, AR_KICK));
+            Assert::AreEqual<size_t>(0, set.GetCount());
+        }
+
+        TEST_METHOD(GrowsPastInitialSlots)
+        {
+            SidSet set;
+            for (DWORD i = 0; i < 100; i++)
+            {
+                Assert::AreEqual(S_OK, set.Add(_Sid(s_ridOther + i).rgb, i % 2 == 0 ? AR_KICK : AR_ALL));
+            }
+
+            Assert::AreEqual<size_t>(100, set.GetCount());
+            for (DWORD i = 0; i < 100; i++)
+            {
+                Assert::AreEqual<DWORD>(i % 2 == 0 ? AR_KICK : AR_ALL, set.Lookup(_Sid(s_ridOther + i).rgb));
+            }
+            Assert::AreEqual<DWORD>(AR_NONE, set.Lookup(_Sid(s_ridOther + 100).rgb));
+        }
+
+        TEST_METHOD(LookupGroupsCombinesEnabledGroups)
+        {
+            SidSet set;
+            _AddConfigured(&set);
+
+            GROUPS groups;
+            groups.Add(_Sid(s_ridOther), SE_GROUP_ENABLED | SE_GROUP_MANDATORY);
+            groups.Add(_Sid(s_ridKick), SE_GROUP_ENABLED);
+            Assert::AreEqual<DWORD>(AR_KICK, set.LookupGroups(groups.Get()));
+
+            groups.Add(_Sid(s_ridKickProtected), SE_GROUP_ENABLED | SE_GROUP_ENABLED_BY_DEFAULT);
+            Assert::AreEqual<DWORD>(AR_ALL, set.LookupGroups(groups.Get()));
+        }
+
+        TEST_METHOD(LookupGroupsIgnoresDisabledGroups)
+        {
+            SidSet set;
+            _AddConfigured(&set);
+
+            GROUPS groups;
+            groups.Add(_Sid(s_ridKick), SE_GROUP_ENABLED);
+            groups.Add(_Sid(s_ridKickProtected), 0);
+            Assert::AreEqual<DWORD>(AR_KICK, set.LookupGroups(groups.Get()));
+        }
+
+        TEST_METHOD(LookupGroupsIgnoresDenyOnlyGroups)
+        {
+            SidSet set;
+            _AddConfigured(&set);
+
+            // What a filtered (UAC) token has for Administrators and the like
+            GROUPS groups;
+            groups.Add(_Sid(s_ridKick), SE_GROUP_USE_FOR_DENY_ONLY);
+            groups.Add(_Sid(s_ridKickProtected), SE_GROUP_USE_FOR_DENY_ONLY | SE_GROUP_MANDATORY);
+            Assert::AreEqual<DWORD>(AR_NONE, set.LookupGroups(groups.Get()));
+
+            groups.Add(_Sid(s_ridKick), SE_GROUP_ENABLED);
+            Assert::AreEqual<DWORD>(AR_KICK, set.LookupGroups(groups.Get()));
+        }
+
+        TEST_METHOD(LookupGroupsOfEmptyTokenOrSet)
+        {
+            SidSet set;
+            GROUPS groups;
+            Assert::AreEqual<DWORD>(AR_NONE, set.LookupGroups(groups.Get()));
+
+            groups.Add(_Sid(s_ridKick), SE_GROUP_ENABLED);
+            Assert::AreEqual<DWORD>(AR_NONE, set.LookupGroups(groups.Get()));
+
+            _AddConfigured(&set);
+            GROUPS noGroups;
+            Assert::AreEqual<DWORD>(AR_NONE, set.LookupGroups(noGroups.Get()));
+        }
+
+        TEST_METHOD(EqualsIgnoresOrder)
+        {
+            SidSet set1;
+            SidSet set2;
+            Assert::IsTrue(set1.Equals(set2));
+
+            for (DWORD i = 0; i < 20; i++)
+            {
+                Assert::AreEqual(S_OK, set1.Add(_Sid(s_ridOther + i).rgb, AR_KICK));
+                Assert::AreEqual(S_OK, set2.Add(_Sid(s_ridOther + 19 - i).rgb, AR_KICK));
+            }
+            Assert::IsTrue(set1.Equals(set2));
+            Assert::IsTrue(set2.Equals(set1));
+        }
+
+        TEST_METHOD(EqualsComparesRightsAndSids)
+        {
+            SidSet set;
+            _AddConfigured(&set);
+
+            SidSet otherRights;
+            Assert::AreEqual(S_OK, otherRights.Add(_Sid(s_ridKick).rgb, AR_KICK));
+            Assert::AreEqual(S_OK, otherRights.Add(_Sid(s_ridKickProtected).rgb, AR_KICK));
+            Assert::IsFalse(set.Equals(otherRights));
+
+            SidSet otherSids;
+            Assert::AreEqual(S_OK, otherSids.Add(_Sid(s_ridKick).rgb, AR_KICK));
+            Assert::AreEqual(S_OK, otherSids.Add(_Sid(s_ridOther).rgb, AR_ALL));
+            Assert::IsFalse(set.Equals(otherSids));
+
+            SidSet fewerSids;
+            Assert::AreEqual(S_OK, fewerSids.Add(_Sid(s_ridKick).rgb, AR_KICK));
+            Assert::IsFalse(set.Equals(fewerSids));
+            Assert::IsFalse(fewerSids.Equals(set));
+        }
+
+    private:
+        struct SID_BUFFER
+        {
+            BYTE rgb[SECURITY_MAX_SID_SIZE];
+        };
+
+        // A TOKEN_GROUPS as GetTokenInformation returns it, with the SIDs it points to.
+        class GROUPS
+        {
+        public:
+            GROUPS()
+            {
+                _groups.GroupCount = 0;
+            }
+
+            void Add(const SID_BUFFER& sid, DWORD dwAttributes)
+            {
+                Assert::IsTrue(_groups.GroupCount < s_cMaxGroups);
+                DWORD i = _groups.GroupCount++;
+                _rgSids[i] = sid;
+                _groups.Groups[i].Sid = _rgSids[i].rgb;
+                _groups.Groups[i].Attributes = dwAttributes;
+            }
+
+            const TOKEN_GROUPS* Get() const
+            {
+                return reinterpret_cast<const TOKEN_GROUPS*>(&_groups);
+            }
+
+        private:
+            static const DWORD s_cMaxGroups = 4;
+
+            struct
+            {
+                DWORD               GroupCount;
+                SID_AND_ATTRIBUTES  Groups[s_cMaxGroups];
+            } _groups;
+            SID_BUFFER _rgSids[s_cMaxGroups];
+        };
+
+        // S-1-5-21-1004336348-1177238915-682003330-dwRid, a group in a made-up domain.
+        static SID_BUFFER _Sid(DWORD dwRid)
+        {
+            SID_BUFFER sid;
+            SID_IDENTIFIER_AUTHORITY authority = SECURITY_NT_AUTHORITY;
+            InitializeSid(sid.rgb, &authority, 5);
+            *GetSidSubAuthority(sid.rgb, 0) = SECURITY_NT_NON_UNIQUE;
+            *GetSidSubAuthority(sid.rgb, 1) = 1004336348;
+            *GetSidSubAuthority(sid.rgb, 2) = 1177238915;
+            *GetSidSubAuthority(sid.rgb, 3) = 682003330;
+            *GetSidSubAuthority(sid.rgb, 4) = dwRid;
+            return sid;
+        }
+
+        static void _AddConfigured(_Inout_ SidSet* pSet)
+        {
+            Assert::AreEqual(S_OK, pSet->Add(_Sid(s_ridKick).rgb, AR_KICK));
+            Assert::AreEqual(S_OK, pSet->Add(_Sid(s_ridKickProtected).rgb, AR_KICK_PROTECTED));
+        }
+    };
+}
@@ -0,0 +1,121 @@
+//
+// GEWIS, 2020-2023
+//
+
+#include "CppUnitTest.h"
+#include "TimerWheel.h"
+#include <initializer_list>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace GEWISUnlockTests
+{
+    // The number of slots in TimerWheel, so one turn of the wheel
+    static const ULONGLONG s_cTurn = 64;
+
+    TEST_CLASS(TimerWheelTests)
+    {
+    public:
+        TEST_METHOD(ExpiresAtDeadline)
+        {
+            _wheel.Reset(0);
+            Assert::IsTrue(SUCCEEDED(_wheel.Schedule(1, 5)));
+            Assert::IsTrue(_wheel.IsScheduled(1));
+
+            _AssertExpired(4, {});
+            _AssertExpired(5, { 1 });
+            Assert::IsFalse(_wheel.IsScheduled(1));
+            _AssertExpired(6, {});
+        }
+
+        TEST_METHOD(WrapsAround)
+        {
+            // Not starting at a multiple of the number of slots, and keys that share a slot a turn apart
+            _wheel.Reset(1000);
+            Assert::IsTrue(SUCCEEDED(_wheel.Schedule(1, 1010)));
+            Assert::IsTrue(SUCCEEDED(_wheel.Schedule(2, 1010 + s_cTurn)));
+            Assert::IsTrue(SUCCEEDED(_wheel.Schedule(3, 1010 + 3 * s_cTurn)));
+
+            _AssertExpired(1010, { 1 });
+            Assert::IsTrue(_wheel.IsScheduled(2));
+            _AssertExpired(1010 + s_cTurn - 1, {});
+            _AssertExpired(1010 + s_cTurn, { 2 });
+
+            for (ULONGLONG ullTick = 1011 + s_cTurn; ullTick < 1010 + 3 * s_cTurn; ullTick++)
+            {
+                _AssertExpired(ullTick, {});
+            }
+            _AssertExpired(1010 + 3 * s_cTurn, { 3 });
+        }
+
+        TEST_METHOD(JumpsOverMoreThanOneTurn)
+        {
+            // E.g. the machine slept; everything that is due by now expires at once, the rest stays
+            _wheel.Reset(0);
+            Assert::IsTrue(SUCCEEDED(_wheel.Schedule(1, 3)));
+            Assert::IsTrue(SUCCEEDED(_wheel.Schedule(2, 100)));
+            Assert::IsTrue(SUCCEEDED(_wheel.Schedule(3, 500)));
+
+            _AssertExpired(200, { 1, 2 });
+            Assert::IsTrue(_wheel.IsScheduled(3));
+            _AssertExpired(499, {});
+            _AssertExpired(1000, { 3 });
+        }
+
+        TEST_METHOD(RescheduleReplacesDeadline)
+        {
+            _wheel.Reset(0);
+            Assert::IsTrue(SUCCEEDED(_wheel.Schedule(1, 5)));
+            Assert::IsTrue(SUCCEEDED(_wheel.Schedule(1, 5 + s_cTurn)));
+
+            // The stale entry in the same slot does not expire it early
+            _AssertExpired(5, {});
+            Assert::IsTrue(_wheel.IsScheduled(1));
+            _AssertExpired(5 + s_cTurn, { 1 });
+
+            // Earlier than before, and the same deadline twice
+            Assert::IsTrue(SUCCEEDED(_wheel.Schedule(2, 200)));
+            Assert::IsTrue(SUCCEEDED(_wheel.Schedule(2, 100)));
+            Assert::IsTrue(SUCCEEDED(_wheel.Schedule(2, 100)));
+            _AssertExpired(100, { 2 });
+            _AssertExpired(300, {});
+        }
+
+        TEST_METHOD(CancelledDoesNotExpire)
+        {
+            _wheel.Reset(0);
+            Assert::IsTrue(SUCCEEDED(_wheel.Schedule(1, 10)));
+            _wheel.Cancel(1);
+            Assert::IsFalse(_wheel.IsScheduled(1));
+            _AssertExpired(100, {});
+        }
+
+        TEST_METHOD(PassedDeadlineExpiresOnNextTick)
+        {
+            _wheel.Reset(10);
+            Assert::IsTrue(SUCCEEDED(_wheel.Schedule(1, 3)));
+            _AssertExpired(10, {});
+            _AssertExpired(11, { 1 });
+        }
+
+    private:
+        // Advances to ullTick and checks which keys expired, in any order.
+        void _AssertExpired(ULONGLONG ullTick, std::initializer_list<DWORD> expected)
+        {
+            ATL::CAtlArray<DWORD> rgExpired;
+            Assert::IsTrue(SUCCEEDED(_wheel.Advance(ullTick, &rgExpired)));
+            Assert::AreEqual(expected.size(), rgExpired.GetCount());
+            for (DWORD dwKey : expected)
+            {
+                bool fFound = false;
+                for (size_t i = 0; i < rgExpired.GetCount(); i++)
+                {
+                    fFound = fFound || rgExpired[i] == dwKey;
+                }
+                Assert::IsTrue(fFound);
+            }
+        }
+
+        TimerWheel  _wheel;
+    };
+}